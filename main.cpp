@@ -35,43 +35,202 @@
 */
 
 #include <iostream>
+#include <map>
+#include <set>
 #include <boost/filesystem.hpp>
 
 #include "nds.h"
 
+//  Options given a path, which may also be passed as the argument after them
+const std::set<std::string> PathOptions = { "from-tar", "base", "delta", "order-trace", "store", "only", "cache", "throttle-file", "key" };
+
 void usage()
 {
-  std::cout << "Usage: mdnds.exe <Command> <Root> <Output>";
+  std::cout << "Usage: mdnds.exe <Command> <Root> <Output> [Options]";
   std::cout << R"DOC(
-    <Command>: "build"|"b" or "extract"|"e" or "files"|"f"
-    <Root>   : Build: Directory where a disc was previously extracted
+    <Command>: "build"|"b" or "extract"|"e" or "files"|"f" or "patch"|"p" or "rehydrate"|"r" or "icons"|"i" or "info"
+               or "layout" or "compact" or "dump" or "diff" or "decrypt" or "encrypt"
+               or "index" or "check"
+    <Root>   : Build: Directory where a disc was previously extracted,
+                      left out with --from-tar or --base
                Extract: Path to the disc to extract from
-               Files: Path to the disc
+               Files, Layout, Compact, Dump, Index: Path to the disc
+               Check: Path to the disc, then optionally paths such as files/a.bin or FAT ids to check
+               Rehydrate: Manifest written by extract --store
+               Diff: Old disc or directory it was extracted to
+               Icons, Info, Decrypt, Encrypt: Discs, directories holding discs, or @lists of discs
     <Output> : Build: Output file path and name
-               Extract: Output directory where files will be extracted
+               Extract: Output directory where files will be extracted,
+                        the manifest to write with --store, or the
+                        archive to write with --format=tar ("-" for stdout)
+               Rehydrate: Output directory to recreate the extraction in
+               Icons: Output directory for <name>.png and <name>.txt
+               Compact: Optional output file, otherwise the disc is compacted in place
+               Diff: New disc or directory it was extracted to
+    [Options]:
+      --io=<auto|uring|threads>  Extract: I/O backend used to write files
+      --queue-depth=<n>          Extract: Files in flight per io_uring batch
+      --threads=<n>              Extract, Icons, Info, Diff, Decrypt, Encrypt, Index, Check: Threads to use
+      --resume                   Extract: Skip files a previous run finished, writing the rest atomically
+      --only=<path>              Extract: Extract one file or directory, such as files/data or sys/arm9.bin
+      --cache=<dir>              Extract, Files: Keep an index of each ROM's file table here for later runs
+      --format=<tar>             Extract: Write one tar archive instead of a directory
+      --format=<json|csv>        Info: Output format
+      --format=<text|json>       Diff: Output format
+      --tables                   Info: Also read overlay and directory counts from the FNT
+      --store=<dir>              Extract, Rehydrate: Content-addressed object store
+      --from-tar=<file|->        Build: Read the extracted files from a tar archive ("-" for stdin)
+      --base=<file>              Build: ROM to copy everything the delta directory doesn't replace from
+      --delta=<dir>              Build: Files to replace or add in the base ROM, laid out like an extraction
+      --order-trace=<file>       Build: Place files first in the order of a trace of FAT ids or paths
+      --align=<n>                Build: Alignment of each file, 4 by default
+      --hot-align=<n>            Build: Alignment of the files in the trace, such as 0x200 for card sectors
+      --watch                    Build: Keep the ROM up to date as the directory changes, Linux only
+      --format=<bps|native>      Patch create: Patch format to write
+      --key=<file>               Decrypt, Encrypt: KEY1 table, or an ARM7 BIOS dump holding it
+      --merkle                   Index: Write a hash of every block and a hash tree to <disc>.mrk for check
+      --block=<n>                Index: Block size, 0x10000 by default
+      --limit-read=<rate>        All: Most bytes read per second, such as 20M
+      --limit-write=<rate>       All: Most bytes written per second
+      --limit-iops=<n>           All: Most reads and writes per second
+      --throttle-file=<file>     All: File of read=, write= and iops= limits, read again when it changes or on SIGUSR1
+    Patch:
+      mdnds.exe patch create <Original.nds> <Modified.nds> <Output.patch>
+      mdnds.exe patch apply <Original.nds> <Input.patch> <Output.nds>
     Examples:
       mdnds.exe extract Example.nds output_dir
       mdnds.exe build output_dir RebuiltExample.nds
+      mdnds.exe diff Example.nds RebuiltExample.nds
+      mdnds.exe build --from-tar=output.tar RebuiltExample.nds
+      mdnds.exe build --base Example.nds --delta translation_dir Translated.nds
+      mdnds.exe patch create Example.nds RebuiltExample.nds Example.bps
   )DOC" << std::endl;
 }
 
 int main(int argc, char *argv[])
 {
-  if (argc < 2)
+  std::vector<std::string> args;              //  Positional arguments
+  std::map<std::string, std::string> options; //  --name=value options
+
+  for (int i = 1; i < argc; i++)
+  {
+    std::string arg(argv[i]);
+
+    if (arg.size() > 2 && arg.compare(0, 2, "--") == 0)
+    {
+      size_t eq = arg.find('=');
+      std::string name = arg.substr(2, eq == std::string::npos ? std::string::npos : eq - 2);
+
+      //  Options that name a file can also take it as the next argument
+      if (eq == std::string::npos && PathOptions.count(name) && i + 1 < argc)
+      {
+        options[name] = argv[++i];
+      }
+      else
+      {
+        options[name] = (eq == std::string::npos) ? "" : arg.substr(eq + 1);
+      }
+    }
+    else
+    {
+      args.push_back(arg);
+    }
+  }
+
+  if (args.size() < 1)
   {
     usage();
     exit(EXIT_FAILURE);
   }
 
-  std::string cmd(argv[1]);   //  Command comes first
+  std::string cmd(args[0]);   //  Command comes first
+
+  //  I/O limits cover every command, and the time spent under them is reported however it ends
+  const char* limit_names[] = { "limit-read", "limit-write", "limit-iops" };
+  uint64_t limits[3] = {};
+
+  for (int i = 0; i < 3; i++)
+  {
+    if (options.count(limit_names[i]) && !util::parse_rate(options[limit_names[i]], limits[i]))
+    {
+      std::cout << "Invalid rate " << options[limit_names[i]] << " for --" << limit_names[i] << std::endl;
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  util::throttle().set(limits[0], limits[1], limits[2]);
 
-  if (argc == 4 && (cmd == "build" || cmd == "b"))
+  if (options.count("throttle-file") && !util::throttle().control(options["throttle-file"]))
   {
-    std::string root(argv[2]);  //  Root directory or file path
-    std::string out(argv[3]);   //  Output directory or file path
-    if (nds::valid_directory(root))
+    std::cout << "Could not read " << options["throttle-file"] << ", running unthrottled until it can be" << std::endl;
+  }
+
+  std::atexit([]()
+  {
+    if (util::throttle().active())
+    {
+      //  Standard error, since standard output may be carrying an archive
+      std::cerr << util::throttle().report() << std::endl;
+    }
+  });
+
+  nds::BuildOptions build;
+
+  if (options.count("order-trace"))
+  {
+    build.order_trace = options["order-trace"];
+  }
+
+  if (options.count("align"))
+  {
+    build.align = static_cast<uint32_t>(std::strtoul(options["align"].c_str(), nullptr, 0));
+  }
+
+  if (options.count("hot-align"))
+  {
+    build.hot_align = static_cast<uint32_t>(std::strtoul(options["hot-align"].c_str(), nullptr, 0));
+  }
+
+  //  Files have to start on a word, and a power of two keeps card sectors lined up
+  for (auto align : { build.align, build.hot_align ? build.hot_align : build.align })
+  {
+    if (align < 4 || (align & (align - 1)) != 0)
     {
-      nds::build(root, out);
+      std::cout << "Alignment must be a power of two of at least 4." << std::endl;
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  if ((cmd == "build" || cmd == "b") && options.count("from-tar"))
+  {
+    if (args.size() != 2 || !nds::build_tar(options["from-tar"], args[1], build))
+    {
+      std::cout << "Could not build from tar archive." << std::endl;
+      exit(EXIT_FAILURE);
+    }
+  }
+  else if ((cmd == "build" || cmd == "b") && options.count("base"))
+  {
+    if (args.size() != 2 || !options.count("delta") || !nds::build_delta(options["base"], options["delta"], args[1], build))
+    {
+      std::cout << "Could not build from base ROM and delta directory." << std::endl;
+      exit(EXIT_FAILURE);
+    }
+  }
+  else if (args.size() == 3 && (cmd == "build" || cmd == "b"))
+  {
+    std::string root(args[1]);  //  Root directory or file path
+    std::string out(args[2]);   //  Output directory or file path
+    if (nds::valid_directory(root) && options.count("watch"))
+    {
+      if (!nds::watch(root, out, build))
+      {
+        exit(EXIT_FAILURE);
+      }
+    }
+    else if (nds::valid_directory(root))
+    {
+      nds::build(root, out, build);
     }
     else
     {
@@ -79,16 +238,184 @@ int main(int argc, char *argv[])
       exit(EXIT_FAILURE);
     }
   }
-  else if (argc == 4 && (cmd == "extract" || cmd == "e"))
+  else if (args.size() == 3 && (cmd == "extract" || cmd == "e"))
   {
-    std::string root(argv[2]);  //  Root directory or file path
-    std::string out(argv[3]);   //  Output directory or file path
-    nds::extract(root, out);
+    std::string root(args[1]);  //  Root directory or file path
+    std::string out(args[2]);   //  Output directory or file path
+    nds::ExtractOptions extract;
+
+    if (options.count("io"))
+    {
+      extract.io = options["io"];
+    }
+
+    if (options.count("queue-depth"))
+    {
+      extract.queue_depth = util::to_int32(options["queue-depth"]);
+    }
+
+    if (options.count("threads"))
+    {
+      extract.threads = util::to_int32(options["threads"]);
+    }
+
+    extract.resume = options.count("resume") > 0;
+
+    if (options.count("only"))
+    {
+      extract.only = options["only"];
+    }
+
+    if (options.count("cache"))
+    {
+      extract.cache = options["cache"];
+    }
+
+    if (options.count("format") && options["format"] == "tar")
+    {
+      if (!nds::extract_tar(root, out))
+      {
+        exit(EXIT_FAILURE);
+      }
+    }
+    else if (options.count("format"))
+    {
+      std::cout << "Unknown extract format " << options["format"] << std::endl;
+      exit(EXIT_FAILURE);
+    }
+    else if (options.count("store"))
+    {
+      if (!nds::store_extract(root, options["store"], out, extract.threads))
+      {
+        exit(EXIT_FAILURE);
+      }
+    }
+    else
+    {
+      nds::extract(root, out, extract);
+    }
+  }
+  else if (args.size() == 2 && (cmd == "files" || cmd == "f"))
+  {
+    std::string root(args[1]);  //  Root directory or file path
+    nds::files(root, options.count("cache") ? options["cache"] : "");
+  }
+  else if (args.size() >= 3 && (cmd == "icons" || cmd == "i"))
+  {
+    std::vector<std::string> inputs(args.begin() + 1, args.end() - 1);
+    uint32_t threads = options.count("threads") ? util::to_int32(options["threads"]) : 0;
+
+    if (!nds::icons(inputs, args.back(), threads))
+    {
+      exit(EXIT_FAILURE);
+    }
+  }
+  else if (args.size() >= 2 && cmd == "info")
+  {
+    std::vector<std::string> inputs(args.begin() + 1, args.end());
+    std::string format = options.count("format") ? options["format"] : "json";
+    uint32_t threads = options.count("threads") ? util::to_int32(options["threads"]) : 0;
+
+    if (!nds::info(inputs, format, options.count("tables") > 0, threads))
+    {
+      exit(EXIT_FAILURE);
+    }
+  }
+  else if (args.size() == 3 && cmd == "diff")
+  {
+    std::string format = options.count("format") ? options["format"] : "text";
+    uint32_t threads = options.count("threads") ? util::to_int32(options["threads"]) : 0;
+
+    if (!nds::diff(args[1], args[2], format, threads))
+    {
+      exit(EXIT_FAILURE);
+    }
+  }
+  else if (args.size() >= 2 && (cmd == "decrypt" || cmd == "encrypt"))
+  {
+    std::vector<std::string> inputs(args.begin() + 1, args.end());
+    uint32_t threads = options.count("threads") ? util::to_int32(options["threads"]) : 0;
+
+    if (!options.count("key"))
+    {
+      std::cout << "The secure area needs a key table, pass it with --key" << std::endl;
+      exit(EXIT_FAILURE);
+    }
+
+    if (!nds::secure_area(inputs, options["key"], cmd == "encrypt", threads))
+    {
+      exit(EXIT_FAILURE);
+    }
+  }
+  else if (args.size() == 2 && cmd == "index")
+  {
+    uint32_t block = options.count("block") ? static_cast<uint32_t>(std::strtoul(options["block"].c_str(), nullptr, 0)) : nds::MerkleIndex::DefaultBlock;
+    uint32_t threads = options.count("threads") ? util::to_int32(options["threads"]) : 0;
+
+    if (!options.count("merkle"))
+    {
+      std::cout << "Only --merkle indexes can be written." << std::endl;
+      exit(EXIT_FAILURE);
+    }
+
+    if (!nds::merkle_index(args[1], block, threads))
+    {
+      exit(EXIT_FAILURE);
+    }
+  }
+  else if (args.size() >= 2 && cmd == "check")
+  {
+    std::vector<std::string> targets(args.begin() + 2, args.end());
+    uint32_t threads = options.count("threads") ? util::to_int32(options["threads"]) : 0;
+
+    if (!nds::merkle_check(args[1], targets, threads))
+    {
+      exit(EXIT_FAILURE);
+    }
+  }
+  else if (args.size() == 2 && cmd == "layout")
+  {
+    if (!nds::layout(args[1]))
+    {
+      exit(EXIT_FAILURE);
+    }
+  }
+  else if (args.size() == 2 && cmd == "dump")
+  {
+    if (!nds::dump(args[1]))
+    {
+      exit(EXIT_FAILURE);
+    }
   }
-  else if (argc == 3 && (cmd == "files" || cmd == "f"))
+  else if ((args.size() == 2 || args.size() == 3) && cmd == "compact")
   {
-    std::string root(argv[2]);  //  Root directory or file path
-    nds::files(root);
+    if (!nds::compact(args[1], (args.size() == 3) ? args[2] : ""))
+    {
+      exit(EXIT_FAILURE);
+    }
+  }
+  else if (args.size() == 3 && (cmd == "rehydrate" || cmd == "r") && options.count("store"))
+  {
+    if (!nds::rehydrate(args[1], options["store"], args[2]))
+    {
+      exit(EXIT_FAILURE);
+    }
+  }
+  else if (args.size() == 5 && (cmd == "patch" || cmd == "p") && args[1] == "create")
+  {
+    std::string format = options.count("format") ? options["format"] : "bps";
+
+    if (!nds::create_patch(args[2], args[3], args[4], format))
+    {
+      exit(EXIT_FAILURE);
+    }
+  }
+  else if (args.size() == 5 && (cmd == "patch" || cmd == "p") && args[1] == "apply")
+  {
+    if (!nds::apply_patch(args[2], args[3], args[4]))
+    {
+      exit(EXIT_FAILURE);
+    }
   }
   else
   {
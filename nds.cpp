@@ -1,6 +1,8 @@
 #include "nds.h"
 
+#include <algorithm>
 #include <chrono>
+#include <set>
 
 using namespace nds;
 
@@ -8,7 +10,7 @@ namespace fs = boost::filesystem;
 
 namespace nds
 {
-  void extract(std::string disc, std::string dir)
+  void extract(std::string disc, std::string dir, ExtractOptions options)
   {
     std::string sysdir = dir + "/sys/";
     std::string filedir = dir + "/files/";
@@ -20,288 +22,345 @@ namespace nds
     boost::filesystem::create_directories(filedir);
     boost::filesystem::create_directories(overlaydir);
 
-    Header header(util::read_file(disc, 0x200));
-    FST table(disc);
-    uint16_t start_id = table.start_id();
-    auto fat = table.get_fat();
-
-    //  Extract all the important components that will be put back if re-built
-    util::write_file(sysdir + "header.bin", util::read_file(disc, 0x200));
-    util::write_file(sysdir + "fnt.bin", table.get_fnt());
-    util::write_file(sysdir + "fat.bin", fat);
-    util::write_file(sysdir + "arm9_overlay.bin", util::read_file(disc, header.arm9_overlay_size(), header.arm9_overlay_offset()));
-    util::write_file(sysdir + "arm7_overlay.bin", util::read_file(disc, header.arm7_overlay_size(), header.arm7_overlay_offset()));
-    util::write_file(sysdir + "arm9.bin", util::read_file(disc, header.arm9_size(), header.arm9_rom_offset()));
-    util::write_file(sysdir + "arm7.bin", util::read_file(disc, header.arm7_size(), header.arm7_rom_offset()));
-
-    //  Extract all the overlay files
-    for (uint16_t i = 0; i < start_id; i++)
+    auto rom = std::make_shared<RomImage>(disc);
+
+    if (!rom->valid())
+    {
+      return;
+    }
+
+    FST table(rom, options.cache);
+    std::vector<ExtractJob> jobs;
+    std::vector<RomEntry> entries = rom_entries(*rom, table);
+
+    //  A single file or directory only reads its own part of the ROM, which matters when it is compressed
+    if (!options.only.empty())
     {
-      uint32_t start = util::read<uint32_t>(fat, i * 8);
-      uint32_t end = util::read<uint32_t>(fat, i * 8 + 4);
+      std::string only = options.only;
 
-      std::cout << "Writing file: overlay_" << util::zero_pad(i, 4) << std::endl;
+      while (only.size() > 1 && only.back() == '/')
+      {
+        only.pop_back();
+      }
 
-      util::write_file(overlaydir + "overlay_" + util::zero_pad(i, 4) + ".bin", util::read_file(disc, end - start, start));
+      entries.erase(std::remove_if(entries.begin(), entries.end(), [&](const RomEntry& entry)
+      {
+        return entry.path != only && entry.path.compare(0, only.size() + 1, only + "/") != 0;
+      }), entries.end());
+
+      if (entries.empty())
+      {
+        std::cout << "Nothing in " << disc << " is at " << only << std::endl;
+        return;
+      }
     }
 
-    //  Extract the files
-    for (auto& file : table.files())
+    //  Write in the order the data sits in the ROM, so it is read in one sequential pass
+    std::stable_sort(entries.begin(), entries.end(), [](const RomEntry& a, const RomEntry& b)
     {
-      std::cout << "Writing file: " << file.path() << std::endl;
+      return a.offset < b.offset;
+    });
 
-      extract_file(file, disc, filedir);
-    }
-  }
+    rom->sequential();
 
-  void extract_file(FileEntry& file, std::string disc, std::string filedir)
-  {
-    fs::path basepath = fs::path(file.path()).parent_path();
+    //  When resuming, outputs already in the journal or matching the ROM are left alone
+    ExtractJournal journal;
+    std::vector<uint64_t> hashes;
+    std::vector<char> hashed(entries.size(), 0);
+    std::vector<char> skip(entries.size(), 0);
+    std::vector<size_t> sources;
 
-    //  Make sure the path the file is written to is made
-    fs::create_directories(filedir + basepath.string());
+    if (options.resume)
+    {
+      if (!journal.open(dir, ExtractJournal::identity(*rom)))
+      {
+        std::cout << "Could not open " << dir << "/" << ExtractJournal::Name << std::endl;
+        return;
+      }
 
-    //  Write the file
-    util::write_file(filedir + file.path(), util::read_file(disc, file.size(), file.begin()));
-  }
+      //  Temporary files of a run that was killed are never finished, whether or not this run writes them again
+      boost::system::error_code error;
 
-  void build(std::string dir, std::string disc)
-  {
-    std::string sysdir = dir + "/sys/";
-    std::string filedir = dir + "/files/";
-    std::string overlaydir = dir + "/overlay/";
+      for (fs::recursive_directory_iterator it(dir, error), end; !error && it != end; it.increment(error))
+      {
+        std::string name = it->path().filename().string();
 
-    std::vector<uint8_t> nds(0x4000);
+        if (name.size() > 11 && name.compare(name.size() - 11, 11, ".mdnds-part") == 0)
+        {
+          fs::remove(it->path(), error);
+        }
+      }
 
-    std::vector<uint8_t> headerbin = util::read_file(sysdir + "header.bin", 0x200);
-    std::vector<uint8_t> oldfat = util::read_file(sysdir + "fat.bin");
-    std::vector<uint8_t> arm9 = util::read_file(sysdir + "arm9.bin");
-    std::vector<uint8_t> arm9_overlay = util::read_file(sysdir + "arm9_overlay.bin");
-    std::vector<uint8_t> arm7 = util::read_file(sysdir + "arm7.bin");
-    std::vector<uint8_t> arm7_overlay = util::read_file(sysdir + "arm7_overlay.bin");
+      hashes.resize(entries.size());
 
-    Header header(headerbin);
+      //  Only files of the right size are looked at, and only those the journal can't vouch for are hashed
+      util::parallel_for(entries.size(), [&](size_t i)
+      {
+        RomEntry& entry = entries[i];
+        uint32_t size = entry.size;
+        boost::system::error_code error;
+        std::string path = dir + "/" + entry.path;
+
+        if (fs::file_size(path, error) != entry.size || error)
+        {
+          return;
+        }
 
-    //  Add ARM9 bin
-    header.set_arm9_offset(0x4000);
-    std::copy(arm9.begin(), arm9.end(), std::back_inserter(nds));
-    util::pad(nds, util::pad(nds.size(), 0x10));
+        if (journal.finished(entry.path, entry.size))
+        {
+          skip[i] = 1;
+          return;
+        }
 
-    //  Add ARM9 overlay
-    header.set_arm9_overlay_offset(nds.size());
-    std::copy(arm9_overlay.begin(), arm9_overlay.end(), std::back_inserter(nds));
+        const uint8_t* data = rom->span(entry.offset, size);
 
-    //  Store the overlay FAT entries separate so we can add them to the real FAT later
-    std::vector<uint8_t> overlay_fat;
-    uint32_t overlay_count = 0;
-    uint32_t overlay_size = 0;
+        if (size != entry.size)
+        {
+          return;
+        }
 
-    for (fs::directory_iterator dir(overlaydir), end; dir != end; ++dir)
-    {
-      if (fs::is_regular_file(dir->path()) && fs::extension(dir->path()) == ".bin")
-      {
-        uint32_t end = util::read<uint32_t>(oldfat, overlay_count * 8 + 4);
+        hashes[i] = util::hash64(data, size);
+        hashed[i] = 1;
 
-        if (overlay_size < end)
+        //  Journaled from another ROM or written by an extraction that kept no journal, so it is journaled again
+        if (journal.contains(entry.path, size, hashes[i]) || util::hash64(util::read_file(path).data(), size) == hashes[i])
         {
-          overlay_size = end;
+          skip[i] = 2;
         }
-        overlay_count++;
-      }
+      }, options.threads);
     }
 
-    overlay_count = 0;
-    std::vector<uint8_t> overlays;
+    //  Create the whole directory tree once and write each file relative to its parent
+#ifdef UTIL_IO_POSIX
+    DirectoryTree tree(filedir, table, options.only.empty());
+#endif
+    std::set<std::string> created;
+    size_t skipped = 0;
 
-    //  Make sure the vector can be allocated correctly.
-    if (overlay_size > nds.size())
+    for (size_t i = 0; i < entries.size(); i++)
     {
-      overlays.resize(overlay_size - nds.size());
+      RomEntry& entry = entries[i];
 
-      for (fs::directory_iterator dir(overlaydir), end; dir != end; ++dir)
+      if (skip[i])
       {
-        if (fs::is_regular_file(dir->path()) && fs::extension(dir->path()) == ".bin")
+        if (skip[i] == 2)
         {
-          uint32_t start = util::read<uint32_t>(oldfat, overlay_count * 8);
-          uint32_t end = util::read<uint32_t>(oldfat, overlay_count * 8 + 4);
-
-          auto file = util::read_file(dir->path().string());
+          journal.add(entry.path, entry.size, hashes[i]);
+        }
 
-          util::push_int(overlay_fat, start); //  Start address in ROM
-          util::push_int(overlay_fat, end);   //  End address in ROM
+        skipped++;
+        continue;
+      }
 
-          std::copy(file.begin(), file.end(), overlays.begin() + (start - nds.size()));
+      sources.push_back(i);
 
-          overlay_count++;
+      if (entry.directory < 0)
+      {
+        if (entry.path.compare(0, 4, "sys/") != 0)
+        {
+          std::cout << "Writing file: " << entry.path << std::endl;
         }
+
+        jobs.push_back(ExtractJob(dir + "/" + entry.path, entry.offset, entry.size));
+        continue;
       }
 
-      std::copy(overlays.begin(), overlays.end(), std::back_inserter(nds));
-    }
+      std::cout << "Writing file: " << entry.path << std::endl;
 
-    util::pad(nds, util::pad(nds.size(), 0x1000), 0xFF);  //  Pad to 0x1000 since ARM7 code must be on an even 0x1000 mark
-    //  Add ARM7 bin
-    header.set_arm7_offset(nds.size());
-    std::copy(arm7.begin(), arm7.end(), std::back_inserter(nds));
+#ifdef UTIL_IO_POSIX
+      if (tree.fd(entry.directory) >= 0)
+      {
+        jobs.push_back(ExtractJob(entry.name(), entry.offset, entry.size, tree.fd(entry.directory)));
+        continue;
+      }
+#endif
 
-    //  Add ARM7 overlay
-    if (arm7_overlay.size() > 0)
-    {
-      header.set_arm7_overlay_offset(nds.size());
-      std::copy(arm7_overlay.begin(), arm7_overlay.end(), std::back_inserter(nds));
+      //  Fall back to full paths if the directory could not be opened
+      std::string basepath = fs::path(dir + "/" + entry.path).parent_path().string();
+
+      if (created.insert(basepath).second)
+      {
+        fs::create_directories(basepath);
+      }
+
+      jobs.push_back(ExtractJob(dir + "/" + entry.path, entry.offset, entry.size));
     }
 
-    FST fst(filedir, nds.size(), overlay_count);
+    //  What is written is hashed for the journal, the ROM ranges are about to be read anyway
+    if (options.resume)
+    {
+      util::parallel_for(sources.size(), [&](size_t i)
+      {
+        RomEntry& entry = entries[sources[i]];
+        uint32_t size = entry.size;
+        const uint8_t* data = rom->span(entry.offset, size);
 
-    std::vector<uint8_t> fnt = fst.get_fnt();
-    std::vector<uint8_t> fat = fst.get_fat();
+        hashes[sources[i]] = hashed[sources[i]] ? hashes[sources[i]] : util::hash64(data, size);
+      }, options.threads);
+    }
 
-    //  Add overlays to the FAT
-    std::copy(fat.begin(), fat.end(), std::back_inserter(overlay_fat));
-    fat = overlay_fat;
+    auto backend = create_backend(options);
+    auto start = std::chrono::steady_clock::now();
+    bool ok = true;
 
-    //  Add FNT
-    header.set_fnt_offset(nds.size());
-    header.set_fnt_size(fnt.size());
-    std::copy(fnt.begin(), fnt.end(), std::back_inserter(nds));
-    util::pad(nds, util::pad(nds.size(), 4));
+    if (!options.resume)
+    {
+      ok = backend->run(*rom, jobs);
+    }
+    else
+    {
+      if (skipped > 0)
+      {
+        std::cout << "Skipping " << skipped << " files that are already extracted" << std::endl;
+      }
 
-    //  Add FAT
-    header.set_fat_offset(nds.size());
-    header.set_fat_size(fat.size());
-    std::copy(fat.begin(), fat.end(), std::back_inserter(nds));
+      //  Write under temporary names and rename in chunks, journaling each chunk once it is in place
+      const size_t ChunkFiles = 1024;
+      const uint64_t ChunkBytes = 32 * 1024 * 1024;
 
-    //  Write all files to the disc
-    add_files(nds, filedir);
+      for (size_t first = 0, last = 0; first < jobs.size(); first = last)
+      {
+        uint64_t bytes = 0;
 
-    //  Write the header data
-    headerbin = header.get_raw();
-    std::copy(headerbin.begin(), headerbin.end(), nds.begin());
+        for (; last < jobs.size() && last - first < ChunkFiles && bytes < ChunkBytes; last++)
+        {
+          jobs[last].target = jobs[last].path;
+          jobs[last].path += ".mdnds-part";
+          bytes += jobs[last].size;
+        }
 
-    util::pad(nds, util::pad(nds.size(), header.capacity()), 0xFF);
+        std::vector<ExtractJob> chunk(jobs.begin() + first, jobs.begin() + last);
+        ok = backend->run(*rom, chunk) && ok;
 
-    util::write_file(disc, nds);
-  }
+        for (size_t i = 0; i < chunk.size(); i++)
+        {
+          RomEntry& entry = entries[sources[first + i]];
 
-  void add_files(std::vector<uint8_t>& rom, std::string root)
-  {
-    for (fs::directory_iterator dir(root), end; dir != end; ++dir)
-    {
-      if (fs::is_regular_file(dir->path()))
-      {
-        std::cout << "Adding " << dir->path().filename().string() << " at offset " << std::hex << rom.size() << std::dec << std::endl;
-        //auto data = util::read_file(dir->path().string());
-        //std::copy(data.begin(), data.end(), std::back_inserter(rom));
+          if (!chunk[i].ok || !chunk[i].rename())
+          {
+            std::cout << "Could not finish " << entry.path << std::endl;
+            ok = false;
+            continue;
+          }
 
-        util::read_file_direct(dir->path().string(), rom, rom.size());
+          journal.add(entry.path, entry.size, hashes[sources[first + i]]);
+        }
 
-        util::pad(rom, util::pad(rom.size(), 4), 0xFF);
+        if (!journal.flush())
+        {
+          std::cout << "Could not write " << dir << "/" << ExtractJournal::Name << std::endl;
+          ok = false;
+        }
       }
     }
 
-    for (fs::directory_iterator dir(root), end; dir != end; ++dir)
+    if (!ok)
     {
-      if (fs::is_directory(dir->path()))
-      {
-        add_files(rom, dir->path().string());
-      }
+      std::cout << "Failed to extract every file from " << disc << std::endl;
     }
+
+    //  Report throughput so the I/O backends can be compared
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    uint64_t bytes = 0;
+
+    for (auto& job : jobs)
+    {
+      bytes += job.size;
+    }
+
+    std::cout << "Extracted " << jobs.size() << " files in " << static_cast<uint64_t>(seconds * 1000) << " ms using "
+              << backend->name() << " (" << static_cast<uint64_t>(jobs.size() / std::max(seconds, 1e-9)) << " files/s, "
+              << static_cast<uint64_t>(bytes / std::max(seconds, 1e-9) / (1024 * 1024)) << " MB/s)" << std::endl;
   }
 
-  void files(std::string disc)
+  void build(std::string dir, std::string disc, BuildOptions options)
   {
-    FST table(disc);
+    //  Lay out every region first, then fill them all in parallel
+    BuildPlan plan(dir, options);
 
-    //  Print out each file path
-    for (auto& file : table.files())
+    if (!execute_plan(plan, disc))
     {
-      std::cout << "./" << file.path() << std::endl;
+      std::cout << "Failed to build " << disc << std::endl;
     }
   }
 
-
   /*
     Summary:
-      Determines whether a given root directory has the required structure and files to be used to create a GCM
+      Builds a variant of a ROM from the ROM itself and a directory holding
+      only the files that differ, laid out like an extracted directory.
+      Files in the delta replace the ones at the same path and new files are
+      added. Everything else is copied straight from the base ROM.
 
-    Parameter:
-      root: Directory to check
+    Parameters:
+      base: Path to the ROM the variant is based on
+      delta: Directory of replaced and added files
+      disc: Output file path
+      options: Where to place files
 
     Returns:
-      True if the directory can be used to create a GCM, or false otherwise.
+      True if the ROM was built.
   */
-  bool valid_directory(std::string root)
+  bool build_delta(std::string base, std::string delta, std::string disc, BuildOptions options)
   {
-    bool ret = true;
-
-    //  If the directory does not have /files and /sys then it wasn't extracted by this extractor
-    if (fs::is_directory(root) == false)
+    if (!fs::is_directory(delta))
     {
-      std::cout << root << " is not a valid directory." << std::endl;
-      ret = false;
+      std::cout << delta << " is not a valid directory." << std::endl;
+      return false;
     }
 
-    if (fs::is_directory(root + "/files") == false)
-    {
-      std::cout << "Missing directory /files under " << root << std::endl;
-      ret = false;
-    }
+    RomTree bottom(base);
+    DiskTree top(delta);
+    OverlayTree tree(bottom, top);
 
-    if (fs::is_directory(root + "/sys") == false)
+    if (!bottom.valid() || !valid_tree(tree))
     {
-      std::cout << "Missing directory /sys under " << root << std::endl;
-      ret = false;
+      return false;
     }
 
-    if (fs::is_directory(root + "/overlay") == false)
-    {
-      std::cout << "Missing directory /overlay under " << root << std::endl;
-      ret = false;
-    }
+    BuildPlan plan(tree, options);
 
-    //  Check for individual system files which are required to re-build the disc
-    if (fs::is_regular_file(root + "/sys/arm9_overlay.bin") == false)
+    if (!execute_plan(plan, disc))
     {
-      std::cout << "Missing file " << root << "/sys/arm9_overlay.bin" << std::endl;
-      ret = false;
+      std::cout << "Failed to build " << disc << std::endl;
+      return false;
     }
 
-    if (fs::is_regular_file(root + "/sys/arm7_overlay.bin") == false)
-    {
-      std::cout << "Missing file " << root << "/sys/arm7_overlay.bin" << std::endl;
-      ret = false;
-    }
+    return true;
+  }
 
-    if (fs::is_regular_file(root + "/sys/arm9.bin") == false)
-    {
-      std::cout << "Missing file " << root << "/sys/arm9.bin" << std::endl;
-      ret = false;
-    }
+  void files(std::string disc, std::string cache)
+  {
+    FST table(std::make_shared<RomImage>(disc), cache);
 
-    if (fs::is_regular_file(root + "/sys/arm7.bin") == false)
+    //  Print out each file path as it is built, without holding every path in memory
+    table.visit([](const FileRef& file)
     {
-      std::cout << "Missing file " << root << "/sys/arm7.bin" << std::endl;
-      ret = false;
-    }
+      std::cout << "./" << file.path << "\n";
+    });
 
-    if (fs::is_regular_file(root + "/sys/fnt.bin") == false)
-    {
-      std::cout << "Missing file " << root << "/sys/fnt.bin" << std::endl;
-      ret = false;
-    }
+    std::cout.flush();
+  }
 
-    if (fs::is_regular_file(root + "/sys/fat.bin") == false)
-    {
-      std::cout << "Missing file " << root << "/sys/fat.bin" << std::endl;
-      ret = false;
-    }
 
-    if (fs::is_regular_file(root + "/sys/header.bin") == false)
+  /*
+    Summary:
+      Determines whether a given root directory has the required structure and files to be used to create a GCM
+
+    Parameter:
+      root: Directory to check
+
+    Returns:
+      True if the directory can be used to create a GCM, or false otherwise.
+  */
+  bool valid_directory(std::string root)
+  {
+    if (fs::is_directory(root) == false)
     {
-      std::cout << "Missing file " << root << "/sys/header.bin" << std::endl;
-      ret = false;
+      std::cout << root << " is not a valid directory." << std::endl;
+      return false;
     }
 
-    return ret;
+    DiskTree tree(root);
+    return valid_tree(tree);
   }
 }
\ No newline at end of file
@@ -8,14 +8,26 @@
 
 #include "nds_header.h"
 #include "nds_fst.h"
+#include "nds_plan.h"
+#include "nds_extract.h"
+#include "nds_patch.h"
+#include "nds_store.h"
+#include "nds_banner.h"
+#include "nds_info.h"
+#include "nds_tar.h"
+#include "nds_layout.h"
+#include "nds_record.h"
+#include "nds_watch.h"
+#include "nds_diff.h"
+#include "nds_secure.h"
+#include "nds_merkle.h"
 
 namespace nds
 {
-  void extract(std::string disc, std::string dir);
-  void extract_file(FileEntry& file, std::string disc, std::string filedir);
-  void build(std::string dir, std::string disc);
-  void add_files(std::vector<uint8_t>& rom, std::string root);
-  void files(std::string disc);
+  void extract(std::string disc, std::string dir, ExtractOptions options = ExtractOptions());
+  void build(std::string dir, std::string disc, BuildOptions options = BuildOptions());
+  bool build_delta(std::string base, std::string delta, std::string disc, BuildOptions options = BuildOptions());
+  void files(std::string disc, std::string cache = "");
 
   bool valid_directory(std::string dir);
 }
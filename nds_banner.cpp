@@ -0,0 +1,231 @@
+#include "nds_banner.h"
+#include "util_io.h"
+#include "util_png.h"
+
+#include <algorithm>
+#include <boost/filesystem.hpp>
+#include <chrono>
+#include <map>
+
+namespace fs = boost::filesystem;
+
+namespace nds
+{
+  const char* const BannerView::Languages[] = { "Japanese", "English", "French", "German", "Italian", "Spanish", "Chinese", "Korean" };
+
+  //  Size of a banner of the given version, or 0 if the version is unknown
+  uint32_t BannerView::size_of(uint16_t version)
+  {
+    switch (version)
+    {
+    case Original:
+      return 0x840;
+    case Chinese:
+      return 0x940;
+    case Korean:
+      return 0xA40;
+    case Animated:
+      return 0x23C0;
+    default:
+      return 0;
+    }
+  }
+
+  uint32_t BannerView::title_count() const
+  {
+    switch (version())
+    {
+    case Original:
+      return 6;
+    case Chinese:
+      return 7;
+    default:
+      return 8;
+    }
+  }
+
+  /*
+    Summary:
+      Gets a title as UTF-8. Titles are stored as UTF-16 and may span
+      several lines.
+
+    Parameters:
+      language: Index into Languages, below title_count()
+  */
+  std::string BannerView::title(uint32_t language) const
+  {
+    return util::utf16_to_utf8(m_data + offset_of<BannerSchema>(BannerSchema::Japanese) + language * TitleSize, TitleSize / 2);
+  }
+
+  /*
+    Summary:
+      Decodes the icon to 32x32 RGBA. The icon is 4x4 tiles of 8x8 pixels
+      at 4 bits per pixel, indexing a palette of 16 BGR555 colors where
+      index 0 is transparent.
+
+      The palette is converted once into RGBA words, then every tile row is
+      read as one 32 bit word and expanded into 8 pixels with shifts, so the
+      inner loop is straight line code with no per-pixel branches.
+
+    Returns:
+      4 bytes per pixel, rows top to bottom.
+  */
+  std::vector<uint8_t> BannerView::icon() const
+  {
+    uint32_t palette[16];
+
+    for (int i = 0; i < 16; i++)
+    {
+      uint32_t color = util::load<uint16_t>(m_data + offset_of<BannerSchema>(BannerSchema::Palette) + i * 2);
+      uint32_t r = color & 0x1F;
+      uint32_t g = (color >> 5) & 0x1F;
+      uint32_t b = (color >> 10) & 0x1F;
+
+      //  Scale 5 bits up to 8 so full intensity stays 0xFF
+      r = (r << 3) | (r >> 2);
+      g = (g << 3) | (g >> 2);
+      b = (b << 3) | (b >> 2);
+
+      palette[i] = r | (g << 8) | (b << 16) | ((i == 0) ? 0 : 0xFF000000);
+    }
+
+    std::vector<uint8_t> rgba(IconSize * IconSize * 4);
+    const uint8_t* tiles = m_data + offset_of<BannerSchema>(BannerSchema::Icon);
+
+    for (int tile = 0; tile < 16; tile++)
+    {
+      for (int row = 0; row < 8; row++)
+      {
+        uint32_t bits = util::load<uint32_t>(tiles + (tile * 8 + row) * 4);
+        uint8_t* out = &rgba[(((tile / 4) * 8 + row) * IconSize + (tile % 4) * 8) * 4];
+
+        //  Low nibble first, so pixel i is bits i*4 to i*4+3
+        for (int i = 0; i < 8; i++)
+        {
+          util::store<uint32_t>(out + i * 4, palette[(bits >> (i * 4)) & 0xF]);
+        }
+      }
+    }
+
+    return rgba;
+  }
+
+  //  Gets the banner of a ROM, or an invalid view if it has none
+  BannerView rom_banner(RomImage& rom)
+  {
+    if (!rom.valid() || rom.header().icon_title_offset() == 0)
+    {
+      return BannerView();
+    }
+
+    uint32_t size = BannerView::size_of(BannerView::Animated);
+    const uint8_t* data = rom.span(rom.header().icon_title_offset(), size);
+
+    return BannerView(data, size);
+  }
+
+  /*
+    Summary:
+      Recomputes every CRC a banner of its version holds, for after it has
+      been edited.
+  */
+  void update_banner_crc(std::vector<uint8_t>& banner)
+  {
+    //  Each CRC covers a larger range than the last, and the DSi one covers the animated icon
+    static const uint32_t ranges[][2] = { { 0x20, 0x840 }, { 0x20, 0x940 }, { 0x20, 0xA40 }, { 0x1240, 0x23C0 } };
+
+    BannerView view(banner.data(), banner.size());
+
+    if (!view.valid())
+    {
+      return;
+    }
+
+    for (int i = 0; i < 4; i++)
+    {
+      if (ranges[i][1] <= view.size())
+      {
+        util::write_int<uint16_t>(banner, util::crc16(&banner[ranges[i][0]], ranges[i][1] - ranges[i][0]), offset_of<BannerSchema>(BannerSchema::CrcOriginal) + i * 2);
+      }
+    }
+  }
+
+  /*
+    Summary:
+      Writes the icon of every ROM as a PNG and its titles as UTF-8 text,
+      spreading the ROMs across threads. Only the header and banner of each
+      ROM are read.
+
+    Parameters:
+      inputs: ROMs, directories or file lists, see find_roms
+      dir: Output directory, which gets <name>.png and <name>.txt per ROM
+      threads: Number of threads to use, or 0 for one per hardware thread
+
+    Returns:
+      True if every ROM had a banner that was written.
+  */
+  bool icons(std::vector<std::string> inputs, std::string dir, uint32_t threads)
+  {
+    std::vector<std::string> roms = find_roms(inputs);
+
+    fs::create_directories(dir);
+
+    //  ROMs with the same name in different directories get a number added
+    std::vector<std::string> names;
+    std::map<std::string, uint32_t> seen;
+
+    for (auto& rom : roms)
+    {
+      std::string lower = fs::path(rom).filename().string();
+      std::transform(lower.begin(), lower.end(), lower.begin(), ::tolower);
+
+      //  x.nds.gz is named after x, like x.nds
+      bool gz = lower.size() > 7 && lower.compare(lower.size() - 7, 7, ".nds.gz") == 0;
+      std::string name = gz ? fs::path(rom).filename().string().substr(0, lower.size() - 7) : fs::path(rom).stem().string();
+      uint32_t count = ++seen[name];
+      names.push_back(count > 1 ? name + "_" + std::to_string(count) : name);
+    }
+
+    std::atomic<bool> ok(true);
+    auto start = std::chrono::steady_clock::now();
+
+    util::parallel_for(roms.size(), [&](size_t i)
+    {
+      RomImage rom(roms[i]);
+      BannerView banner = rom_banner(rom);
+
+      if (!banner.valid())
+      {
+        if (rom.valid())
+        {
+          std::cout << roms[i] << " has no banner" << std::endl;
+        }
+
+        ok = false;
+        return;
+      }
+
+      std::vector<uint8_t> png = util::encode_png(banner.icon().data(), BannerView::IconSize, BannerView::IconSize);
+      std::string text;
+
+      for (uint32_t language = 0; language < banner.title_count(); language++)
+      {
+        text += std::string("[") + BannerView::Languages[language] + "]\n" + banner.title(language) + "\n\n";
+      }
+
+      util::File out;
+
+      if (!out.create(dir + "/" + names[i] + ".png") || !out.write_at(png.data(), png.size(), 0) ||
+        !out.create(dir + "/" + names[i] + ".txt") || !out.write_at(reinterpret_cast<const uint8_t*>(text.data()), text.size(), 0))
+      {
+        std::cout << "Could not write the icon of " << roms[i] << std::endl;
+        ok = false;
+      }
+    }, threads);
+
+    auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+    std::cout << "Wrote icons for " << roms.size() << " ROMs in " << ms << " ms" << std::endl;
+
+    return ok;
+  }
+}
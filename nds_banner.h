@@ -0,0 +1,82 @@
+#ifndef _MD_NDS_BANNER_H
+#define _MD_NDS_BANNER_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "nds_image.h"
+#include "nds_record.h"
+
+namespace nds
+{
+  /*
+    A non-owning view of the banner the DS menu shows for a ROM: a 32x32
+    icon and a title in each language. Later versions add more languages,
+    and DSi banners add an animated icon after the titles.
+  */
+  class BannerView
+  {
+  public:
+    enum Version
+    {
+      Original = 0x0001,
+      Chinese = 0x0002,
+      Korean = 0x0003,
+      Animated = 0x0103
+    };
+
+    static const int IconSize = 32;
+    static const int TitleSize = 0x100;
+    static const char* const Languages[];
+
+    BannerView() : m_data(nullptr), m_size(0) {};
+
+    //  The view is only valid if the data holds a whole banner of a known version
+    BannerView(const uint8_t* data, size_t size) : m_data(nullptr), m_size(0)
+    {
+      if (data != nullptr && size >= 2 && size_of(util::load<uint16_t>(data)) != 0 && size >= size_of(util::load<uint16_t>(data)))
+      {
+        m_data = data;
+        m_size = size_of(util::load<uint16_t>(data));
+      }
+    }
+
+    static uint32_t size_of(uint16_t version);
+
+    inline bool valid() const
+    {
+      return m_data != nullptr;
+    }
+
+    inline uint16_t version() const
+    {
+      return get<BannerSchema, BannerSchema::Version>(m_data);
+    }
+
+    inline const uint8_t* bytes() const
+    {
+      return m_data;
+    }
+
+    inline uint32_t size() const
+    {
+      return m_size;
+    }
+
+    uint32_t title_count() const;
+    std::string title(uint32_t language) const;
+    std::vector<uint8_t> icon() const;
+
+  private:
+    const uint8_t* m_data;
+    uint32_t m_size;
+  };
+
+  BannerView rom_banner(RomImage& rom);
+  void update_banner_crc(std::vector<uint8_t>& banner);
+
+  bool icons(std::vector<std::string> inputs, std::string dir, uint32_t threads = 0);
+}
+
+#endif
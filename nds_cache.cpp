@@ -0,0 +1,230 @@
+#include "nds_cache.h"
+#include "nds_fst.h"
+
+#include <boost/filesystem.hpp>
+#include <cstdio>
+#include <cstring>
+
+namespace fs = boost::filesystem;
+
+namespace nds
+{
+  //  Copies of a ROM, or the same ROM compressed and not, each get their own file
+  std::string FstCache::path(std::string dir, const RomImage& image, uint64_t size, int64_t mtime)
+  {
+    uint64_t seed = util::hash64(reinterpret_cast<const uint8_t*>(&mtime), sizeof(mtime), size);
+    return dir + "/" + util::to_hex<uint64_t>(util::hash64(image.header().bytes(), Header::Size, seed)) + ".fst";
+  }
+
+  //  What a cached index has to match: the file's size and modification time, and a hash of the FAT
+  void FstCache::identity(const RomImage& image, uint64_t& size, int64_t& mtime, uint64_t& fat)
+  {
+    boost::system::error_code error;
+    FatView table = image.fat();
+
+    size = fs::file_size(image.path(), error);
+    mtime = static_cast<int64_t>(fs::last_write_time(image.path(), error));
+    fat = util::hash64(table.data(), table.size() * 8);
+  }
+
+  /*
+    Summary:
+      Maps the cached index of a ROM, checking it still matches the ROM and
+      that every array and path in it is in bounds.
+
+    Parameters:
+      dir: Cache directory
+      image: The ROM
+
+    Returns:
+      True if the index can be used.
+  */
+  bool FstCache::open(std::string dir, const RomImage& image)
+  {
+    uint64_t size;
+    int64_t mtime;
+    uint64_t fat;
+
+    if (!image.valid())
+    {
+      return false;
+    }
+
+    identity(image, size, mtime, fat);
+
+    if (!m_file.open(path(dir, image, size, mtime)) || m_file.size() < HeaderSize)
+    {
+      return false;
+    }
+
+    const uint8_t* data = m_file.data();
+
+    if (memcmp(data, "MDFST001", 8) != 0 || util::load<uint64_t>(data + 8) != size || util::load<int64_t>(data + 16) != mtime
+      || util::load<uint64_t>(data + 24) != util::hash64(image.header().bytes(), Header::Size) || util::load<uint64_t>(data + 32) != fat)
+    {
+      return false;
+    }
+
+    m_files = util::load<uint32_t>(data + 40);
+    m_dirs = util::load<uint32_t>(data + 44);
+    m_start_id = static_cast<uint16_t>(util::load<uint32_t>(data + 48));
+
+    uint64_t pool = util::load<uint32_t>(data + 52);
+    uint64_t arrays = static_cast<uint64_t>(m_files) * 16 + static_cast<uint64_t>(m_dirs) * 6;
+
+    if (m_dirs == 0 || m_dirs > 0x10000 || m_file.size() != HeaderSize + arrays + pool)
+    {
+      return false;
+    }
+
+    m_begins = data + HeaderSize;
+    m_ends = m_begins + m_files * 4;
+    m_file_paths = m_ends + m_files * 4;
+    m_dir_paths = m_file_paths + m_files * 4;
+    m_ids = m_dir_paths + m_dirs * 4;
+    m_file_dirs = m_ids + m_files * 2;
+    m_parents = m_file_dirs + m_files * 2;
+    m_pool = reinterpret_cast<const char*>(m_parents + m_dirs * 2);
+
+    //  Path ends run up through the pool, files first
+    uint32_t end = 0;
+
+    for (uint32_t i = 0; i < m_files + m_dirs; i++)
+    {
+      uint32_t next = util::load<uint32_t>(m_file_paths + i * 4);
+
+      if (next < end || next > pool)
+      {
+        return false;
+      }
+
+      end = next;
+      m_file_pool = (i + 1 == m_files) ? end : m_file_pool;
+    }
+
+    for (uint32_t i = 0; i < m_files; i++)
+    {
+      if (file_directory(i) >= m_dirs)
+      {
+        return false;
+      }
+    }
+
+    for (uint32_t i = 0; i < m_dirs; i++)
+    {
+      if (directory_parent(static_cast<uint16_t>(i)) >= m_dirs)
+      {
+        return false;
+      }
+    }
+
+    return true;
+  }
+
+  /*
+    Summary:
+      Writes the index of a ROM to the cache directory, under a temporary
+      name of its own first so a concurrent run never maps half of one,
+      nor writes into the same temporary file.
+
+    Parameters:
+      dir: Cache directory, created if needed
+      image: The ROM
+      table: The FST read from the ROM
+
+    Returns:
+      True if the index was written.
+  */
+  bool FstCache::save(std::string dir, const RomImage& image, FST& table)
+  {
+    uint64_t size;
+    int64_t mtime;
+    uint64_t fat;
+    uint32_t files = table.file_count();
+    uint16_t dirs = table.directory_count();
+    util::ByteWriter pool;
+    util::ByteWriter arrays(static_cast<size_t>(files) * 16 + dirs * 6);
+    std::vector<uint32_t> ends;
+    std::string text;
+
+    identity(image, size, mtime, fat);
+    ends.reserve(files + dirs);
+
+    table.visit([&](const FileRef& file)
+    {
+      pool.write(file.path);
+      ends.push_back(static_cast<uint32_t>(pool.size()));
+    });
+
+    for (uint16_t i = 0; i < dirs; i++)
+    {
+      table.directory_path(i, text);
+      pool.write(text);
+      ends.push_back(static_cast<uint32_t>(pool.size()));
+    }
+
+    for (uint32_t i = 0; i < files; i++)
+    {
+      arrays.write<uint32_t>(table.file_range(i).begin);
+    }
+
+    for (uint32_t i = 0; i < files; i++)
+    {
+      arrays.write<uint32_t>(table.file_range(i).end);
+    }
+
+    for (auto end : ends)
+    {
+      arrays.write<uint32_t>(end);
+    }
+
+    for (uint32_t i = 0; i < files; i++)
+    {
+      arrays.write<uint16_t>(table.fat_id(i));
+    }
+
+    for (uint32_t i = 0; i < files; i++)
+    {
+      arrays.write<uint16_t>(table.file_directory(i));
+    }
+
+    for (uint16_t i = 0; i < dirs; i++)
+    {
+      arrays.write<uint16_t>(table.directory_parent(i));
+    }
+
+    util::ByteWriter header(HeaderSize);
+
+    header.write("MDFST001", 8);
+    header.write<uint64_t>(size);
+    header.write<int64_t>(mtime);
+    header.write<uint64_t>(util::hash64(image.header().bytes(), Header::Size));
+    header.write<uint64_t>(fat);
+    header.write<uint32_t>(files);
+    header.write<uint32_t>(dirs);
+    header.write<uint32_t>(table.start_id());
+    header.write<uint32_t>(static_cast<uint32_t>(pool.size()));
+    header.fill(0, HeaderSize - header.size());
+
+    boost::system::error_code error;
+    fs::create_directories(dir, error);
+
+    std::string target = path(dir, image, size, mtime);
+    std::string temp = target + fs::unique_path(".%%%%%%%%.tmp").string();
+    util::File out;
+
+    bool ok = out.create(temp) && out.write_at(header.data().data(), header.size(), 0)
+      && out.write_at(arrays.data().data(), arrays.size(), header.size())
+      && out.write_at(pool.data().data(), pool.size(), header.size() + arrays.size());
+
+    out.close();
+
+    if (!ok || std::rename(temp.c_str(), target.c_str()) != 0)
+    {
+      std::remove(temp.c_str());
+      return false;
+    }
+
+    return true;
+  }
+}
@@ -0,0 +1,108 @@
+#ifndef _MD_NDS_CACHE_H
+#define _MD_NDS_CACHE_H
+
+#include <cstdint>
+#include <string>
+
+#include "nds_image.h"
+#include "nds_view.h"
+#include "util_io.h"
+
+namespace nds
+{
+  class FST;
+
+  /*
+    A flat copy of what an FST reads from a ROM, kept in a cache directory
+    so later runs can map it instead of walking the FNT: the FAT range, id,
+    directory and full path of every file, and the parent and full path of
+    every directory. Paths are stored whole, so listing never joins names.
+
+    Each ROM gets <dir>/<hash>.fst, named by its header, size and
+    modification time, which is only used while all of those and a hash of
+    its FAT still match what it recorded.
+  */
+  class FstCache
+  {
+  public:
+    FstCache() {};
+    FstCache(const FstCache&) = delete;
+    FstCache& operator=(const FstCache&) = delete;
+
+    bool open(std::string dir, const RomImage& image);
+    static bool save(std::string dir, const RomImage& image, FST& table);
+
+    inline uint32_t file_count() const
+    {
+      return m_files;
+    }
+
+    inline uint16_t directory_count() const
+    {
+      return static_cast<uint16_t>(m_dirs);
+    }
+
+    inline uint16_t start_id() const
+    {
+      return m_start_id;
+    }
+
+    inline uint16_t fat_id(uint32_t index) const
+    {
+      return util::load<uint16_t>(m_ids + index * 2);
+    }
+
+    inline uint16_t file_directory(uint32_t index) const
+    {
+      return util::load<uint16_t>(m_file_dirs + index * 2);
+    }
+
+    inline uint16_t directory_parent(uint16_t dir) const
+    {
+      return util::load<uint16_t>(m_parents + dir * 2);
+    }
+
+    inline FatRange file_range(uint32_t index) const
+    {
+      return FatRange{ util::load<uint32_t>(m_begins + index * 4), util::load<uint32_t>(m_ends + index * 4) };
+    }
+
+    //  Full path of a file from the FNT root
+    inline void file_path(uint32_t index, std::string& out) const
+    {
+      uint32_t begin = (index == 0) ? 0 : util::load<uint32_t>(m_file_paths + (index - 1) * 4);
+      out.assign(m_pool + begin, util::load<uint32_t>(m_file_paths + index * 4) - begin);
+    }
+
+    //  Full path of a directory from the FNT root, empty for the root
+    inline void directory_path(uint16_t dir, std::string& out) const
+    {
+      uint32_t begin = (dir == 0) ? m_file_pool : util::load<uint32_t>(m_dir_paths + (dir - 1) * 4);
+      out.assign(m_pool + begin, util::load<uint32_t>(m_dir_paths + dir * 4) - begin);
+    }
+
+  private:
+    static const uint32_t HeaderSize = 64;
+
+    util::MappedFile m_file;
+    uint32_t m_files = 0;
+    uint32_t m_dirs = 0;
+    uint16_t m_start_id = 0;
+    uint32_t m_file_pool = 0;   //  Bytes of file paths at the start of the pool, directory paths follow
+
+    //  Arrays in the mapping, read with util::load since nothing promises they are aligned
+    const uint8_t* m_begins = nullptr;
+    const uint8_t* m_ends = nullptr;
+    const uint8_t* m_file_paths = nullptr;  //  End of each file's path in the pool
+    const uint8_t* m_dir_paths = nullptr;   //  End of each directory's path in the pool
+    const uint8_t* m_ids = nullptr;
+    const uint8_t* m_file_dirs = nullptr;
+    const uint8_t* m_parents = nullptr;
+    const char* m_pool = nullptr;
+
+    static std::string path(std::string dir, const RomImage& image, uint64_t size, int64_t mtime);
+    static void identity(const RomImage& image, uint64_t& size, int64_t& mtime, uint64_t& fat);
+  };
+}
+
+#endif
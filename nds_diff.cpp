@@ -0,0 +1,416 @@
+#include "nds_diff.h"
+#include "nds_extract.h"
+#include "nds_fst.h"
+#include "nds_image.h"
+#include "util.h"
+#include "util_io.h"
+
+#include <algorithm>
+#include <boost/filesystem.hpp>
+#include <chrono>
+#include <cstring>
+#include <memory>
+#include <sstream>
+#include <unordered_map>
+
+namespace fs = boost::filesystem;
+
+namespace nds
+{
+  namespace
+  {
+    //  A file on one side of a diff
+    struct DiffEntry
+    {
+      DiffEntry(std::string path, uint64_t offset, uint64_t size) : path(path), offset(offset), size(size) {};
+
+      std::string path;   //  Path relative to the extraction root, such as sys/arm9.bin
+      uint64_t offset;    //  Start in the ROM, 0 for a file on disk
+      uint64_t size;
+    };
+
+    /*
+      One side of a diff, either a ROM, with every section, overlay and
+      file as a range of the mapped image, or a directory a ROM was
+      extracted to. Entries are sorted by path.
+    */
+    class DiffSide
+    {
+    public:
+      std::vector<DiffEntry> entries;
+
+      bool open(std::string path)
+      {
+        if (fs::is_directory(path))
+        {
+          return open_directory(path);
+        }
+
+        m_rom = std::make_shared<RomImage>(path);
+
+        if (!m_rom->valid())
+        {
+          std::cout << "Could not read a header from " << path << std::endl;
+          return false;
+        }
+
+        FST table(m_rom);
+
+        if (!table.fnt().valid())
+        {
+          std::cout << "Could not read the file table of " << path << std::endl;
+          return false;
+        }
+
+        for (auto& entry : rom_entries(*m_rom, table))
+        {
+          entries.push_back(DiffEntry(entry.path, entry.offset, entry.size));
+        }
+
+        sort();
+        return true;
+      }
+
+      inline bool rom() const
+      {
+        return m_rom != nullptr;
+      }
+
+      /*
+        Summary:
+          Points at the contents of an entry, mapping it first if it is a
+          file on disk.
+
+        Parameters:
+          entry: Entry of this side
+          map: Holds the mapping of a file on disk for as long as the contents are used
+
+        Returns:
+          The contents, or null if the entry could not be read whole.
+      */
+      const uint8_t* contents(const DiffEntry& entry, util::MappedFile& map) const
+      {
+        util::throttle().read(entry.size);
+
+        if (m_rom)
+        {
+          uint32_t size = static_cast<uint32_t>(entry.size);
+          const uint8_t* data = m_rom->span(entry.offset, size);
+          return (size == entry.size) ? data : nullptr;
+        }
+
+        return (map.open(m_root + "/" + entry.path) && map.size() == entry.size) ? map.data() : nullptr;
+      }
+
+    private:
+      std::string m_root;
+      std::shared_ptr<RomImage> m_rom;
+
+      //  Every file under an extraction, leaving out the journal and files a cut off extraction left unfinished
+      bool open_directory(std::string root)
+      {
+        boost::system::error_code error;
+        m_root = root;
+
+        for (fs::recursive_directory_iterator it(root, error), end; !error && it != end; it.increment(error))
+        {
+          std::string name = it->path().filename().string();
+
+          if (!fs::is_regular_file(it->path()) || name == ExtractJournal::Name
+            || (name.size() > 11 && name.compare(name.size() - 11, 11, ".mdnds-part") == 0))
+          {
+            continue;
+          }
+
+          entries.push_back(DiffEntry(it->path().lexically_relative(root).generic_string(), 0, fs::file_size(it->path())));
+        }
+
+        if (error)
+        {
+          std::cout << "Could not read " << root << ": " << error.message() << std::endl;
+          return false;
+        }
+
+        sort();
+        return true;
+      }
+
+      void sort()
+      {
+        std::sort(entries.begin(), entries.end(), [](const DiffEntry& x, const DiffEntry& y) { return x.path < y.path; });
+      }
+    };
+
+    //  Whether two entries hold the same bytes, stopping at the first difference
+    bool same(const DiffSide& a, const DiffEntry& x, const DiffSide& b, const DiffEntry& y)
+    {
+      util::MappedFile map_x;
+      util::MappedFile map_y;
+
+      if (x.size != y.size)
+      {
+        return false;
+      }
+
+      if (x.size == 0)
+      {
+        return true;
+      }
+
+      const uint8_t* data_x = a.contents(x, map_x);
+      const uint8_t* data_y = b.contents(y, map_y);
+
+      return data_x && data_y && memcmp(data_x, data_y, static_cast<size_t>(x.size)) == 0;
+    }
+
+    uint64_t hash(const DiffSide& side, const DiffEntry& entry)
+    {
+      util::MappedFile map;
+      const uint8_t* data = (entry.size > 0) ? side.contents(entry, map) : nullptr;
+      return data ? util::hash64(data, static_cast<size_t>(entry.size)) : 0;
+    }
+
+    const char* kind_name(DiffChange::Kind kind)
+    {
+      switch (kind)
+      {
+      case DiffChange::Added: return "added";
+      case DiffChange::Removed: return "removed";
+      case DiffChange::Modified: return "modified";
+      default: return "moved";
+      }
+    }
+
+    std::string to_text(const DiffChange& change)
+    {
+      std::ostringstream out;
+
+      switch (change.kind)
+      {
+      case DiffChange::Added:
+        out << "A " << change.path << " (" << change.new_size << " bytes)";
+        break;
+      case DiffChange::Removed:
+        out << "D " << change.path << " (" << change.old_size << " bytes)";
+        break;
+      case DiffChange::Modified:
+        out << "M " << change.path << " (" << change.old_size << " -> " << change.new_size << " bytes)";
+        break;
+      case DiffChange::Moved:
+        out << "R " << change.from << " -> " << change.path;
+        break;
+      }
+
+      return out.str();
+    }
+
+    std::string to_json(const DiffChange& change)
+    {
+      std::ostringstream out;
+      out << "{\"change\":\"" << kind_name(change.kind) << "\",\"section\":" << util::json_string(change.section())
+        << ",\"path\":" << util::json_string(change.path);
+
+      if (change.kind == DiffChange::Moved)
+      {
+        out << ",\"from\":" << util::json_string(change.from);
+      }
+
+      if (change.kind != DiffChange::Added)
+      {
+        out << ",\"old_size\":" << change.old_size;
+      }
+
+      if (change.kind != DiffChange::Removed)
+      {
+        out << ",\"new_size\":" << change.new_size;
+      }
+
+      out << "}";
+      return out.str();
+    }
+  }
+
+  /*
+    Summary:
+      Finds the files that differ between two ROMs, two extractions, or a
+      ROM and an extraction. Entries are matched by path and compared by
+      size, and only when the sizes agree by their bytes. Files only on one
+      side are hashed, and a removed file with the same contents as an
+      added one is reported as moved.
+
+    Parameters:
+      a: Old ROM or extraction directory
+      b: New ROM or extraction directory
+      ok: Set to whether both sides could be read
+      threads: Number of threads to use, or 0 for one per hardware thread
+
+    Returns:
+      The changes, sorted by path.
+  */
+  std::vector<DiffChange> diff_changes(std::string a, std::string b, bool& ok, uint32_t threads)
+  {
+    std::vector<DiffChange> changes;
+    DiffSide old_side;
+    DiffSide new_side;
+
+    ok = old_side.open(a) && new_side.open(b);
+
+    if (!ok)
+    {
+      return changes;
+    }
+
+    auto& olds = old_side.entries;
+    auto& news = new_side.entries;
+    std::vector<std::pair<size_t, size_t>> pairs;
+    std::vector<size_t> removed;
+    std::vector<size_t> added;
+
+    //  Both sides are sorted, so walk them together
+    for (size_t i = 0, j = 0; i < olds.size() || j < news.size();)
+    {
+      if (j == news.size() || (i < olds.size() && olds[i].path < news[j].path))
+      {
+        removed.push_back(i++);
+      }
+      else if (i == olds.size() || news[j].path < olds[i].path)
+      {
+        added.push_back(j++);
+      }
+      else
+      {
+        pairs.push_back(std::make_pair(i++, j++));
+      }
+    }
+
+    //  Compare in ROM order so a ROM that isn't cached yet is read front to back
+    const auto& ordered = old_side.rom() ? olds : news;
+    bool by_old = old_side.rom();
+
+    std::sort(pairs.begin(), pairs.end(), [&](const std::pair<size_t, size_t>& x, const std::pair<size_t, size_t>& y)
+    {
+      return ordered[by_old ? x.first : x.second].offset < ordered[by_old ? y.first : y.second].offset;
+    });
+
+    std::vector<uint8_t> modified(pairs.size());
+    std::vector<uint64_t> removed_hashes(removed.size());
+    std::vector<uint64_t> added_hashes(added.size());
+
+    util::parallel_for(pairs.size() + removed.size() + added.size(), [&](size_t i)
+    {
+      if (i < pairs.size())
+      {
+        modified[i] = !same(old_side, olds[pairs[i].first], new_side, news[pairs[i].second]);
+      }
+      else if (i < pairs.size() + removed.size())
+      {
+        i -= pairs.size();
+        removed_hashes[i] = hash(old_side, olds[removed[i]]);
+      }
+      else
+      {
+        i -= pairs.size() + removed.size();
+        added_hashes[i] = hash(new_side, news[added[i]]);
+      }
+    }, threads);
+
+    for (size_t i = 0; i < pairs.size(); i++)
+    {
+      if (modified[i])
+      {
+        auto& x = olds[pairs[i].first];
+        changes.push_back(DiffChange(DiffChange::Modified, x.path, x.size, news[pairs[i].second].size));
+      }
+    }
+
+    //  Hashes only narrow down the candidates, a move is confirmed by comparing the contents
+    std::unordered_multimap<uint64_t, size_t> gone;
+    std::vector<bool> moved(removed.size());
+
+    for (size_t i = 0; i < removed.size(); i++)
+    {
+      gone.insert(std::make_pair(removed_hashes[i] ^ olds[removed[i]].size, i));
+    }
+
+    for (size_t j = 0; j < added.size(); j++)
+    {
+      auto& y = news[added[j]];
+      auto range = gone.equal_range(added_hashes[j] ^ y.size);
+      auto match = range.second;
+
+      for (auto it = range.first; it != range.second && match == range.second; ++it)
+      {
+        match = same(old_side, olds[removed[it->second]], new_side, y) ? it : range.second;
+      }
+
+      if (match != range.second)
+      {
+        auto& x = olds[removed[match->second]];
+        changes.push_back(DiffChange(DiffChange::Moved, y.path, x.size, y.size, x.path));
+        moved[match->second] = true;
+        gone.erase(match);
+      }
+      else
+      {
+        changes.push_back(DiffChange(DiffChange::Added, y.path, 0, y.size));
+      }
+    }
+
+    for (size_t i = 0; i < removed.size(); i++)
+    {
+      if (!moved[i])
+      {
+        changes.push_back(DiffChange(DiffChange::Removed, olds[removed[i]].path, olds[removed[i]].size, 0));
+      }
+    }
+
+    std::sort(changes.begin(), changes.end(), [](const DiffChange& x, const DiffChange& y) { return x.path < y.path; });
+    return changes;
+  }
+
+  /*
+    Summary:
+      Prints the files that differ between two ROMs or extractions, see
+      diff_changes, one line or JSON object per change.
+
+    Parameters:
+      a: Old ROM or extraction directory
+      b: New ROM or extraction directory
+      format: "text" or "json"
+      threads: Number of threads to use, or 0 for one per hardware thread
+
+    Returns:
+      True if both sides could be read.
+  */
+  bool diff(std::string a, std::string b, std::string format, uint32_t threads)
+  {
+    if (format != "text" && format != "json")
+    {
+      std::cout << "Unknown diff format " << format << std::endl;
+      return false;
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    bool ok;
+    std::vector<DiffChange> changes = diff_changes(a, b, ok, threads);
+
+    if (!ok)
+    {
+      return false;
+    }
+
+    auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+    uint32_t counts[4] = {};
+
+    for (auto& change : changes)
+    {
+      std::cout << ((format == "json") ? to_json(change) : to_text(change)) << "\n";
+      counts[change.kind]++;
+    }
+
+    std::cerr << counts[DiffChange::Added] << " added, " << counts[DiffChange::Removed] << " removed, "
+      << counts[DiffChange::Modified] << " modified, " << counts[DiffChange::Moved] << " moved in " << ms << " ms" << std::endl;
+
+    return true;
+  }
+}
@@ -0,0 +1,41 @@
+#ifndef _MD_NDS_DIFF_H
+#define _MD_NDS_DIFF_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace nds
+{
+  //  How a file differs between two ROMs or extractions, by its path as extract writes it
+  struct DiffChange
+  {
+    enum Kind
+    {
+      Added,
+      Removed,
+      Modified,
+      Moved     //  The same contents under another path, with the old path in from
+    };
+
+    DiffChange(Kind kind, std::string path, uint64_t old_size, uint64_t new_size, std::string from = "")
+      : kind(kind), path(path), from(from), old_size(old_size), new_size(new_size) {};
+
+    Kind kind;
+    std::string path;
+    std::string from;
+    uint64_t old_size;
+    uint64_t new_size;
+
+    //  "sys", "overlay" or "files"
+    inline std::string section() const
+    {
+      return path.substr(0, path.find('/'));
+    }
+  };
+
+  std::vector<DiffChange> diff_changes(std::string a, std::string b, bool& ok, uint32_t threads = 0);
+  bool diff(std::string a, std::string b, std::string format = "text", uint32_t threads = 0);
+}
+
+#endif
@@ -0,0 +1,648 @@
+#include "nds_extract.h"
+#include "nds_banner.h"
+#include "util.h"
+#include "util_uring.h"
+
+#include <boost/filesystem.hpp>
+
+#ifdef UTIL_IO_POSIX
+#include <sys/resource.h>
+#endif
+
+namespace nds
+{
+  namespace
+  {
+    //  How far past the files being written the ROM is read ahead
+    const uint64_t ReadAheadWindow = 16 * 1024 * 1024;
+
+    /*
+      Keeps the kernel reading the ROM a window ahead of the jobs being
+      written. Jobs sorted by offset make each window one sequential read
+      that covers many small files, which are then written straight from
+      the mapping.
+    */
+    class ReadAhead
+    {
+    public:
+      ReadAhead(RomImage& rom, std::vector<ExtractJob>& jobs) : m_rom(rom), m_jobs(jobs), m_next(0), m_end(0) {};
+
+      //  Reads ahead up to a window past the start of the given job
+      void advance(size_t index)
+      {
+        if (index >= m_jobs.size())
+        {
+          return;
+        }
+
+        uint64_t begin = std::max<uint64_t>(m_end, m_jobs[index].offset);
+        uint64_t target = m_jobs[index].offset + ReadAheadWindow;
+
+        for (; m_next < m_jobs.size() && m_jobs[m_next].offset < target; m_next++)
+        {
+          m_end = std::max<uint64_t>(m_end, static_cast<uint64_t>(m_jobs[m_next].offset) + m_jobs[m_next].size);
+        }
+
+        if (m_end > begin)
+        {
+          m_rom.read_ahead(begin, m_end - begin);
+        }
+      }
+
+    private:
+      RomImage& m_rom;
+      std::vector<ExtractJob>& m_jobs;
+      size_t m_next;
+      uint64_t m_end;
+    };
+  }
+
+  /*
+    Summary:
+      Lists every range of a ROM that extract writes out: the sys blobs,
+      each overlay and each file, named by their path under the output.
+
+    Parameters:
+      rom: The ROM to list
+      table: The FST read from the ROM
+  */
+  std::vector<RomEntry> rom_entries(RomImage& rom, FST& table)
+  {
+    HeaderView header = rom.header();
+    FatView fat = table.fat();
+    std::vector<RomEntry> entries;
+
+    entries.reserve(8 + table.start_id() + table.file_count());
+
+    //  All the important components that will be put back if re-built
+    entries.push_back(RomEntry("sys/header.bin", 0, Header::Size));
+    entries.push_back(RomEntry("sys/fnt.bin", header.file_name_table(), header.file_name_size()));
+    entries.push_back(RomEntry("sys/fat.bin", header.file_alloc_table(), header.file_alloc_size()));
+    entries.push_back(RomEntry("sys/arm9_overlay.bin", header.arm9_overlay_offset(), header.arm9_overlay_size()));
+    entries.push_back(RomEntry("sys/arm7_overlay.bin", header.arm7_overlay_offset(), header.arm7_overlay_size()));
+    entries.push_back(RomEntry("sys/arm9.bin", header.arm9_rom_offset(), header.arm9_size()));
+    entries.push_back(RomEntry("sys/arm7.bin", header.arm7_rom_offset(), header.arm7_size()));
+
+    BannerView banner = rom_banner(rom);
+
+    if (banner.valid())
+    {
+      entries.push_back(RomEntry("sys/banner.bin", header.icon_title_offset(), banner.size()));
+    }
+
+    //  Overlays take the file ids before the first FNT file
+    for (uint16_t i = 0; i < table.start_id() && fat.contains(i); i++)
+    {
+      FatRange range = fat[i];
+      entries.push_back(RomEntry("overlay/overlay_" + util::zero_pad(i, 4) + ".bin", range.begin, range.size()));
+    }
+
+    table.visit([&](const FileRef& file)
+    {
+      entries.push_back(RomEntry("files/" + file.path, file.range.begin, file.size(), file.directory));
+    });
+
+    return entries;
+  }
+
+  /*
+    Summary:
+      Moves a job written under a temporary name to its real one. Renaming
+      within a directory is atomic, so the real name only ever refers to a
+      complete file.
+
+    Returns:
+      True if the job has no other name or was renamed.
+  */
+  bool ExtractJob::rename()
+  {
+    if (target.empty())
+    {
+      return true;
+    }
+
+#ifdef UTIL_IO_POSIX
+    if (dir >= 0)
+    {
+      return ::renameat(dir, path.c_str(), dir, target.c_str()) == 0;
+    }
+#endif
+
+    boost::system::error_code error;
+    boost::filesystem::rename(path, target, error);
+    return !error;
+  }
+
+  const char* ExtractJournal::Name = ".mdnds-journal";
+
+  /*
+    Summary:
+      Reads the journal in an extraction directory and opens it to append
+      to. Each line is "<hash> <size> <path>" or "rom <hash>", and a line
+      cut short by a crash is ignored.
+
+    Parameters:
+      dir: Extraction directory holding the journal
+      rom: Identity of the ROM being extracted, see identity
+
+    Returns:
+      True if the journal could be opened for writing.
+  */
+  bool ExtractJournal::open(std::string dir, uint64_t rom)
+  {
+    std::string path = dir + "/" + Name;
+    std::ifstream in(path);
+    std::string line;
+    bool same = false;
+
+    while (std::getline(in, line))
+    {
+      size_t hash_end = line.find(' ');
+      size_t size_end = (hash_end == std::string::npos) ? hash_end : line.find(' ', hash_end + 1);
+
+      //  Lines before a ROM line were written from whatever ROM came before it
+      if (line.size() == 20 && line.compare(0, 4, "rom ") == 0)
+      {
+        for (auto& entry : m_entries)
+        {
+          entry.second.current = false;
+        }
+
+        same = std::strtoull(line.c_str() + 4, nullptr, 16) == rom;
+        continue;
+      }
+
+      if (hash_end != 16 || size_end == std::string::npos || size_end + 1 >= line.size())
+      {
+        continue;
+      }
+
+      uint64_t hash = std::strtoull(line.c_str(), nullptr, 16);
+      uint32_t size = static_cast<uint32_t>(std::strtoul(line.c_str() + hash_end + 1, nullptr, 10));
+      m_entries[line.substr(size_end + 1)] = Entry{ size, hash, true };
+    }
+
+    //  Start on a fresh line if the last one was cut off
+    in.clear();
+    in.seekg(-1, std::ios::end);
+    bool cut = in && in.get() != '\n';
+    in.close();
+
+    m_out.open(path, std::ios::app);
+
+    if (cut)
+    {
+      m_out << "\n";
+    }
+
+    if (!same)
+    {
+      for (auto& entry : m_entries)
+      {
+        entry.second.current = false;
+      }
+
+      m_out << "rom " << util::to_hex(rom) << "\n";
+    }
+
+    return static_cast<bool>(m_out);
+  }
+
+  //  Whether a file was finished from this same ROM, which needs no hash
+  bool ExtractJournal::finished(const std::string& path, uint32_t size) const
+  {
+    auto it = m_entries.find(path);
+    return it != m_entries.end() && it->second.current && it->second.size == size;
+  }
+
+  bool ExtractJournal::contains(const std::string& path, uint32_t size, uint64_t hash) const
+  {
+    auto it = m_entries.find(path);
+    return it != m_entries.end() && it->second.size == size && it->second.hash == hash;
+  }
+
+  //  The ROM's size, modification time and header, which change whenever it is rewritten
+  uint64_t ExtractJournal::identity(const RomImage& rom)
+  {
+    boost::system::error_code error;
+    uint64_t size = boost::filesystem::file_size(rom.path(), error);
+    int64_t mtime = static_cast<int64_t>(boost::filesystem::last_write_time(rom.path(), error));
+    uint64_t seed = util::hash64(reinterpret_cast<const uint8_t*>(&mtime), sizeof(mtime), size);
+
+    return util::hash64(rom.header().bytes(), Header::Size, seed);
+  }
+
+  void ExtractJournal::add(const std::string& path, uint32_t size, uint64_t hash)
+  {
+    m_entries[path] = Entry{ size, hash, true };
+    m_out << util::to_hex(hash) << " " << size << " " << path << "\n";
+  }
+
+  bool ExtractJournal::flush()
+  {
+    m_out.flush();
+    return static_cast<bool>(m_out);
+  }
+
+#ifdef UTIL_IO_POSIX
+  /*
+    Summary:
+      Creates the directory tree under root and opens every directory in it.
+
+    Parameters:
+      root: Directory that holds the FNT root
+      table: FST holding the directories
+  */
+  DirectoryTree::DirectoryTree(std::string root, FST& table, bool all)
+    : m_fds(table.directory_count(), -1), m_table(table)
+  {
+    //  One descriptor per directory can go past the default limit on large trees
+    rlimit limit;
+
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < m_fds.size() + 256)
+    {
+      limit.rlim_cur = std::min<rlim_t>(limit.rlim_max, m_fds.size() + 256);
+      setrlimit(RLIMIT_NOFILE, &limit);
+    }
+
+    if (!m_fds.empty())
+    {
+      m_fds[0] = ::open(root.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    }
+
+    for (uint16_t id = 1; all && id < m_fds.size(); id++)
+    {
+      open(id, 0);
+    }
+  }
+
+  DirectoryTree::~DirectoryTree()
+  {
+    for (auto fd : m_fds)
+    {
+      if (fd >= 0)
+      {
+        ::close(fd);
+      }
+    }
+  }
+
+  /*
+    Summary:
+      Opens a directory, creating it and its parents first if needed.
+
+    Returns:
+      The descriptor, or -1 if it or one of its parents could not be opened.
+  */
+  int DirectoryTree::open(uint16_t id, uint32_t depth)
+  {
+    //  Already opened, or a parent chain that loops back on itself
+    if (m_fds[id] >= 0 || id == 0 || depth > m_fds.size())
+    {
+      return m_fds[id];
+    }
+
+    uint16_t parent = m_table.directory_parent(id);
+    std::string name = m_table.directory_name(id);
+
+    if (parent >= m_fds.size() || name.empty() || open(parent, depth + 1) < 0)
+    {
+      return -1;
+    }
+
+    if (mkdirat(m_fds[parent], name.c_str(), 0755) != 0 && errno != EEXIST)
+    {
+      return -1;
+    }
+
+    m_fds[id] = ::openat(m_fds[parent], name.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    return m_fds[id];
+  }
+#endif
+
+  /*
+    Summary:
+      Writes every job on a pool of threads, one file at a time per thread.
+      Jobs go a window at a time, with the next window read ahead while
+      the current one is written.
+
+    Returns:
+      True if every file was written.
+  */
+  bool ThreadedBackend::run(RomImage& rom, std::vector<ExtractJob>& jobs)
+  {
+    std::atomic<bool> ok(true);
+    ReadAhead ahead(rom, jobs);
+    size_t first = 0;
+    size_t last = 0;
+
+    auto write = [&](size_t i)
+    {
+      ExtractJob& job = jobs[first + i];
+      uint32_t size = job.size;
+      const uint8_t* data = rom.span(job.offset, size);
+      util::File out;
+
+      //  The ROM is read through its mapping, so charge the read here
+      util::throttle().read(size);
+
+      if (size != job.size)
+      {
+        std::cout << "Could not read all of " << job.path << " from the disc" << std::endl;
+        ok = false;
+      }
+
+#ifdef UTIL_IO_POSIX
+      bool created = (job.dir >= 0) ? out.create(job.dir, job.path) : out.create(job.path);
+#else
+      bool created = out.create(job.path);
+#endif
+
+      if (!created || (size > 0 && !out.write_at(data, size, 0)))
+      {
+        std::cout << "Could not write " << job.path << std::endl;
+        ok = false;
+      }
+      else
+      {
+        job.ok = (size == job.size);
+      }
+    };
+
+    for (ahead.advance(0); first < jobs.size(); first = last)
+    {
+      uint64_t end = jobs[first].offset + ReadAheadWindow;
+
+      last = first + 1;
+
+      while (last < jobs.size() && jobs[last].offset < end)
+      {
+        last++;
+      }
+
+      ahead.advance(last);
+      util::parallel_for(last - first, write, m_threads);
+    }
+
+    return ok;
+  }
+
+#ifdef __linux__
+  /*
+    Summary:
+      Checks whether the running kernel can open, write and close through io_uring.
+  */
+  bool UringBackend::supported()
+  {
+    util::Uring ring;
+    return ring.setup(2) && ring.supports({ IORING_OP_OPENAT, IORING_OP_WRITE, IORING_OP_CLOSE });
+  }
+
+  namespace
+  {
+    //  Marks every file of a batch as not written once the ring stops giving completions
+    bool fail_batch(std::vector<ExtractJob>& jobs, size_t first, uint32_t count)
+    {
+      std::cout << "Lost track of the io_uring completions, could not write " << count << " files from " << jobs[first].path << std::endl;
+
+      for (uint32_t i = 0; i < count; i++)
+      {
+        jobs[first + i].ok = false;
+      }
+
+      return false;
+    }
+  }
+
+  /*
+    Summary:
+      Writes the jobs in batches of the queue depth. Every file in a batch is
+      opened with one submission, then every write and its linked close go
+      out with a second submission. Writes come straight from the mapped ROM.
+
+    Returns:
+      True if every file was written.
+  */
+  bool UringBackend::run(RomImage& rom, std::vector<ExtractJob>& jobs)
+  {
+    util::Uring ring;
+
+    //  Each file needs a write and a close in flight at the same time, which the kernel limits
+    uint32_t files = std::min(std::max(m_queue_depth, 1u), util::Uring::MaxEntries / 2);
+
+    if (files < m_queue_depth)
+    {
+      std::cout << "A queue depth of " << m_queue_depth << " is more than io_uring allows, using " << files << std::endl;
+    }
+
+    if (!ring.setup(files * 2))
+    {
+      std::cout << "Could not set up io_uring with a queue depth of " << files << ": " << strerror(errno) << std::endl;
+      return false;
+    }
+
+    uint32_t depth = ring.entries() / 2;
+    bool ok = true;
+
+    std::vector<const uint8_t*> data(depth);
+    std::vector<uint32_t> sizes(depth);
+    std::vector<int> fds(depth);
+    std::vector<int> written(depth);
+    std::vector<int> closed(depth);
+
+    ReadAhead ahead(rom, jobs);
+
+    for (size_t first = 0; first < jobs.size(); first += depth)
+    {
+      uint32_t count = static_cast<uint32_t>(std::min<size_t>(depth, jobs.size() - first));
+      io_uring_cqe cqe;
+      uint32_t completed = 0;
+
+      //  Nothing is carried over from the previous batch, so a missing completion can't reuse its fds
+      std::fill(fds.begin(), fds.end(), -1);
+      std::fill(written.begin(), written.end(), 0);
+      std::fill(closed.begin(), closed.end(), 0);
+
+      ahead.advance(first);
+
+      //  Queue an open for every file in the batch
+      for (uint32_t i = 0; i < count; i++)
+      {
+        ExtractJob& job = jobs[first + i];
+        sizes[i] = job.size;
+        data[i] = rom.span(job.offset, sizes[i]);
+
+        if (sizes[i] != job.size)
+        {
+          std::cout << "Could not read all of " << job.path << " from the disc" << std::endl;
+          ok = false;
+        }
+
+        //  Writes bypass util::File, so the whole file is charged before it is queued
+        util::throttle().read(sizes[i]);
+        util::throttle().write(sizes[i]);
+
+        io_uring_sqe* sqe = ring.get_sqe();
+        sqe->opcode = IORING_OP_OPENAT;
+        sqe->fd = (job.dir >= 0) ? job.dir : AT_FDCWD;
+        sqe->addr = reinterpret_cast<uintptr_t>(job.path.c_str());
+        sqe->len = 0644;
+        sqe->open_flags = O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC;
+        sqe->user_data = i;
+      }
+
+      bool submitted = ring.submit(count) >= 0;
+
+      for (completed = 0; submitted && completed < count && ring.wait(cqe); completed++)
+      {
+        fds[cqe.user_data] = cqe.res;
+      }
+
+      //  Without every completion it isn't known which files opened, so the batch fails and the ring is given up
+      if (completed < count)
+      {
+        for (uint32_t i = 0; i < count; i++)
+        {
+          if (fds[i] >= 0)
+          {
+            ::close(fds[i]);
+          }
+        }
+
+        return fail_batch(jobs, first, count);
+      }
+
+      //  Queue a write linked to a close for every file that opened
+      uint32_t pending = 0;
+
+      for (uint32_t i = 0; i < count; i++)
+      {
+        if (fds[i] < 0)
+        {
+          std::cout << "Could not write " << jobs[first + i].path << std::endl;
+          ok = false;
+          continue;
+        }
+
+        if (sizes[i] > 0)
+        {
+          io_uring_sqe* sqe = ring.get_sqe();
+          sqe->opcode = IORING_OP_WRITE;
+          sqe->fd = fds[i];
+          sqe->addr = reinterpret_cast<uintptr_t>(data[i]);
+          sqe->len = sizes[i];
+          sqe->off = 0;
+          sqe->flags = IOSQE_IO_LINK;
+          sqe->user_data = i * 2;
+          pending++;
+        }
+
+        io_uring_sqe* sqe = ring.get_sqe();
+        sqe->opcode = IORING_OP_CLOSE;
+        sqe->fd = fds[i];
+        sqe->user_data = i * 2 + 1;
+        pending++;
+      }
+
+      submitted = ring.submit(pending) >= 0;
+
+      for (completed = 0; submitted && completed < pending && ring.wait(cqe); completed++)
+      {
+        uint32_t index = static_cast<uint32_t>(cqe.user_data / 2);
+
+        if (cqe.user_data & 1)
+        {
+          closed[index] = cqe.res;
+        }
+        else
+        {
+          written[index] = cqe.res;
+        }
+      }
+
+      //  A close may have completed unseen, so finishing the files here could close a reused fd
+      if (completed < pending)
+      {
+        return fail_batch(jobs, first, count);
+      }
+
+      //  A short write breaks the link and cancels the close, so finish those files here
+      for (uint32_t i = 0; i < count; i++)
+      {
+        if (fds[i] < 0)
+        {
+          continue;
+        }
+
+        if (closed[i] != -ECANCELED)
+        {
+          bool written_all = (closed[i] == 0) && (sizes[i] == 0 || written[i] == static_cast<int>(sizes[i]));
+
+          if (!written_all)
+          {
+            std::cout << "Could not write " << jobs[first + i].path << std::endl;
+            ok = false;
+          }
+
+          jobs[first + i].ok = written_all && (sizes[i] == jobs[first + i].size);
+          continue;
+        }
+
+        size_t done = std::max(written[i], 0);
+
+        while (done < sizes[i])
+        {
+          ssize_t ret = pwrite(fds[i], data[i] + done, sizes[i] - done, done);
+
+          if (ret <= 0)
+          {
+            std::cout << "Could not write " << jobs[first + i].path << std::endl;
+            ok = false;
+            break;
+          }
+
+          done += ret;
+        }
+
+        bool closed_ok = ::close(fds[i]) == 0;
+
+        //  A failed write was reported above
+        if (!closed_ok && done == sizes[i])
+        {
+          std::cout << "Could not write " << jobs[first + i].path << std::endl;
+          ok = false;
+        }
+
+        jobs[first + i].ok = closed_ok && (done == sizes[i]) && (sizes[i] == jobs[first + i].size);
+      }
+    }
+
+    return ok;
+  }
+#endif
+
+  /*
+    Summary:
+      Picks the I/O backend for an extraction. io_uring is used when asked
+      for, or by default when the kernel supports it, otherwise threads.
+  */
+  std::unique_ptr<ExtractBackend> create_backend(ExtractOptions& options)
+  {
+#ifdef __linux__
+    if (options.io != "threads")
+    {
+      if (UringBackend::supported())
+      {
+        return std::unique_ptr<ExtractBackend>(new UringBackend(options.queue_depth));
+      }
+
+      if (options.io == "uring")
+      {
+        std::cout << "io_uring is not supported by this kernel, using threads instead" << std::endl;
+      }
+    }
+#endif
+
+    return std::unique_ptr<ExtractBackend>(new ThreadedBackend(options.threads));
+  }
+}
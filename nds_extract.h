@@ -0,0 +1,180 @@
+#ifndef _MD_NDS_EXTRACT_H
+#define _MD_NDS_EXTRACT_H
+
+#include <cstdint>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "nds_fst.h"
+#include "nds_image.h"
+#include "util_io.h"
+
+namespace nds
+{
+  struct ExtractOptions
+  {
+    std::string io = "auto";      //  "auto", "uring" or "threads"
+    uint32_t queue_depth = 64;    //  Files in flight per io_uring batch
+    uint32_t threads = 0;         //  Threads for the threaded path, 0 for one per hardware thread
+    bool resume = false;          //  Skip finished outputs and write the rest through temporary names
+    std::string only;             //  Path of one file or directory to extract by itself, such as files/data/a.bin
+    std::string cache;            //  Directory of cached FST indexes, or empty for none
+  };
+
+  //  A named range of a ROM, laid out the way extract writes it
+  struct RomEntry
+  {
+    RomEntry(std::string path, uint32_t offset, uint32_t size, int32_t directory = -1)
+      : path(path), offset(offset), size(size), directory(directory) {};
+
+    std::string path;   //  Path relative to the extraction root, such as sys/arm9.bin
+    uint32_t offset;
+    uint32_t size;
+    int32_t directory;  //  FNT directory id for entries under files/, otherwise -1
+
+    inline std::string name() const
+    {
+      return path.substr(path.find_last_of('/') + 1);
+    }
+  };
+
+  std::vector<RomEntry> rom_entries(RomImage& rom, FST& table);
+
+  //  A range of the ROM to be written out to its own file
+  struct ExtractJob
+  {
+    ExtractJob(std::string path, uint32_t offset, uint32_t size, int dir = -1)
+      : path(path), offset(offset), size(size), dir(dir), ok(false) {};
+
+    std::string path;   //  Full path, or a name relative to dir when dir is open
+    uint32_t offset;
+    uint32_t size;
+    int dir;            //  Directory descriptor the path is relative to, or -1
+    std::string target; //  Name the file is renamed to once written, relative like path, or empty
+    bool ok;            //  Set by the backend once every byte is written
+
+    bool rename();
+  };
+
+  /*
+    Remembers which outputs of an extraction are finished, by their path,
+    size and a hash of the range of the ROM they were written from. Lines
+    are appended as files are renamed into place, so an extraction that is
+    cut off can be run again and skip what it already wrote.
+
+    A "rom <hash>" line names the ROM the lines after it were written from.
+    While it is still the same ROM, those are trusted on their size alone,
+    so resuming reads nothing it doesn't write. Older lines still need the
+    hash of the ROM range to match.
+  */
+  class ExtractJournal
+  {
+  public:
+    static const char* Name;
+
+    bool open(std::string dir, uint64_t rom);
+    bool finished(const std::string& path, uint32_t size) const;
+    bool contains(const std::string& path, uint32_t size, uint64_t hash) const;
+    void add(const std::string& path, uint32_t size, uint64_t hash);
+    bool flush();
+
+    static uint64_t identity(const RomImage& rom);
+
+  private:
+    struct Entry
+    {
+      uint32_t size;
+      uint64_t hash;
+      bool current;   //  Written from the ROM being extracted
+    };
+
+    std::unordered_map<std::string, Entry> m_entries;
+    std::ofstream m_out;
+  };
+
+#ifdef UTIL_IO_POSIX
+  /*
+    Creates the directories of the FNT and keeps a descriptor open for each
+    one, so files can be created relative to their parent without looking
+    up the whole path again. Directories are all created up front so empty
+    ones are kept, or only as files need them.
+  */
+  class DirectoryTree
+  {
+  public:
+    DirectoryTree(std::string root, FST& table, bool all = true);
+    DirectoryTree(const DirectoryTree&) = delete;
+    DirectoryTree& operator=(const DirectoryTree&) = delete;
+    ~DirectoryTree();
+
+    //  Descriptor of a directory id, or -1 if it could not be opened
+    inline int fd(uint16_t id)
+    {
+      return (id < m_fds.size()) ? open(id, 0) : -1;
+    }
+
+  private:
+    std::vector<int> m_fds;
+    FST& m_table;
+
+    int open(uint16_t id, uint32_t depth);
+  };
+#endif
+
+  /*
+    Writes a batch of ROM ranges out to files. Directories that the jobs
+    write into must already exist.
+  */
+  class ExtractBackend
+  {
+  public:
+    virtual ~ExtractBackend() {};
+    virtual std::string name() = 0;
+    virtual bool run(RomImage& rom, std::vector<ExtractJob>& jobs) = 0;
+  };
+
+  //  Reads and writes each file on its own thread with plain positional I/O
+  class ThreadedBackend : public ExtractBackend
+  {
+  public:
+    ThreadedBackend(uint32_t threads) : m_threads(threads) {};
+
+    std::string name()
+    {
+      return "threads";
+    }
+
+    bool run(RomImage& rom, std::vector<ExtractJob>& jobs);
+
+  private:
+    uint32_t m_threads;
+  };
+
+#ifdef __linux__
+  //  Submits the open, write and close of a whole batch of files at once through io_uring
+  class UringBackend : public ExtractBackend
+  {
+  public:
+    UringBackend(uint32_t queue_depth) : m_queue_depth(queue_depth) {};
+
+    std::string name()
+    {
+      return "uring";
+    }
+
+    bool run(RomImage& rom, std::vector<ExtractJob>& jobs);
+
+    static bool supported();
+
+  private:
+    uint32_t m_queue_depth;
+  };
+#endif
+
+  std::unique_ptr<ExtractBackend> create_backend(ExtractOptions& options);
+}
+
+#endif
@@ -4,158 +4,321 @@ namespace fs = boost::filesystem;
 
 namespace nds
 {
-  FST::FST(std::string disc)
+  FST::FST(std::string disc) : FST(std::make_shared<RomImage>(disc))
   {
-    Header header(util::read_file(disc, 0x200));
-    m_fat = util::read_file(disc, header.file_alloc_size(), header.file_alloc_table());
-    m_fnt = util::read_file(disc, header.file_name_size(), header.file_name_table());
+  }
 
-    std::vector<std::string> current_directory = { "." };         //  The current directory that is being read from
-    std::map<uint16_t, std::string> directories = { { 0, "." } }; //  A map of all directories <dir_id, name>
+  /*
+    Summary:
+      Reads the FST of a ROM. The FAT and FNT are used in place through views
+      into the mapped image rather than being copied out, and names are
+      only read from the FNT when a path is asked for.
 
-    uint32_t dir_index = 0;                           //  Current directory index
-    uint32_t total = util::read<uint16_t>(m_fnt, 6);  //  Total entries
+      With a cache directory, a cached index of the ROM is mapped instead
+      and the FNT isn't read at all, or one is saved for next time.
 
-    std::cout << "Storing main table entries" << std::endl;
+    Parameters:
+      image: The ROM to read from
+      cache: Cache directory, or empty for none
+  */
+  FST::FST(std::shared_ptr<RomImage> image, std::string cache) : m_image(image), m_fat_base(0), m_verbose(false)
+  {
+    m_fat_view = image->fat();
 
-    for (uint32_t i = 0; i < total; i++)
+    if (!cache.empty())
     {
-      m_table_entries.push_back(TableEntry(util::subset(m_fnt, i * 8, 8)));
+      auto index = std::make_shared<FstCache>();
+
+      if (index->open(cache, *image))
+      {
+        //  Everything is read from the mapping from here on, nothing is copied out of it
+        m_cache = index;
+        return;
+      }
     }
 
-    std::cout << "Iterating main table entries" << std::endl;
-    for (auto& entry : m_table_entries)
+    m_fnt_view = image->fnt();
+
+    if (!m_fnt_view.valid())
     {
-      std::cout << "dir_index: " << dir_index << std::endl;
+      std::cout << "Invalid file name table" << std::endl;
+      return;
+    }
 
-      uint32_t file_id = entry.first_id();  //  The starting file id in this folder
-      uint32_t subdirs = 0;                 //  The amount of sub directories in this folder
+    index();
 
-      //  Offsets are relative to the FNT offset
-      uint32_t offset = entry.offset();
+    if (!cache.empty() && !FstCache::save(cache, *image, *this))
+    {
+      std::cout << "Could not save an index of " << image->path() << " to " << cache << std::endl;
+    }
+  }
 
-      //  0 indicates the section has ended
-      while (m_fnt[offset] != 0)
-      {
-        std::string entry = "";       //  Holds the current entry identifier
-        uint8_t len = m_fnt[offset];  //  First byte is the length of the file/directory name
+  /*
+    Summary:
+      Fills the file and directory arrays from the FNT, keeping only the
+      offset of each name.
+  */
+  void FST::index()
+  {
+    FntView table = fnt();
+    uint16_t total = table.directory_count();  //  Total directories
 
-        //  If length is 0x01 to 0x7F then it is a file entry
-        if (len > 0x00 && len < 0x80)
-        {
-          entry = util::read(m_fnt, offset + 1, len);         //  Get the file name
-          entry = current_directory[dir_index] + "/" + entry; //  Prepend the directory structure before the file name
-          offset += len + 1;                                  //  Offset increase by file name length + length byte
+    m_dir_names.assign(total, 0);
+    m_dir_parents.assign(total, 0);
 
-          //  File Allocation Table holds pairs of integers noting start and end offsets into the rom.
-          uint32_t file_start = util::read<uint32_t>(m_fat, file_id * 8);
-          uint32_t file_end = util::read<uint32_t>(m_fat, file_id * 8 + 4);
+    //  Directories are named by the entry their parent's sub-table holds for them
+    for (uint16_t dir = 0; dir < total; dir++)
+    {
+      if (dir > 0)
+      {
+        m_dir_parents[dir] = table.parent(dir);
+      }
 
-          //  Create new NDSEntry with file start offset and file size and store it into the entries map
-          m_entries.push_back(FileEntry(entry, file_start, file_end));
+      for (auto entry : table.entries(dir))
+      {
+        uint32_t offset = static_cast<uint32_t>(reinterpret_cast<const uint8_t*>(entry.name) - 1 - table.data());
 
-          //  Next file id
-          file_id++;
-        }
-        //  If the length is 0x81 to 0xFF then it is a directory entry
-        else if (len > 0x80)
+        if (entry.directory)
         {
-          len -= 0x80;                                //  Subtract 0x80 to get directory name length
-          entry = util::read(m_fnt, offset + 1, len); //  Get the directory name
-
-          //  Directories have an extra 2 bytes indicating the directory id
-          uint16_t id = util::read<uint16_t>(m_fnt, offset + len + 1) & 0x0FFF; //  id is in form 0xFXXX so bitwise and it with 0xFFF
-
-          offset += len + 3;  //  Increase offset by length byte + 2 bytes for id + name length
-
-          directories[id] = entry;  //  Add this directory to the list
-
-          //  If current parent directory is root
-          if (dir_index == 0)
-          {
-            //  Push back root identifier + new directory name
-            current_directory.push_back("./" + entry);
-          }
-          else
-          {
-            //  Place this directory under its parent
-            current_directory.insert(current_directory.begin() + dir_index + subdirs + 1, current_directory[dir_index] + "/" + entry);
-            subdirs++;
-          }
+          m_dir_names[entry.id] = offset;
         }
         else
         {
-          //  0x00 and 0x80 are invalid
-          //  0x00 indicates end of sub-table
-          //  0x80 is reserved
+          m_file_names.push_back(offset);
+          m_file_ids.push_back(entry.id);
+          m_file_dirs.push_back(dir);
         }
       }
+    }
+  }
 
-      //  Increase directory index to point to the next directory name in current_directory
-      dir_index++;
+  void FST::append_name(uint32_t offset, std::string& out)
+  {
+    //  Read the table directly, since making a view of a built FNT checks all of it
+    const uint8_t* name = (m_image ? m_fnt_view.data() : m_fnt.data()) + offset;
+    out.append(reinterpret_cast<const char*>(name + 1), name[0] & 0x7F);
+  }
+
+  std::string FST::file_name(uint32_t index)
+  {
+    std::string name;
+
+    if (m_cache)
+    {
+      m_cache->file_path(index, name);
+      return name.substr(name.find_last_of('/') + 1);
     }
+
+    append_name(m_file_names[index], name);
+    return name;
+  }
+
+  /*
+    Summary:
+      Builds the path of a file from the FNT root, such as a/b.bin.
+
+    Parameters:
+      index: Position of the file in files order
+      out: Buffer to build the path in, replacing what it held
+  */
+  void FST::file_path(uint32_t index, std::string& out)
+  {
+    if (m_cache)
+    {
+      m_cache->file_path(index, out);
+      return;
+    }
+
+    directory_path(m_file_dirs[index], out);
+    out += out.empty() ? "" : "/";
+    append_name(m_file_names[index], out);
+  }
+
+  std::string FST::directory_name(uint16_t dir)
+  {
+    std::string name;
+
+    if (m_cache && dir < m_cache->directory_count())
+    {
+      m_cache->directory_path(dir, name);
+      return name.substr(name.find_last_of('/') + 1);
+    }
+
+    if (dir > 0 && dir < m_dir_names.size() && m_dir_names[dir] > 0)
+    {
+      append_name(m_dir_names[dir], name);
+    }
+
+    return name;
+  }
+
+  /*
+    Summary:
+      Builds the path of a directory from the FNT root, which is empty for
+      the root itself.
+
+    Parameters:
+      dir: The directory id
+      out: Buffer to build the path in, replacing what it held
+  */
+  void FST::directory_path(uint16_t dir, std::string& out)
+  {
+    out.clear();
+
+    if (m_cache)
+    {
+      if (dir < m_cache->directory_count())
+      {
+        m_cache->directory_path(dir, out);
+      }
+
+      return;
+    }
+
+    directory_path(dir, out, 0);
+  }
+
+  void FST::directory_path(uint16_t dir, std::string& out, uint32_t depth)
+  {
+    //  Stop at the root, or on parent chains that loop
+    if (dir == 0 || dir >= m_dir_names.size() || depth > m_dir_names.size() || m_dir_names[dir] == 0)
+    {
+      return;
+    }
+
+    directory_path(m_dir_parents[dir], out, depth + 1);
+    out += out.empty() ? "" : "/";
+    append_name(m_dir_names[dir], out);
   }
 
   /*
     Summary
-      Builds a FST (FNT + FAT) from a given directory
+      Builds a FST (FNT + file list) from a given directory. The FAT is not
+      known until the files have been placed, see create_allocation_table.
 
     Parameters:
       root: The root directory to read files and directories from
-      fst_offset: The offset where the start of the FST (FNT) will be in the ROM.
+      file_id_offset: The first file id to use, which comes after the overlays.
+  */
+  FST::FST(std::string root, uint32_t file_id_offset) : m_verbose(true)
+  {
+    DiskTree tree(root);
+    build(tree, "", file_id_offset);
+  }
+
+  /*
+    Summary
+      Builds a FST from a directory inside a source tree.
+
+    Parameters:
+      tree: The tree to read from
+      root: Path of the FNT root inside the tree
+      file_id_offset: The first file id to use, which comes after the overlays.
+      verbose: Whether to print each directory
   */
-  FST::FST(std::string root, uint32_t fst_offset, uint32_t file_id_offset)
+  FST::FST(SourceTree& tree, std::string root, uint32_t file_id_offset, bool verbose) : m_verbose(verbose)
+  {
+    build(tree, root, file_id_offset);
+  }
+
+  void FST::build(SourceTree& tree, std::string root, uint32_t file_id_offset)
   {
+    m_fat_base = file_id_offset;
     file_id = file_id_offset;
     dir_id = 1;
-    initialize_directory_table(root);
+    string_size = 1;
+    file_total = 0;
+    m_dir_parents.assign(1, 0);
+    initialize_directory_table(tree, root, 0);
+
+    //  The first walk sized every table, so the FNT is written into a single allocation
+    util::ByteWriter fnt(dir_id * 8 + string_size);
+    create_main_table(tree, root, fnt, 0);
+    create_string_table(tree, root, fnt, 0);
+    m_fnt = fnt.release();
+
+    //  Until the files are placed the FAT only holds their sizes
+    util::ByteWriter fat(file_total * 8);
+    collect_sizes(tree, root, fat);
+    m_fat = fat.release();
+
+    index();
+  }
 
-    m_fnt = create_main_table(root);
-    std::vector<uint8_t> string_table = create_string_table(root);
+  //  Ids are handed out depth first, so the children of a directory come after it in id order, each past the last one's subtree
+  uint16_t FST::next_child(uint16_t dir, uint16_t previous) const
+  {
+    uint16_t next = previous + 1;
 
-    //  Append string table to the FNT
-    std::copy(string_table.begin(), string_table.end(), std::back_inserter(m_fnt));
+    while (next < m_dir_parents.size() && m_dir_parents[next] != dir)
+    {
+      next++;
+    }
 
-    //  Offset is FST offset + FNT size + FAT size (total files * size of FAT entry)
-    file_offset = fst_offset + m_fnt.size() + ((file_id_offset + total_files(root, true)) * 8);
-    file_offset += util::pad(file_offset, 4);
-    create_allocation_table(root);
+    return next;
   }
 
-  void FST::initialize_directory_table(std::string root)
+  /*
+    Summary:
+      Recursively assigns every directory its id, depth first, and counts
+      the files and string table bytes so the tables can be sized before
+      they are built. The parent of every id goes in m_dir_parents.
+
+    Parameters:
+      tree: The tree to read from
+      root: Directory to number the sub-directories of
+      dir: Id of root
+  */
+  void FST::initialize_directory_table(SourceTree& tree, std::string root, uint16_t dir)
   {
-    for (fs::directory_iterator dir(root), end; dir != end; ++dir)
+    for (auto& entry : tree.list(root))
     {
-      if (fs::is_directory(dir->path()))
+      std::string path = tree_path(root, entry.name);
+
+      if (entry.directory)
       {
-        std::cout << dir_id << "\t" << dir->path().string() << std::endl;
-        m_dir_parent[dir->path()] = 0xF000 | dir_id;
+        if (m_verbose)
+        {
+          std::cout << dir_id << "\t" << path << std::endl;
+        }
+
+        m_dir_parents.push_back(dir);
         ++dir_id;
-        initialize_directory_table(dir->path().string());
+
+        //  Length byte, name, directory id and the sub-directory's terminating 0
+        string_size += entry.name.length() + 4;
+        initialize_directory_table(tree, path, static_cast<uint16_t>(m_dir_parents.size() - 1));
+      }
+      else
+      {
+        string_size += entry.name.length() + 1;
+        ++file_total;
       }
     }
   }
 
-  std::vector<uint8_t> FST::create_main_table(std::string root, bool is_root)
+  void FST::create_main_table(SourceTree& tree, std::string root, util::ByteWriter& main_table, uint16_t dir)
   {
-    std::vector<uint8_t> main_table;
+    bool is_root = (dir == 0);
 
     //  If this is the true root then add the root table entry
     if (is_root)
     {
       //  Sub table offset starts after all main table entries (8 bytes each) + root (8 bytes)
-      table_offset = total_directories(root, true) * 8 + 8;
-      util::push_int(main_table, table_offset);
-      util::push_int<uint16_t>(main_table, file_id);
-      util::push_int<uint16_t>(main_table, total_directories(root, true) + 1);
+      table_offset = (dir_id - 1) * 8 + 8;
+      main_table.write(table_offset);
+      main_table.write<uint16_t>(file_id);
+      main_table.write<uint16_t>(dir_id);
     }
 
+    std::vector<TreeEntry> entries = tree.list(root);
+
     //  Count every file in the current directory
-    for (fs::directory_iterator dir(root), end; dir != end; ++dir)
+    for (auto& entry : entries)
     {
-      table_offset += dir->path().filename().string().length() + 1;
+      table_offset += entry.name.length() + 1;
 
-      if (fs::is_regular_file(dir->path()))
+      if (!entry.directory)
       {
         file_id++;
       }
@@ -168,188 +331,184 @@ namespace nds
     table_offset++; //  Add 1 for the 0 byte ending the sub-table
 
     //  Go through every sub-directory in the current directory
-    for (fs::directory_iterator dir(root), end; dir != end; ++dir)
+    uint16_t child = dir;
+
+    for (auto& entry : entries)
     {
-      if (fs::is_directory(dir->path()))
+      if (entry.directory)
       {
-        std::cout << "Parent of " << dir->path().string() << " is " << std::hex << m_dir_parent[dir->path().parent_path()] << std::dec << std::endl;
-        util::push_int(main_table, table_offset);
-        util::push_int<uint16_t>(main_table, file_id);
-        util::push_int<uint16_t>(main_table, 0xF000 | m_dir_parent[dir->path().parent_path()]);
+        std::string path = tree_path(root, entry.name);
+        child = next_child(dir, child);
 
-        //  Recursively append contents to the string table
-        auto table = create_main_table(dir->path().string(), false);
-        std::copy(table.begin(), table.end(), std::back_inserter(main_table));
+        if (m_verbose)
+        {
+          std::cout << "Parent of " << path << " is " << std::hex << (0xF000 | dir) << std::dec << std::endl;
+        }
+
+        main_table.write(table_offset);
+        main_table.write<uint16_t>(file_id);
+        main_table.write<uint16_t>(0xF000 | dir);
+
+        //  Recursively append contents to the main table
+        create_main_table(tree, path, main_table, child);
       }
     }
-
-    return main_table;
   }
 
-  void FST::create_allocation_table(std::string root)
+  /*
+    Summary:
+      Recursively writes a FAT entry from 0 to the size of every file under
+      a directory in file id order, which is every file in a directory
+      followed by each sub-directory.
+
+    Parameters:
+      tree: The tree to read from
+      root: Directory in the tree to read
+      fat: Table to append to
+  */
+  void FST::collect_sizes(SourceTree& tree, std::string root, util::ByteWriter& fat)
   {
-    for (fs::directory_iterator dir(root), end; dir != end; ++dir)
+    std::vector<TreeEntry> entries = tree.list(root);
+
+    for (auto& entry : entries)
     {
-      if (fs::is_regular_file(dir->path()))
+      if (!entry.directory)
       {
-        util::push_int(m_fat, file_offset);
-        file_offset += static_cast<uint32_t>(fs::file_size(dir->path()));
-        util::push_int(m_fat, file_offset);
-
-        file_offset += util::pad(file_offset, 4);
+        fat.write<uint32_t>(0);
+        fat.write(static_cast<uint32_t>(entry.size));
       }
     }
 
-    for (fs::directory_iterator dir(root), end; dir != end; ++dir)
+    for (auto& entry : entries)
     {
-      if (fs::is_directory(dir->path()))
+      if (entry.directory)
       {
-        create_allocation_table(dir->path().string());
+        collect_sizes(tree, tree_path(root, entry.name), fat);
       }
     }
   }
 
   /*
     Summary:
-      Recursively goes through a given directory and generates a
-      FNT string table from the contents
+      Places every file one after another and generates the FAT for them.
+      Files given in order are placed first, in that order, and the rest
+      follow in id order. The FAT itself is always in id order.
 
     Parameters:
-      root: The root directory to make the table from
-
-    Returns:
-      The raw bytes of the string table which is to be placed after
-      the main tables in the FNT.
+      file_offset: The offset of the first file in the ROM
+      align: Alignment of the start of each file
+      order: Positions in files order of the files to place first
+      order_align: Alignment of the start of each file in order
   */
-  std::vector<uint8_t> FST::create_string_table(std::string root)
+  void FST::create_allocation_table(uint32_t file_offset, uint32_t align, const std::vector<uint32_t>& order, uint32_t order_align)
   {
-    std::vector<uint8_t> string_table;
+    //  Entries that aren't files of the FNT, such as overlays in a ROM's FAT, keep their ranges
+    FatView table = fat();
+    std::vector<FatRange> ranges(table.begin(), table.end());
+    std::vector<bool> placed(file_count(), false);
 
-    //  Go through every file in the current directory
-    for (fs::directory_iterator dir(root), end; dir != end; ++dir)
+    auto place = [&](uint32_t index, uint32_t file_align)
     {
-      if (fs::is_regular_file(dir->path()))
+      uint32_t size = file_range(index).size();
+      uint32_t slot = fat_id(index) - m_fat_base;
+
+      file_offset += util::pad(file_offset, file_align);
+      placed[index] = true;
+
+      if (slot < ranges.size())
       {
-        std::string name = dir->path().filename().string();
+        ranges[slot] = { file_offset, file_offset + size };
+      }
 
-        //  Push back the file name length as a single byte
-        string_table.push_back(name.length());
+      file_offset += size;
+    };
 
-        //  Push back the actual file name
-        util::push(string_table, name);
+    for (auto index : order)
+    {
+      if (index < placed.size() && !placed[index])
+      {
+        place(index, order_align);
       }
     }
 
-    //  Go through every sub-directory in the current directory
-    for (fs::directory_iterator dir(root), end; dir != end; ++dir)
+    for (uint32_t i = 0; i < placed.size(); i++)
     {
-      if (fs::is_directory(dir->path()))
+      if (!placed[i])
       {
-        std::string name = dir->path().filename().string();
-
-        //  Push back the directory name length and add 0x80 to mark it as a directory entry
-        string_table.push_back(name.length() + 0x80);
-
-        //  Push back the actual directory name
-        util::push(string_table, name);
-
-        //  Push back the directory ID and set the MSB to 1 to mark it as a directory
-        util::push_int<uint16_t>(string_table, 0xF000 | m_dir_parent[dir->path()]);
+        place(i, align);
       }
     }
 
-    //  Push back a 0 to mark the end of this sub-table
-    string_table.push_back(0);
+    util::ByteWriter fat(ranges.size() * 8);
 
-    //  For every sub-directory
-    for (fs::directory_iterator dir(root), end; dir != end; ++dir)
+    for (auto& range : ranges)
     {
-      if (fs::is_directory(dir->path()))
-      {
-        //  Recursively append contents to the string table
-        auto table = create_string_table(dir->path().string());
-        std::copy(table.begin(), table.end(), std::back_inserter(string_table));
-      }
+      fat.write(range.begin);
+      fat.write(range.end);
     }
 
-    return string_table;
+    m_fat = fat.release();
   }
 
   /*
     Summary:
-      Counts how many files are in a directory
+      Recursively goes through a given directory and generates a
+      FNT string table from the contents
 
     Parameters:
-      root: Directory to count files in
-      recurse: If true the search will include all sub-directories
-
-    Returns:
-      Total number of files found
+      tree: The tree to read from
+      root: The root directory to make the table from
+      string_table: Buffer the string table is appended to, which is to be
+                    placed after the main tables in the FNT.
+      dir: Id of root
   */
-  uint32_t FST::total_files(boost::filesystem::path root, bool recurse)
+  void FST::create_string_table(SourceTree& tree, std::string root, util::ByteWriter& string_table, uint16_t dir)
   {
-    uint32_t ret = 0;
+    std::vector<TreeEntry> entries = tree.list(root);
 
-    if (recurse)
+    //  Go through every file in the current directory
+    for (auto& entry : entries)
     {
-      for (fs::recursive_directory_iterator dir(root), end; dir != end; ++dir)
+      if (!entry.directory)
       {
-        if (fs::is_regular_file(dir->path()))
-        {
-          ++ret;
-        }
+        //  Write the file name length as a single byte followed by the actual file name
+        string_table.write<uint8_t>(entry.name.length());
+        string_table.write(entry.name);
       }
     }
-    else
+
+    //  Go through every sub-directory in the current directory
+    uint16_t child = dir;
+
+    for (auto& entry : entries)
     {
-      for (fs::directory_iterator dir(root), end; dir != end; ++dir)
+      if (entry.directory)
       {
-        if (fs::is_regular_file(dir->path()))
-        {
-          ++ret;
-        }
-      }
-    }
+        child = next_child(dir, child);
 
-    return ret;
-  }
+        //  Write the directory name length and add 0x80 to mark it as a directory entry
+        string_table.write<uint8_t>(entry.name.length() + 0x80);
+        string_table.write(entry.name);
 
-  /*
-    Summary:
-      Counts how many sub-directories are in a directory
+        //  Write the directory ID and set the MSB to 1 to mark it as a directory
+        string_table.write<uint16_t>(0xF000 | child);
+      }
+    }
 
-    Parameters:
-      root: Directory to count sub-directories in
-      recurse: If true the search will include all sub-directories
+    //  Write a 0 to mark the end of this sub-table
+    string_table.write<uint8_t>(0);
 
-    Returns:
-      Total number of sub-directories found
-  */
-  uint32_t FST::total_directories(boost::filesystem::path root, bool recurse)
-  {
-    uint32_t ret = 0;
+    //  For every sub-directory
+    child = dir;
 
-    if (recurse)
+    for (auto& entry : entries)
     {
-      for (fs::recursive_directory_iterator dir(root), end; dir != end; ++dir)
+      if (entry.directory)
       {
-        if (fs::is_directory(dir->path()))
-        {
-          ++ret;
-        }
-      }
-    }
-    else
-    {
-      for (fs::directory_iterator dir(root), end; dir != end; ++dir)
-      {
-        if (fs::is_directory(dir->path()))
-        {
-          ++ret;
-        }
+        //  Recursively append contents to the string table
+        child = next_child(dir, child);
+        create_string_table(tree, tree_path(root, entry.name), string_table, child);
       }
     }
-
-    return ret;
   }
 }
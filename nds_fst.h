@@ -2,48 +2,36 @@
 #define _MD_NDS_FST_H
 
 #include <vector>
-#include <map>
+#include <memory>
 #include <cstdint>
 
 #include <boost/filesystem.hpp>
 
+#include "nds_cache.h"
 #include "nds_header.h"
+#include "nds_image.h"
+#include "nds_tree.h"
+#include "nds_view.h"
 #include "util.h"
 
 namespace nds
 {
-  struct FileEntry
+  /*
+    A file as an FST visitor sees it. The path is built into a buffer that
+    is reused for the next file, so it is only valid during the call.
+  */
+  struct FileRef
   {
-    FileEntry(std::string path, uint32_t begin, uint32_t end)
-    {
-      m_path = path;
-      m_begin = begin;
-      m_end = end;
-    }
+    uint32_t index;             //  Position of the file in files order, from 0
+    uint16_t id;                //  FAT id
+    uint16_t directory;         //  Id of the FNT directory that holds the file
+    FatRange range;
+    const std::string& path;    //  Path from the FNT root, such as a/b.bin
 
-    inline std::string path()
+    inline uint32_t size() const
     {
-      return m_path.substr(2); // Gets rid of ./
+      return range.size();
     }
-
-    inline uint32_t begin()
-    {
-      return m_begin;
-    }
-
-    inline uint32_t end()
-    {
-      return m_end;
-    }
-
-    inline uint32_t size()
-    {
-      return m_end - m_begin;
-    }
-  private:
-    std::string m_path;
-    uint32_t m_begin;
-    uint32_t m_end;
   };
 
   struct TableEntry
@@ -100,47 +88,174 @@ namespace nds
   {
   public:
     FST(std::string disc);
-    FST(std::string root, uint32_t offset, uint32_t file_id_offset);
+    FST(std::shared_ptr<RomImage> image, std::string cache = "");
+    FST(std::string root, uint32_t file_id_offset);
+    FST(SourceTree& tree, std::string root, uint32_t file_id_offset, bool verbose = true);
+
+    //  Number of files in the FNT, not counting overlays
+    inline uint32_t file_count() const
+    {
+      return m_cache ? m_cache->file_count() : static_cast<uint32_t>(m_file_ids.size());
+    }
+
+    //  FAT id of a file
+    inline uint16_t fat_id(uint32_t index) const
+    {
+      return m_cache ? m_cache->fat_id(index) : m_file_ids[index];
+    }
+
+    //  Id of the FNT directory that holds a file
+    inline uint16_t file_directory(uint32_t index) const
+    {
+      return m_cache ? m_cache->file_directory(index) : m_file_dirs[index];
+    }
+
+    inline FatRange file_range(uint32_t index)
+    {
+      if (m_cache)
+      {
+        return m_cache->file_range(index);
+      }
+
+      FatView table = fat();
+      uint32_t slot = fat_id(index) - m_fat_base;
+      return table.contains(slot) ? table[slot] : FatRange{ 0, 0 };
+    }
+
+    std::string file_name(uint32_t index);
+    void file_path(uint32_t index, std::string& out);
 
-    inline std::vector<FileEntry> files()
+    //  Number of directories, including the root
+    inline uint16_t directory_count() const
     {
-      return m_entries;
+      return m_cache ? m_cache->directory_count() : static_cast<uint16_t>(m_dir_parents.size());
+    }
+
+    //  Parent of a directory, 0 for the root
+    inline uint16_t directory_parent(uint16_t dir) const
+    {
+      return m_cache ? m_cache->directory_parent(dir) : m_dir_parents[dir];
+    }
+
+    std::string directory_name(uint16_t dir);
+    void directory_path(uint16_t dir, std::string& out);
+
+    /*
+      Summary:
+        Calls a visitor with a FileRef for every file in files order, which
+        is directory by directory. Paths are built incrementally in one
+        buffer, so nothing is allocated per file.
+    */
+    template<typename Visitor> void visit(Visitor visitor)
+    {
+      std::string path;
+      size_t prefix = 0;
+      int32_t dir = -1;
+
+      //  Cached paths are stored whole
+      for (uint32_t i = 0; m_cache && i < m_cache->file_count(); i++)
+      {
+        m_cache->file_path(i, path);
+        visitor(FileRef{ i, m_cache->fat_id(i), m_cache->file_directory(i), m_cache->file_range(i), path });
+      }
+
+      for (uint32_t i = 0; !m_cache && i < m_file_ids.size(); i++)
+      {
+
+        if (m_file_dirs[i] != dir)
+        {
+          dir = m_file_dirs[i];
+          directory_path(static_cast<uint16_t>(dir), path);
+          path += path.empty() ? "" : "/";
+          prefix = path.size();
+        }
+
+        path.resize(prefix);
+        append_name(m_file_names[i], path);
+        visitor(FileRef{ i, m_file_ids[i], m_file_dirs[i], file_range(i), path });
+      }
     }
 
     inline uint16_t start_id()
     {
-      return util::read<uint16_t>(m_fnt, 4);
+      if (m_cache)
+      {
+        return m_cache->start_id();
+      }
+
+      return fnt().valid() ? fnt().first_id(0) : 0;
     }
 
-    inline std::vector<uint8_t> get_fnt()
+    inline const std::vector<uint8_t>& get_fnt()
     {
       return m_fnt;
     }
 
-    inline std::vector<uint8_t> get_fat()
+    inline const std::vector<uint8_t>& get_fat()
     {
       return m_fat;
     }
 
+    //  Views of the tables, either into the ROM they were read from or over the ones that were built
+    inline FntView fnt()
+    {
+      //  An FST read from the cache only checks the FNT if something asks for it
+      if (m_cache && !m_fnt_view.valid())
+      {
+        m_fnt_view = m_image->fnt();
+      }
+
+      return m_image ? m_fnt_view : FntView(m_fnt.data(), m_fnt.size());
+    }
+
+    inline FatView fat()
+    {
+      return m_image ? m_fat_view : FatView(m_fat.data(), m_fat.size());
+    }
+
+    //  The ROM this FST was read from, if any
+    inline std::shared_ptr<RomImage> image()
+    {
+      return m_image;
+    }
+
+    void create_allocation_table(uint32_t file_offset, uint32_t align = 4, const std::vector<uint32_t>& order = {}, uint32_t order_align = 4);
+
   private:
     std::vector<uint8_t> m_fat;
     std::vector<uint8_t> m_fnt;
-    std::vector<FileEntry> m_entries;
-    std::vector<TableEntry> m_table_entries;
-    std::map<boost::filesystem::path, uint16_t> m_dir_parent;
+    std::shared_ptr<RomImage> m_image;
+    std::shared_ptr<FstCache> m_cache;    //  Index the names and ranges come from instead of the FNT, if one was cached
+    FatView m_fat_view;
+    FntView m_fnt_view;
+    uint32_t m_fat_base;    //  File id of the first FAT entry, which skips the overlays in a built FAT
+
+    //  Files in the order the FNT lists them directory by directory, which is file id order, left empty when cached
+    std::vector<uint32_t> m_file_names;   //  Offset of the length byte of each name in the FNT
+    std::vector<uint16_t> m_file_ids;
+    std::vector<uint16_t> m_file_dirs;
+
+    //  Directories by id
+    std::vector<uint32_t> m_dir_names;    //  Offset of the length byte of each name in the FNT, 0 for the root
+    std::vector<uint16_t> m_dir_parents;
 
-    uint32_t file_offset;
     uint32_t table_offset;
+    uint32_t string_size;
+    uint32_t file_total;
     uint16_t file_id;
     uint16_t dir_id;
+    bool m_verbose;     //  Print each directory as it is numbered
 
-    void initialize_directory_table(std::string root);
-    std::vector<uint8_t> create_main_table(std::string root, bool is_root = true);
-    void create_allocation_table(std::string root);
-    std::vector<uint8_t> create_string_table(std::string root);
+    void index();
+    void append_name(uint32_t offset, std::string& out);
+    void directory_path(uint16_t dir, std::string& out, uint32_t depth);
 
-    uint32_t total_files(boost::filesystem::path, bool recurse = false);
-    uint32_t total_directories(boost::filesystem::path, bool recurse = false);
+    void build(SourceTree& tree, std::string root, uint32_t file_id_offset);
+    void initialize_directory_table(SourceTree& tree, std::string root, uint16_t dir);
+    uint16_t next_child(uint16_t dir, uint16_t previous) const;
+    void create_main_table(SourceTree& tree, std::string root, util::ByteWriter& main_table, uint16_t dir);
+    void collect_sizes(SourceTree& tree, std::string root, util::ByteWriter& fat);
+    void create_string_table(SourceTree& tree, std::string root, util::ByteWriter& string_table, uint16_t dir);
   };
 }
 
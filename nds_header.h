@@ -1,343 +1,363 @@
 #ifndef _MD_NDS_HEADER_H
 #define _MD_NDS_HEADER_H
 
+#include <array>
 #include <cstdint>
 #include <vector>
 #include <iterator>
 
+#include "nds_record.h"
 #include "util.h"
 
 namespace nds
 {
-  class Header
+  /*
+    Read accessors shared by Header, which owns its bytes, and HeaderView,
+    which points into a ROM. T must provide bytes() returning at least
+    Size readable bytes.
+  */
+  template<typename T> class HeaderReader
   {
   public:
-    static const int Size = 0x200;
+    static const int Size = HeaderSchema::Size;
+    typedef HeaderSchema::Field Field;
 
-    Header() {};
-    Header(std::vector<uint8_t>& rom)
+    //  Reads any number field of the header by its place in the schema
+    template<Field F> inline typename FieldType<HeaderSchema::Fields[F].width>::type get() const
     {
-      std::copy(rom.begin(), rom.begin() + Header::Size, std::back_inserter(m_header));
+      return nds::get<HeaderSchema, F>(bytes());
     }
-    
-    std::vector<uint8_t> get_raw();
 
-    std::string title();
-    std::string game_code();
-    std::string maker_code();
+    inline std::string title() const
+    {
+      return text<HeaderSchema, HeaderSchema::Title>(bytes());
+    }
 
-    uint8_t unit_code();
-    uint8_t encryption_seed();
-    uint32_t capacity();
-    uint8_t version();
-    uint8_t autostart();
+    inline std::string game_code() const
+    {
+      return text<HeaderSchema, HeaderSchema::GameCode>(bytes());
+    }
 
-    uint32_t arm9_rom_offset();
-    uint32_t arm9_entry_address();
-    uint32_t arm9_ram_address();
-    uint32_t arm9_size();
+    inline std::string maker_code() const
+    {
+      return text<HeaderSchema, HeaderSchema::MakerCode>(bytes());
+    }
 
-    uint32_t arm7_rom_offset();
-    uint32_t arm7_entry_address();
-    uint32_t arm7_ram_address();
-    uint32_t arm7_size();
+    inline uint8_t unit_code() const
+    {
+      return get<HeaderSchema::UnitCode>();
+    }
 
-    uint32_t file_name_table();
-    uint32_t file_name_size();
-    uint32_t file_alloc_table();
-    uint32_t file_alloc_size();
+    inline uint8_t encryption_seed() const
+    {
+      return get<HeaderSchema::EncryptionSeed>();
+    }
 
-    uint32_t arm9_overlay_offset();
-    uint32_t arm9_overlay_size();
-    uint32_t arm7_overlay_offset();
-    uint32_t arm7_overlay_size();
+    inline uint32_t capacity() const
+    {
+      return 0x20000 << get<HeaderSchema::Capacity>();
+    }
 
-    uint32_t command_port_normal();
-    uint32_t command_port_key1();
+    inline uint8_t version() const
+    {
+      return get<HeaderSchema::Version>();
+    }
 
-    uint32_t icon_title_offset();
+    inline uint8_t autostart() const
+    {
+      return get<HeaderSchema::AutoStart>();
+    }
 
-    uint16_t secure_checksum();
-    uint16_t secure_loading_timeout();
+    inline uint32_t arm9_rom_offset() const
+    {
+      return get<HeaderSchema::ARM9Rom>();
+    }
 
-    uint32_t arm9_auto_load();
-    uint32_t arm7_auto_load();
+    inline uint32_t arm9_entry_address() const
+    {
+      return get<HeaderSchema::ARM9Entry>();
+    }
 
-    uint64_t secure_area_disable();
+    inline uint32_t arm9_ram_address() const
+    {
+      return get<HeaderSchema::ARM9RAM>();
+    }
 
-    uint32_t size_used();
-    uint32_t header_size();
+    inline uint32_t arm9_size() const
+    {
+      return get<HeaderSchema::ARM9Size>();
+    }
 
-    void set_fnt_offset(uint32_t);
-    void set_fnt_size(uint32_t);
-    void set_fat_offset(uint32_t);
-    void set_fat_size(uint32_t);
+    inline uint32_t arm7_rom_offset() const
+    {
+      return get<HeaderSchema::ARM7Rom>();
+    }
 
-    void set_arm9_offset(uint32_t);
-    void set_arm9_overlay_offset(uint32_t);
-    void set_arm7_offset(uint32_t);
-    void set_arm7_overlay_offset(uint32_t);
+    inline uint32_t arm7_entry_address() const
+    {
+      return get<HeaderSchema::ARM7Entry>();
+    }
 
-    enum Offset
-    {
-      Title = 0x00,
-      GameCode = 0x0C,
-      MakerCode = 0x10,
-      UnitCode = 0x12,
-      EncryptionSeed = 0x13,
-      Capacity = 0x14,
-      Version = 0x1E,
-      AutoStart = 0x1F,
-      ARM9Rom = 0x20,
-      ARM9Entry = 0x24,
-      ARM9RAM = 0x28,
-      ARM9Size = 0x2C,
-      ARM7Rom = 0x30,
-      ARM7Entry = 0x34,
-      ARM7RAM = 0x38,
-      ARM7Size = 0x3C,
-      FileTableOffset = 0x40,
-      FileTableSize = 0x44,
-      FileAllocationOffset = 0x48,
-      FileAllocationSize = 0x4C,
-      ARM9Overlay = 0x50,
-      ARM9OverlaySize = 0x54,
-      ARM7Overlay = 0x58,
-      ARM7OverlaySize = 0x5C,
-      CommandPortNormal = 0x60,
-      CommandPortKey1 = 0x64,
-      IconTitle = 0x68,
-      SecureChecksum = 0x6C,
-      SecureLoadingTimeout = 0x6E,
-      ARM9AutoLoadRAM = 0x70,
-      ARM7AutoLoadRAM = 0x74,
-      SecureAreaDisable = 0x78,
-      SizeUsed = 0x80,
-      HeaderSize = 0x84,
-      Logo = 0xC0,
-      LogoChecksum = 0x15C,
-      HeaderChecksum = 0x15E,
-      DebugRomOffset = 0x160,
-      DebugSize = 0x164,
-      DebugRAMAddress = 0x168,
-    };
-  private:
-    std::vector<uint8_t> m_header;
-  };
+    inline uint32_t arm7_ram_address() const
+    {
+      return get<HeaderSchema::ARM7RAM>();
+    }
 
-  inline std::vector<uint8_t> Header::get_raw()
-  {
-    return m_header;
-  }
+    inline uint32_t arm7_size() const
+    {
+      return get<HeaderSchema::ARM7Size>();
+    }
 
-  inline std::string Header::title()
-  {
-    return std::string(m_header.begin() + Offset::Title, m_header.begin() + Offset::Title + 12);
-  }
+    inline uint32_t file_name_table() const
+    {
+      return get<HeaderSchema::FileTableOffset>();
+    }
 
-  inline std::string Header::game_code()
-  {
-    return std::string(m_header.begin() + Offset::GameCode, m_header.begin() + Offset::GameCode + 4);
-  }
+    inline uint32_t file_name_size() const
+    {
+      return get<HeaderSchema::FileTableSize>();
+    }
 
-  inline std::string Header::maker_code()
-  {
-    return std::string(m_header.begin() + Offset::MakerCode, m_header.begin() + Offset::MakerCode + 2);
-  }
+    inline uint32_t file_alloc_table() const
+    {
+      return get<HeaderSchema::FileAllocationOffset>();
+    }
 
-  inline uint8_t Header::unit_code()
-  {
-    return m_header[Offset::UnitCode];
-  }
+    inline uint32_t file_alloc_size() const
+    {
+      return get<HeaderSchema::FileAllocationSize>();
+    }
 
-  inline uint8_t Header::encryption_seed()
-  {
-    return m_header[Offset::EncryptionSeed];
-  }
+    inline uint32_t arm9_overlay_offset() const
+    {
+      return get<HeaderSchema::ARM9Overlay>();
+    }
 
-  inline uint32_t Header::capacity()
-  {
-    return 0x20000 << m_header[Offset::Capacity];
-  }
+    inline uint32_t arm9_overlay_size() const
+    {
+      return get<HeaderSchema::ARM9OverlaySize>();
+    }
 
-  inline uint8_t Header::version()
-  {
-    return m_header[Offset::Version];
-  }
+    inline uint32_t arm7_overlay_offset() const
+    {
+      return get<HeaderSchema::ARM7Overlay>();
+    }
 
-  inline uint8_t Header::autostart()
-  {
-    return m_header[Offset::AutoStart];
-  }
+    inline uint32_t arm7_overlay_size() const
+    {
+      return get<HeaderSchema::ARM7OverlaySize>();
+    }
 
-  inline uint32_t Header::arm9_rom_offset()
-  {
-    return util::read<uint32_t>(m_header, Offset::ARM9Rom);
-  }
+    inline uint32_t command_port_normal() const
+    {
+      return get<HeaderSchema::CommandPortNormal>();
+    }
 
-  inline uint32_t Header::arm9_entry_address()
-  {
-    return util::read<uint32_t>(m_header, Offset::ARM9Entry);
-  }
+    inline uint32_t command_port_key1() const
+    {
+      return get<HeaderSchema::CommandPortKey1>();
+    }
 
-  inline uint32_t Header::arm9_ram_address()
-  {
-    return util::read<uint32_t>(m_header, Offset::ARM9RAM);
-  }
+    inline uint32_t icon_title_offset() const
+    {
+      return get<HeaderSchema::IconTitle>();
+    }
 
-  inline uint32_t Header::arm9_size()
-  {
-    return util::read<uint32_t>(m_header, Offset::ARM9Size);
-  }
+    inline uint16_t secure_checksum() const
+    {
+      return get<HeaderSchema::SecureChecksum>();
+    }
 
-  inline uint32_t Header::arm7_rom_offset()
-  {
-    return util::read<uint32_t>(m_header, Offset::ARM7Rom);
-  }
+    inline uint16_t secure_loading_timeout() const
+    {
+      return get<HeaderSchema::SecureLoadingTimeout>();
+    }
 
-  inline uint32_t Header::arm7_entry_address()
-  {
-    return util::read<uint32_t>(m_header, Offset::ARM7Entry);
-  }
+    inline uint32_t arm9_auto_load() const
+    {
+      return get<HeaderSchema::ARM9AutoLoadRAM>();
+    }
 
-  inline uint32_t Header::arm7_ram_address()
-  {
-    return util::read<uint32_t>(m_header, Offset::ARM7RAM);
-  }
+    inline uint32_t arm7_auto_load() const
+    {
+      return get<HeaderSchema::ARM7AutoLoadRAM>();
+    }
 
-  inline uint32_t Header::arm7_size()
-  {
-    return util::read<uint32_t>(m_header, Offset::ARM7Size);
-  }
+    inline uint64_t secure_area_disable() const
+    {
+      return get<HeaderSchema::SecureAreaDisable>();
+    }
 
-  inline uint32_t Header::file_name_table()
-  {
-    return util::read<uint32_t>(m_header, Offset::FileTableOffset);
-  }
+    inline uint32_t size_used() const
+    {
+      return get<HeaderSchema::SizeUsed>();
+    }
 
-  inline uint32_t Header::file_name_size()
-  {
-    return util::read<uint32_t>(m_header, Offset::FileTableSize);
-  }
+    inline uint32_t header_size() const
+    {
+      return get<HeaderSchema::HeaderSize>();
+    }
 
-  inline uint32_t Header::file_alloc_table()
-  {
-    return util::read<uint32_t>(m_header, Offset::FileAllocationOffset);
-  }
+    inline uint16_t logo_checksum() const
+    {
+      return get<HeaderSchema::LogoChecksum>();
+    }
 
-  inline uint32_t Header::file_alloc_size()
-  {
-    return util::read<uint32_t>(m_header, Offset::FileAllocationSize);
-  }
+    inline uint16_t header_checksum() const
+    {
+      return get<HeaderSchema::HeaderChecksum>();
+    }
 
-  inline uint32_t Header::arm9_overlay_offset()
-  {
-    return util::read<uint32_t>(m_header, Offset::ARM9Overlay);
-  }
+    //  True if the stored CRC of the header matches the bytes before it
+    inline bool header_checksum_valid() const
+    {
+      return util::crc16(bytes(), offset_of<HeaderSchema>(HeaderSchema::HeaderChecksum)) == header_checksum();
+    }
 
-  inline uint32_t Header::arm9_overlay_size()
-  {
-    return util::read<uint32_t>(m_header, Offset::ARM9OverlaySize);
-  }
+    //  True if the stored CRC of the Nintendo logo matches the logo
+    inline bool logo_checksum_valid() const
+    {
+      return util::crc16(bytes() + offset_of<HeaderSchema>(HeaderSchema::Logo), width_of<HeaderSchema>(HeaderSchema::Logo)) == logo_checksum();
+    }
 
-  inline uint32_t Header::arm7_overlay_offset()
-  {
-    return util::read<uint32_t>(m_header, Offset::ARM7Overlay);
-  }
+  private:
+    inline const uint8_t* bytes() const
+    {
+      return static_cast<const T*>(this)->bytes();
+    }
+  };
 
-  inline uint32_t Header::arm7_overlay_size()
+  //  A non-owning header over the first 0x200 bytes of a ROM
+  class HeaderView : public HeaderReader<HeaderView>
   {
-    return util::read<uint32_t>(m_header, Offset::ARM7OverlaySize);
-  }
+  public:
+    HeaderView() : m_data(nullptr) {};
 
-  inline uint32_t Header::command_port_normal()
-  {
-    return util::read<uint32_t>(m_header, Offset::CommandPortNormal);
-  }
+    //  The view is only valid if the data holds a complete header
+    HeaderView(const uint8_t* data, size_t size) : m_data(size >= Size ? data : nullptr) {};
 
-  inline uint32_t Header::command_port_key1()
-  {
-    return util::read<uint32_t>(m_header, Offset::CommandPortKey1);
-  }
+    inline bool valid() const
+    {
+      return m_data != nullptr;
+    }
 
-  inline uint32_t Header::icon_title_offset()
-  {
-    return util::read<uint32_t>(m_header, Offset::IconTitle);
-  }
+    inline const uint8_t* bytes() const
+    {
+      return m_data;
+    }
 
-  inline uint16_t Header::secure_checksum()
-  {
-    return util::read<uint16_t>(m_header, Offset::SecureChecksum);
-  }
+  private:
+    const uint8_t* m_data;
+  };
 
-  inline uint16_t Header::secure_loading_timeout()
+  class Header : public HeaderReader<Header>
   {
-    return util::read<uint16_t>(m_header, Offset::SecureLoadingTimeout);
-  }
+  public:
+    Header()
+    {
+      m_header.fill(0);
+    }
 
-  inline uint32_t Header::arm9_auto_load()
-  {
-    return util::read<uint32_t>(m_header, Offset::ARM9AutoLoadRAM);
-  }
+    Header(const std::vector<uint8_t>& rom)
+    {
+      m_header.fill(0);
+      std::copy(rom.begin(), rom.begin() + std::min<size_t>(rom.size(), Header::Size), m_header.begin());
+    }
 
-  inline uint32_t Header::arm7_auto_load()
-  {
-    return util::read<uint32_t>(m_header, Offset::ARM7AutoLoadRAM);
-  }
+    Header(HeaderView view)
+    {
+      std::copy(view.bytes(), view.bytes() + Header::Size, m_header.begin());
+    }
 
-  inline uint64_t Header::secure_area_disable()
-  {
-    return util::read<uint64_t>(m_header, Offset::SecureAreaDisable);
-  }
+    std::vector<uint8_t> get_raw();
 
-  inline uint32_t Header::size_used()
-  {
-    return util::read<uint32_t>(m_header, Offset::SizeUsed);
-  }
+    void set_fnt_offset(uint32_t);
+    void set_fnt_size(uint32_t);
+    void set_fat_offset(uint32_t);
+    void set_fat_size(uint32_t);
 
-  inline uint32_t Header::header_size()
+    void set_arm9_offset(uint32_t);
+    void set_arm9_overlay_offset(uint32_t);
+    void set_arm7_offset(uint32_t);
+    void set_arm7_overlay_offset(uint32_t);
+    void set_icon_title_offset(uint32_t);
+    void set_size_used(uint32_t);
+    void set_secure_checksum(uint16_t);
+    void update_checksum();
+
+    inline const uint8_t* bytes() const
+    {
+      return m_header.data();
+    }
+
+  private:
+    std::array<uint8_t, Size> m_header;
+  };
+
+  inline std::vector<uint8_t> Header::get_raw()
   {
-    return util::read<uint32_t>(m_header, Offset::HeaderSize);
+    return std::vector<uint8_t>(m_header.begin(), m_header.end());
   }
 
   inline void Header::set_fnt_offset(uint32_t value)
   {
-    util::write_int(m_header, value, Offset::FileTableOffset);
+    nds::set<HeaderSchema, HeaderSchema::FileTableOffset>(m_header.data(), value);
   }
 
   inline void Header::set_fnt_size(uint32_t value)
   {
-    util::write_int(m_header, value, Offset::FileTableSize);
+    nds::set<HeaderSchema, HeaderSchema::FileTableSize>(m_header.data(), value);
   }
 
   inline void Header::set_fat_offset(uint32_t value)
   {
-    util::write_int(m_header, value, Offset::FileAllocationOffset);
+    nds::set<HeaderSchema, HeaderSchema::FileAllocationOffset>(m_header.data(), value);
   }
 
   inline void Header::set_fat_size(uint32_t value)
   {
-    util::write_int(m_header, value, Offset::FileAllocationSize);
+    nds::set<HeaderSchema, HeaderSchema::FileAllocationSize>(m_header.data(), value);
   }
 
   inline void Header::set_arm9_offset(uint32_t value)
   {
-    util::write_int(m_header, value, Offset::ARM9Rom);
+    nds::set<HeaderSchema, HeaderSchema::ARM9Rom>(m_header.data(), value);
   }
 
   inline void Header::set_arm9_overlay_offset(uint32_t value)
   {
-    util::write_int(m_header, value, Offset::ARM9Overlay);
+    nds::set<HeaderSchema, HeaderSchema::ARM9Overlay>(m_header.data(), value);
   }
 
   inline void Header::set_arm7_offset(uint32_t value)
   {
-    util::write_int(m_header, value, Offset::ARM7Rom);
+    nds::set<HeaderSchema, HeaderSchema::ARM7Rom>(m_header.data(), value);
   }
 
   inline void Header::set_arm7_overlay_offset(uint32_t value)
   {
-    util::write_int(m_header, value, Offset::ARM7Overlay);
+    nds::set<HeaderSchema, HeaderSchema::ARM7Overlay>(m_header.data(), value);
+  }
+
+  inline void Header::set_icon_title_offset(uint32_t value)
+  {
+    nds::set<HeaderSchema, HeaderSchema::IconTitle>(m_header.data(), value);
+  }
+
+  inline void Header::set_size_used(uint32_t value)
+  {
+    nds::set<HeaderSchema, HeaderSchema::SizeUsed>(m_header.data(), value);
+  }
+
+  inline void Header::set_secure_checksum(uint16_t value)
+  {
+    nds::set<HeaderSchema, HeaderSchema::SecureChecksum>(m_header.data(), value);
+  }
+
+  //  Recomputes the CRC16 over everything before it
+  inline void Header::update_checksum()
+  {
+    nds::set<HeaderSchema, HeaderSchema::HeaderChecksum>(m_header.data(), util::crc16(m_header.data(), offset_of<HeaderSchema>(HeaderSchema::HeaderChecksum)));
   }
 
 }
@@ -0,0 +1,145 @@
+#include "nds_image.h"
+
+#include <algorithm>
+#include <boost/filesystem.hpp>
+#include <fstream>
+#include <iostream>
+
+namespace fs = boost::filesystem;
+
+namespace nds
+{
+  RomImage::RomImage(std::string disc) : m_disc(disc)
+  {
+    if (!m_file.open(disc))
+    {
+      std::cout << "Could not open " << disc << std::endl;
+      return;
+    }
+
+    if (util::GzipImage::is_gzip(m_file.data(), m_file.size()))
+    {
+      std::string index = disc + ".zidx";
+
+      m_file.close();
+      m_gzip.reset(new util::GzipImage());
+
+      if (!m_gzip->open(disc, index))
+      {
+        std::cout << "Could not decompress " << disc << std::endl;
+        return;
+      }
+
+      if (!m_gzip->saved())
+      {
+        std::cout << "Could not save the seek index to " << index << ", " << disc << " will be decompressed again next time" << std::endl;
+      }
+    }
+
+    uint32_t size = Header::Size;
+    const uint8_t* data = span(0, size);
+    m_header = HeaderView(data, size);
+
+    if (!m_header.valid())
+    {
+      std::cout << disc << " is too small to be a ROM" << std::endl;
+    }
+  }
+
+  FatView RomImage::fat() const
+  {
+    if (!valid())
+    {
+      return FatView();
+    }
+
+    uint32_t size = m_header.file_alloc_size();
+    const uint8_t* data = span(m_header.file_alloc_table(), size);
+
+    return FatView(data, size);
+  }
+
+  FntView RomImage::fnt() const
+  {
+    if (!valid())
+    {
+      return FntView();
+    }
+
+    uint32_t size = m_header.file_name_size();
+    const uint8_t* data = span(m_header.file_name_table(), size);
+
+    return FntView(data, size);
+  }
+
+  /*
+    Summary:
+      Expands a list of inputs into the ROMs they name. Directories are
+      searched recursively for .nds and .nds.gz files, and an input of
+      @list reads one path per line from the file list.
+
+    Returns:
+      Every ROM path, directories sorted so runs are repeatable.
+  */
+  std::vector<std::string> find_roms(const std::vector<std::string>& inputs)
+  {
+    std::vector<std::string> roms;
+
+    for (auto& input : inputs)
+    {
+      if (input.size() > 1 && input[0] == '@')
+      {
+        std::ifstream list(input.substr(1));
+        std::string line;
+
+        if (!list)
+        {
+          std::cout << "Could not open " << input.substr(1) << std::endl;
+        }
+
+        while (std::getline(list, line))
+        {
+          if (!line.empty() && line.back() == '\r')
+          {
+            line.pop_back();
+          }
+
+          if (!line.empty())
+          {
+            roms.push_back(line);
+          }
+        }
+
+        continue;
+      }
+
+      if (!fs::is_directory(input))
+      {
+        roms.push_back(input);
+        continue;
+      }
+
+      std::vector<std::string> found;
+
+      for (fs::recursive_directory_iterator it(input), end; it != end; ++it)
+      {
+        std::string name = it->path().filename().string();
+        std::transform(name.begin(), name.end(), name.begin(), ::tolower);
+
+        //  Compressed ROMs are read the same way, see GzipImage
+        bool nds = name.size() > 4 && name.compare(name.size() - 4, 4, ".nds") == 0;
+        bool gz = name.size() > 7 && name.compare(name.size() - 7, 7, ".nds.gz") == 0;
+
+        if ((nds || gz) && fs::is_regular_file(it->path()))
+        {
+          found.push_back(it->path().string());
+        }
+      }
+
+      std::sort(found.begin(), found.end());
+      roms.insert(roms.end(), found.begin(), found.end());
+    }
+
+    return roms;
+  }
+}
@@ -0,0 +1,127 @@
+#ifndef _MD_NDS_IMAGE_H
+#define _MD_NDS_IMAGE_H
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "nds_header.h"
+#include "nds_view.h"
+#include "util_gzip.h"
+#include "util_io.h"
+
+namespace nds
+{
+  /*
+    A ROM mapped into memory. Every section is handed out as a view into
+    the mapping, with ranges from the header clamped to the file so a
+    damaged header can never read past the end.
+
+    A gzip compressed ROM is inflated a span at a time as views into it are
+    taken, using a seek index kept next to it in <disc>.zidx.
+  */
+  class RomImage
+  {
+  public:
+    RomImage(std::string disc);
+
+    inline bool valid() const
+    {
+      return m_header.valid();
+    }
+
+    //  Inflates all of a compressed ROM, prefer span() for parts of it
+    inline const uint8_t* data() const
+    {
+      if (m_gzip)
+      {
+        m_gzip->fill(0, m_gzip->size());
+        return m_gzip->data();
+      }
+
+      return m_file.data();
+    }
+
+    inline size_t size() const
+    {
+      return m_gzip ? static_cast<size_t>(m_gzip->size()) : m_file.size();
+    }
+
+    //  Whether the ROM is read through gzip, in which case it can't be changed in place
+    inline bool compressed() const
+    {
+      return m_gzip != nullptr;
+    }
+
+    inline HeaderView header() const
+    {
+      return m_header;
+    }
+
+    inline const std::string& path() const
+    {
+      return m_disc;
+    }
+
+    /*
+      Summary:
+        Gets a pointer to a range of the ROM, shortening the range so it
+        fits inside the file.
+
+      Parameters:
+        offset: Start of the range
+        size: Requested size, updated to the size actually available
+    */
+    inline const uint8_t* span(uint64_t offset, uint32_t& size) const
+    {
+      const uint8_t* data = m_gzip ? m_gzip->data() : m_file.data();
+      uint64_t total = this->size();
+
+      if (offset >= total)
+      {
+        size = 0;
+        return data;
+      }
+
+      size = static_cast<uint32_t>(std::min<uint64_t>(size, total - offset));
+
+      if (m_gzip)
+      {
+        m_gzip->fill(offset, size);
+      }
+
+      return data + offset;
+    }
+
+    //  Hints for reading the ROM in offset order, see util::MappedFile. Compressed spans are inflated when taken instead.
+    inline void sequential() const
+    {
+      if (!m_gzip)
+      {
+        m_file.sequential();
+      }
+    }
+
+    inline void read_ahead(uint64_t offset, uint64_t size) const
+    {
+      if (!m_gzip)
+      {
+        m_file.read_ahead(offset, size);
+      }
+    }
+
+    FatView fat() const;
+    FntView fnt() const;
+
+  private:
+    std::string m_disc;
+    util::MappedFile m_file;
+    std::unique_ptr<util::GzipImage> m_gzip;
+    HeaderView m_header;
+  };
+
+  std::vector<std::string> find_roms(const std::vector<std::string>& inputs);
+}
+
+#endif
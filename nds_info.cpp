@@ -0,0 +1,227 @@
+#include "nds_info.h"
+#include "nds_header.h"
+#include "nds_image.h"
+#include "util_io.h"
+
+#include <algorithm>
+#include <chrono>
+#include <sstream>
+
+namespace nds
+{
+  namespace
+  {
+    //  Header strings are padded with zeros
+    std::string trim(const std::string& str)
+    {
+      return str.substr(0, str.find('\0'));
+    }
+
+    std::string csv_string(const std::string& str)
+    {
+      std::string ret = "\"";
+
+      for (char c : str)
+      {
+        ret += (c == '"') ? "\"\"" : std::string(1, c);
+      }
+
+      return ret + "\"";
+    }
+
+    std::string to_json(const RomInfo& info)
+    {
+      std::ostringstream out;
+      out << "{\"path\":" << util::json_string(info.path) << ",\"valid\":" << (info.valid ? "true" : "false");
+
+      if (info.valid)
+      {
+        out << ",\"title\":" << util::json_string(info.title)
+          << ",\"game_code\":" << util::json_string(info.game_code)
+          << ",\"maker_code\":" << util::json_string(info.maker_code)
+          << ",\"version\":" << info.version
+          << ",\"capacity\":" << info.capacity
+          << ",\"size\":" << info.size
+          << ",\"arm9_size\":" << info.arm9_size
+          << ",\"arm7_size\":" << info.arm7_size
+          << ",\"fnt_size\":" << info.fnt_size
+          << ",\"fat_size\":" << info.fat_size
+          << ",\"file_count\":" << info.file_count;
+
+        if (info.overlay_count >= 0)
+        {
+          out << ",\"overlay_count\":" << info.overlay_count << ",\"directory_count\":" << info.directory_count;
+        }
+
+        out << ",\"header_crc_valid\":" << (info.header_crc ? "true" : "false")
+          << ",\"logo_crc_valid\":" << (info.logo_crc ? "true" : "false");
+      }
+
+      out << "}";
+      return out.str();
+    }
+
+    const char CsvColumns[] = "path,valid,title,game_code,maker_code,version,capacity,size,arm9_size,arm7_size,"
+      "fnt_size,fat_size,file_count,overlay_count,directory_count,header_crc_valid,logo_crc_valid";
+
+    std::string to_csv(const RomInfo& info)
+    {
+      std::ostringstream out;
+      out << csv_string(info.path) << "," << (info.valid ? "true" : "false");
+
+      if (!info.valid)
+      {
+        out << ",,,,,,,,,,,,,,,";
+        return out.str();
+      }
+
+      out << "," << csv_string(info.title) << "," << csv_string(info.game_code) << "," << csv_string(info.maker_code)
+        << "," << info.version << "," << info.capacity << "," << info.size << "," << info.arm9_size << "," << info.arm7_size
+        << "," << info.fnt_size << "," << info.fat_size << "," << info.file_count << ",";
+
+      if (info.overlay_count >= 0)
+      {
+        out << info.overlay_count << "," << info.directory_count;
+      }
+      else
+      {
+        out << ",";
+      }
+
+      out << "," << (info.header_crc ? "true" : "false") << "," << (info.logo_crc ? "true" : "false");
+      return out.str();
+    }
+  }
+
+  /*
+    Summary:
+      Reads the metadata of a ROM with as little I/O as possible: the
+      header, and with tables the 8 byte root entry of the FNT, which holds
+      the overlay and directory counts. A compressed ROM is read through
+      RomImage like any other, so only its start is inflated.
+
+    Parameters:
+      disc: Path to the ROM
+      tables: Also read the FNT root entry
+
+    Returns:
+      The metadata, with valid set if the header checksum matches and the
+      ARM binaries, FNT and FAT it points at are inside the ROM.
+  */
+  RomInfo read_info(std::string disc, bool tables)
+  {
+    RomInfo info;
+    info.path = disc;
+
+    RomImage rom(disc);
+
+    if (!rom.valid())
+    {
+      return info;
+    }
+
+    HeaderView header = rom.header();
+    uint64_t size = rom.size();
+
+    auto inside = [&](uint64_t offset, uint64_t length)
+    {
+      return offset <= size && length <= size - offset;
+    };
+
+    if (!header.header_checksum_valid() || !inside(header.arm9_rom_offset(), header.arm9_size())
+      || !inside(header.arm7_rom_offset(), header.arm7_size()) || !inside(header.file_name_table(), header.file_name_size())
+      || !inside(header.file_alloc_table(), header.file_alloc_size()))
+    {
+      return info;
+    }
+
+    info.valid = true;
+    info.title = trim(header.title());
+    info.game_code = trim(header.game_code());
+    info.maker_code = trim(header.maker_code());
+    info.version = header.version();
+    info.capacity = header.capacity();
+    info.size = size;
+    info.arm9_size = header.arm9_size();
+    info.arm7_size = header.arm7_size();
+    info.fnt_size = header.file_name_size();
+    info.fat_size = header.file_alloc_size();
+    info.header_crc = true;
+    info.logo_crc = header.logo_checksum_valid();
+
+    //  Overlays come first in the FAT, one for each 32 byte entry of the overlay tables
+    uint32_t overlays = (header.arm9_overlay_size() + header.arm7_overlay_size()) / 32;
+    info.file_count = info.fat_size / 8 - std::min(overlays, info.fat_size / 8);
+
+    uint32_t length = 8;
+    const uint8_t* root = rom.span(header.file_name_table(), length);
+
+    //  The FNT knows where the files start, which is what the FAT uses, whatever the overlay tables say
+    if (tables && info.fnt_size >= 8 && length == 8)
+    {
+      info.overlay_count = std::min<uint32_t>(util::load<uint16_t>(root + 4), info.fat_size / 8);
+      info.directory_count = util::load<uint16_t>(root + 6);
+      info.file_count = info.fat_size / 8 - info.overlay_count;
+    }
+
+    return info;
+  }
+
+  /*
+    Summary:
+      Prints the metadata of many ROMs, one JSON object or CSV row per line
+      in the order they were given. Reading is spread across threads since
+      a scan of a large library mostly waits on the disk.
+
+    Parameters:
+      inputs: ROMs, directories or file lists, see find_roms
+      format: "json" or "csv"
+      tables: Also read the FNT root entry of each ROM
+      threads: Number of threads to use, or 0 for four per hardware thread
+
+    Returns:
+      True if every ROM had a readable header.
+  */
+  bool info(std::vector<std::string> inputs, std::string format, bool tables, uint32_t threads)
+  {
+    if (format != "json" && format != "csv")
+    {
+      std::cout << "Unknown info format " << format << std::endl;
+      return false;
+    }
+
+    std::vector<std::string> roms = find_roms(inputs);
+    std::vector<RomInfo> infos(roms.size());
+
+    //  Each ROM is a couple of small reads, so keep plenty in flight
+    if (threads == 0)
+    {
+      threads = std::max(1u, std::thread::hardware_concurrency()) * 4;
+    }
+
+    auto start = std::chrono::steady_clock::now();
+
+    util::parallel_for(roms.size(), [&](size_t i)
+    {
+      infos[i] = read_info(roms[i], tables);
+    }, threads);
+
+    auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+    bool ok = true;
+
+    if (format == "csv")
+    {
+      std::cout << CsvColumns << "\n";
+    }
+
+    for (auto& info : infos)
+    {
+      std::cout << ((format == "csv") ? to_csv(info) : to_json(info)) << "\n";
+      ok = ok && info.valid;
+    }
+
+    std::cerr << "Scanned " << roms.size() << " ROMs in " << ms << " ms" << std::endl;
+
+    return ok;
+  }
+}
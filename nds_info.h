@@ -0,0 +1,36 @@
+#ifndef _MD_NDS_INFO_H
+#define _MD_NDS_INFO_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace nds
+{
+  //  What info reports about one ROM
+  struct RomInfo
+  {
+    std::string path;
+    bool valid = false;
+    std::string title;
+    std::string game_code;
+    std::string maker_code;
+    uint32_t version = 0;
+    uint32_t capacity = 0;
+    uint64_t size = 0;
+    uint32_t arm9_size = 0;
+    uint32_t arm7_size = 0;
+    uint32_t fnt_size = 0;
+    uint32_t fat_size = 0;
+    uint32_t file_count = 0;      //  FAT entries less the overlays, counted from the overlay tables or, with the tables read, the FNT
+    int32_t overlay_count = -1;   //  Only known once the tables are read
+    int32_t directory_count = -1; //  Only known once the tables are read
+    bool header_crc = false;
+    bool logo_crc = false;
+  };
+
+  RomInfo read_info(std::string disc, bool tables = false);
+  bool info(std::vector<std::string> inputs, std::string format = "json", bool tables = false, uint32_t threads = 0);
+}
+
+#endif
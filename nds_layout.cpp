@@ -0,0 +1,586 @@
+#include "nds_layout.h"
+#include "nds_banner.h"
+#include "nds_merkle.h"
+#include "util_io.h"
+
+#include <map>
+
+namespace nds
+{
+  namespace
+  {
+    //  Path of every FAT id, with overlays named the way extract writes them
+    std::vector<std::string> file_names(FST& table)
+    {
+      std::vector<std::string> names(table.fat().size());
+
+      for (uint16_t i = 0; i < table.start_id() && i < names.size(); i++)
+      {
+        names[i] = "overlay/overlay_" + util::zero_pad(i, 4) + ".bin";
+      }
+
+      table.visit([&](const FileRef& file)
+      {
+        if (file.id < names.size())
+        {
+          names[file.id] = "files/" + file.path;
+        }
+      });
+
+      return names;
+    }
+
+    //  Describes the bytes of a range, which tells padding apart from leftover data
+    std::string contents(RomImage& rom, uint32_t begin, uint32_t end)
+    {
+      uint32_t size = end - begin;
+      const uint8_t* data = rom.span(begin, size);
+
+      if (size == 0)
+      {
+        return "past the end";
+      }
+
+      if (std::all_of(data, data + size, [&](uint8_t byte) { return byte == data[0]; }))
+      {
+        return "filled with " + util::to_hex(data[0]);
+      }
+
+      return "holding data";
+    }
+
+    std::string range(uint32_t begin, uint32_t end)
+    {
+      return util::to_hex(begin) + "-" + util::to_hex(end) + " " + util::to_hex(end - begin);
+    }
+
+    //  Size of the RSA signature retail ROMs carry right after the used size
+    const uint32_t SignatureSize = 0x88;
+
+    //  A file to be moved by compact
+    struct Move
+    {
+      uint32_t source;
+      uint32_t target;
+      uint32_t size;
+    };
+
+    //  Moves a range inside a file, copying in the direction that never overwrites bytes it still has to read
+    bool move_range(util::File& file, uint32_t source, uint32_t target, uint32_t size)
+    {
+      std::vector<uint8_t> block(std::min<uint32_t>(size, 0x100000));
+
+      for (uint32_t done = 0; done < size;)
+      {
+        uint32_t len = std::min<uint32_t>(size - done, block.size());
+        uint32_t pos = (target < source) ? done : size - done - len;
+
+        if (file.read_at(&block[0], len, source + pos) != len || !file.write_at(&block[0], len, target + pos))
+        {
+          return false;
+        }
+
+        done += len;
+      }
+
+      return true;
+    }
+  }
+
+  /*
+    Summary:
+      Gets every range the header and FAT point at, sorted by offset.
+
+    Parameters:
+      rom: The ROM
+      table: Its FST
+
+    Returns:
+      The ranges, including empty ones.
+  */
+  std::vector<Interval> rom_intervals(RomImage& rom, FST& table)
+  {
+    HeaderView header = rom.header();
+    FatView fat = table.fat();
+    std::vector<Interval> intervals;
+
+    //  The ARM9 binary starts with the secure area, which is always at 0x4000
+    intervals.push_back(Interval("sys/header.bin", 0, Header::Size, 1));
+    intervals.push_back(Interval("sys/arm9.bin", header.arm9_rom_offset(), header.arm9_rom_offset() + header.arm9_size(), 0x4000));
+    intervals.push_back(Interval("sys/arm9_overlay.bin", header.arm9_overlay_offset(), header.arm9_overlay_offset() + header.arm9_overlay_size(), 4));
+    intervals.push_back(Interval("sys/arm7.bin", header.arm7_rom_offset(), header.arm7_rom_offset() + header.arm7_size(), 0x200));
+    intervals.push_back(Interval("sys/arm7_overlay.bin", header.arm7_overlay_offset(), header.arm7_overlay_offset() + header.arm7_overlay_size(), 4));
+    intervals.push_back(Interval("sys/fnt.bin", header.file_name_table(), header.file_name_table() + header.file_name_size(), 4));
+    intervals.push_back(Interval("sys/fat.bin", header.file_alloc_table(), header.file_alloc_table() + header.file_alloc_size(), 4));
+
+    BannerView banner = rom_banner(rom);
+
+    if (banner.valid())
+    {
+      intervals.push_back(Interval("sys/banner.bin", header.icon_title_offset(), header.icon_title_offset() + banner.size(), 0x200));
+    }
+
+    std::vector<std::string> names = file_names(table);
+
+    for (uint32_t id = 0; id < fat.size(); id++)
+    {
+      FatRange range = fat[id];
+      std::string name = names[id].empty() ? "unnamed file " + std::to_string(id) : names[id];
+
+      intervals.push_back(Interval(name, range.begin, range.end, (id < table.start_id()) ? 0x200 : 4, id));
+    }
+
+    std::stable_sort(intervals.begin(), intervals.end(), [](const Interval& a, const Interval& b)
+    {
+      return a.begin < b.begin || (a.begin == b.begin && a.end < b.end);
+    });
+
+    return intervals;
+  }
+
+  /*
+    Summary:
+      Prints a map of everything in a ROM in offset order, along with the
+      gaps between the ranges, ranges that overlap, FNT files that are not
+      in FAT order and the padding after the last range.
+
+    Parameters:
+      disc: Path to the ROM
+
+    Returns:
+      True if the ROM could be read.
+  */
+  bool layout(std::string disc)
+  {
+    auto image = std::make_shared<RomImage>(disc);
+
+    if (!image->valid())
+    {
+      std::cout << "Could not read a header from " << disc << std::endl;
+      return false;
+    }
+
+    FST table(image);
+    std::vector<Interval> intervals = rom_intervals(*image, table);
+
+    uint32_t data_end = 0;
+    uint64_t data = 0, gaps = 0, alignment = 0, overlaps = 0;
+    uint32_t gap_count = 0, alignment_count = 0, overlap_count = 0, shared = 0, empty = 0, out_of_order = 0;
+    const Interval* last = nullptr;
+
+    for (auto& interval : intervals)
+    {
+      if (interval.size() == 0)
+      {
+        empty++;
+        continue;
+      }
+
+      bool is_shared = last && interval.begin == last->begin && interval.end == last->end;
+
+      if (last && interval.begin > data_end)
+      {
+        //  Anything shorter than the next boundary is the cost of alignment rather than free space
+        bool aligned = interval.begin - data_end < interval.align && interval.begin % interval.align == 0;
+        std::string kind = aligned ? "alignment" : "gap";
+
+        std::cout << range(data_end, interval.begin) << "   " << kind << ", " << contents(*image, data_end, interval.begin) << "\n";
+
+        (aligned ? alignment : gaps) += interval.begin - data_end;
+        (aligned ? alignment_count : gap_count)++;
+      }
+      else if (is_shared)
+      {
+        std::cout << range(interval.begin, interval.end) << "   shared by " << last->name << " and " << interval.name << "\n";
+        shared++;
+      }
+      else if (last && interval.begin < data_end)
+      {
+        uint32_t overlap = std::min(data_end, interval.end) - interval.begin;
+
+        std::cout << range(interval.begin, interval.begin + overlap) << "   overlap of " << last->name << " and " << interval.name << "\n";
+
+        overlaps += overlap;
+        overlap_count++;
+      }
+
+      std::cout << range(interval.begin, interval.end) << " " << interval.name;
+
+      if (interval.end > image->size())
+      {
+        std::cout << " (past the end of the ROM)";
+      }
+
+      std::cout << "\n";
+
+      data += is_shared ? 0 : interval.size();
+
+      if (!last || interval.end > data_end)
+      {
+        data_end = interval.end;
+        last = &interval;
+      }
+    }
+
+    //  Files are expected to follow each other in the order of their ids
+    FatView fat = table.fat();
+    std::vector<std::string> names = file_names(table);
+
+    for (uint32_t id = table.start_id() + 1; id < fat.size(); id++)
+    {
+      if (fat[id].size() > 0 && fat[id].begin < fat[id - 1].begin)
+      {
+        std::cout << "out of order: " << names[id] << " (id " << id << ") is before " << names[id - 1] << "\n";
+        out_of_order++;
+      }
+    }
+
+    uint64_t tail = (image->size() > data_end) ? image->size() - data_end : 0;
+
+    std::cout << "Ranges:        " << intervals.size() - empty << " (" << empty << " empty not shown)\n";
+    std::cout << "Data:          " << data << " bytes\n";
+    std::cout << "Gaps:          " << gaps << " bytes in " << gap_count << " ranges\n";
+    std::cout << "Alignment:     " << alignment << " bytes in " << alignment_count << " ranges\n";
+    std::cout << "Overlaps:      " << overlaps << " bytes in " << overlap_count << " ranges\n";
+    std::cout << "Shared:        " << shared << " ranges\n";
+    std::cout << "Out of order:  " << out_of_order << " files\n";
+    std::cout << "Padding tail:  " << tail << " bytes after " << util::to_hex(data_end) << ", "
+      << ((tail > 0) ? contents(*image, data_end, static_cast<uint32_t>(image->size())) : "empty") << "\n";
+    std::cout << "Size used:     " << util::to_hex(image->header().size_used()) << " in the header\n";
+    std::cout << "ROM size:      " << image->size() << " bytes" << std::endl;
+
+    return true;
+  }
+
+  /*
+    Summary:
+      Shrinks a ROM by packing its FNT files in FAT order into the lowest
+      gaps between the system sections and overlays that fit them, then
+      after the last of those, and cutting off the padding after them. Gaps
+      left over are filled with 0xFF. Anything past the data, such as the
+      RSA signature, is kept and moved to the new end. Files are moved in
+      place in the order of their new offsets, so only files whose old
+      range is about to be overwritten are held in memory. Only the FAT and
+      the header are rewritten; the system sections and overlays stay where
+      they are. DSi enhanced ROMs are refused, their DSi area sits at fixed
+      offsets past the NDS data.
+
+    Parameters:
+      disc: Path to the ROM
+      out: Path to write the compacted ROM to, or empty to compact disc itself
+
+    Returns:
+      True if the ROM was compacted.
+  */
+  bool compact(std::string disc, std::string out)
+  {
+    std::vector<uint8_t> header_bytes;
+    std::vector<uint8_t> fat_bytes;
+    std::vector<Move> moves;
+    std::vector<std::pair<uint32_t, uint32_t>> holes;
+    std::vector<uint8_t> tail;
+    uint32_t fat_offset;
+    uint32_t floor;
+    uint32_t end;
+    uint64_t old_size;
+
+    {
+      auto image = std::make_shared<RomImage>(disc);
+
+      if (!image->valid())
+      {
+        std::cout << "Could not read a header from " << disc << std::endl;
+        return false;
+      }
+
+      if (image->compressed())
+      {
+        std::cout << disc << " is compressed, decompress it before compacting" << std::endl;
+        return false;
+      }
+
+      FST table(image);
+
+      if (!table.fnt().valid())
+      {
+        return false;
+      }
+
+      HeaderView header = image->header();
+      FatView fat = table.fat();
+
+      header_bytes.assign(header.bytes(), header.bytes() + Header::Size);
+      fat_bytes.assign(fat.data(), fat.data() + fat.size() * 8);
+      fat_offset = header.file_alloc_table();
+      old_size = image->size();
+
+      if (header.unit_code() & 0x02)
+      {
+        std::cout << disc << " has a DSi area, which compact can't move, not compacting" << std::endl;
+        return false;
+      }
+
+      //  Everything that isn't an FNT file stays where it is, and the files are packed into the space around it
+      std::vector<Interval> files;
+      std::vector<Interval> fixed;
+      uint32_t data_end = 0;
+
+      //  Card reads below 0x8000 don't reach the ROM, so files only go there if they already were
+      floor = 0x8000;
+
+      for (auto& interval : rom_intervals(*image, table))
+      {
+        data_end = std::max(data_end, interval.end);
+
+        if (interval.file_id >= table.start_id())
+        {
+          files.push_back(interval);
+          floor = (interval.size() > 0) ? std::min(floor, interval.begin) : floor;
+        }
+        else if (interval.size() > 0)
+        {
+          fixed.push_back(interval);
+        }
+      }
+
+      //  Files that partly overlap can't be moved apart, while identical ranges stay shared
+      const Interval* last = nullptr;
+
+      for (auto& file : files)
+      {
+        if (file.end < file.begin || file.end > old_size)
+        {
+          std::cout << file.name << " is not inside the ROM, not compacting" << std::endl;
+          return false;
+        }
+
+        if (file.size() == 0)
+        {
+          continue;
+        }
+
+        if (last && file.begin < last->end && (file.begin != last->begin || file.end != last->end))
+        {
+          std::cout << last->name << " and " << file.name << " overlap, not compacting" << std::endl;
+          return false;
+        }
+
+        last = &file;
+      }
+
+      //  Whatever follows the data up to the padding, such as the RSA signature of a retail ROM, goes after the packed files
+      const uint8_t* bytes = image->data();
+      uint64_t tail_begin = std::max<uint64_t>(header.size_used(), data_end);
+      uint64_t tail_end = old_size;
+
+      while (tail_end > tail_begin && bytes[tail_end - 1] == bytes[old_size - 1])
+      {
+        tail_end--;
+      }
+
+      //  A signature can end in bytes that look like padding, so once anything is there its full size is kept
+      if (tail_end > tail_begin)
+      {
+        tail_end = std::max(tail_end, std::min<uint64_t>(old_size, tail_begin + SignatureSize));
+        tail_end = std::min<uint64_t>(old_size, tail_end + util::pad(tail_end - tail_begin, 4));
+        tail.assign(bytes + tail_begin, bytes + tail_end);
+      }
+
+      //  Holes between the sections that stay, from the floor up, the last one open ended
+      uint32_t cursor = floor;
+
+      for (auto& interval : fixed)
+      {
+        if (interval.begin > cursor)
+        {
+          holes.push_back(std::make_pair(cursor, interval.begin));
+        }
+
+        cursor = std::max(cursor, interval.end);
+      }
+
+      holes.push_back(std::make_pair(cursor, UINT32_MAX));
+      end = cursor;
+
+      std::sort(files.begin(), files.end(), [](const Interval& a, const Interval& b)
+      {
+        return a.file_id < b.file_id;
+      });
+
+      //  Each file goes in the lowest hole it fits in, in FAT order
+      std::vector<std::pair<uint32_t, uint32_t>> free = holes;
+      std::map<std::pair<uint32_t, uint32_t>, uint32_t> placed;
+
+      for (auto& file : files)
+      {
+        auto key = std::make_pair(file.begin, file.end);
+        uint32_t target = 0;
+
+        if (file.size() > 0 && placed.count(key))
+        {
+          target = placed[key];
+        }
+        else
+        {
+          for (auto& hole : free)
+          {
+            uint32_t at = hole.first + util::pad(hole.first, 4);
+
+            if (at <= hole.second && hole.second - at >= file.size())
+            {
+              target = at;
+              hole.first = (file.size() > 0) ? at + file.size() : hole.first;
+              break;
+            }
+          }
+
+          if (file.size() > 0)
+          {
+            placed[key] = target;
+            moves.push_back(Move{ file.begin, target, file.size() });
+            end = std::max(end, target + file.size());
+          }
+        }
+
+        util::store<uint32_t>(&fat_bytes[file.file_id * 8], target);
+        util::store<uint32_t>(&fat_bytes[file.file_id * 8 + 4], target + file.size());
+      }
+
+      end += util::pad(end, 4);
+
+      //  Moving in the order of the new offsets keeps the data held in memory small
+      std::sort(moves.begin(), moves.end(), [](const Move& a, const Move& b) { return a.target < b.target; });
+    }
+
+    std::string target = out.empty() ? disc : out;
+    util::File file;
+
+    if (!out.empty())
+    {
+      util::File in;
+
+      if (!in.open(disc) || !file.create(out) || !file.copy_from(in, 0, old_size, 0))
+      {
+        std::cout << "Could not copy " << disc << " to " << out << std::endl;
+        return false;
+      }
+    }
+    else if (!file.modify(disc))
+    {
+      std::cout << "Could not open " << disc << " for writing" << std::endl;
+      return false;
+    }
+
+    //  Sources not moved yet, by offset, and copies of the ones a move was about to overwrite
+    std::map<uint32_t, size_t> pending;
+    std::map<size_t, std::vector<uint8_t>> held;
+
+    for (size_t i = 0; i < moves.size(); i++)
+    {
+      pending[moves[i].source] = i;
+    }
+
+    for (size_t i = 0; i < moves.size(); i++)
+    {
+      Move& move = moves[i];
+      pending.erase(move.source);
+
+      if (move.source == move.target)
+      {
+        continue;
+      }
+
+      auto it = pending.upper_bound(move.target);
+
+      if (it != pending.begin())
+      {
+        --it;
+      }
+
+      while (it != pending.end() && it->first < move.target + move.size)
+      {
+        Move& other = moves[it->second];
+
+        if (other.source + other.size <= move.target)
+        {
+          ++it;
+          continue;
+        }
+
+        std::vector<uint8_t>& copy = held[it->second];
+        copy.resize(other.size);
+
+        if (file.read_at(&copy[0], copy.size(), other.source) != copy.size())
+        {
+          std::cout << "Could not read " << target << std::endl;
+          return false;
+        }
+
+        it = pending.erase(it);
+      }
+
+      bool ok;
+
+      if (held.count(i))
+      {
+        ok = file.write_at(&held[i][0], move.size, move.target);
+        held.erase(i);
+      }
+      else
+      {
+        ok = move_range(file, move.source, move.target, move.size);
+      }
+
+      if (!ok)
+      {
+        std::cout << "Could not move data in " << target << ", it is now damaged" << std::endl;
+        return false;
+      }
+    }
+
+    //  What is left of the holes is padded the way build pads, so no stale data stays behind
+    bool ok = true;
+    auto next = moves.begin();
+
+    for (auto& hole : holes)
+    {
+      uint32_t pos = hole.first;
+      uint32_t hole_end = std::min(hole.second, end);
+
+      for (; next != moves.end() && next->target < hole_end; ++next)
+      {
+        ok = ok && file.fill_at(0xFF, next->target - pos, pos);
+        pos = next->target + next->size;
+      }
+
+      ok = ok && (pos >= hole_end || file.fill_at(0xFF, hole_end - pos, pos));
+    }
+
+    Header header(header_bytes);
+    header.set_size_used(end);
+    header.update_checksum();
+
+    ok = ok && file.write_at(fat_bytes.data(), fat_bytes.size(), fat_offset);
+    ok = ok && file.write_at(header.bytes(), Header::Size, 0);
+    ok = ok && (tail.empty() || file.write_at(tail.data(), tail.size(), end));
+    ok = ok && file.truncate(end + tail.size());
+
+    if (!ok)
+    {
+      std::cout << "Could not update " << target << ", it is now damaged" << std::endl;
+      return false;
+    }
+
+    //  Everything from the floor on may have moved, and an index of a copy would describe the original
+    if (out.empty())
+    {
+      merkle_update(disc, { ByteRange(0, Header::Size), ByteRange(fat_offset, fat_bytes.size()), ByteRange(floor, end + tail.size() - floor) });
+    }
+
+    //  Files already in their place aren't counted, and the size includes what was kept past the data
+    size_t moved = std::count_if(moves.begin(), moves.end(), [](const Move& move) { return move.source != move.target; });
+
+    std::cout << "Compacted " << disc << " from " << old_size << " to " << end + tail.size() << " bytes, moved " << moved << " files" << std::endl;
+    return true;
+  }
+}
@@ -0,0 +1,37 @@
+#ifndef _MD_NDS_LAYOUT_H
+#define _MD_NDS_LAYOUT_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "nds_fst.h"
+#include "nds_image.h"
+
+namespace nds
+{
+  //  A range of a ROM that the header or the FAT points at
+  struct Interval
+  {
+    Interval(std::string name, uint32_t begin, uint32_t end, uint32_t align, int32_t file_id = -1)
+      : name(name), begin(begin), end(end), align(align), file_id(file_id) {};
+
+    std::string name;
+    uint32_t begin;
+    uint32_t end;
+    uint32_t align;     //  Boundary the range has to start on
+    int32_t file_id;    //  FAT id for overlays and files, otherwise -1
+
+    inline uint32_t size() const
+    {
+      return (end > begin) ? end - begin : 0;
+    }
+  };
+
+  std::vector<Interval> rom_intervals(RomImage& rom, FST& table);
+
+  bool layout(std::string disc);
+  bool compact(std::string disc, std::string out = "");
+}
+
+#endif
@@ -0,0 +1,512 @@
+#include "nds_merkle.h"
+#include "nds_extract.h"
+#include "nds_fst.h"
+#include "util.h"
+#include "util_io.h"
+
+#include <algorithm>
+#include <boost/filesystem.hpp>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+
+namespace fs = boost::filesystem;
+
+namespace nds
+{
+  namespace
+  {
+    const uint32_t HeaderSize = 32;
+    const uint32_t DigestSize = 32;
+
+    //  Starts what a node hashes, so a node's hash can never pass for a block's
+    const uint8_t NodePrefix = 0x01;
+
+    std::string to_hex(const MerkleIndex::Digest& digest)
+    {
+      std::string hex;
+
+      for (uint8_t byte : digest)
+      {
+        hex += util::to_hex(byte);
+      }
+
+      return hex;
+    }
+
+    inline uint64_t elapsed_ms(std::chrono::steady_clock::time_point start)
+    {
+      return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+    }
+  }
+
+  MerkleIndex::Digest MerkleIndex::hash_block(const uint8_t* data, size_t size)
+  {
+    return util::sha256(data, size);
+  }
+
+  //  Hashes the one or two children of a node of the level above
+  MerkleIndex::Digest MerkleIndex::hash_node(const std::vector<Digest>& level, uint64_t index)
+  {
+    uint8_t children[1 + DigestSize * 2];
+    bool pair = index * 2 + 1 < level.size();
+
+    children[0] = NodePrefix;
+    std::copy(level[index * 2].begin(), level[index * 2].end(), children + 1);
+
+    if (pair)
+    {
+      std::copy(level[index * 2 + 1].begin(), level[index * 2 + 1].end(), children + 1 + DigestSize);
+    }
+
+    return util::sha256(children, pair ? sizeof(children) : 1 + DigestSize);
+  }
+
+  //  Starts an index of a ROM of the given size, with every block still to be hashed
+  void MerkleIndex::create(uint64_t size, uint32_t block)
+  {
+    m_block = block;
+    m_size = size;
+    m_levels.assign(1, std::vector<Digest>(std::max<uint64_t>(1, (size + block - 1) / block)));
+    build();
+  }
+
+  //  Builds every level above the blocks
+  void MerkleIndex::build()
+  {
+    m_levels.resize(1);
+
+    while (m_levels.back().size() > 1)
+    {
+      std::vector<Digest> level((m_levels.back().size() + 1) / 2);
+
+      for (uint64_t i = 0; i < level.size(); i++)
+      {
+        level[i] = hash_node(m_levels.back(), i);
+      }
+
+      m_levels.push_back(std::move(level));
+    }
+  }
+
+  /*
+    Summary:
+      Reads an index, checking that every node matches the ones below it
+      so a damaged index is never trusted.
+
+    Returns:
+      True if the index is whole.
+  */
+  bool MerkleIndex::load(std::string path)
+  {
+    std::vector<uint8_t> data = util::read_file(path);
+
+    if (data.size() < HeaderSize || memcmp(data.data(), "MDMERK02", 8) != 0)
+    {
+      return false;
+    }
+
+    uint32_t block = util::load<uint32_t>(&data[8]);
+    uint64_t size = util::load<uint64_t>(&data[16]);
+    uint64_t count = util::load<uint64_t>(&data[24]);
+
+    if (block == 0 || (block & (block - 1)) != 0 || count != std::max<uint64_t>(1, size / block + (size % block != 0)))
+    {
+      return false;
+    }
+
+    create(size, block);
+
+    uint64_t nodes = 0;
+
+    for (auto& level : m_levels)
+    {
+      nodes += level.size();
+    }
+
+    if (data.size() != HeaderSize + nodes * DigestSize)
+    {
+      return false;
+    }
+
+    const uint8_t* node = &data[HeaderSize];
+
+    for (auto& level : m_levels)
+    {
+      for (auto& hash : level)
+      {
+        std::copy(node, node + DigestSize, hash.begin());
+        node += DigestSize;
+      }
+    }
+
+    for (size_t k = 1; k < m_levels.size(); k++)
+    {
+      for (uint64_t i = 0; i < m_levels[k].size(); i++)
+      {
+        if (m_levels[k][i] != hash_node(m_levels[k - 1], i))
+        {
+          return false;
+        }
+      }
+    }
+
+    return true;
+  }
+
+  //  Writes the index under a temporary name first, so a reader never sees half of one
+  bool MerkleIndex::save(std::string path) const
+  {
+    util::ByteWriter out(HeaderSize);
+
+    out.write("MDMERK02", 8);
+    out.write<uint32_t>(m_block);
+    out.write<uint32_t>(0);
+    out.write<uint64_t>(m_size);
+    out.write<uint64_t>(blocks());
+
+    for (auto& level : m_levels)
+    {
+      for (auto& hash : level)
+      {
+        out.write(hash.data(), DigestSize);
+      }
+    }
+
+    std::string temp = path + ".tmp";
+    util::File file;
+    bool ok = file.create(temp) && file.write_at(out.data().data(), out.size(), 0);
+
+    file.close();
+
+    if (!ok || std::rename(temp.c_str(), path.c_str()) != 0)
+    {
+      std::remove(temp.c_str());
+      return false;
+    }
+
+    return true;
+  }
+
+  //  Covers a new ROM size, with the blocks that changed length or are new still to be hashed
+  void MerkleIndex::resize(uint64_t size)
+  {
+    m_size = size;
+    m_levels[0].resize(std::max<uint64_t>(1, (size + m_block - 1) / m_block));
+    build();
+  }
+
+  /*
+    Summary:
+      Sets the hashes of some blocks and hashes again only the nodes above
+      them, level by level.
+
+    Parameters:
+      leaves: Block index and hash pairs
+  */
+  void MerkleIndex::update(const std::vector<std::pair<uint64_t, Digest>>& leaves)
+  {
+    std::vector<uint64_t> dirty;
+
+    for (auto& leaf : leaves)
+    {
+      m_levels[0][leaf.first] = leaf.second;
+      dirty.push_back(leaf.first);
+    }
+
+    for (size_t k = 1; k < m_levels.size(); k++)
+    {
+      for (auto& index : dirty)
+      {
+        index /= 2;
+      }
+
+      std::sort(dirty.begin(), dirty.end());
+      dirty.erase(std::unique(dirty.begin(), dirty.end()), dirty.end());
+
+      for (auto index : dirty)
+      {
+        m_levels[k][index] = hash_node(m_levels[k - 1], index);
+      }
+    }
+  }
+
+  //  Indexes of the blocks holding any byte of the ranges, sorted
+  std::vector<uint64_t> MerkleIndex::covering(const std::vector<ByteRange>& ranges) const
+  {
+    std::vector<uint64_t> indexes;
+
+    for (auto& range : ranges)
+    {
+      if (range.second == 0 || range.first >= m_size)
+      {
+        continue;
+      }
+
+      uint64_t last = std::min(m_size, range.first + range.second) - 1;
+
+      for (uint64_t i = range.first / m_block; i <= last / m_block; i++)
+      {
+        indexes.push_back(i);
+      }
+    }
+
+    std::sort(indexes.begin(), indexes.end());
+    indexes.erase(std::unique(indexes.begin(), indexes.end()), indexes.end());
+    return indexes;
+  }
+
+  /*
+    Summary:
+      Hashes every block of a ROM across threads and writes the index next
+      to it, see MerkleIndex.
+
+    Parameters:
+      disc: Path to the ROM
+      block: Block size, a power of two of at least 512 bytes
+      threads: Number of threads to use, or 0 for one per hardware thread
+
+    Returns:
+      True if the index was written.
+  */
+  bool merkle_index(std::string disc, uint32_t block, uint32_t threads)
+  {
+    if (block < 0x200 || (block & (block - 1)) != 0)
+    {
+      std::cout << "Block size must be a power of two of at least 512." << std::endl;
+      return false;
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    RomImage rom(disc);
+
+    if (!rom.valid())
+    {
+      std::cout << "Could not read a header from " << disc << std::endl;
+      return false;
+    }
+
+    MerkleIndex index;
+    index.create(rom.size(), block);
+
+    std::vector<std::pair<uint64_t, MerkleIndex::Digest>> leaves(index.blocks());
+
+    rom.sequential();
+
+    util::parallel_for(leaves.size(), [&](size_t i)
+    {
+      uint32_t size = index.block_length(i);
+      const uint8_t* data = rom.span(i * block, size);
+
+      util::throttle().read(size);
+      leaves[i] = std::make_pair(i, MerkleIndex::hash_block(data, size));
+    }, threads);
+
+    index.update(leaves);
+
+    if (!index.save(MerkleIndex::sidecar(disc)))
+    {
+      std::cout << "Could not write " << MerkleIndex::sidecar(disc) << std::endl;
+      return false;
+    }
+
+    std::cout << "Indexed " << index.blocks() << " blocks of " << block << " bytes in " << elapsed_ms(start)
+      << " ms, root " << to_hex(index.root()) << std::endl;
+
+    return true;
+  }
+
+  /*
+    Summary:
+      Checks a ROM against its index, reading only the blocks that cover
+      what is checked: the whole ROM, or sections, overlays and files by
+      the path extract writes them to, or FAT ranges by file id.
+
+    Parameters:
+      disc: Path to the ROM
+      targets: Paths such as files/data/a.bin or FAT ids, or none for the whole ROM
+      threads: Number of threads to use, or 0 for one per hardware thread
+
+    Returns:
+      True if every block read matched.
+  */
+  bool merkle_check(std::string disc, std::vector<std::string> targets, uint32_t threads)
+  {
+    auto start = std::chrono::steady_clock::now();
+    auto rom = std::make_shared<RomImage>(disc);
+    MerkleIndex index;
+
+    if (!index.load(MerkleIndex::sidecar(disc)))
+    {
+      std::cout << MerkleIndex::sidecar(disc) << " is missing or damaged, run index --merkle again" << std::endl;
+      return false;
+    }
+
+    if (!rom->valid())
+    {
+      std::cout << "Could not read a header from " << disc << std::endl;
+      return false;
+    }
+
+    if (rom->size() != index.size())
+    {
+      std::cout << disc << " is " << rom->size() << " bytes but its index covers " << index.size() << std::endl;
+      return false;
+    }
+
+    std::vector<ByteRange> ranges;
+
+    if (targets.empty())
+    {
+      targets.push_back(disc);
+      ranges.push_back(ByteRange(0, rom->size()));
+    }
+    else
+    {
+      FST table(rom);
+      FatView fat = table.fat();
+      std::vector<RomEntry> entries = rom_entries(*rom, table);
+
+      for (auto& target : targets)
+      {
+        //  Ids are parsed wide and checked against the FAT, so a large one can't wrap onto another file
+        bool id = !target.empty() && target.find_first_not_of("0123456789") == std::string::npos;
+        uint64_t value = id ? std::strtoull(target.c_str(), nullptr, 10) : 0;
+        auto entry = std::find_if(entries.begin(), entries.end(), [&](const RomEntry& e) { return e.path == target; });
+
+        if (id && target.size() <= 10 && value <= UINT32_MAX && fat.contains(static_cast<uint32_t>(value)))
+        {
+          FatRange range = fat[static_cast<uint32_t>(value)];
+          ranges.push_back(ByteRange(range.begin, range.size()));
+        }
+        else if (!id && entry != entries.end())
+        {
+          ranges.push_back(ByteRange(entry->offset, entry->size));
+        }
+        else
+        {
+          std::cout << "No file or FAT id " << target << " in " << disc << std::endl;
+          return false;
+        }
+      }
+    }
+
+    //  Blocks shared by several targets are only read once
+    std::vector<uint64_t> blocks = index.covering(ranges);
+    std::vector<uint8_t> bad(blocks.size());
+
+    rom->sequential();
+
+    util::parallel_for(blocks.size(), [&](size_t i)
+    {
+      uint32_t size = index.block_length(blocks[i]);
+      const uint8_t* data = rom->span(blocks[i] * index.block_size(), size);
+
+      util::throttle().read(size);
+      bad[i] = MerkleIndex::hash_block(data, size) != index.leaf(blocks[i]);
+    }, threads);
+
+    bool ok = true;
+
+    for (size_t t = 0; t < targets.size(); t++)
+    {
+      std::vector<uint64_t> covered = index.covering({ ranges[t] });
+      uint64_t first = 0;
+      uint32_t damaged = 0;
+
+      for (auto block : covered)
+      {
+        if (bad[std::lower_bound(blocks.begin(), blocks.end(), block) - blocks.begin()])
+        {
+          first = damaged ? first : block;
+          damaged++;
+        }
+      }
+
+      if (damaged)
+      {
+        std::cout << targets[t] << ": " << damaged << " of " << covered.size() << " blocks differ, first at 0x"
+          << util::to_hex(first * index.block_size()) << "\n";
+      }
+      else
+      {
+        std::cout << targets[t] << ": ok, " << covered.size() << " blocks\n";
+      }
+
+      ok = ok && damaged == 0;
+    }
+
+    std::cerr << "Checked " << blocks.size() << " of " << index.blocks() << " blocks in " << elapsed_ms(start) << " ms" << std::endl;
+    return ok;
+  }
+
+  /*
+    Summary:
+      Brings the index of a ROM up to date after ranges of it were written
+      in place, hashing only the blocks they touch. A ROM whose size changed
+      has its last block and any new ones hashed too.
+
+    Parameters:
+      disc: Path to the ROM
+      ranges: Ranges that were written
+
+    Returns:
+      True if the ROM has no index, or its index was updated.
+  */
+  bool merkle_update(std::string disc, const std::vector<ByteRange>& ranges)
+  {
+    std::string path = MerkleIndex::sidecar(disc);
+    boost::system::error_code error;
+    MerkleIndex index;
+    util::File file;
+
+    if (!fs::exists(path, error))
+    {
+      return true;
+    }
+
+    if (!index.load(path) || !file.open(disc))
+    {
+      std::cout << path << " could not be updated, run index --merkle again" << std::endl;
+      return false;
+    }
+
+    std::vector<ByteRange> touched = ranges;
+    uint64_t size = file.size();
+
+    if (size != index.size())
+    {
+      uint64_t from = std::min(size, index.size()) / index.block_size() * index.block_size();
+      touched.push_back(ByteRange(from, size - from));
+      index.resize(size);
+    }
+
+    //  Writers in place touch a few blocks, so they are read one after another
+    std::vector<std::pair<uint64_t, MerkleIndex::Digest>> leaves;
+    std::vector<uint8_t> data(index.block_size());
+
+    for (auto block : index.covering(touched))
+    {
+      uint32_t length = index.block_length(block);
+
+      if (file.read_at(data.data(), length, block * index.block_size()) != length)
+      {
+        std::cout << "Could not read " << disc << ", run index --merkle again" << std::endl;
+        return false;
+      }
+
+      leaves.push_back(std::make_pair(block, MerkleIndex::hash_block(data.data(), length)));
+    }
+
+    index.update(leaves);
+
+    if (!index.save(path))
+    {
+      std::cout << path << " could not be updated, run index --merkle again" << std::endl;
+      return false;
+    }
+
+    return true;
+  }
+}
@@ -0,0 +1,97 @@
+#ifndef _MD_NDS_MERKLE_H
+#define _MD_NDS_MERKLE_H
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "nds_image.h"
+
+namespace nds
+{
+  //  A range of a ROM as its start and size
+  typedef std::pair<uint64_t, uint64_t> ByteRange;
+
+  /*
+    A hash of every fixed-size block of a ROM with a binary tree of hashes
+    over them, kept next to it in <disc>.mrk. Any range can be checked by
+    reading only the blocks that cover it, and a tool that writes a ROM in
+    place hashes only the blocks it wrote, then the nodes above them.
+
+    Blocks and nodes are hashed with SHA-256, so a block can't be changed
+    without the index noticing. The file holds a 32 byte header,
+    "MDMERK02", the block size, the ROM size and the number of blocks, then
+    every level of the tree as 32 byte digests, from the blocks up to the
+    root.
+  */
+  class MerkleIndex
+  {
+  public:
+    static const uint32_t DefaultBlock = 0x10000;
+
+    typedef std::array<uint8_t, 32> Digest;
+
+    static inline std::string sidecar(const std::string& disc)
+    {
+      return disc + ".mrk";
+    }
+
+    static Digest hash_block(const uint8_t* data, size_t size);
+
+    void create(uint64_t size, uint32_t block);
+    bool load(std::string path);
+    bool save(std::string path) const;
+
+    inline uint32_t block_size() const
+    {
+      return m_block;
+    }
+
+    inline uint64_t size() const
+    {
+      return m_size;
+    }
+
+    inline uint64_t blocks() const
+    {
+      return m_levels[0].size();
+    }
+
+    inline const Digest& leaf(uint64_t index) const
+    {
+      return m_levels[0][index];
+    }
+
+    inline const Digest& root() const
+    {
+      return m_levels.back()[0];
+    }
+
+    //  Bytes of a block, the last one may be short
+    inline uint32_t block_length(uint64_t index) const
+    {
+      return static_cast<uint32_t>(std::min<uint64_t>(m_block, m_size - std::min(m_size, index * m_block)));
+    }
+
+    void resize(uint64_t size);
+    void update(const std::vector<std::pair<uint64_t, Digest>>& leaves);
+    std::vector<uint64_t> covering(const std::vector<ByteRange>& ranges) const;
+
+  private:
+    uint32_t m_block = DefaultBlock;
+    uint64_t m_size = 0;
+    std::vector<std::vector<Digest>> m_levels;  //  Block hashes first, the root last
+
+    static Digest hash_node(const std::vector<Digest>& level, uint64_t index);
+    void build();
+  };
+
+  bool merkle_index(std::string disc, uint32_t block = MerkleIndex::DefaultBlock, uint32_t threads = 0);
+  bool merkle_check(std::string disc, std::vector<std::string> targets, uint32_t threads = 0);
+  bool merkle_update(std::string disc, const std::vector<ByteRange>& ranges);
+}
+
+#endif
@@ -0,0 +1,1124 @@
+#include "nds_patch.h"
+#include "nds_extract.h"
+#include "util.h"
+#include "util_io.h"
+
+#include <algorithm>
+#include <chrono>
+#include <memory>
+#include <unordered_map>
+
+namespace nds
+{
+  namespace
+  {
+    const uint32_t MinCopy = 32;        //  Shortest run of equal bytes worth a copy instead of new data
+    const uint32_t MinFill = 16;        //  Shortest run of one byte worth a fill
+    const size_t BufferSize = 0x100000; //  Bytes buffered by each reader and writer
+
+    const char BpsMagic[] = "BPS1";
+    const char NativeMagic[] = "MDP1";
+
+    const uint32_t NativeHeaderSize = 32;
+    const uint32_t NativeOpSize = 32;
+
+    //  Collects ops in target order, merging each one into the last where possible
+    class OpList
+    {
+    public:
+      OpList(const uint8_t* target) : m_target(target) {};
+
+      void copy(uint64_t target, uint64_t source, uint64_t length)
+      {
+        if (length == 0)
+        {
+          return;
+        }
+
+        if (!m_ops.empty())
+        {
+          PatchOp& last = m_ops.back();
+
+          if (last.type == PatchOp::SourceCopy && last.target + last.length == target && last.source + last.length == source)
+          {
+            last.length += length;
+            return;
+          }
+        }
+
+        m_ops.push_back(PatchOp(PatchOp::SourceCopy, target, source, length));
+      }
+
+      //  Adds new bytes, splitting out any long runs of a single value as fills
+      void data(uint64_t target, uint64_t length)
+      {
+        const uint8_t* data = m_target + target;
+        uint64_t start = 0;
+        uint64_t pos = 0;
+
+        while (pos < length)
+        {
+          uint64_t run = 1;
+
+          while (pos + run < length && data[pos + run] == data[pos])
+          {
+            run++;
+          }
+
+          if (run >= MinFill)
+          {
+            literal(target + start, pos - start);
+            m_ops.push_back(PatchOp(PatchOp::Fill, target + pos, 0, run, data[pos]));
+            start = pos + run;
+          }
+
+          pos += run;
+        }
+
+        literal(target + start, length - start);
+      }
+
+      std::vector<PatchOp>& ops()
+      {
+        return m_ops;
+      }
+
+    private:
+      const uint8_t* m_target;
+      std::vector<PatchOp> m_ops;
+
+      void literal(uint64_t target, uint64_t length)
+      {
+        if (length == 0)
+        {
+          return;
+        }
+
+        if (!m_ops.empty() && m_ops.back().type == PatchOp::TargetData && m_ops.back().target + m_ops.back().length == target)
+        {
+          m_ops.back().length += length;
+          return;
+        }
+
+        m_ops.push_back(PatchOp(PatchOp::TargetData, target, target, length));
+      }
+    };
+
+    //  Number of equal bytes at the start of two ranges
+    uint64_t common_prefix(const uint8_t* a, const uint8_t* b, uint64_t length)
+    {
+      uint64_t pos = 0;
+
+      while (pos + 8 <= length && util::load<uint64_t>(a + pos) == util::load<uint64_t>(b + pos))
+      {
+        pos += 8;
+      }
+
+      while (pos < length && a[pos] == b[pos])
+      {
+        pos++;
+      }
+
+      return pos;
+    }
+
+    //  Number of equal bytes at the end of two ranges
+    uint64_t common_suffix(const uint8_t* a, uint64_t a_size, const uint8_t* b, uint64_t b_size)
+    {
+      uint64_t length = std::min(a_size, b_size);
+      uint64_t pos = 0;
+
+      while (pos < length && a[a_size - pos - 1] == b[b_size - pos - 1])
+      {
+        pos++;
+      }
+
+      return pos;
+    }
+
+    /*
+      Summary:
+        Describes a range of the target against a reference range of the
+        source. Bytes are compared at the same distance from the start of
+        each range, and a shared tail is matched against the end so files
+        that grew or shrank still copy most of their contents.
+
+      Parameters:
+        ops: Ops to add to
+        source: Mapped source ROM
+        target: Mapped target ROM
+        offset: Start of the range in the target
+        size: Size of the range in the target
+        ref: Start of the reference range in the source
+        ref_size: Size of the reference range, may be 0
+    */
+    void diff_range(OpList& ops, RomImage& source, RomImage& target, uint64_t offset, uint64_t size, uint64_t ref, uint64_t ref_size)
+    {
+      const uint8_t* data = target.data() + offset;
+      const uint8_t* old = source.data() + ref;
+
+      uint64_t suffix = (ref_size != size) ? common_suffix(data, size, old, ref_size) : 0;
+
+      if (suffix < MinCopy)
+      {
+        suffix = 0;
+      }
+
+      uint64_t head = size - suffix;
+      uint64_t limit = std::min(head, ref_size);
+      uint64_t start = 0;
+      uint64_t pos = 0;
+
+      while (pos < limit)
+      {
+        uint64_t run = common_prefix(data + pos, old + pos, limit - pos);
+
+        if (run >= MinCopy)
+        {
+          ops.data(offset + start, pos - start);
+          ops.copy(offset + pos, ref + pos, run);
+          start = pos + run;
+        }
+
+        pos += std::max<uint64_t>(run, 1);
+      }
+
+      ops.data(offset + start, head - start);
+      ops.copy(offset + head, ref + ref_size - suffix, suffix);
+    }
+
+    //  Writes a BPS variable length number
+    void write_number(util::ByteWriter& out, uint64_t value)
+    {
+      while (true)
+      {
+        uint8_t x = value & 0x7F;
+        value >>= 7;
+
+        if (value == 0)
+        {
+          out.write<uint8_t>(0x80 | x);
+          break;
+        }
+
+        out.write<uint8_t>(x);
+        value--;
+      }
+    }
+
+    //  Writes a relative offset from the last position as BPS stores it, with the sign in the low bit
+    void write_relative(util::ByteWriter& out, uint64_t offset, uint64_t& last)
+    {
+      uint64_t delta = (offset >= last) ? offset - last : last - offset;
+      write_number(out, (delta << 1) | (offset < last ? 1 : 0));
+    }
+
+    /*
+      Summary:
+        Encodes ops as a standard BPS patch, which most patching tools can apply.
+    */
+    std::vector<uint8_t> encode_bps(std::vector<PatchOp>& ops, RomImage& source, RomImage& target)
+    {
+      enum { SourceRead, TargetRead, SourceCopy, TargetCopy };
+
+      util::ByteWriter out;
+      uint64_t source_relative = 0;
+      uint64_t target_relative = 0;
+
+      out.write(BpsMagic, 4);
+      write_number(out, source.size());
+      write_number(out, target.size());
+      write_number(out, 0);   //  No metadata
+
+      for (auto& op : ops)
+      {
+        switch (op.type)
+        {
+        case PatchOp::SourceCopy:
+          if (op.source == op.target)
+          {
+            write_number(out, ((op.length - 1) << 2) | SourceRead);
+          }
+          else
+          {
+            write_number(out, ((op.length - 1) << 2) | SourceCopy);
+            write_relative(out, op.source, source_relative);
+            source_relative = op.source + op.length;
+          }
+          break;
+
+        case PatchOp::TargetData:
+          write_number(out, ((op.length - 1) << 2) | TargetRead);
+          out.write(target.data() + op.source, op.length);
+          break;
+
+        case PatchOp::Fill:
+          //  One new byte, then copy it forward over itself
+          write_number(out, TargetRead);
+          out.write<uint8_t>(op.value);
+
+          if (op.length > 1)
+          {
+            write_number(out, ((op.length - 2) << 2) | TargetCopy);
+            write_relative(out, op.target, target_relative);
+            target_relative = op.target + op.length - 1;
+          }
+          break;
+        }
+      }
+
+      out.write(util::crc32(source.data(), source.size()));
+      out.write(util::crc32(target.data(), target.size()));
+      out.write(util::crc32(out.data().data(), out.size()));
+
+      return out.release();
+    }
+
+    /*
+      Summary:
+        Encodes ops in the native format. Every op carries its own target
+        offset so the ops can be applied in any order and in parallel, and
+        all new data is stored after the op table.
+
+      Layout:
+        0x00 "MDP1", op count, source size, target size, source CRC, target CRC
+        0x20 Op table of target, source, length, type, value
+        Data for every TargetData op, then a CRC of everything before it
+    */
+    std::vector<uint8_t> encode_native(std::vector<PatchOp>& ops, RomImage& source, RomImage& target)
+    {
+      uint64_t data_size = 0;
+
+      for (auto& op : ops)
+      {
+        data_size += (op.type == PatchOp::TargetData) ? op.length : 0;
+      }
+
+      util::ByteWriter out(NativeHeaderSize + ops.size() * NativeOpSize + data_size + 4);
+      uint64_t data_offset = 0;
+
+      out.write(NativeMagic, 4);
+      out.write(static_cast<uint32_t>(ops.size()));
+      out.write(static_cast<uint64_t>(source.size()));
+      out.write(static_cast<uint64_t>(target.size()));
+      out.write(util::crc32(source.data(), source.size()));
+      out.write(util::crc32(target.data(), target.size()));
+
+      for (auto& op : ops)
+      {
+        out.write(op.target);
+        out.write((op.type == PatchOp::TargetData) ? data_offset : op.source);
+        out.write(op.length);
+        out.write<uint8_t>(op.type);
+        out.write<uint8_t>(op.value);
+        out.fill(0, 6);
+
+        data_offset += (op.type == PatchOp::TargetData) ? op.length : 0;
+      }
+
+      for (auto& op : ops)
+      {
+        if (op.type == PatchOp::TargetData)
+        {
+          out.write(target.data() + op.source, op.length);
+        }
+      }
+
+      out.write(util::crc32(out.data().data(), out.size()));
+
+      return out.release();
+    }
+
+    //  Reads a patch front to back through a fixed buffer, keeping a CRC of everything read
+    class PatchReader
+    {
+    public:
+      PatchReader(util::File& file, uint64_t end)
+        : m_file(file), m_buffer(BufferSize), m_pos(0), m_fill(0), m_offset(0), m_end(end), m_crc(0), m_ok(true) {};
+
+      bool read(uint8_t* data, size_t size)
+      {
+        while (size > 0)
+        {
+          if (m_pos == m_fill && !refill())
+          {
+            return false;
+          }
+
+          size_t count = std::min(size, m_fill - m_pos);
+          std::memcpy(data, &m_buffer[m_pos], count);
+
+          m_pos += count;
+          data += count;
+          size -= count;
+        }
+
+        return true;
+      }
+
+      bool number(uint64_t& value)
+      {
+        uint64_t shift = 1;
+        value = 0;
+
+        for (int i = 0; i < 10; i++)
+        {
+          uint8_t x;
+
+          if (!read(&x, 1))
+          {
+            return false;
+          }
+
+          value += (x & 0x7F) * shift;
+
+          if (x & 0x80)
+          {
+            return true;
+          }
+
+          shift <<= 7;
+          value += shift;
+        }
+
+        return false;
+      }
+
+      bool relative(uint64_t& last)
+      {
+        uint64_t value;
+
+        if (!number(value))
+        {
+          return false;
+        }
+
+        last += (value & 1) ? -static_cast<int64_t>(value >> 1) : static_cast<int64_t>(value >> 1);
+        return true;
+      }
+
+      //  Bytes read so far
+      inline uint64_t position() const
+      {
+        return m_offset - (m_fill - m_pos);
+      }
+
+      inline uint32_t crc() const
+      {
+        return m_crc;
+      }
+
+    private:
+      util::File& m_file;
+      std::vector<uint8_t> m_buffer;
+      size_t m_pos;
+      size_t m_fill;
+      uint64_t m_offset;
+      uint64_t m_end;
+      uint32_t m_crc;
+      bool m_ok;
+
+      bool refill()
+      {
+        size_t count = static_cast<size_t>(std::min<uint64_t>(m_buffer.size(), m_end - m_offset));
+
+        if (count == 0 || m_file.read_at(&m_buffer[0], count, m_offset) != count)
+        {
+          return false;
+        }
+
+        m_crc = util::crc32(&m_buffer[0], count, m_crc);
+        m_offset += count;
+        m_pos = 0;
+        m_fill = count;
+
+        return true;
+      }
+    };
+
+    //  Writes the target front to back through a fixed buffer, keeping a CRC of everything written
+    class TargetWriter
+    {
+    public:
+      TargetWriter(util::File& file) : m_file(file), m_buffer(BufferSize), m_fill(0), m_flushed(0), m_crc(0), m_ok(true) {};
+
+      void write(const uint8_t* data, uint64_t size)
+      {
+        while (size > 0)
+        {
+          size_t count = static_cast<size_t>(std::min<uint64_t>(size, m_buffer.size() - m_fill));
+          std::memcpy(&m_buffer[m_fill], data, count);
+
+          m_fill += count;
+          data += count;
+          size -= count;
+
+          if (m_fill == m_buffer.size())
+          {
+            flush();
+          }
+        }
+      }
+
+      /*
+        Summary:
+          Copies earlier output to the end. Bytes still in the buffer are
+          copied one at a time so a copy may overlap what it writes.
+      */
+      void copy(uint64_t from, uint64_t size)
+      {
+        std::vector<uint8_t> block;
+
+        while (size > 0 && m_ok)
+        {
+          if (from < m_flushed)
+          {
+            block.resize(static_cast<size_t>(std::min<uint64_t>({ size, m_flushed - from, m_buffer.size() })));
+            m_ok = m_file.read_at(&block[0], block.size(), from) == block.size();
+
+            write(&block[0], block.size());
+            from += block.size();
+            size -= block.size();
+          }
+          else
+          {
+            uint8_t value = m_buffer[static_cast<size_t>(from - m_flushed)];
+            write(&value, 1);
+            from++;
+            size--;
+          }
+        }
+      }
+
+      bool flush()
+      {
+        if (m_fill > 0)
+        {
+          m_crc = util::crc32(&m_buffer[0], m_fill, m_crc);
+          m_ok = m_file.write_at(&m_buffer[0], m_fill, m_flushed) && m_ok;
+          m_flushed += m_fill;
+          m_fill = 0;
+        }
+
+        return m_ok;
+      }
+
+      inline uint64_t position() const
+      {
+        return m_flushed + m_fill;
+      }
+
+      inline uint32_t crc() const
+      {
+        return m_crc;
+      }
+
+    private:
+      util::File& m_file;
+      std::vector<uint8_t> m_buffer;
+      size_t m_fill;
+      uint64_t m_flushed;
+      uint32_t m_crc;
+      bool m_ok;
+    };
+
+    /*
+      Summary:
+        Applies a BPS patch. The patch is read and the target is written
+        sequentially through fixed buffers, so memory use does not depend
+        on the size of either ROM.
+    */
+    bool apply_bps(util::MappedFile& source, util::File& patch, uint64_t patch_size, util::File& out)
+    {
+      enum { SourceRead, TargetRead, SourceCopy, TargetCopy };
+
+      PatchReader reader(patch, patch_size - 4);
+      TargetWriter writer(out);
+
+      uint8_t magic[4];
+      uint64_t source_size;
+      uint64_t target_size;
+      uint64_t metadata_size;
+
+      if (!reader.read(magic, 4) || !reader.number(source_size) || !reader.number(target_size) || !reader.number(metadata_size))
+      {
+        std::cout << "Patch header is incomplete" << std::endl;
+        return false;
+      }
+
+      if (source_size != source.size())
+      {
+        std::cout << "Patch expects a source of " << source_size << " bytes but it is " << source.size() << " bytes" << std::endl;
+        return false;
+      }
+
+      std::vector<uint8_t> block(std::min<uint64_t>(BufferSize, std::max<uint64_t>(metadata_size, 1)));
+
+      //  Metadata is not used
+      for (uint64_t left = metadata_size; left > 0;)
+      {
+        size_t count = static_cast<size_t>(std::min<uint64_t>(left, block.size()));
+
+        if (!reader.read(&block[0], count))
+        {
+          std::cout << "Patch metadata is incomplete" << std::endl;
+          return false;
+        }
+
+        left -= count;
+      }
+
+      out.allocate(target_size);
+
+      uint64_t source_relative = 0;
+      uint64_t target_relative = 0;
+      block.resize(BufferSize);
+
+      while (reader.position() < patch_size - 12)
+      {
+        uint64_t action;
+
+        if (!reader.number(action))
+        {
+          break;
+        }
+
+        uint64_t length = (action >> 2) + 1;
+        uint64_t pos = writer.position();
+        bool ok = pos + length <= target_size;
+
+        switch (action & 3)
+        {
+        case SourceRead:
+          ok = ok && pos + length <= source.size();
+
+          if (ok)
+          {
+            writer.write(source.data() + pos, length);
+          }
+          break;
+
+        case TargetRead:
+          for (uint64_t left = length; ok && left > 0;)
+          {
+            size_t count = static_cast<size_t>(std::min<uint64_t>(left, block.size()));
+            ok = reader.read(&block[0], count);
+            writer.write(&block[0], count);
+            left -= count;
+          }
+          break;
+
+        case SourceCopy:
+          ok = ok && reader.relative(source_relative) && source_relative + length <= source.size();
+
+          if (ok)
+          {
+            writer.write(source.data() + source_relative, length);
+            source_relative += length;
+          }
+          break;
+
+        case TargetCopy:
+          ok = ok && reader.relative(target_relative) && target_relative < pos;
+
+          if (ok)
+          {
+            writer.copy(target_relative, length);
+            target_relative += length;
+          }
+          break;
+        }
+
+        if (!ok)
+        {
+          std::cout << "Patch action at " << reader.position() << " is out of bounds" << std::endl;
+          return false;
+        }
+      }
+
+      uint8_t footer[12];
+
+      if (!reader.read(footer, 8) || !writer.flush())
+      {
+        std::cout << "Could not finish writing the patched ROM" << std::endl;
+        return false;
+      }
+
+      uint32_t patch_crc = reader.crc();
+      patch.read_at(footer + 8, 4, patch_size - 4);
+
+      if (writer.position() != target_size)
+      {
+        std::cout << "Patch produced " << writer.position() << " bytes but should produce " << target_size << std::endl;
+        return false;
+      }
+
+      if (util::load<uint32_t>(footer + 8) != patch_crc)
+      {
+        std::cout << "Patch CRC does not match, the patch is damaged" << std::endl;
+        return false;
+      }
+
+      if (util::load<uint32_t>(footer) != util::crc32(source.data(), source.size()))
+      {
+        std::cout << "Source CRC does not match, this patch is for a different ROM" << std::endl;
+        return false;
+      }
+
+      if (util::load<uint32_t>(footer + 4) != writer.crc())
+      {
+        std::cout << "Target CRC does not match" << std::endl;
+        return false;
+      }
+
+      return true;
+    }
+
+    /*
+      Summary:
+        Applies a native patch. The output is allocated at its final size
+        and every op is written independently across threads, with copies
+        done by the kernel where it can.
+    */
+    bool apply_native(std::string source_name, util::MappedFile& source, util::File& patch, uint64_t patch_size, util::File& out)
+    {
+      std::vector<uint8_t> header(NativeHeaderSize);
+
+      if (patch.read_at(&header[0], header.size(), 0) != header.size())
+      {
+        std::cout << "Patch header is incomplete" << std::endl;
+        return false;
+      }
+
+      uint32_t count = util::read<uint32_t>(header, 4);
+      uint64_t source_size = util::read<uint64_t>(header, 8);
+      uint64_t target_size = util::read<uint64_t>(header, 16);
+      uint64_t data_start = NativeHeaderSize + static_cast<uint64_t>(count) * NativeOpSize;
+
+      if (data_start + 4 > patch_size)
+      {
+        std::cout << "Patch op table is incomplete" << std::endl;
+        return false;
+      }
+
+      if (source_size != source.size())
+      {
+        std::cout << "Patch expects a source of " << source_size << " bytes but it is " << source.size() << " bytes" << std::endl;
+        return false;
+      }
+
+      if (util::read<uint32_t>(header, 24) != util::crc32(source.data(), source.size()))
+      {
+        std::cout << "Source CRC does not match, this patch is for a different ROM" << std::endl;
+        return false;
+      }
+
+      //  Check the whole patch before anything is written
+      std::vector<uint8_t> block(BufferSize);
+      uint32_t crc = 0;
+
+      for (uint64_t pos = 0; pos < patch_size - 4;)
+      {
+        size_t len = static_cast<size_t>(std::min<uint64_t>(block.size(), patch_size - 4 - pos));
+
+        if (patch.read_at(&block[0], len, pos) != len)
+        {
+          return false;
+        }
+
+        crc = util::crc32(&block[0], len, crc);
+        pos += len;
+      }
+
+      uint8_t footer[4];
+
+      if (patch.read_at(footer, 4, patch_size - 4) != 4 || util::load<uint32_t>(footer) != crc)
+      {
+        std::cout << "Patch CRC does not match, the patch is damaged" << std::endl;
+        return false;
+      }
+
+      std::vector<uint8_t> table(static_cast<size_t>(data_start - NativeHeaderSize));
+      std::vector<PatchOp> ops;
+      uint64_t data_size = patch_size - 4 - data_start;
+
+      if (!table.empty())
+      {
+        patch.read_at(&table[0], table.size(), NativeHeaderSize);
+      }
+
+      for (uint32_t i = 0; i < count; i++)
+      {
+        const uint8_t* record = &table[i * NativeOpSize];
+        PatchOp op(static_cast<PatchOp::Type>(record[24]), util::load<uint64_t>(record), util::load<uint64_t>(record + 8), util::load<uint64_t>(record + 16), record[25]);
+
+        bool ok = op.target + op.length <= target_size && op.target + op.length >= op.target;
+
+        if (op.type == PatchOp::SourceCopy)
+        {
+          ok = ok && op.source + op.length <= source.size();
+        }
+        else if (op.type == PatchOp::TargetData)
+        {
+          ok = ok && op.source + op.length <= data_size;
+        }
+        else
+        {
+          ok = ok && op.type == PatchOp::Fill;
+        }
+
+        if (!ok)
+        {
+          std::cout << "Patch op " << i << " is out of bounds" << std::endl;
+          return false;
+        }
+
+        ops.push_back(op);
+      }
+
+      util::File in;
+
+      if (!in.open(source_name) || !out.allocate(target_size))
+      {
+        std::cout << "Could not prepare the patched ROM" << std::endl;
+        return false;
+      }
+
+      std::atomic<bool> ok(true);
+
+      util::parallel_for(ops.size(), [&](size_t i)
+      {
+        PatchOp& op = ops[i];
+
+        if (op.type == PatchOp::SourceCopy)
+        {
+          ok = out.copy_from(in, op.source, static_cast<size_t>(op.length), op.target) && ok;
+        }
+        else if (op.type == PatchOp::TargetData)
+        {
+          ok = out.copy_from(patch, data_start + op.source, static_cast<size_t>(op.length), op.target) && ok;
+        }
+        else
+        {
+          ok = out.fill_at(op.value, static_cast<size_t>(op.length), op.target) && ok;
+        }
+      });
+
+      if (!ok)
+      {
+        std::cout << "Could not write the patched ROM" << std::endl;
+        return false;
+      }
+
+      //  The ops were written out of order, so read the result back to check it
+      crc = 0;
+
+      for (uint64_t pos = 0; pos < target_size;)
+      {
+        size_t len = static_cast<size_t>(std::min<uint64_t>(block.size(), target_size - pos));
+
+        if (out.read_at(&block[0], len, pos) != len)
+        {
+          return false;
+        }
+
+        crc = util::crc32(&block[0], len, crc);
+        pos += len;
+      }
+
+      if (util::read<uint32_t>(header, 28) != crc)
+      {
+        std::cout << "Target CRC does not match" << std::endl;
+        return false;
+      }
+
+      return true;
+    }
+  }
+
+  /*
+    Summary:
+      Works out how to turn one ROM into another. Both ROMs are split into
+      the ranges extract would write. A range that exists in the source
+      under the same path, or anywhere with the same contents, becomes a
+      single copy no matter where build moved it. Changed files are
+      compared against their old version, and anything between files is
+      compared against the source at the same offset.
+
+    Parameters:
+      source: The original ROM
+      target: The modified ROM
+
+    Returns:
+      Ops covering every byte of the target in order.
+  */
+  std::vector<PatchOp> diff_roms(std::shared_ptr<RomImage> source_rom, std::shared_ptr<RomImage> target_rom)
+  {
+    RomImage& source = *source_rom;
+    RomImage& target = *target_rom;
+    FST source_table(source_rom);
+    FST target_table(target_rom);
+
+    std::vector<RomEntry> old_entries = rom_entries(source, source_table);
+    std::vector<RomEntry> new_entries = rom_entries(target, target_table);
+
+    //  Clamp every range to its file so later comparisons never read past the end
+    auto clamp = [](RomImage& rom, std::vector<RomEntry>& entries)
+    {
+      for (auto& entry : entries)
+      {
+        rom.span(entry.offset, entry.size);
+      }
+    };
+
+    clamp(source, old_entries);
+    clamp(target, new_entries);
+
+    std::vector<uint64_t> old_hashes(old_entries.size());
+    std::vector<uint64_t> new_hashes(new_entries.size());
+
+    util::parallel_for(old_entries.size(), [&](size_t i)
+    {
+      old_hashes[i] = util::hash64(source.data() + old_entries[i].offset, old_entries[i].size);
+    });
+
+    util::parallel_for(new_entries.size(), [&](size_t i)
+    {
+      new_hashes[i] = util::hash64(target.data() + new_entries[i].offset, new_entries[i].size);
+    });
+
+    std::unordered_map<std::string, size_t> by_path;
+    std::unordered_multimap<uint64_t, size_t> by_hash;
+
+    for (size_t i = 0; i < old_entries.size(); i++)
+    {
+      by_path[old_entries[i].path] = i;
+
+      if (old_entries[i].size >= MinCopy)
+      {
+        by_hash.insert(std::make_pair(old_hashes[i], i));
+      }
+    }
+
+    //  Returns the source entry holding the same bytes as a target entry, if any
+    auto find_copy = [&](size_t i) -> const RomEntry*
+    {
+      const RomEntry& entry = new_entries[i];
+      auto range = by_hash.equal_range(new_hashes[i]);
+
+      auto same = [&](const RomEntry& old)
+      {
+        return old.size == entry.size && std::memcmp(source.data() + old.offset, target.data() + entry.offset, entry.size) == 0;
+      };
+
+      auto path = by_path.find(entry.path);
+
+      if (path != by_path.end() && old_hashes[path->second] == new_hashes[i] && same(old_entries[path->second]))
+      {
+        return &old_entries[path->second];
+      }
+
+      for (auto it = range.first; it != range.second; ++it)
+      {
+        if (same(old_entries[it->second]))
+        {
+          return &old_entries[it->second];
+        }
+      }
+
+      return nullptr;
+    };
+
+    std::vector<size_t> order(new_entries.size());
+
+    for (size_t i = 0; i < order.size(); i++)
+    {
+      order[i] = i;
+    }
+
+    std::sort(order.begin(), order.end(), [&](size_t a, size_t b)
+    {
+      return new_entries[a].offset < new_entries[b].offset;
+    });
+
+    OpList ops(target.data());
+    uint64_t pos = 0;
+
+    //  Bytes outside every entry are compared with the source at the same place
+    auto gap = [&](uint64_t end)
+    {
+      if (end > pos)
+      {
+        uint64_t ref_size = (pos < source.size()) ? std::min<uint64_t>(end, source.size()) - pos : 0;
+        diff_range(ops, source, target, pos, end - pos, pos, ref_size);
+        pos = end;
+      }
+    };
+
+    for (size_t i : order)
+    {
+      RomEntry& entry = new_entries[i];
+      uint64_t end = static_cast<uint64_t>(entry.offset) + entry.size;
+
+      //  Entries that overlap one already written only add their remainder
+      if (entry.size == 0 || end <= pos)
+      {
+        continue;
+      }
+
+      if (entry.offset < pos)
+      {
+        gap(end);
+        continue;
+      }
+
+      gap(entry.offset);
+
+      auto path = by_path.find(entry.path);
+      const RomEntry* copy = find_copy(i);
+
+      if (copy != nullptr)
+      {
+        ops.copy(entry.offset, copy->offset, entry.size);
+      }
+      else if (path != by_path.end())
+      {
+        const RomEntry& old = old_entries[path->second];
+        diff_range(ops, source, target, entry.offset, entry.size, old.offset, old.size);
+      }
+      else
+      {
+        ops.data(entry.offset, entry.size);
+      }
+
+      pos = end;
+    }
+
+    gap(target.size());
+
+    return ops.ops();
+  }
+
+  /*
+    Summary:
+      Creates a patch that turns one ROM into another.
+
+    Parameters:
+      source: The original ROM
+      target: The modified ROM
+      patch: Path of the patch to write
+      format: "bps" for a standard BPS patch, or "native" for this tool's own format
+
+    Returns:
+      True if the patch was written.
+  */
+  bool create_patch(std::string source, std::string target, std::string patch, std::string format)
+  {
+    if (format != "bps" && format != "native")
+    {
+      std::cout << "Unknown patch format " << format << std::endl;
+      return false;
+    }
+
+    auto source_rom = std::make_shared<RomImage>(source);
+    auto target_rom = std::make_shared<RomImage>(target);
+
+    if (!source_rom->valid() || !target_rom->valid())
+    {
+      return false;
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    std::vector<PatchOp> ops = diff_roms(source_rom, target_rom);
+
+    std::vector<uint8_t> data = (format == "bps") ? encode_bps(ops, *source_rom, *target_rom) : encode_native(ops, *source_rom, *target_rom);
+
+    util::File out;
+
+    if (!out.create(patch) || !out.write_at(&data[0], data.size(), 0))
+    {
+      std::cout << "Could not write " << patch << std::endl;
+      return false;
+    }
+
+    auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+
+    uint64_t copied = 0;
+    uint64_t added = 0;
+
+    for (auto& op : ops)
+    {
+      (op.type == PatchOp::SourceCopy ? copied : added) += op.length;
+    }
+
+    std::cout << "Created " << format << " patch of " << data.size() << " bytes in " << ms << " ms ("
+      << copied << " bytes copied, " << added << " bytes new)" << std::endl;
+
+    return true;
+  }
+
+  /*
+    Summary:
+      Applies a BPS or native patch, detected from the patch header.
+
+    Parameters:
+      source: The original ROM
+      patch: The patch to apply
+      target: Path of the patched ROM to write
+
+    Returns:
+      True if the patched ROM was written and its CRC matched.
+  */
+  bool apply_patch(std::string source, std::string patch, std::string target)
+  {
+    util::MappedFile source_file;
+    util::File patch_file;
+    util::File out;
+
+    if (!source_file.open(source))
+    {
+      std::cout << "Could not open " << source << std::endl;
+      return false;
+    }
+
+    if (!patch_file.open(patch))
+    {
+      std::cout << "Could not open " << patch << std::endl;
+      return false;
+    }
+
+    uint64_t patch_size = patch_file.size();
+    char magic[4] = {};
+
+    if (patch_size < 16 || patch_file.read_at(reinterpret_cast<uint8_t*>(magic), 4, 0) != 4)
+    {
+      std::cout << patch << " is too small to be a patch" << std::endl;
+      return false;
+    }
+
+    bool bps = std::memcmp(magic, BpsMagic, 4) == 0;
+
+    if (!bps && std::memcmp(magic, NativeMagic, 4) != 0)
+    {
+      std::cout << patch << " is not a BPS or native patch" << std::endl;
+      return false;
+    }
+
+    if (!out.create(target))
+    {
+      std::cout << "Could not create " << target << std::endl;
+      return false;
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    bool ok = bps ? apply_bps(source_file, patch_file, patch_size, out) : apply_native(source, source_file, patch_file, patch_size, out);
+    auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+
+    if (ok)
+    {
+      std::cout << "Applied " << (bps ? "bps" : "native") << " patch in " << ms << " ms" << std::endl;
+    }
+
+    return ok;
+  }
+}
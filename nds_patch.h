@@ -0,0 +1,39 @@
+#ifndef _MD_NDS_PATCH_H
+#define _MD_NDS_PATCH_H
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "nds_image.h"
+
+namespace nds
+{
+  //  One step of turning the source ROM into the target ROM
+  struct PatchOp
+  {
+    enum Type : uint8_t
+    {
+      SourceCopy,   //  Copy length bytes from source offset in the source ROM
+      TargetData,   //  New bytes, stored at source offset in the target ROM or patch data
+      Fill          //  Repeat value length times
+    };
+
+    PatchOp(Type type, uint64_t target, uint64_t source, uint64_t length, uint8_t value = 0)
+      : type(type), target(target), source(source), length(length), value(value) {};
+
+    Type type;
+    uint64_t target;    //  Offset written in the target
+    uint64_t source;
+    uint64_t length;
+    uint8_t value;
+  };
+
+  std::vector<PatchOp> diff_roms(std::shared_ptr<RomImage> source, std::shared_ptr<RomImage> target);
+
+  bool create_patch(std::string source, std::string target, std::string patch, std::string format = "bps");
+  bool apply_patch(std::string source, std::string patch, std::string target);
+}
+
+#endif
@@ -0,0 +1,428 @@
+#include "nds_plan.h"
+#include "nds_banner.h"
+#include "util_io.h"
+
+#include <cstring>
+#include <fstream>
+#include <unordered_map>
+
+namespace fs = boost::filesystem;
+
+namespace nds
+{
+  namespace
+  {
+    /*
+      Summary:
+        Reads an access trace, one FAT id or file path per line. Ids can be
+        decimal or 0x prefixed hex, paths are relative to files/ and blank
+        lines and lines starting with # are skipped.
+
+      Parameters:
+        trace: Path to the trace
+        fst: The files being placed
+        overlay_count: Number of overlays, which take the ids before the first file
+
+      Returns:
+        Positions in files order, in the order they are first listed.
+    */
+    std::vector<uint32_t> read_trace(std::string trace, FST& fst, uint32_t overlay_count)
+    {
+      std::ifstream in(trace);
+      std::vector<uint32_t> order;
+
+      if (!in)
+      {
+        std::cout << "Could not open " << trace << ", placing files in id order" << std::endl;
+        return order;
+      }
+
+      std::unordered_map<std::string, uint32_t> paths;
+
+      fst.visit([&](const FileRef& file)
+      {
+        paths[file.path] = file.index;
+      });
+
+      std::vector<bool> seen(fst.file_count(), false);
+      uint32_t unknown = 0;
+      std::string line;
+
+      while (std::getline(in, line))
+      {
+        line.erase(line.find_last_not_of(" \t\r") + 1);
+        line.erase(0, line.find_first_not_of(" \t"));
+
+        if (line.empty() || line[0] == '#')
+        {
+          continue;
+        }
+
+        int64_t index = -1;
+
+        if (line.find_first_not_of("0123456789") == std::string::npos || (line.compare(0, 2, "0x") == 0 && line.size() > 2))
+        {
+          int64_t id = std::strtoll(line.c_str(), nullptr, 0);
+          index = (id >= overlay_count) ? id - overlay_count : -1;
+        }
+        else
+        {
+          for (auto prefix : { "./", "/", "files/" })
+          {
+            if (line.compare(0, std::strlen(prefix), prefix) == 0)
+            {
+              line.erase(0, std::strlen(prefix));
+            }
+          }
+
+          auto it = paths.find(line);
+          index = (it == paths.end()) ? -1 : it->second;
+        }
+
+        if (index < 0 || index >= static_cast<int64_t>(seen.size()))
+        {
+          unknown++;
+        }
+        else if (!seen[index])
+        {
+          seen[index] = true;
+          order.push_back(static_cast<uint32_t>(index));
+        }
+      }
+
+      if (unknown > 0)
+      {
+        std::cout << "Skipped " << unknown << " lines of " << trace << " that are not files" << std::endl;
+      }
+
+      return order;
+    }
+  }
+
+  /*
+    Summary:
+      Lays out a ROM from a directory that was previously extracted.
+
+    Parameters:
+      dir: The directory containing sys/, overlay/ and files/
+      options: Where to place files
+  */
+  BuildPlan::BuildPlan(std::string dir, const BuildOptions& options)
+  {
+    DiskTree tree(dir);
+    layout(tree, options);
+  }
+
+  /*
+    Summary:
+      Lays out a ROM from a tree with the same layout as an extracted directory.
+
+    Parameters:
+      tree: The tree containing sys/, overlay/ and files/
+      options: Where to place files
+  */
+  BuildPlan::BuildPlan(SourceTree& tree, const BuildOptions& options)
+  {
+    layout(tree, options);
+  }
+
+  void BuildPlan::layout(SourceTree& tree, const BuildOptions& options)
+  {
+    std::vector<uint8_t> headerbin = tree.read("sys/header.bin");
+    std::vector<uint8_t> oldfat = tree.read("sys/fat.bin");
+    std::vector<uint8_t> arm9_overlay = tree.read("sys/arm9_overlay.bin");
+    std::vector<uint8_t> arm7_overlay = tree.read("sys/arm7_overlay.bin");
+
+    uint32_t arm9_size = static_cast<uint32_t>(tree.size("sys/arm9.bin"));
+    uint32_t arm7_size = static_cast<uint32_t>(tree.size("sys/arm7.bin"));
+
+    Header header(headerbin);
+    uint32_t offset = 0x4000;
+
+    //  Add ARM9 bin
+    header.set_arm9_offset(offset);
+    add_file("arm9.bin", offset, arm9_size, tree, "sys/arm9.bin");
+    offset += arm9_size;
+    offset += util::pad(offset, 0x10);
+
+    //  Add ARM9 overlay
+    header.set_arm9_overlay_offset(offset);
+    offset += arm9_overlay.size();
+    add_data("arm9_overlay.bin", header.arm9_overlay_offset(), arm9_overlay);
+
+    //  Overlays keep the offsets they had in the original FAT, sorted by name so they line up with their ids
+    std::vector<TreeEntry> overlays;
+
+    for (auto& entry : tree.list("overlay"))
+    {
+      if (!entry.directory && fs::extension(entry.name) == ".bin")
+      {
+        overlays.push_back(entry);
+      }
+    }
+
+    std::sort(overlays.begin(), overlays.end(), [](const TreeEntry& a, const TreeEntry& b)
+    {
+      return a.name < b.name;
+    });
+
+    //  Store the overlay FAT entries separate so we can add them to the real FAT later
+    util::ByteWriter overlay_fat(overlays.size() * 8);
+    uint32_t overlay_count = 0;
+    uint32_t overlay_size = 0;
+
+    for (uint32_t i = 0; i < overlays.size(); i++)
+    {
+      overlay_size = std::max(overlay_size, util::read<uint32_t>(oldfat, i * 8 + 4));
+    }
+
+    //  Only place the overlays if they fit after the ARM9 overlay table
+    if (overlay_size > offset)
+    {
+      for (auto& overlay : overlays)
+      {
+        uint32_t start = util::read<uint32_t>(oldfat, overlay_count * 8);
+        uint32_t end = util::read<uint32_t>(oldfat, overlay_count * 8 + 4);
+
+        overlay_fat.write(start); //  Start address in ROM
+        overlay_fat.write(end);   //  End address in ROM
+
+        add_file(overlay.name, start, static_cast<uint32_t>(overlay.size), tree, "overlay/" + overlay.name).file_id = overlay_count;
+
+        overlay_count++;
+      }
+
+      offset = overlay_size;
+    }
+
+    //  Pad to 0x1000 since ARM7 code must be on an even 0x1000 mark
+    add_fill("arm7 padding", offset, util::pad(offset, 0x1000), 0xFF);
+    offset += util::pad(offset, 0x1000);
+
+    //  Add ARM7 bin
+    header.set_arm7_offset(offset);
+    add_file("arm7.bin", offset, arm7_size, tree, "sys/arm7.bin");
+    offset += arm7_size;
+
+    //  Add ARM7 overlay
+    if (arm7_overlay.size() > 0)
+    {
+      header.set_arm7_overlay_offset(offset);
+      add_data("arm7_overlay.bin", offset, arm7_overlay);
+      offset += arm7_overlay.size();
+    }
+
+    FST fst(tree, "files", overlay_count, options.verbose);
+    const std::vector<uint8_t>& fnt = fst.get_fnt();
+
+    //  Add FNT
+    header.set_fnt_offset(offset);
+    header.set_fnt_size(fnt.size());
+    offset += fnt.size();
+    offset += util::pad(offset, 4);
+
+    //  FAT holds the overlays followed by every file
+    uint32_t fat_size = (overlay_count + fst.file_count()) * 8;
+    uint32_t file_offset = offset + fat_size;
+
+    //  The banner goes between the FAT and the files, aligned like retail ROMs
+    std::vector<uint8_t> banner;
+
+    if (tree.is_file("sys/banner.bin"))
+    {
+      banner = tree.read("sys/banner.bin");
+    }
+
+    if (BannerView(banner.data(), banner.size()).valid())
+    {
+      uint32_t banner_offset = file_offset + util::pad(file_offset, 0x200);
+
+      banner.resize(BannerView(banner.data(), banner.size()).size());
+      update_banner_crc(banner);
+
+      header.set_icon_title_offset(banner_offset);
+      add_fill("banner padding", file_offset, banner_offset - file_offset, 0xFF);
+      file_offset = banner_offset + banner.size();
+      add_data("banner.bin", banner_offset, banner);
+    }
+    else
+    {
+      if (!banner.empty())
+      {
+        std::cout << "Skipping sys/banner.bin since its version is unknown" << std::endl;
+      }
+
+      header.set_icon_title_offset(0);
+    }
+
+    file_offset += util::pad(file_offset, 4);
+
+    //  Files read first at run time go first, so loading touches as few parts of the card as possible
+    std::vector<uint32_t> order;
+
+    if (!options.order_trace.empty())
+    {
+      order = read_trace(options.order_trace, fst, overlay_count);
+    }
+
+    fst.create_allocation_table(file_offset, options.align, order, options.hot_align ? options.hot_align : options.align);
+
+    util::ByteWriter fat(fat_size);
+    fat.write(overlay_fat.data());
+    fat.write(fst.get_fat());
+
+    add_data("fnt.bin", header.file_name_table(), fnt);
+
+    //  Add FAT
+    header.set_fat_offset(offset);
+    header.set_fat_size(fat.size());
+    add_data("fat.bin", offset, fat.release());
+    offset = file_offset;
+
+    //  Place every file in offset order, padding the space up to the next one with 0xFF
+    struct PlacedFile
+    {
+      FatRange range;
+      uint32_t id;
+      std::string path;
+    };
+
+    std::vector<PlacedFile> placed;
+    placed.reserve(fst.file_count());
+
+    fst.visit([&](const FileRef& file)
+    {
+      placed.push_back({ file.range, file.id, file.path });
+    });
+
+    std::stable_sort(placed.begin(), placed.end(), [](const PlacedFile& a, const PlacedFile& b)
+    {
+      return a.range.begin < b.range.begin || (a.range.begin == b.range.begin && a.range.end < b.range.end);
+    });
+
+    for (size_t i = 0; i < placed.size(); i++)
+    {
+      FatRange& file = placed[i].range;
+      std::string& path = placed[i].path;
+      uint32_t next = (i + 1 < placed.size()) ? placed[i + 1].range.begin : file.end + util::pad(file.end, 4);
+
+      if (options.verbose)
+      {
+        std::cout << "Adding " << path << " at offset " << std::hex << file.begin << std::dec << "\n";
+      }
+
+      add_fill(path + " alignment", offset, file.begin - offset, 0xFF);
+      add_file(path, file.begin, file.size(), tree, "files/" + path).file_id = placed[i].id;
+      add_fill(path + " padding", file.end, next - file.end, 0xFF);
+
+      offset = next;
+    }
+
+    //  Pad the rest of the ROM out to its capacity
+    m_size = offset + util::pad(offset, header.capacity());
+    add_fill("capacity padding", offset, m_size - offset, 0xFF);
+
+    //  The header is only complete once every offset is known
+    add_data("header.bin", 0, header.get_raw());
+  }
+
+  Region& BuildPlan::add_data(std::string name, uint32_t offset, std::vector<uint8_t> data)
+  {
+    m_regions.push_back(Region(name, offset, data.size()));
+    m_regions.back().data = std::move(data);
+    return m_regions.back();
+  }
+
+  Region& BuildPlan::add_file(std::string name, uint32_t offset, uint32_t size, SourceTree& tree, std::string path)
+  {
+    m_regions.push_back(Region(name, offset, size));
+    tree.source(m_regions.back(), path);
+    return m_regions.back();
+  }
+
+  Region& BuildPlan::add_fill(std::string name, uint32_t offset, uint32_t size, uint8_t value)
+  {
+    m_regions.push_back(Region(name, offset, size));
+    m_regions.back().fill = value;
+    return m_regions.back();
+  }
+
+  /*
+    Summary:
+      Writes one region of a plan to the output.
+
+    Parameters:
+      out: Output ROM, already sized to hold the region
+      region: The region to write
+      zeroed: Whether the output is known to be zero under the region, so zero fills can be skipped
+
+    Returns:
+      True if the region was written.
+  */
+  bool write_region(util::File& out, const Region& region, bool zeroed)
+  {
+    if (region.size == 0)
+    {
+      return true;
+    }
+
+    if (!region.source.empty())
+    {
+      //  Copied inside the kernel where possible, so ranges of a base ROM or archive never pass through memory
+      util::File in;
+
+      if (!in.open(region.source) || !out.copy_from(in, region.source_offset, region.size, region.offset))
+      {
+        std::cout << "Could not read " << region.source << std::endl;
+        return false;
+      }
+
+      return true;
+    }
+
+    if (!region.data.empty())
+    {
+      return out.write_at(&region.data[0], region.data.size(), region.offset);
+    }
+
+    //  Zero fills are already covered by the allocation
+    return (region.fill == 0 && zeroed) || out.fill_at(region.fill, region.size, region.offset);
+  }
+
+  /*
+    Summary:
+      Writes out a planned ROM. The output is allocated once at its final
+      size and every region is then filled independently across threads.
+
+    Parameters:
+      plan: The layout to write
+      disc: Output file path
+      threads: Number of threads to use, or 0 for one per hardware thread
+
+    Returns:
+      True if every region was written.
+  */
+  bool execute_plan(BuildPlan& plan, std::string disc, uint32_t threads)
+  {
+    util::File out;
+
+    if (!out.create(disc) || !out.allocate(plan.size()))
+    {
+      std::cout << "Could not create " << disc << std::endl;
+      return false;
+    }
+
+    auto& regions = plan.regions();
+    std::atomic<bool> ok(true);
+
+    util::parallel_for(regions.size(), [&](size_t i)
+    {
+      if (!write_region(out, regions[i]))
+      {
+        ok = false;
+      }
+    }, threads);
+
+    return ok;
+  }
+}
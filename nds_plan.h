@@ -0,0 +1,82 @@
+#ifndef _MD_NDS_PLAN_H
+#define _MD_NDS_PLAN_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "nds_header.h"
+#include "nds_fst.h"
+#include "nds_tree.h"
+#include "util_io.h"
+
+namespace nds
+{
+  /*
+    A contiguous range of the output ROM and where its bytes come from.
+    A region is copied from a file on disk if it has a source, otherwise from
+    its in-memory data, otherwise it is filled with a single byte value.
+  */
+  struct Region
+  {
+    Region(std::string name, uint32_t offset, uint32_t size)
+      : name(name), offset(offset), size(size), source_offset(0), fill(0), file_id(-1) {};
+
+    std::string name;
+    uint32_t offset;
+    uint32_t size;
+
+    std::string source;
+    uint64_t source_offset;   //  Where the bytes start in source, which may be an archive
+    std::vector<uint8_t> data;
+    uint8_t fill;
+    int32_t file_id;          //  FAT entry holding the range of an overlay or file, otherwise -1
+  };
+
+  //  Choices about where build places files
+  struct BuildOptions
+  {
+    std::string order_trace;    //  File listing FAT ids or paths in the order they are first read
+    uint32_t align = 4;         //  Alignment of each file
+    uint32_t hot_align = 0;     //  Alignment of the files in the trace, 0 for the same as align
+    bool verbose = true;        //  Print every file as it is placed
+  };
+
+  /*
+    The complete layout of a ROM to be built from an extracted directory,
+    or from any other tree laid out the same way.
+    Every section, overlay and file has its final offset before a single
+    byte of output is written, so the regions can be filled in any order.
+  */
+  class BuildPlan
+  {
+  public:
+    BuildPlan(std::string dir, const BuildOptions& options = BuildOptions());
+    BuildPlan(SourceTree& tree, const BuildOptions& options = BuildOptions());
+
+    inline std::vector<Region>& regions()
+    {
+      return m_regions;
+    }
+
+    inline uint32_t size()
+    {
+      return m_size;
+    }
+
+  private:
+    std::vector<Region> m_regions;
+    uint32_t m_size;
+
+    Region& add_data(std::string name, uint32_t offset, std::vector<uint8_t> data);
+    void layout(SourceTree& tree, const BuildOptions& options);
+
+    Region& add_file(std::string name, uint32_t offset, uint32_t size, SourceTree& tree, std::string path);
+    Region& add_fill(std::string name, uint32_t offset, uint32_t size, uint8_t value);
+  };
+
+  bool write_region(util::File& out, const Region& region, bool zeroed = true);
+  bool execute_plan(BuildPlan& plan, std::string disc, uint32_t threads = 0);
+}
+
+#endif
@@ -0,0 +1,219 @@
+#include "nds_record.h"
+#include "nds_banner.h"
+#include "nds_image.h"
+
+#include <iostream>
+#include <sstream>
+
+namespace nds
+{
+  constexpr FieldInfo HeaderSchema::Fields[];
+  constexpr FieldInfo OverlaySchema::Fields[];
+  constexpr FieldInfo BannerSchema::Fields[];
+
+  namespace
+  {
+    uint64_t load_number(const uint8_t* data, uint32_t width)
+    {
+      switch (width)
+      {
+      case 1:
+        return data[0];
+      case 2:
+        return util::load<uint16_t>(data);
+      case 4:
+        return util::load<uint32_t>(data);
+      default:
+        return util::load<uint64_t>(data);
+      }
+    }
+
+    std::string hex(uint64_t value)
+    {
+      std::ostringstream out;
+      out << "0x" << std::hex << value;
+      return out.str();
+    }
+  }
+
+  /*
+    Summary:
+      Formats a record as a JSON object with a member per field, named as in
+      the schema. Text is trimmed at the first zero and bytes are shown as hex.
+  */
+  std::string record_json(const FieldInfo* fields, uint32_t count, const uint8_t* record)
+  {
+    std::ostringstream out;
+    out << "{";
+
+    for (uint32_t i = 0; i < count; i++)
+    {
+      const FieldInfo& field = fields[i];
+      const uint8_t* data = record + field.offset;
+
+      out << (i > 0 ? "," : "") << "\"" << field.name << "\":";
+
+      switch (field.kind)
+      {
+      case FieldKind::Text:
+      {
+        std::string text(reinterpret_cast<const char*>(data), field.width);
+        out << util::json_string(text.substr(0, text.find('\0')));
+        break;
+      }
+      case FieldKind::Utf16:
+        out << util::json_string(util::utf16_to_utf8(data, field.width / 2));
+        break;
+      case FieldKind::Bytes:
+      {
+        std::string bytes;
+
+        for (uint32_t j = 0; j < field.width; j++)
+        {
+          bytes += util::to_hex<uint8_t>(data[j]);
+        }
+
+        out << "\"" << bytes << "\"";
+        break;
+      }
+      default:
+        out << load_number(data, field.width);
+        break;
+      }
+    }
+
+    out << "}";
+    return out.str();
+  }
+
+  std::vector<std::string> record_problems(const FieldInfo* fields, uint32_t count, const uint8_t* record, uint64_t image_size)
+  {
+    std::vector<std::string> problems;
+
+    for (uint32_t i = 0; i < count; i++)
+    {
+      const FieldInfo& field = fields[i];
+      const uint8_t* data = record + field.offset;
+
+      if (field.kind == FieldKind::Offset)
+      {
+        uint64_t offset = load_number(data, field.width);
+        uint64_t size = (field.extent >= 0) ? load_number(record + fields[field.extent].offset, fields[field.extent].width) : 0;
+
+        //  Unused sections are left as zero
+        if ((offset != 0 || size != 0) && (offset >= image_size || size > image_size - offset))
+        {
+          problems.push_back(std::string(field.name) + " " + hex(offset) + (size ? " + " + hex(size) : "")
+            + " is past the end of the image at " + hex(image_size));
+        }
+      }
+      else if (field.kind == FieldKind::Text)
+      {
+        uint32_t end = 0;
+
+        while (end < field.width && data[end] >= 0x20 && data[end] < 0x7F)
+        {
+          end++;
+        }
+
+        for (uint32_t j = end; j < field.width; j++)
+        {
+          if (data[j] != 0)
+          {
+            problems.push_back(std::string(field.name) + " holds a byte that isn't printable ASCII or padding at " + hex(field.offset + j));
+            break;
+          }
+        }
+      }
+    }
+
+    return problems;
+  }
+
+  /*
+    Summary:
+      Prints the header, banner and both overlay tables of a ROM as one
+      JSON object, along with anything in them that doesn't check out.
+
+    Parameters:
+      disc: Path to the ROM
+
+    Returns:
+      True if the ROM could be read, whether or not it has problems.
+  */
+  bool dump(std::string disc)
+  {
+    RomImage rom(disc);
+
+    if (!rom.valid())
+    {
+      std::cout << "Could not read a header from " << disc << std::endl;
+      return false;
+    }
+
+    HeaderView header = rom.header();
+    std::vector<std::string> problems;
+    std::ostringstream out;
+
+    for (auto& problem : validate<HeaderSchema>(header.bytes(), rom.size()))
+    {
+      problems.push_back("header." + problem);
+    }
+
+    if (!header.header_checksum_valid())
+    {
+      problems.push_back("header.header_checksum does not match the header");
+    }
+
+    if (!header.logo_checksum_valid())
+    {
+      problems.push_back("header.logo_checksum does not match the logo");
+    }
+
+    out << "{\"path\":" << util::json_string(disc) << ",\"header\":" << to_json<HeaderSchema>(header.bytes());
+
+    BannerView banner = rom_banner(rom);
+    out << ",\"banner\":" << (banner.valid() ? to_json<BannerSchema>(banner.bytes()) : "null");
+
+    uint32_t fat_entries = header.file_alloc_size() / 8;
+    const char* names[] = { "arm9_overlays", "arm7_overlays" };
+    uint32_t offsets[] = { header.arm9_overlay_offset(), header.arm7_overlay_offset() };
+    uint32_t sizes[] = { header.arm9_overlay_size(), header.arm7_overlay_size() };
+
+    for (int table = 0; table < 2; table++)
+    {
+      uint32_t size = sizes[table];
+      const uint8_t* data = rom.span(offsets[table], size);
+
+      out << ",\"" << names[table] << "\":[";
+
+      for (uint32_t i = 0; (i + 1) * OverlaySchema::Size <= size; i++)
+      {
+        const uint8_t* entry = data + i * OverlaySchema::Size;
+        Record<OverlaySchema> overlay = decode<OverlaySchema>(entry);
+
+        if (overlay[OverlaySchema::FileId] >= fat_entries)
+        {
+          problems.push_back(std::string(names[table]) + "[" + std::to_string(i) + "].file_id " + std::to_string(overlay[OverlaySchema::FileId])
+            + " is past the end of the FAT");
+        }
+
+        out << (i > 0 ? "," : "") << to_json<OverlaySchema>(entry);
+      }
+
+      out << "]";
+    }
+
+    out << ",\"problems\":[";
+
+    for (size_t i = 0; i < problems.size(); i++)
+    {
+      out << (i > 0 ? "," : "") << util::json_string(problems[i]);
+    }
+
+    out << "]}";
+    std::cout << out.str() << std::endl;
+
+    return true;
+  }
+}
@@ -0,0 +1,304 @@
+#ifndef _MD_NDS_RECORD_H
+#define _MD_NDS_RECORD_H
+
+#include <array>
+#include <cstdint>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "util.h"
+
+namespace nds
+{
+  //  How a field of a record is read, shown and checked
+  enum class FieldKind
+  {
+    Number,   //  Little endian unsigned integer
+    Offset,   //  Number that points into the ROM, checked against the ROM size
+    Size,     //  Number of bytes at an offset
+    Text,     //  ASCII padded with zeros
+    Utf16,    //  UTF-16 padded with zeros
+    Bytes     //  Anything else, shown as hex
+  };
+
+  //  One field of a fixed size little endian record
+  struct FieldInfo
+  {
+    const char* name;
+    uint32_t offset;
+    uint32_t width;
+    FieldKind kind;
+    int32_t extent;   //  For an offset, the index of the field holding its size, otherwise -1
+  };
+
+  constexpr bool is_number(const FieldInfo& field)
+  {
+    return field.kind == FieldKind::Number || field.kind == FieldKind::Offset || field.kind == FieldKind::Size;
+  }
+
+  /*
+    Summary:
+      Checks at compile time that a schema's fields are in offset order,
+      don't overlap, fit in the record and that numbers have a width that
+      can be loaded.
+  */
+  template<typename S> constexpr bool valid_schema()
+  {
+    for (uint32_t i = 0; i < S::Count; i++)
+    {
+      const FieldInfo& field = S::Fields[i];
+
+      if (field.offset + field.width > S::Size || (i > 0 && field.offset < S::Fields[i - 1].offset + S::Fields[i - 1].width))
+      {
+        return false;
+      }
+
+      if (is_number(field) && field.width != 1 && field.width != 2 && field.width != 4 && field.width != 8)
+      {
+        return false;
+      }
+
+      if (field.extent >= 0 && (field.kind != FieldKind::Offset || field.extent >= static_cast<int32_t>(S::Count)
+        || S::Fields[field.extent].kind != FieldKind::Size))
+      {
+        return false;
+      }
+    }
+
+    return true;
+  }
+
+  template<typename S> constexpr uint32_t offset_of(typename S::Field field)
+  {
+    return S::Fields[field].offset;
+  }
+
+  template<typename S> constexpr uint32_t width_of(typename S::Field field)
+  {
+    return S::Fields[field].width;
+  }
+
+  //  Integer type of a number field by its width, which text and byte fields don't have
+  template<uint32_t Width> struct FieldType {};
+  template<> struct FieldType<1> { typedef uint8_t type; };
+  template<> struct FieldType<2> { typedef uint16_t type; };
+  template<> struct FieldType<4> { typedef uint32_t type; };
+  template<> struct FieldType<8> { typedef uint64_t type; };
+
+  /*
+    Summary:
+      Reads one number field. The offset and width come from the schema at
+      compile time, so this is the same single unaligned load as writing
+      util::load by hand.
+  */
+  template<typename S, typename S::Field F> inline typename FieldType<S::Fields[F].width>::type get(const uint8_t* record)
+  {
+    static_assert(is_number(S::Fields[F]), "Only number fields can be read as integers");
+    return util::load<typename FieldType<S::Fields[F].width>::type>(record + S::Fields[F].offset);
+  }
+
+  template<typename S, typename S::Field F> inline void set(uint8_t* record, typename FieldType<S::Fields[F].width>::type value)
+  {
+    static_assert(is_number(S::Fields[F]), "Only number fields can be written as integers");
+    util::store<typename FieldType<S::Fields[F].width>::type>(record + S::Fields[F].offset, value);
+  }
+
+  //  Reads a text field whole, padding included
+  template<typename S, typename S::Field F> inline std::string text(const uint8_t* record)
+  {
+    static_assert(S::Fields[F].kind == FieldKind::Text, "Only text fields can be read as strings");
+    return std::string(reinterpret_cast<const char*>(record + S::Fields[F].offset), S::Fields[F].width);
+  }
+
+  //  Every number field of a record, decoded at once and indexed by field. Other fields are 0.
+  template<typename S> struct Record
+  {
+    std::array<uint64_t, S::Count> values;
+
+    inline uint64_t operator[](typename S::Field field) const
+    {
+      return values[field];
+    }
+  };
+
+  namespace detail
+  {
+    template<typename S, size_t I> inline uint64_t decode_field(const uint8_t* record, std::true_type)
+    {
+      return util::load<typename FieldType<S::Fields[I].width>::type>(record + S::Fields[I].offset);
+    }
+
+    template<typename S, size_t I> inline uint64_t decode_field(const uint8_t*, std::false_type)
+    {
+      return 0;
+    }
+
+    template<typename S, size_t... I> inline void decode_fields(const uint8_t* record, Record<S>& out, std::index_sequence<I...>)
+    {
+      int expand[] = { 0, (out.values[I] = decode_field<S, I>(record, std::integral_constant<bool, is_number(S::Fields[I])>()), 0)... };
+      (void)expand;
+    }
+  }
+
+  /*
+    Summary:
+      Decodes every number field of a record in one pass. The loads are
+      expanded at compile time, one per field, with no loop over the schema.
+  */
+  template<typename S> inline Record<S> decode(const uint8_t* record)
+  {
+    Record<S> out;
+    detail::decode_fields<S>(record, out, std::make_index_sequence<S::Count>());
+    return out;
+  }
+
+  std::string record_json(const FieldInfo* fields, uint32_t count, const uint8_t* record);
+  std::vector<std::string> record_problems(const FieldInfo* fields, uint32_t count, const uint8_t* record, uint64_t image_size);
+
+  //  Formats every field of a record as a JSON object
+  template<typename S> inline std::string to_json(const uint8_t* record)
+  {
+    return record_json(S::Fields, S::Count, record);
+  }
+
+  /*
+    Summary:
+      Checks the values of a record: offsets and the ranges they start
+      must lie inside an image of the given size, and text must be
+      printable ASCII followed only by padding.
+
+    Returns:
+      A message for every field that fails, or nothing if the record is valid.
+  */
+  template<typename S> inline std::vector<std::string> validate(const uint8_t* record, uint64_t image_size)
+  {
+    return record_problems(S::Fields, S::Count, record, image_size);
+  }
+
+  //  The 0x200 byte ROM header
+  struct HeaderSchema
+  {
+    static const uint32_t Size = 0x200;
+
+    enum Field
+    {
+      Title, GameCode, MakerCode, UnitCode, EncryptionSeed, Capacity, Version, AutoStart,
+      ARM9Rom, ARM9Entry, ARM9RAM, ARM9Size, ARM7Rom, ARM7Entry, ARM7RAM, ARM7Size,
+      FileTableOffset, FileTableSize, FileAllocationOffset, FileAllocationSize,
+      ARM9Overlay, ARM9OverlaySize, ARM7Overlay, ARM7OverlaySize,
+      CommandPortNormal, CommandPortKey1, IconTitle, SecureChecksum, SecureLoadingTimeout,
+      ARM9AutoLoadRAM, ARM7AutoLoadRAM, SecureAreaDisable, SizeUsed, HeaderSize,
+      Logo, LogoChecksum, HeaderChecksum, DebugRomOffset, DebugSize, DebugRAMAddress,
+      Count
+    };
+
+    static constexpr FieldInfo Fields[Count] =
+    {
+      { "title", 0x00, 12, FieldKind::Text, -1 },
+      { "game_code", 0x0C, 4, FieldKind::Text, -1 },
+      { "maker_code", 0x10, 2, FieldKind::Text, -1 },
+      { "unit_code", 0x12, 1, FieldKind::Number, -1 },
+      { "encryption_seed", 0x13, 1, FieldKind::Number, -1 },
+      { "capacity", 0x14, 1, FieldKind::Number, -1 },
+      { "version", 0x1E, 1, FieldKind::Number, -1 },
+      { "autostart", 0x1F, 1, FieldKind::Number, -1 },
+      { "arm9_rom_offset", 0x20, 4, FieldKind::Offset, ARM9Size },
+      { "arm9_entry_address", 0x24, 4, FieldKind::Number, -1 },
+      { "arm9_ram_address", 0x28, 4, FieldKind::Number, -1 },
+      { "arm9_size", 0x2C, 4, FieldKind::Size, -1 },
+      { "arm7_rom_offset", 0x30, 4, FieldKind::Offset, ARM7Size },
+      { "arm7_entry_address", 0x34, 4, FieldKind::Number, -1 },
+      { "arm7_ram_address", 0x38, 4, FieldKind::Number, -1 },
+      { "arm7_size", 0x3C, 4, FieldKind::Size, -1 },
+      { "fnt_offset", 0x40, 4, FieldKind::Offset, FileTableSize },
+      { "fnt_size", 0x44, 4, FieldKind::Size, -1 },
+      { "fat_offset", 0x48, 4, FieldKind::Offset, FileAllocationSize },
+      { "fat_size", 0x4C, 4, FieldKind::Size, -1 },
+      { "arm9_overlay_offset", 0x50, 4, FieldKind::Offset, ARM9OverlaySize },
+      { "arm9_overlay_size", 0x54, 4, FieldKind::Size, -1 },
+      { "arm7_overlay_offset", 0x58, 4, FieldKind::Offset, ARM7OverlaySize },
+      { "arm7_overlay_size", 0x5C, 4, FieldKind::Size, -1 },
+      { "command_port_normal", 0x60, 4, FieldKind::Number, -1 },
+      { "command_port_key1", 0x64, 4, FieldKind::Number, -1 },
+      { "icon_title_offset", 0x68, 4, FieldKind::Offset, -1 },
+      { "secure_checksum", 0x6C, 2, FieldKind::Number, -1 },
+      { "secure_loading_timeout", 0x6E, 2, FieldKind::Number, -1 },
+      { "arm9_auto_load", 0x70, 4, FieldKind::Number, -1 },
+      { "arm7_auto_load", 0x74, 4, FieldKind::Number, -1 },
+      { "secure_area_disable", 0x78, 8, FieldKind::Number, -1 },
+      { "size_used", 0x80, 4, FieldKind::Number, -1 },
+      { "header_size", 0x84, 4, FieldKind::Number, -1 },
+      { "logo", 0xC0, 0x9C, FieldKind::Bytes, -1 },
+      { "logo_checksum", 0x15C, 2, FieldKind::Number, -1 },
+      { "header_checksum", 0x15E, 2, FieldKind::Number, -1 },
+      { "debug_rom_offset", 0x160, 4, FieldKind::Offset, DebugSize },
+      { "debug_size", 0x164, 4, FieldKind::Size, -1 },
+      { "debug_ram_address", 0x168, 4, FieldKind::Number, -1 },
+    };
+  };
+
+  //  One 32 byte entry of the ARM9 or ARM7 overlay table
+  struct OverlaySchema
+  {
+    static const uint32_t Size = 0x20;
+
+    enum Field
+    {
+      Id, RamAddress, RamSize, BssSize, StaticInitStart, StaticInitEnd, FileId, Flags,
+      Count
+    };
+
+    static constexpr FieldInfo Fields[Count] =
+    {
+      { "id", 0x00, 4, FieldKind::Number, -1 },
+      { "ram_address", 0x04, 4, FieldKind::Number, -1 },
+      { "ram_size", 0x08, 4, FieldKind::Number, -1 },
+      { "bss_size", 0x0C, 4, FieldKind::Number, -1 },
+      { "static_init_start", 0x10, 4, FieldKind::Number, -1 },
+      { "static_init_end", 0x14, 4, FieldKind::Number, -1 },
+      { "file_id", 0x18, 4, FieldKind::Number, -1 },
+      { "flags", 0x1C, 4, FieldKind::Number, -1 },
+    };
+  };
+
+  //  The part of the banner every version shares, up to the end of the original six titles
+  struct BannerSchema
+  {
+    static const uint32_t Size = 0x840;
+
+    enum Field
+    {
+      Version, CrcOriginal, CrcChinese, CrcKorean, CrcAnimated, Reserved, Icon, Palette,
+      Japanese, English, French, German, Italian, Spanish,
+      Count
+    };
+
+    static constexpr FieldInfo Fields[Count] =
+    {
+      { "version", 0x00, 2, FieldKind::Number, -1 },
+      { "crc_original", 0x02, 2, FieldKind::Number, -1 },
+      { "crc_chinese", 0x04, 2, FieldKind::Number, -1 },
+      { "crc_korean", 0x06, 2, FieldKind::Number, -1 },
+      { "crc_animated", 0x08, 2, FieldKind::Number, -1 },
+      { "reserved", 0x0A, 0x16, FieldKind::Bytes, -1 },
+      { "icon", 0x20, 0x200, FieldKind::Bytes, -1 },
+      { "palette", 0x220, 0x20, FieldKind::Bytes, -1 },
+      { "title_japanese", 0x240, 0x100, FieldKind::Utf16, -1 },
+      { "title_english", 0x340, 0x100, FieldKind::Utf16, -1 },
+      { "title_french", 0x440, 0x100, FieldKind::Utf16, -1 },
+      { "title_german", 0x540, 0x100, FieldKind::Utf16, -1 },
+      { "title_italian", 0x640, 0x100, FieldKind::Utf16, -1 },
+      { "title_spanish", 0x740, 0x100, FieldKind::Utf16, -1 },
+    };
+  };
+
+  static_assert(valid_schema<HeaderSchema>(), "Header fields overlap or don't fit");
+  static_assert(valid_schema<OverlaySchema>(), "Overlay table fields overlap or don't fit");
+  static_assert(valid_schema<BannerSchema>(), "Banner fields overlap or don't fit");
+
+  bool dump(std::string disc);
+}
+
+#endif
@@ -0,0 +1,354 @@
+#include "nds_secure.h"
+#include "nds_header.h"
+#include "nds_image.h"
+#include "nds_merkle.h"
+#include "util.h"
+#include "util_io.h"
+
+#include <boost/filesystem.hpp>
+#include <chrono>
+#include <cstring>
+
+namespace fs = boost::filesystem;
+
+namespace nds
+{
+  namespace
+  {
+    //  What a decrypted secure area starts with, and what its first block holds before encryption
+    const uint32_t Decrypted = 0xE7FFDEFF;
+    const char* Magic = "encryObj";
+
+    inline uint32_t bswap(uint32_t value)
+    {
+      return (value >> 24) | ((value >> 8) & 0xFF00) | ((value << 8) & 0xFF0000) | (value << 24);
+    }
+
+    inline bool decrypted(const uint8_t* area)
+    {
+      return util::load<uint32_t>(area) == Decrypted && util::load<uint32_t>(area + 4) == Decrypted;
+    }
+  }
+
+  /*
+    Summary:
+      Loads the key table from a file holding only the table, or from a
+      dump of the ARM7 BIOS, which holds it at 0x30.
+
+    Returns:
+      True if the file was one of those sizes.
+  */
+  bool Key1::load(std::string path)
+  {
+    std::vector<uint8_t> data = util::read_file(path);
+    uint32_t offset = (data.size() == BiosSize) ? BiosOffset : 0;
+
+    if (data.size() != TableSize && data.size() != BiosSize)
+    {
+      std::cout << path << " is neither a KEY1 table of " << TableSize << " bytes nor an ARM7 BIOS of " << BiosSize << " bytes" << std::endl;
+      return false;
+    }
+
+    for (uint32_t i = 0; i < m_table.size(); i++)
+    {
+      m_table[i] = util::load<uint32_t>(&data[offset + i * 4]);
+    }
+
+    m_key = m_table;
+    return true;
+  }
+
+  void Key1::init(uint32_t code, uint32_t level, uint32_t modulo)
+  {
+    m_key = m_table;
+    m_code = { code, code >> 1, code << 1 };
+
+    if (level >= 1)
+    {
+      apply(modulo);
+    }
+
+    if (level >= 2)
+    {
+      apply(modulo);
+    }
+
+    m_code[1] <<= 1;
+    m_code[2] >>= 1;
+
+    if (level >= 3)
+    {
+      apply(modulo);
+    }
+  }
+
+  //  Runs the 16 rounds on a block held as its two words, low word first
+  void Key1::encrypt(uint32_t& y, uint32_t& x) const
+  {
+    for (uint32_t i = 0; i < 16; i++)
+    {
+      uint32_t z = m_key[i] ^ x;
+      x = round(z) ^ y;
+      y = z;
+    }
+
+    uint32_t low = x ^ m_key[16];
+    x = y ^ m_key[17];
+    y = low;
+  }
+
+  void Key1::encrypt(uint8_t* block) const
+  {
+    uint32_t y = util::load<uint32_t>(block);
+    uint32_t x = util::load<uint32_t>(block + 4);
+
+    encrypt(y, x);
+    util::store<uint32_t>(block, y);
+    util::store<uint32_t>(block + 4, x);
+  }
+
+  void Key1::decrypt(uint8_t* block) const
+  {
+    uint32_t y = util::load<uint32_t>(block);
+    uint32_t x = util::load<uint32_t>(block + 4);
+
+    for (uint32_t i = 17; i >= 2; i--)
+    {
+      uint32_t z = m_key[i] ^ x;
+      x = round(z) ^ y;
+      y = z;
+    }
+
+    util::store<uint32_t>(block, x ^ m_key[1]);
+    util::store<uint32_t>(block + 4, y ^ m_key[0]);
+  }
+
+  //  Encrypts the key code with the current key, mixes it into the subkeys, then rebuilds every subkey and S-box entry
+  void Key1::apply(uint32_t modulo)
+  {
+    encrypt(m_code[1], m_code[2]);
+    encrypt(m_code[0], m_code[1]);
+
+    for (uint32_t i = 0; i < 18; i++)
+    {
+      m_key[i] ^= bswap(m_code[(i * 4 % modulo) / 4]);
+    }
+
+    uint32_t y = 0;
+    uint32_t x = 0;
+
+    for (uint32_t i = 0; i < m_key.size(); i += 2)
+    {
+      encrypt(y, x);
+      m_key[i] = x;
+      m_key[i + 1] = y;
+    }
+  }
+
+  /*
+    Summary:
+      Decrypts a secure area in place. Its first block is encrypted twice,
+      once more with the key at level 2, and holds a known value once
+      decrypted, which is then replaced with the one decrypted dumps hold.
+
+    Parameters:
+      key: Key with the table loaded, keyed again here
+      code: Game code from the header
+      area: The first SecureAreaSize bytes of the ARM9 binary
+
+    Returns:
+      True if the first block decrypted to the known value. The area is
+      garbage otherwise, since the key table or game code was wrong.
+  */
+  bool secure_decrypt(Key1& key, uint32_t code, uint8_t* area)
+  {
+    key.init(code, 2, 8);
+    key.decrypt(area);
+    key.init(code, 3, 8);
+
+    for (uint32_t i = 0; i < SecureAreaSize; i += 8)
+    {
+      key.decrypt(area + i);
+    }
+
+    if (memcmp(area, Magic, 8) != 0)
+    {
+      return false;
+    }
+
+    util::store<uint32_t>(area, Decrypted);
+    util::store<uint32_t>(area + 4, Decrypted);
+    return true;
+  }
+
+  //  Encrypts a decrypted secure area in place, undoing secure_decrypt
+  void secure_encrypt(Key1& key, uint32_t code, uint8_t* area)
+  {
+    memcpy(area, Magic, 8);
+    key.init(code, 3, 8);
+
+    for (uint32_t i = 0; i < SecureAreaSize; i += 8)
+    {
+      key.encrypt(area + i);
+    }
+
+    key.init(code, 2, 8);
+    key.encrypt(area);
+  }
+
+  namespace
+  {
+    /*
+      Summary:
+        Decrypts or encrypts the secure area of one ROM in place. The secure
+        area CRC in the header covers 0x4000 to 0x8000 as stored on the
+        card, encrypted, so it is recomputed when encrypting and left alone
+        when decrypting, where it still describes what encrypting restores.
+
+      Returns:
+        What happened to the ROM, and whether it worked in ok.
+    */
+    std::string secure_rom(const std::string& disc, const Key1& table, bool encrypt, bool& ok)
+    {
+      util::File file;
+      std::vector<uint8_t> data(SecureAreaOffset * 2);
+      Key1 key = table;
+
+      ok = false;
+
+      size_t read = file.modify(disc) ? file.read_at(data.data(), data.size(), 0) : 0;
+
+      if (read < Header::Size)
+      {
+        return "Could not read " + disc;
+      }
+
+      HeaderView view(data.data(), Header::Size);
+      uint8_t* area = &data[SecureAreaOffset];
+      uint32_t code = util::load<uint32_t>(data.data() + offset_of<HeaderSchema>(HeaderSchema::GameCode));
+
+      if (data[0] == 0x1F && data[1] == 0x8B)
+      {
+        return disc + " is compressed, decompress it first";
+      }
+
+      if (view.arm9_rom_offset() != SecureAreaOffset || view.arm9_size() < SecureAreaSize || read != data.size())
+      {
+        return disc + " has no secure area";
+      }
+
+      //  An area already in the requested state is left as it is, but only counted as encrypted if it decrypts
+      std::vector<uint8_t> copy(area, area + SecureAreaSize);
+
+      if (decrypted(area) && encrypt)
+      {
+        secure_encrypt(key, code, area);
+      }
+      else if (decrypted(area))
+      {
+        ok = true;
+        return disc + " is already decrypted";
+      }
+      else if (!secure_decrypt(key, code, copy.data()))
+      {
+        return disc + " does not decrypt with this key table";
+      }
+      else if (encrypt)
+      {
+        ok = true;
+        return disc + " is already encrypted";
+      }
+      else
+      {
+        std::copy(copy.begin(), copy.end(), area);
+      }
+
+      Header header(view);
+
+      if (encrypt)
+      {
+        header.set_secure_checksum(util::crc16(area, SecureAreaOffset));
+        header.update_checksum();
+      }
+
+      if (!file.write_at(area, SecureAreaSize, SecureAreaOffset) || !file.write_at(header.bytes(), Header::Size, 0))
+      {
+        return "Could not write " + disc;
+      }
+
+      file.close();
+      merkle_update(disc, { ByteRange(0, Header::Size), ByteRange(SecureAreaOffset, SecureAreaSize) });
+
+      ok = true;
+      return (encrypt ? "Encrypted " : "Decrypted ") + disc;
+    }
+  }
+
+  /*
+    Summary:
+      Decrypts or encrypts the ARM9 secure area of many ROMs in place, one
+      line per ROM in the order they were given. Compressed ROMs can't be
+      changed in place, so those found in a directory are skipped. The table is loaded once
+      and copied for each ROM, so a library is spread across threads.
+
+    Parameters:
+      inputs: ROMs, directories or file lists, see find_roms
+      key: KEY1 table or ARM7 BIOS dump, see Key1::load
+      encrypt: Encrypt rather than decrypt
+      threads: Number of threads to use, or 0 for one per hardware thread
+
+    Returns:
+      True if every ROM that wasn't skipped ended up in the requested state.
+  */
+  bool secure_area(std::vector<std::string> inputs, std::string key, bool encrypt, uint32_t threads)
+  {
+    Key1 table;
+
+    if (!table.load(key))
+    {
+      return false;
+    }
+
+    //  Compressed ROMs found in a directory are skipped, while one named on its own is an error
+    std::vector<std::string> roms;
+    std::vector<uint8_t> skip;
+
+    for (auto& input : inputs)
+    {
+      bool walked = fs::is_directory(input);
+
+      for (auto& rom : find_roms({ input }))
+      {
+        roms.push_back(rom);
+        skip.push_back(walked && fs::path(rom).extension() == ".gz");
+      }
+    }
+
+    std::vector<std::string> results(roms.size());
+    std::vector<uint8_t> oks(roms.size());
+    auto start = std::chrono::steady_clock::now();
+
+    util::parallel_for(roms.size(), [&](size_t i)
+    {
+      bool ok = true;
+      results[i] = skip[i] ? "Skipped " + roms[i] + ", it is compressed" : secure_rom(roms[i], table, encrypt, ok);
+      oks[i] = ok;
+    }, threads);
+
+    auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+    uint32_t done = 0;
+    uint32_t skipped = 0;
+
+    for (size_t i = 0; i < roms.size(); i++)
+    {
+      std::cout << results[i] << "\n";
+      done += oks[i] && !skip[i];
+      skipped += skip[i];
+    }
+
+    std::cerr << (encrypt ? "Encrypted " : "Decrypted ") << done << " of " << (roms.size() - skipped) << " ROMs in " << ms << " ms, skipped "
+      << skipped << " compressed" << std::endl;
+
+    return done + skipped == roms.size();
+  }
+}
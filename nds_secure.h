@@ -0,0 +1,66 @@
+#ifndef _MD_NDS_SECURE_H
+#define _MD_NDS_SECURE_H
+
+#include <array>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace nds
+{
+  /*
+    KEY1, the Blowfish variant DS cards use for the ARM9 secure area. The
+    key table isn't bundled: it is loaded from a dump of the ARM7 BIOS or
+    of the table alone, then keyed on the game code of each ROM. A Key1 is
+    cheap to copy, so one table can be loaded once and copied per ROM.
+  */
+  class Key1
+  {
+  public:
+    static const uint32_t TableSize = 0x1048;   //  18 subkeys and four 256 entry S-boxes
+    static const uint32_t BiosOffset = 0x30;    //  Where the table sits in the ARM7 BIOS
+    static const uint32_t BiosSize = 0x4000;
+
+    bool load(std::string path);
+
+    /*
+      Summary:
+        Resets the key to the loaded table and mixes the game code into it
+        as many times as the level says.
+
+      Parameters:
+        code: Game code from the header, read as a little endian word
+        level: 1 to 3, the secure area uses 2 for its first block and 3 for the rest
+        modulo: Bytes of the key code mixed in per subkey, 8 for the secure area
+    */
+    void init(uint32_t code, uint32_t level, uint32_t modulo);
+
+    //  Encrypts or decrypts 8 bytes in place, two little endian words
+    void encrypt(uint8_t* block) const;
+    void decrypt(uint8_t* block) const;
+
+  private:
+    std::array<uint32_t, TableSize / 4> m_table;  //  As loaded
+    std::array<uint32_t, TableSize / 4> m_key;    //  Subkeys then S-boxes, as keyed by init
+    std::array<uint32_t, 3> m_code;
+
+    inline uint32_t round(uint32_t z) const
+    {
+      const uint32_t* s = m_key.data() + 18;
+      return (((s[z >> 24] + s[0x100 + ((z >> 16) & 0xFF)]) ^ s[0x200 + ((z >> 8) & 0xFF)]) + s[0x300 + (z & 0xFF)]);
+    }
+
+    void encrypt(uint32_t& y, uint32_t& x) const;
+    void apply(uint32_t modulo);
+  };
+
+  //  Size of the encrypted start of the ARM9 binary, and where it is in a ROM
+  const uint32_t SecureAreaSize = 0x800;
+  const uint32_t SecureAreaOffset = 0x4000;
+
+  bool secure_decrypt(Key1& key, uint32_t code, uint8_t* area);
+  void secure_encrypt(Key1& key, uint32_t code, uint8_t* area);
+  bool secure_area(std::vector<std::string> inputs, std::string key, bool encrypt, uint32_t threads = 0);
+}
+
+#endif
@@ -0,0 +1,323 @@
+#include "nds_store.h"
+#include "nds_extract.h"
+#include "util.h"
+#include "util_io.h"
+
+#include <boost/filesystem.hpp>
+#include <chrono>
+#include <cstdlib>
+#include <memory>
+#include <unordered_set>
+
+namespace fs = boost::filesystem;
+
+namespace nds
+{
+  /*
+    Summary:
+      Opens a store, creating its shard directories if they don't exist yet.
+
+    Parameters:
+      root: Directory holding the store
+  */
+  ObjectStore::ObjectStore(std::string root) : m_root(root + "/objects/")
+  {
+    for (uint32_t shard = 0; shard < 0x100; shard++)
+    {
+      fs::create_directories(m_root + util::to_hex<uint8_t>(shard));
+    }
+  }
+
+  std::string ObjectStore::path(const std::string& hash) const
+  {
+    return m_root + hash.substr(0, 2) + "/" + hash.substr(2);
+  }
+
+  bool ObjectStore::contains(const std::string& hash) const
+  {
+    boost::system::error_code error;
+    return fs::exists(path(hash), error);
+  }
+
+  /*
+    Summary:
+      Adds an object. It is written under a temporary name and renamed into
+      place, so other extractions sharing the store never see a partial
+      object. Objects are read only since extracted directories link to them.
+
+    Returns:
+      True if the object is in the store.
+  */
+  bool ObjectStore::write(const std::string& hash, const uint8_t* data, size_t size)
+  {
+    std::string name = path(hash);
+    std::string temp = name + fs::unique_path(".%%%%%%%%.tmp").string();
+    util::File out;
+
+    if (!out.create(temp) || (size > 0 && !out.write_at(data, size, 0)))
+    {
+      out.close();
+      fs::remove(temp);
+      return false;
+    }
+
+    out.close();
+
+    boost::system::error_code error;
+    fs::permissions(temp, fs::owner_read | fs::group_read | fs::others_read, error);
+    fs::rename(temp, name, error);
+
+    return !error;
+  }
+
+  //  SHA-256 of the contents as 64 hex digits, since an object with a matching name is never compared or rewritten
+  std::string ObjectStore::hash(const uint8_t* data, size_t size)
+  {
+    std::string name;
+
+    for (uint8_t byte : util::sha256(data, size))
+    {
+      name += util::to_hex(byte);
+    }
+
+    return name;
+  }
+
+  /*
+    Summary:
+      Extracts a ROM into an object store. Every file, overlay and sys blob
+      is hashed straight from the mapped ROM, and only objects the store
+      does not already hold are written. The layout of the ROM is kept in a
+      manifest that rehydrate turns back into a normal extracted directory.
+
+    Parameters:
+      disc: Path to the disc to extract from
+      store: Root directory of the store
+      manifest: Path of the manifest to write
+      threads: Number of threads to use, or 0 for one per hardware thread
+
+    Returns:
+      True if every object and the manifest were written.
+  */
+  bool store_extract(std::string disc, std::string store, std::string manifest, uint32_t threads)
+  {
+    auto rom = std::make_shared<RomImage>(disc);
+
+    if (!rom->valid())
+    {
+      return false;
+    }
+
+    auto start = std::chrono::steady_clock::now();
+
+    FST table(rom);
+    ObjectStore objects(store);
+    std::vector<RomEntry> entries = rom_entries(*rom, table);
+    std::vector<ManifestEntry> lines;
+
+    lines.push_back(ManifestEntry("sys"));
+    lines.push_back(ManifestEntry("overlay"));
+    lines.push_back(ManifestEntry("files"));
+
+    std::string path;
+
+    for (uint16_t dir = 1; dir < table.directory_count(); dir++)
+    {
+      table.directory_path(dir, path);
+
+      if (!path.empty())
+      {
+        lines.push_back(ManifestEntry("files/" + path));
+      }
+    }
+
+    size_t first = lines.size();
+
+    for (auto& entry : entries)
+    {
+      rom->span(entry.offset, entry.size);
+      lines.push_back(ManifestEntry(entry.path, "", entry.size));
+    }
+
+    util::parallel_for(entries.size(), [&](size_t i)
+    {
+      lines[first + i].hash = ObjectStore::hash(rom->data() + entries[i].offset, entries[i].size);
+    }, threads);
+
+    //  Only the first entry with a given hash is written, and only if the store lacks it
+    std::unordered_set<std::string> seen;
+    std::vector<size_t> missing;
+
+    for (size_t i = 0; i < entries.size(); i++)
+    {
+      if (seen.insert(lines[first + i].hash).second && !objects.contains(lines[first + i].hash))
+      {
+        missing.push_back(i);
+      }
+    }
+
+    std::atomic<bool> ok(true);
+    std::atomic<uint64_t> written(0);
+
+    util::parallel_for(missing.size(), [&](size_t i)
+    {
+      RomEntry& entry = entries[missing[i]];
+
+      if (!objects.write(lines[first + missing[i]].hash, rom->data() + entry.offset, entry.size))
+      {
+        std::cout << "Could not store " << entry.path << std::endl;
+        ok = false;
+        return;
+      }
+
+      written += entry.size;
+    }, threads);
+
+    if (!write_manifest(manifest, lines))
+    {
+      std::cout << "Could not write " << manifest << std::endl;
+      return false;
+    }
+
+    auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+
+    std::cout << "Stored " << entries.size() << " files in " << ms << " ms: " << missing.size() << " new objects ("
+      << written << " bytes written), " << (entries.size() - missing.size()) << " already stored" << std::endl;
+
+    return ok;
+  }
+
+  /*
+    Summary:
+      Recreates an extracted directory from a manifest. Files are hardlinked
+      to their objects, falling back to a copy when the store is on another
+      file system.
+
+    Parameters:
+      manifest: Manifest written by store_extract
+      store: Root directory of the store
+      dir: Output directory, laid out as extract would write it
+      threads: Number of threads to use, or 0 for one per hardware thread
+
+    Returns:
+      True if every file was linked or copied.
+  */
+  bool rehydrate(std::string manifest, std::string store, std::string dir, uint32_t threads)
+  {
+    std::vector<ManifestEntry> entries = read_manifest(manifest);
+    ObjectStore objects(store);
+
+    if (entries.empty())
+    {
+      std::cout << "Could not read " << manifest << std::endl;
+      return false;
+    }
+
+    fs::create_directories(dir);
+
+    for (auto& entry : entries)
+    {
+      if (entry.directory())
+      {
+        fs::create_directories(dir + "/" + entry.path);
+      }
+    }
+
+    std::atomic<bool> ok(true);
+    std::atomic<uint32_t> copied(0);
+
+    util::parallel_for(entries.size(), [&](size_t i)
+    {
+      ManifestEntry& entry = entries[i];
+
+      if (entry.directory())
+      {
+        return;
+      }
+
+      std::string object = objects.path(entry.hash);
+      std::string path = dir + "/" + entry.path;
+      boost::system::error_code error;
+
+      fs::remove(path, error);
+      fs::create_hard_link(object, path, error);
+
+      if (error)
+      {
+        fs::copy_file(object, path, error);
+        copied++;
+      }
+
+      if (error)
+      {
+        std::cout << "Could not restore " << entry.path << " from " << object << std::endl;
+        ok = false;
+      }
+    }, threads);
+
+    if (copied > 0)
+    {
+      std::cout << copied << " files could not be linked and were copied instead" << std::endl;
+    }
+
+    return ok;
+  }
+
+  /*
+    Summary:
+      Reads a manifest. Each line is either "d <path>" for a directory or
+      "f <hash> <size> <path>" for a file.
+
+    Returns:
+      Every entry, or nothing if the manifest could not be read.
+  */
+  std::vector<ManifestEntry> read_manifest(std::string manifest)
+  {
+    std::ifstream in(manifest);
+    std::vector<ManifestEntry> entries;
+    std::string line;
+
+    while (std::getline(in, line))
+    {
+      if (line.size() > 2 && line.compare(0, 2, "d ") == 0)
+      {
+        entries.push_back(ManifestEntry(line.substr(2)));
+      }
+      else if (line.size() > 2 && line.compare(0, 2, "f ") == 0)
+      {
+        size_t hash_end = line.find(' ', 2);
+        size_t size_end = (hash_end == std::string::npos) ? hash_end : line.find(' ', hash_end + 1);
+
+        if (size_end == std::string::npos || hash_end - 2 != ObjectStore::HashDigits)
+        {
+          std::cout << "Invalid manifest line: " << line << std::endl;
+          return std::vector<ManifestEntry>();
+        }
+
+        uint64_t size = std::strtoull(line.c_str() + hash_end + 1, nullptr, 10);
+        entries.push_back(ManifestEntry(line.substr(size_end + 1), line.substr(2, ObjectStore::HashDigits), size));
+      }
+    }
+
+    return entries;
+  }
+
+  bool write_manifest(std::string manifest, std::vector<ManifestEntry>& entries)
+  {
+    std::ofstream out(manifest);
+
+    for (auto& entry : entries)
+    {
+      if (entry.directory())
+      {
+        out << "d " << entry.path << "\n";
+      }
+      else
+      {
+        out << "f " << entry.hash << " " << entry.size << " " << entry.path << "\n";
+      }
+    }
+
+    return static_cast<bool>(out);
+  }
+}
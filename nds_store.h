@@ -0,0 +1,56 @@
+#ifndef _MD_NDS_STORE_H
+#define _MD_NDS_STORE_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace nds
+{
+  //  A line of a manifest: a file and the object holding its contents, or a directory
+  struct ManifestEntry
+  {
+    ManifestEntry(std::string path, std::string hash = "", uint64_t size = 0)
+      : path(path), hash(hash), size(size) {};
+
+    std::string path;   //  Path relative to the extraction root
+    std::string hash;   //  Object name, empty for directories
+    uint64_t size;
+
+    inline bool directory() const
+    {
+      return hash.empty();
+    }
+  };
+
+  /*
+    A content-addressed store of extracted files. Every object is named by
+    the SHA-256 of its contents and kept under a directory named by the
+    first two hex digits, so an object is only ever written once no matter
+    how many ROMs hold it.
+  */
+  class ObjectStore
+  {
+  public:
+    static constexpr uint32_t HashDigits = 64;
+
+    ObjectStore(std::string root);
+
+    std::string path(const std::string& hash) const;
+    bool contains(const std::string& hash) const;
+    bool write(const std::string& hash, const uint8_t* data, size_t size);
+
+    static std::string hash(const uint8_t* data, size_t size);
+
+  private:
+    std::string m_root;
+  };
+
+  bool store_extract(std::string disc, std::string store, std::string manifest, uint32_t threads = 0);
+  bool rehydrate(std::string manifest, std::string store, std::string dir, uint32_t threads = 0);
+
+  std::vector<ManifestEntry> read_manifest(std::string manifest);
+  bool write_manifest(std::string manifest, std::vector<ManifestEntry>& entries);
+}
+
+#endif
@@ -0,0 +1,511 @@
+#include "nds_tar.h"
+#include "nds_extract.h"
+#include "nds_plan.h"
+
+#include <boost/filesystem.hpp>
+#include <chrono>
+#include <ctime>
+
+namespace fs = boost::filesystem;
+
+namespace nds
+{
+  namespace
+  {
+    //  Writes a number as a zero terminated octal field
+    void octal(uint8_t* field, size_t size, uint64_t value)
+    {
+      field[size - 1] = 0;
+
+      for (size_t i = size - 1; i > 0; i--)
+      {
+        field[i - 1] = '0' + (value & 7);
+        value >>= 3;
+      }
+    }
+
+    //  Reads an octal field, or a base 256 one when the high bit of the first byte is set
+    uint64_t number(const uint8_t* field, size_t size)
+    {
+      uint64_t value = 0;
+
+      if (field[0] & 0x80)
+      {
+        for (size_t i = 1; i < size; i++)
+        {
+          value = (value << 8) | field[i];
+        }
+
+        return value;
+      }
+
+      for (size_t i = 0; i < size && field[i] != 0; i++)
+      {
+        if (field[i] >= '0' && field[i] <= '7')
+        {
+          value = (value << 3) | (field[i] - '0');
+        }
+      }
+
+      return value;
+    }
+
+    std::string field(const uint8_t* data, size_t size)
+    {
+      const char* text = reinterpret_cast<const char*>(data);
+      return std::string(text, std::find(text, text + size, '\0'));
+    }
+
+    //  Strips leading "./" and "/" and any trailing "/" from an archive path
+    std::string normalize(std::string path)
+    {
+      while (true)
+      {
+        if (path.compare(0, 2, "./") == 0)
+        {
+          path.erase(0, 2);
+        }
+        else if (!path.empty() && path[0] == '/')
+        {
+          path.erase(0, 1);
+        }
+        else
+        {
+          break;
+        }
+      }
+
+      while (!path.empty() && path.back() == '/')
+      {
+        path.pop_back();
+      }
+
+      return (path == ".") ? "" : path;
+    }
+  }
+
+  bool TarWriter::directory(std::string path)
+  {
+    return header(path + "/", 0, '5', 0755);
+  }
+
+  bool TarWriter::file(std::string path, const uint8_t* data, uint64_t size)
+  {
+    if (!header(path, size, '0', 0644) || !m_out.write(data, static_cast<size_t>(size)))
+    {
+      return false;
+    }
+
+    return m_out.fill(0, util::pad(size, BlockSize));
+  }
+
+  //  Ends the archive with two empty blocks
+  bool TarWriter::finish()
+  {
+    return m_out.fill(0, BlockSize * 2) && m_out.flush();
+  }
+
+  /*
+    Summary:
+      Writes the header block of an entry. A path that fits in the name
+      field, or splits at a '/' into the prefix and name fields, is stored
+      directly, anything longer is stored in a pax header first.
+  */
+  bool TarWriter::header(std::string path, uint64_t size, char type, uint32_t mode)
+  {
+    uint8_t block[BlockSize] = {};
+    std::string name = path;
+    std::string prefix;
+
+    if (path.size() > 100)
+    {
+      size_t split = path.find('/', path.size() > 101 ? path.size() - 101 : 0);
+
+      if (split != std::string::npos && split <= 155 && path.size() - split - 1 <= 100 && split + 1 < path.size())
+      {
+        prefix = path.substr(0, split);
+        name = path.substr(split + 1);
+      }
+      else
+      {
+        //  Each pax record is "<length> path=<path>\n" where length counts itself
+        std::string record = " path=" + path + "\n";
+        size_t length = record.size() + 1;
+
+        while (std::to_string(length).size() + record.size() != length)
+        {
+          length++;
+        }
+
+        record = std::to_string(length) + record;
+
+        if (!header("PaxHeader", record.size(), 'x', 0644) || !m_out.write(record.data(), record.size()) ||
+          !m_out.fill(0, util::pad<uint64_t>(record.size(), BlockSize)))
+        {
+          return false;
+        }
+
+        name = path.substr(0, 100);
+      }
+    }
+
+    std::memcpy(block, name.data(), name.size());
+    octal(block + 100, 8, mode);
+    octal(block + 108, 8, 0);
+    octal(block + 116, 8, 0);
+    octal(block + 124, 12, size);
+    octal(block + 136, 12, m_mtime);
+    block[156] = type;
+    std::memcpy(block + 257, "ustar\0" "00", 8);
+    std::memcpy(block + 345, prefix.data(), prefix.size());
+
+    //  The checksum is taken with its own field as spaces
+    std::memset(block + 148, ' ', 8);
+    uint32_t checksum = 0;
+
+    for (auto byte : block)
+    {
+      checksum += byte;
+    }
+
+    octal(block + 148, 7, checksum);
+
+    return m_out.write(block, BlockSize);
+  }
+
+  /*
+    Summary:
+      Writes everything extract would write as one tar stream. Directories
+      come first, then every range in the order it sits in the ROM, so the
+      ROM is read sequentially and the output is one sequential write.
+
+    Parameters:
+      disc: Path to the disc to extract from
+      out: Path of the archive, or "-" for standard output
+
+    Returns:
+      True if the whole archive was written.
+  */
+  bool extract_tar(std::string disc, std::string out)
+  {
+    auto rom = std::make_shared<RomImage>(disc);
+
+    if (!rom->valid())
+    {
+      return false;
+    }
+
+    util::OutputStream stream;
+
+    if (!stream.open(out))
+    {
+      std::cerr << "Could not create " << out << std::endl;
+      return false;
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    boost::system::error_code error;
+    uint64_t mtime = static_cast<uint64_t>(std::max<std::time_t>(0, fs::last_write_time(disc, error)));
+
+    FST table(rom);
+    TarWriter tar(stream, mtime);
+    std::vector<RomEntry> entries = rom_entries(*rom, table);
+    bool ok = tar.directory("sys") && tar.directory("overlay") && tar.directory("files");
+
+    std::string path;
+
+    for (uint16_t dir = 1; dir < table.directory_count() && ok; dir++)
+    {
+      table.directory_path(dir, path);
+      ok = path.empty() || tar.directory("files/" + path);
+    }
+
+    std::stable_sort(entries.begin(), entries.end(), [](const RomEntry& a, const RomEntry& b)
+    {
+      return a.offset < b.offset;
+    });
+
+    for (auto& entry : entries)
+    {
+      uint32_t size = entry.size;
+      const uint8_t* data = rom->span(entry.offset, size);
+
+      if (size != entry.size)
+      {
+        std::cerr << "Could not read all of " << entry.path << " from the disc" << std::endl;
+      }
+
+      ok = ok && tar.file(entry.path, data, size);
+    }
+
+    ok = ok && tar.finish() && stream.close();
+
+    if (!ok)
+    {
+      std::cerr << "Could not write " << out << std::endl;
+      return false;
+    }
+
+    auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+    std::cerr << "Wrote " << entries.size() << " files (" << stream.position() << " bytes) in " << ms << " ms" << std::endl;
+
+    return true;
+  }
+
+  /*
+    Summary:
+      Reads the layout of a tar archive.
+
+    Parameters:
+      archive: Path of the archive, or "-" for standard input
+      memory_limit: Largest file whose contents are kept in memory
+  */
+  TarTree::TarTree(std::string archive, uint64_t memory_limit) : m_archive(archive), m_valid(false)
+  {
+    util::InputStream in;
+
+    if (!in.open(archive))
+    {
+      std::cout << "Could not open " << archive << std::endl;
+      return;
+    }
+
+    m_valid = parse(in, memory_limit);
+
+    //  Archives made from an extracted directory often hold it as their only entry
+    if (m_valid && find("sys") < 0 && m_nodes[0].children.size() == 1 && m_nodes[m_nodes[0].children[0]].directory)
+    {
+      m_base = m_nodes[m_nodes[0].children[0]].name;
+    }
+  }
+
+  TarTree::~TarTree()
+  {
+    if (!m_spill.empty())
+    {
+      boost::system::error_code error;
+      fs::remove(m_spill, error);
+    }
+  }
+
+  /*
+    Summary:
+      Reads every header of the archive, keeping the contents of small files
+      until memory_limit bytes are held in total and recording where the rest
+      can be read from.
+
+    Returns:
+      True if the archive was read to its end.
+  */
+  bool TarTree::parse(util::InputStream& in, uint64_t memory_limit)
+  {
+    const uint64_t MemoryBudget = 0x4000000;   //  Total bytes of small files kept in memory
+
+    uint8_t block[TarWriter::BlockSize];
+    std::string long_path;
+    util::File spill;
+    uint64_t spill_size = 0;
+    uint64_t in_memory = 0;
+    size_t count;
+
+    while ((count = in.read(block, sizeof(block))) == sizeof(block))
+    {
+      if (std::all_of(block, block + sizeof(block), [](uint8_t byte) { return byte == 0; }))
+      {
+        return true;
+      }
+
+      //  The checksum is taken with its own field as spaces
+      uint32_t checksum = 8 * ' ';
+
+      for (size_t i = 0; i < sizeof(block); i++)
+      {
+        checksum += (i >= 148 && i < 156) ? 0 : block[i];
+      }
+
+      if (checksum != number(block + 148, 8))
+      {
+        std::cout << m_archive << " is not a tar archive or is damaged at " << in.position() - sizeof(block) << std::endl;
+        return false;
+      }
+
+      uint64_t size = number(block + 124, 12);
+      uint64_t padding = util::pad<uint64_t>(size, TarWriter::BlockSize);
+      char type = static_cast<char>(block[156]);
+      std::string path = field(block, 100);
+
+      if (std::memcmp(block + 257, "ustar", 5) == 0 && block[345] != 0)
+      {
+        path = field(block + 345, 155) + "/" + path;
+      }
+
+      if (!long_path.empty() && type != 'x' && type != 'L')
+      {
+        path = long_path;
+        long_path.clear();
+      }
+
+      //  GNU long names and pax headers hold the path of the next entry
+      if (type == 'L' || type == 'x')
+      {
+        std::vector<uint8_t> data(static_cast<size_t>(std::min<uint64_t>(size, 0x100000)));
+
+        if (in.read(data.data(), data.size()) != data.size() || !in.skip(size - data.size() + padding))
+        {
+          break;
+        }
+
+        if (type == 'L')
+        {
+          long_path = field(data.data(), data.size());
+          continue;
+        }
+
+        //  Each pax record is "<length> <key>=<value>\n"
+        for (size_t pos = 0; pos < data.size();)
+        {
+          size_t length = std::strtoul(reinterpret_cast<const char*>(&data[pos]), nullptr, 10);
+          std::string record(data.begin() + pos, data.begin() + std::min(data.size(), pos + length));
+          size_t space = record.find(' ');
+          size_t equals = record.find('=');
+
+          if (length == 0 || space == std::string::npos || equals == std::string::npos)
+          {
+            break;
+          }
+
+          if (record.compare(space + 1, equals - space - 1, "path") == 0)
+          {
+            long_path = record.substr(equals + 1, record.size() - equals - 2);
+          }
+
+          pos += length;
+        }
+
+        continue;
+      }
+
+      path = normalize(path);
+
+      if (type == '5')
+      {
+        add(path, true);
+        padding += size;
+      }
+      else if ((type == '0' || type == '\0' || type == '7') && !path.empty())
+      {
+        Node& node = m_nodes[add(path, false)];
+        node.size = size;
+        node.data.clear();
+        node.file.clear();
+
+        if (size <= memory_limit && in_memory + size <= MemoryBudget)
+        {
+          node.data.resize(static_cast<size_t>(size));
+
+          if (in.read(node.data.data(), node.data.size()) != node.data.size())
+          {
+            break;
+          }
+
+          in_memory += size;
+        }
+        else if (in.seekable() && m_archive != "-")
+        {
+          //  Read it again from the archive when the ROM is written, which can't be done by name for stdin
+          node.file = m_archive;
+          node.offset = in.position();
+
+          if (!in.skip(size))
+          {
+            break;
+          }
+        }
+        else
+        {
+          if (!spill.is_open())
+          {
+            m_spill = (fs::temp_directory_path() / fs::unique_path("mdnds-%%%%-%%%%-%%%%.spill")).string();
+
+            if (!spill.create(m_spill))
+            {
+              std::cout << "Could not create " << m_spill << std::endl;
+              return false;
+            }
+          }
+
+          node.file = m_spill;
+          node.offset = spill_size;
+
+          std::vector<uint8_t> data(static_cast<size_t>(std::min<uint64_t>(size, 0x100000)));
+
+          for (uint64_t left = size; left > 0;)
+          {
+            size_t len = static_cast<size_t>(std::min<uint64_t>(left, data.size()));
+
+            if (in.read(data.data(), len) != len || !spill.write_at(data.data(), len, spill_size))
+            {
+              std::cout << "Could not copy " << path << " out of " << m_archive << std::endl;
+              return false;
+            }
+
+            spill_size += len;
+            left -= len;
+          }
+        }
+      }
+      else
+      {
+        //  Links, devices and anything else have no place in a ROM
+        padding += size;
+      }
+
+      if (!in.skip(padding))
+      {
+        break;
+      }
+    }
+
+    //  Archives are allowed to end without their two empty blocks
+    if (count == 0)
+    {
+      return true;
+    }
+
+    std::cout << m_archive << " ends in the middle of an entry" << std::endl;
+    return false;
+  }
+
+  /*
+    Summary:
+      Builds a ROM straight from a tar archive of an extracted directory,
+      without unpacking it anywhere.
+
+    Parameters:
+      archive: Path of the archive, or "-" for standard input
+      disc: Output file path
+      options: Where to place files
+
+    Returns:
+      True if the ROM was built.
+  */
+  bool build_tar(std::string archive, std::string disc, const BuildOptions& options)
+  {
+    TarTree tree(archive);
+
+    if (!tree.valid() || !valid_tree(tree))
+    {
+      return false;
+    }
+
+    BuildPlan plan(tree, options);
+
+    if (!execute_plan(plan, disc))
+    {
+      std::cout << "Failed to build " << disc << std::endl;
+      return false;
+    }
+
+    return true;
+  }
+}
@@ -0,0 +1,70 @@
+#ifndef _MD_NDS_TAR_H
+#define _MD_NDS_TAR_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "nds_plan.h"
+#include "nds_tree.h"
+#include "util_io.h"
+
+namespace nds
+{
+  /*
+    Writes a POSIX (ustar) tar archive front to back, so it can go to a
+    pipe. Paths too long for the ustar header get a pax extended header.
+  */
+  class TarWriter
+  {
+  public:
+    static const int BlockSize = 512;
+
+    TarWriter(util::OutputStream& out, uint64_t mtime = 0) : m_out(out), m_mtime(mtime) {};
+
+    bool directory(std::string path);
+    bool file(std::string path, const uint8_t* data, uint64_t size);
+    bool finish();
+
+  private:
+    util::OutputStream& m_out;
+    uint64_t m_mtime;
+
+    bool header(std::string path, uint64_t size, char type, uint32_t mode);
+  };
+
+  /*
+    A tree read from a tar archive in a single pass. Only the layout is
+    kept in memory along with the contents of small files. Larger files
+    are read again from the archive when it is a regular file, or spilled
+    to a temporary file when it is a pipe.
+  */
+  class TarTree : public IndexTree
+  {
+  public:
+    TarTree(std::string archive, uint64_t memory_limit = 0x10000);
+    ~TarTree();
+
+    inline bool valid() const
+    {
+      return m_valid;
+    }
+
+    inline std::string name()
+    {
+      return m_archive;
+    }
+
+  private:
+    std::string m_archive;
+    std::string m_spill;
+    bool m_valid;
+
+    bool parse(util::InputStream& in, uint64_t memory_limit);
+  };
+
+  bool extract_tar(std::string disc, std::string out);
+  bool build_tar(std::string archive, std::string disc, const BuildOptions& options = BuildOptions());
+}
+
+#endif
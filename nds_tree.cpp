@@ -0,0 +1,367 @@
+#include "nds_tree.h"
+#include "nds_extract.h"
+#include "nds_plan.h"
+#include "util.h"
+#include "util_io.h"
+
+#include <boost/filesystem.hpp>
+
+namespace fs = boost::filesystem;
+
+namespace nds
+{
+  bool DiskTree::is_directory(const std::string& path)
+  {
+    return fs::is_directory(full(path));
+  }
+
+  bool DiskTree::is_file(const std::string& path)
+  {
+    return fs::is_regular_file(full(path));
+  }
+
+  uint64_t DiskTree::size(const std::string& path)
+  {
+    boost::system::error_code error;
+    uint64_t size = fs::file_size(full(path), error);
+    return error ? 0 : size;
+  }
+
+  //  Lists a directory in the order the file system returns it, skipping anything that isn't a file or directory
+  std::vector<TreeEntry> DiskTree::list(const std::string& path)
+  {
+    std::vector<TreeEntry> entries;
+
+    for (fs::directory_iterator dir(full(path)), end; dir != end; ++dir)
+    {
+      if (fs::is_directory(dir->path()))
+      {
+        entries.push_back(TreeEntry(dir->path().filename().string(), true));
+      }
+      else if (fs::is_regular_file(dir->path()))
+      {
+        entries.push_back(TreeEntry(dir->path().filename().string(), false, fs::file_size(dir->path())));
+      }
+    }
+
+    return entries;
+  }
+
+  std::vector<uint8_t> DiskTree::read(const std::string& path)
+  {
+    return util::read_file(full(path));
+  }
+
+  void DiskTree::source(Region& region, const std::string& path)
+  {
+    region.source = full(path);
+    region.source_offset = 0;
+  }
+
+  IndexTree::IndexTree()
+  {
+    m_nodes.push_back(Node());
+    m_nodes[0].directory = true;
+    m_nodes[0].size = 0;
+    m_nodes[0].offset = 0;
+    m_index[""] = 0;
+  }
+
+  //  Gets a node by its path under the base directory, or -1 if there is none
+  int64_t IndexTree::find(const std::string& path)
+  {
+    std::string full = m_base.empty() ? path : (path.empty() ? m_base : m_base + "/" + path);
+    auto it = m_index.find(full);
+    return (it == m_index.end()) ? -1 : static_cast<int64_t>(it->second);
+  }
+
+  //  Adds a node by its full path, adding any parent directories that haven't been seen yet
+  uint32_t IndexTree::add(const std::string& path, bool directory)
+  {
+    auto it = m_index.find(path);
+
+    if (it != m_index.end())
+    {
+      return it->second;
+    }
+
+    size_t slash = path.find_last_of('/');
+    uint32_t parent = (slash == std::string::npos) ? 0 : add(path.substr(0, slash), true);
+    uint32_t id = static_cast<uint32_t>(m_nodes.size());
+
+    m_nodes.push_back(Node());
+    m_nodes.back().name = (slash == std::string::npos) ? path : path.substr(slash + 1);
+    m_nodes.back().directory = directory;
+    m_nodes.back().size = 0;
+    m_nodes.back().offset = 0;
+    m_nodes[parent].children.push_back(id);
+    m_index[path] = id;
+
+    return id;
+  }
+
+  bool IndexTree::is_directory(const std::string& path)
+  {
+    int64_t id = find(path);
+    return id >= 0 && m_nodes[id].directory;
+  }
+
+  bool IndexTree::is_file(const std::string& path)
+  {
+    int64_t id = find(path);
+    return id >= 0 && !m_nodes[id].directory;
+  }
+
+  uint64_t IndexTree::size(const std::string& path)
+  {
+    int64_t id = find(path);
+    return (id >= 0) ? m_nodes[id].size : 0;
+  }
+
+  std::vector<TreeEntry> IndexTree::list(const std::string& path)
+  {
+    std::vector<TreeEntry> entries;
+    int64_t id = find(path);
+
+    if (id >= 0)
+    {
+      for (auto child : m_nodes[id].children)
+      {
+        entries.push_back(TreeEntry(m_nodes[child].name, m_nodes[child].directory, m_nodes[child].size));
+      }
+    }
+
+    return entries;
+  }
+
+  std::vector<uint8_t> IndexTree::read(const std::string& path)
+  {
+    int64_t id = find(path);
+
+    if (id < 0 || m_nodes[id].directory)
+    {
+      return std::vector<uint8_t>();
+    }
+
+    Node& node = m_nodes[id];
+
+    if (node.file.empty())
+    {
+      return node.data;
+    }
+
+    util::File in;
+    std::vector<uint8_t> data(static_cast<size_t>(node.size));
+
+    if (!in.open(node.file) || (!data.empty() && in.read_at(data.data(), data.size(), node.offset) != data.size()))
+    {
+      std::cout << "Could not read " << path << " from " << node.file << std::endl;
+      return std::vector<uint8_t>();
+    }
+
+    return data;
+  }
+
+  void IndexTree::source(Region& region, const std::string& path)
+  {
+    int64_t id = find(path);
+
+    if (id < 0)
+    {
+      return;
+    }
+
+    if (m_nodes[id].file.empty())
+    {
+      region.data = m_nodes[id].data;
+    }
+    else
+    {
+      region.source = m_nodes[id].file;
+      region.source_offset = m_nodes[id].offset;
+    }
+  }
+
+  /*
+    Summary:
+      Indexes every section, overlay and file of a ROM under the paths
+      extract would write them to. Nothing but the header and tables is
+      read until the tree is built from.
+
+    Parameters:
+      disc: Path to the ROM
+  */
+  RomTree::RomTree(std::string disc) : m_disc(disc), m_valid(false)
+  {
+    auto rom = std::make_shared<RomImage>(disc);
+
+    if (!rom->valid())
+    {
+      std::cout << "Could not read a header from " << disc << std::endl;
+      return;
+    }
+
+    //  Nodes are read back from the file itself
+    if (rom->compressed())
+    {
+      std::cout << disc << " is compressed, decompress it before building from it" << std::endl;
+      return;
+    }
+
+    FST table(rom);
+
+    if (!table.fnt().valid())
+    {
+      return;
+    }
+
+    for (auto dir : { "sys", "overlay", "files" })
+    {
+      add(dir, true);
+    }
+
+    //  Directories are added first so empty ones are kept and the rest stay in id order
+    std::string path;
+
+    for (uint16_t dir = 1; dir < table.directory_count(); dir++)
+    {
+      table.directory_path(dir, path);
+
+      if (!path.empty())
+      {
+        add("files/" + path, true);
+      }
+    }
+
+    for (auto& entry : rom_entries(*rom, table))
+    {
+      Node& node = m_nodes[add(entry.path, false)];
+      node.size = entry.size;
+      node.file = disc;
+      node.offset = entry.offset;
+    }
+
+    m_valid = true;
+  }
+
+  bool OverlayTree::is_directory(const std::string& path)
+  {
+    //  A path that is a file in one tree and a directory in the other keeps the bottom's kind
+    return m_bottom.is_directory(path) || (m_top.is_directory(path) && !m_bottom.is_file(path));
+  }
+
+  bool OverlayTree::is_file(const std::string& path)
+  {
+    return m_bottom.is_file(path) || (m_top.is_file(path) && !m_bottom.is_directory(path));
+  }
+
+  uint64_t OverlayTree::size(const std::string& path)
+  {
+    return m_top.is_file(path) ? m_top.size(path) : m_bottom.size(path);
+  }
+
+  //  Lists the bottom directory with the top's files swapped in, followed by whatever only the top has, by name
+  std::vector<TreeEntry> OverlayTree::list(const std::string& path)
+  {
+    std::vector<TreeEntry> entries;
+    std::vector<TreeEntry> added;
+
+    if (m_bottom.is_directory(path))
+    {
+      entries = m_bottom.list(path);
+    }
+
+    if (!m_top.is_directory(path))
+    {
+      return entries;
+    }
+
+    std::unordered_map<std::string, size_t> names;
+
+    for (size_t i = 0; i < entries.size(); i++)
+    {
+      names[entries[i].name] = i;
+    }
+
+    for (auto& entry : m_top.list(path))
+    {
+      auto it = names.find(entry.name);
+
+      if (it == names.end())
+      {
+        added.push_back(entry);
+      }
+      else if (entry.directory == entries[it->second].directory)
+      {
+        entries[it->second] = entry;
+      }
+      else
+      {
+        std::cout << "Skipping " << m_top.name() << "/" << tree_path(path, entry.name) << " since it replaces a "
+          << (entry.directory ? "file" : "directory") << " with a " << (entry.directory ? "directory" : "file") << std::endl;
+      }
+    }
+
+    std::sort(added.begin(), added.end(), [](const TreeEntry& a, const TreeEntry& b)
+    {
+      return a.name < b.name;
+    });
+
+    entries.insert(entries.end(), added.begin(), added.end());
+    return entries;
+  }
+
+  std::vector<uint8_t> OverlayTree::read(const std::string& path)
+  {
+    return m_top.is_file(path) ? m_top.read(path) : m_bottom.read(path);
+  }
+
+  void OverlayTree::source(Region& region, const std::string& path)
+  {
+    if (m_top.is_file(path))
+    {
+      m_top.source(region, path);
+    }
+    else
+    {
+      m_bottom.source(region, path);
+    }
+  }
+
+  /*
+    Summary:
+      Determines whether a tree has the structure and files needed to build a ROM
+
+    Parameter:
+      tree: Tree to check
+
+    Returns:
+      True if a ROM can be built from the tree, or false otherwise.
+  */
+  bool valid_tree(SourceTree& tree)
+  {
+    bool ret = true;
+
+    //  If the tree does not have /files and /sys then it wasn't extracted by this extractor
+    for (auto dir : { "files", "sys", "overlay" })
+    {
+      if (!tree.is_directory(dir))
+      {
+        std::cout << "Missing directory /" << dir << " under " << tree.name() << std::endl;
+        ret = false;
+      }
+    }
+
+    //  Check for individual system files which are required to re-build the disc
+    for (auto file : { "arm9_overlay.bin", "arm7_overlay.bin", "arm9.bin", "arm7.bin", "fnt.bin", "fat.bin", "header.bin" })
+    {
+      if (!tree.is_file(std::string("sys/") + file))
+      {
+        std::cout << "Missing file " << tree.name() << "/sys/" << file << std::endl;
+        ret = false;
+      }
+    }
+
+    return ret;
+  }
+}
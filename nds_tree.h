@@ -0,0 +1,170 @@
+#ifndef _MD_NDS_TREE_H
+#define _MD_NDS_TREE_H
+
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace nds
+{
+  struct Region;
+
+  //  A file or directory inside a SourceTree
+  struct TreeEntry
+  {
+    TreeEntry(std::string name, bool directory, uint64_t size = 0)
+      : name(name), directory(directory), size(size) {};
+
+    std::string name;
+    bool directory;
+    uint64_t size;
+  };
+
+  /*
+    The files a ROM is built from, laid out the way extract writes them.
+    Paths are relative to the root and separated by '/', with "" as the
+    root itself. A directory lists its entries in the order their ids are
+    given out in the FNT.
+  */
+  class SourceTree
+  {
+  public:
+    virtual ~SourceTree() {};
+
+    virtual bool is_directory(const std::string& path) = 0;
+    virtual bool is_file(const std::string& path) = 0;
+    virtual uint64_t size(const std::string& path) = 0;
+    virtual std::vector<TreeEntry> list(const std::string& path) = 0;
+    virtual std::vector<uint8_t> read(const std::string& path) = 0;
+
+    //  Points a region at the contents of a file
+    virtual void source(Region& region, const std::string& path) = 0;
+
+    //  Describes the tree in messages
+    virtual std::string name() = 0;
+  };
+
+  //  A directory on disk that a ROM was previously extracted to
+  class DiskTree : public SourceTree
+  {
+  public:
+    DiskTree(std::string root) : m_root(root) {};
+
+    bool is_directory(const std::string& path);
+    bool is_file(const std::string& path);
+    uint64_t size(const std::string& path);
+    std::vector<TreeEntry> list(const std::string& path);
+    std::vector<uint8_t> read(const std::string& path);
+    void source(Region& region, const std::string& path);
+
+    inline std::string name()
+    {
+      return m_root;
+    }
+
+  private:
+    std::string m_root;
+
+    inline std::string full(const std::string& path) const
+    {
+      return m_root + "/" + path;
+    }
+  };
+
+  /*
+    A tree whose whole layout is held in memory, with each file either
+    held in memory too or found at an offset inside some other file.
+  */
+  class IndexTree : public SourceTree
+  {
+  public:
+    IndexTree();
+    IndexTree(const IndexTree&) = delete;
+    IndexTree& operator=(const IndexTree&) = delete;
+
+    bool is_directory(const std::string& path);
+    bool is_file(const std::string& path);
+    uint64_t size(const std::string& path);
+    std::vector<TreeEntry> list(const std::string& path);
+    std::vector<uint8_t> read(const std::string& path);
+    void source(Region& region, const std::string& path);
+
+  protected:
+    struct Node
+    {
+      std::string name;
+      bool directory;
+      uint64_t size;
+      std::vector<uint32_t> children;   //  In the order they were added
+      std::string file;                 //  File holding the contents when they aren't in data
+      uint64_t offset;
+      std::vector<uint8_t> data;
+    };
+
+    std::string m_base;                 //  Top directory every path is under, if there is one
+    std::vector<Node> m_nodes;
+    std::unordered_map<std::string, uint32_t> m_index;
+
+    int64_t find(const std::string& path);
+    uint32_t add(const std::string& path, bool directory);
+  };
+
+  //  A ROM seen as the tree extract would write, with every file read straight from the ROM
+  class RomTree : public IndexTree
+  {
+  public:
+    RomTree(std::string disc);
+
+    inline bool valid() const
+    {
+      return m_valid;
+    }
+
+    inline std::string name()
+    {
+      return m_disc;
+    }
+
+  private:
+    std::string m_disc;
+    bool m_valid;
+  };
+
+  /*
+    A tree with another laid over it. Files in the top tree replace the
+    ones at the same path in the bottom tree and anything else is added,
+    after the bottom tree's entries of the same directory.
+  */
+  class OverlayTree : public SourceTree
+  {
+  public:
+    OverlayTree(SourceTree& bottom, SourceTree& top) : m_bottom(bottom), m_top(top) {};
+
+    bool is_directory(const std::string& path);
+    bool is_file(const std::string& path);
+    uint64_t size(const std::string& path);
+    std::vector<TreeEntry> list(const std::string& path);
+    std::vector<uint8_t> read(const std::string& path);
+    void source(Region& region, const std::string& path);
+
+    inline std::string name()
+    {
+      return m_bottom.name() + " with " + m_top.name();
+    }
+
+  private:
+    SourceTree& m_bottom;
+    SourceTree& m_top;
+  };
+
+  bool valid_tree(SourceTree& tree);
+
+  //  Joins a directory path and a name inside a tree
+  inline std::string tree_path(const std::string& dir, const std::string& name)
+  {
+    return dir.empty() ? name : dir + "/" + name;
+  }
+}
+
+#endif
@@ -0,0 +1,316 @@
+#ifndef _MD_NDS_VIEW_H
+#define _MD_NDS_VIEW_H
+
+#include <cstdint>
+#include <iterator>
+#include <string>
+
+#include "util.h"
+
+namespace nds
+{
+  //  Start and end offsets of a file in the ROM
+  struct FatRange
+  {
+    uint32_t begin;
+    uint32_t end;
+
+    inline uint32_t size() const
+    {
+      return end - begin;
+    }
+  };
+
+  /*
+    A non-owning view of the File Allocation Table, which is an array of
+    8 byte start and end offsets indexed by file id.
+  */
+  class FatView
+  {
+  public:
+    FatView() : m_data(nullptr), m_count(0) {};
+    FatView(const uint8_t* data, size_t size) : m_data(data), m_count(static_cast<uint32_t>(size / 8)) {};
+
+    class iterator
+    {
+    public:
+      typedef std::forward_iterator_tag iterator_category;
+      typedef FatRange value_type;
+      typedef std::ptrdiff_t difference_type;
+      typedef const FatRange* pointer;
+      typedef FatRange reference;
+
+      iterator(const uint8_t* pos) : m_pos(pos) {};
+
+      inline FatRange operator*() const
+      {
+        return { util::load<uint32_t>(m_pos), util::load<uint32_t>(m_pos + 4) };
+      }
+
+      inline iterator& operator++()
+      {
+        m_pos += 8;
+        return *this;
+      }
+
+      inline bool operator==(const iterator& other) const
+      {
+        return m_pos == other.m_pos;
+      }
+
+      inline bool operator!=(const iterator& other) const
+      {
+        return m_pos != other.m_pos;
+      }
+
+    private:
+      const uint8_t* m_pos;
+    };
+
+    //  Number of entries in the table
+    inline uint32_t size() const
+    {
+      return m_count;
+    }
+
+    inline bool contains(uint32_t id) const
+    {
+      return id < m_count;
+    }
+
+    inline FatRange operator[](uint32_t id) const
+    {
+      return { util::load<uint32_t>(m_data + id * 8), util::load<uint32_t>(m_data + id * 8 + 4) };
+    }
+
+    inline iterator begin() const
+    {
+      return iterator(m_data);
+    }
+
+    inline iterator end() const
+    {
+      return iterator(m_data + m_count * 8);
+    }
+
+    inline const uint8_t* data() const
+    {
+      return m_data;
+    }
+
+  private:
+    const uint8_t* m_data;
+    uint32_t m_count;
+  };
+
+  //  A single file or directory entry from an FNT sub-table
+  struct FntEntry
+  {
+    const char* name;     //  Not null terminated
+    uint8_t length;       //  Length of the name
+    bool directory;       //  True if this is a sub-directory
+    uint16_t id;          //  File id, or directory id without the 0xF000 mark
+
+    inline std::string str() const
+    {
+      return std::string(name, length);
+    }
+  };
+
+  /*
+    A non-owning view of the File Name Table. The whole table is checked
+    once when the view is made, so walking it afterwards needs no bounds
+    checks and never allocates.
+  */
+  class FntView
+  {
+  public:
+    FntView() : m_data(nullptr), m_size(0), m_count(0) {};
+
+    FntView(const uint8_t* data, size_t size) : m_data(nullptr), m_size(0), m_count(0)
+    {
+      if (check(data, size))
+      {
+        m_data = data;
+        m_size = size;
+        m_count = util::load<uint16_t>(data + 6);
+      }
+    }
+
+    //  Walks the entries of one sub-table, stopping at its terminating 0
+    class iterator
+    {
+    public:
+      typedef std::forward_iterator_tag iterator_category;
+      typedef FntEntry value_type;
+      typedef std::ptrdiff_t difference_type;
+      typedef const FntEntry* pointer;
+      typedef FntEntry reference;
+
+      iterator() : m_pos(nullptr), m_file_id(0) {};
+      iterator(const uint8_t* pos, uint16_t file_id) : m_pos(pos), m_file_id(file_id) {};
+
+      inline FntEntry operator*() const
+      {
+        FntEntry entry;
+        entry.length = m_pos[0] & 0x7F;
+        entry.directory = (m_pos[0] & 0x80) != 0;
+        entry.name = reinterpret_cast<const char*>(m_pos + 1);
+        entry.id = entry.directory ? (util::load<uint16_t>(m_pos + 1 + entry.length) & 0x0FFF) : m_file_id;
+        return entry;
+      }
+
+      inline iterator& operator++()
+      {
+        if (m_pos[0] & 0x80)
+        {
+          m_pos += (m_pos[0] & 0x7F) + 3;
+        }
+        else
+        {
+          m_pos += m_pos[0] + 1;
+          m_file_id++;
+        }
+
+        return *this;
+      }
+
+      inline bool operator==(const iterator& other) const
+      {
+        return done() == other.done() && (done() || m_pos == other.m_pos);
+      }
+
+      inline bool operator!=(const iterator& other) const
+      {
+        return !(*this == other);
+      }
+
+    private:
+      const uint8_t* m_pos;
+      uint16_t m_file_id;
+
+      inline bool done() const
+      {
+        return m_pos == nullptr || m_pos[0] == 0;
+      }
+    };
+
+    struct Entries
+    {
+      iterator first;
+
+      inline iterator begin() const
+      {
+        return first;
+      }
+
+      inline iterator end() const
+      {
+        return iterator();
+      }
+    };
+
+    inline bool valid() const
+    {
+      return m_data != nullptr;
+    }
+
+    //  Number of directories, including the root
+    inline uint16_t directory_count() const
+    {
+      return m_count;
+    }
+
+    //  Offset of a directory's sub-table from the start of the FNT
+    inline uint32_t offset(uint16_t dir) const
+    {
+      return util::load<uint32_t>(m_data + dir * 8);
+    }
+
+    //  The file id of the first file in a directory
+    inline uint16_t first_id(uint16_t dir) const
+    {
+      return util::load<uint16_t>(m_data + dir * 8 + 4);
+    }
+
+    //  The parent of a directory, only meaningful for directories other than the root
+    inline uint16_t parent(uint16_t dir) const
+    {
+      return util::load<uint16_t>(m_data + dir * 8 + 6) & 0x0FFF;
+    }
+
+    inline Entries entries(uint16_t dir) const
+    {
+      return { iterator(m_data + offset(dir), first_id(dir)) };
+    }
+
+    inline const uint8_t* data() const
+    {
+      return m_data;
+    }
+
+    inline size_t size() const
+    {
+      return m_size;
+    }
+
+  private:
+    const uint8_t* m_data;
+    size_t m_size;
+    uint16_t m_count;
+
+    /*
+      Summary:
+        Checks that every main table entry and every sub-table entry lies
+        inside the data and that every sub-table is terminated.
+    */
+    static bool check(const uint8_t* data, size_t size)
+    {
+      if (data == nullptr || size < 8)
+      {
+        return false;
+      }
+
+      uint32_t count = util::load<uint16_t>(data + 6);
+
+      if (count == 0 || count > 0x1000 || count * 8 > size)
+      {
+        return false;
+      }
+
+      for (uint32_t dir = 0; dir < count; dir++)
+      {
+        size_t pos = util::load<uint32_t>(data + dir * 8);
+
+        while (pos < size && data[pos] != 0)
+        {
+          uint8_t len = data[pos];
+
+          //  0x80 is reserved
+          if (len == 0x80)
+          {
+            return false;
+          }
+
+          size_t next = pos + 1 + (len & 0x7F) + ((len & 0x80) ? 2 : 0);
+
+          if (next > size || ((len & 0x80) && (util::load<uint16_t>(data + next - 2) & 0x0FFF) >= count))
+          {
+            return false;
+          }
+
+          pos = next;
+        }
+
+        if (pos >= size)
+        {
+          return false;
+        }
+      }
+
+      return true;
+    }
+  };
+}
+
+#endif
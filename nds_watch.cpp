@@ -0,0 +1,513 @@
+#include "nds_watch.h"
+#include "nds_merkle.h"
+#include "util.h"
+
+#include <boost/filesystem.hpp>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <numeric>
+
+#ifdef __linux__
+#include <poll.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+#endif
+
+namespace fs = boost::filesystem;
+
+namespace nds
+{
+#ifdef __linux__
+  namespace
+  {
+    //  Events closer together than this are applied as one change, which covers an editor's save
+    const int DebounceMs = 50;
+
+    const uint32_t WatchEvents = IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF;
+
+    //  Ranges of a plan that no region covers, which a fresh build leaves as zero
+    std::set<std::pair<uint32_t, uint32_t>> gaps(BuildPlan& plan)
+    {
+      std::vector<std::pair<uint32_t, uint32_t>> ranges;
+      std::set<std::pair<uint32_t, uint32_t>> ret;
+      uint32_t end = 0;
+
+      for (auto& region : plan.regions())
+      {
+        ranges.push_back(std::make_pair(region.offset, region.offset + region.size));
+      }
+
+      std::sort(ranges.begin(), ranges.end());
+
+      for (auto& range : ranges)
+      {
+        if (range.first > end)
+        {
+          ret.insert(std::make_pair(end, range.first));
+        }
+
+        end = std::max(end, range.second);
+      }
+
+      if (plan.size() > end)
+      {
+        ret.insert(std::make_pair(end, plan.size()));
+      }
+
+      return ret;
+    }
+
+    double elapsed_ms(std::chrono::steady_clock::time_point start)
+    {
+      return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    }
+  }
+
+  Watcher::Watcher(std::string dir, std::string disc, const BuildOptions& options)
+    : m_dir(dir), m_disc(disc), m_options(options), m_fd(-1)
+  {
+  }
+
+  Watcher::~Watcher()
+  {
+    if (m_fd >= 0)
+    {
+      ::close(m_fd);
+    }
+  }
+
+  /*
+    Summary:
+      Builds the ROM once, keeping its plan, and starts watching sys/,
+      overlay/ and files/ along with every directory under them.
+
+    Returns:
+      True if the ROM was built and the directories are being watched.
+  */
+  bool Watcher::start()
+  {
+    DiskTree tree(m_dir);
+
+    if (!valid_tree(tree))
+    {
+      return false;
+    }
+
+    m_plan.reset(new BuildPlan(tree, m_options));
+
+    if (!execute_plan(*m_plan, m_disc) || !m_out.modify(m_disc))
+    {
+      std::cout << "Failed to build " << m_disc << std::endl;
+      return false;
+    }
+
+    index();
+
+    //  The whole ROM was just written, so an index left from before is hashed again
+    merkle_update(m_disc, { ByteRange(0, m_plan->size()) });
+
+    m_fd = inotify_init1(IN_CLOEXEC);
+
+    if (m_fd < 0)
+    {
+      std::cout << "Could not start watching " << m_dir << std::endl;
+      return false;
+    }
+
+    for (auto dir : { "sys", "overlay", "files" })
+    {
+      add_watches(dir);
+    }
+
+    std::cout << "Watching " << m_dir << " to keep " << m_disc << " up to date" << std::endl;
+    return true;
+  }
+
+  /*
+    Summary:
+      Waits for changes and applies them until the process is stopped.
+
+    Returns:
+      False if the watch could no longer be read.
+  */
+  bool Watcher::run()
+  {
+    pollfd fd = { m_fd, POLLIN, 0 };
+    std::set<std::string> changed;
+    bool structural = false;
+
+    while (true)
+    {
+      if (poll(&fd, 1, -1) < 0)
+      {
+        if (errno == EINTR)
+        {
+          continue;
+        }
+
+        return false;
+      }
+
+      if (!read_events(changed, structural))
+      {
+        return false;
+      }
+
+      //  Let the rest of the save arrive before touching the ROM
+      while (poll(&fd, 1, DebounceMs) > 0)
+      {
+        if (!read_events(changed, structural))
+        {
+          return false;
+        }
+      }
+
+      if (changed.empty() && !structural)
+      {
+        continue;
+      }
+
+      auto start = std::chrono::steady_clock::now();
+
+      if (!structural && update_in_place(changed))
+      {
+        std::cout << "Updated " << changed.size() << " file(s) in place in " << elapsed_ms(start) << " ms" << std::endl;
+      }
+      else
+      {
+        rebuild(changed);
+      }
+
+      changed.clear();
+      structural = false;
+    }
+  }
+
+  //  Maps every overlay and file to its region
+  void Watcher::index()
+  {
+    auto& regions = m_plan->regions();
+    std::vector<size_t> order(regions.size());
+
+    std::iota(order.begin(), order.end(), 0);
+    std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b)
+    {
+      return regions[a].offset < regions[b].offset;
+    });
+
+    m_sources.clear();
+
+    for (size_t i = 0; i < order.size(); i++)
+    {
+      Region& region = regions[order[i]];
+
+      if (region.file_id >= 0 && !region.source.empty())
+      {
+        m_sources[region.source] = order[i];
+      }
+    }
+  }
+
+  //  Watches a directory under the root and every directory below it
+  void Watcher::add_watches(const std::string& path)
+  {
+    std::string full = m_dir + "/" + path;
+    int wd = inotify_add_watch(m_fd, full.c_str(), WatchEvents);
+
+    if (wd < 0)
+    {
+      std::cout << "Could not watch " << full << std::endl;
+      return;
+    }
+
+    m_watches[wd] = path;
+    boost::system::error_code error;
+
+    for (fs::directory_iterator dir(full, error), end; !error && dir != end; dir.increment(error))
+    {
+      if (fs::is_directory(dir->path()))
+      {
+        add_watches(path + "/" + dir->path().filename().string());
+      }
+    }
+  }
+
+  /*
+    Summary:
+      Reads the events that are waiting. Files that were written, moved or
+      deleted are collected by their full path. Anything that changes the
+      directories, or events that were dropped, calls for a new layout.
+
+    Returns:
+      False if the events could not be read.
+  */
+  bool Watcher::read_events(std::set<std::string>& changed, bool& structural)
+  {
+    alignas(inotify_event) char buffer[0x10000];
+    ssize_t len = ::read(m_fd, buffer, sizeof(buffer));
+
+    if (len < 0)
+    {
+      return errno == EINTR || errno == EAGAIN;
+    }
+
+    for (char* ptr = buffer; ptr < buffer + len; ptr += sizeof(inotify_event) + reinterpret_cast<inotify_event*>(ptr)->len)
+    {
+      inotify_event* event = reinterpret_cast<inotify_event*>(ptr);
+      auto watch = m_watches.find(event->wd);
+
+      if (event->mask & IN_Q_OVERFLOW)
+      {
+        structural = true;
+        continue;
+      }
+
+      if (watch == m_watches.end())
+      {
+        continue;
+      }
+
+      if (event->mask & IN_IGNORED)
+      {
+        m_watches.erase(watch);
+        continue;
+      }
+
+      if (event->len == 0)
+      {
+        structural = true;
+        continue;
+      }
+
+      std::string path = watch->second + "/" + event->name;
+
+      if (event->mask & IN_ISDIR)
+      {
+        structural = true;
+
+        if (event->mask & (IN_CREATE | IN_MOVED_TO))
+        {
+          add_watches(path);
+        }
+
+        continue;
+      }
+
+      //  A new file is picked up once it is closed after writing
+      if (event->mask == IN_CREATE)
+      {
+        continue;
+      }
+
+      changed.insert(m_dir + "/" + path);
+    }
+
+    return true;
+  }
+
+  /*
+    Summary:
+      Writes changed overlays and files straight over their old range.
+      Nothing is written unless every change is to an existing overlay or
+      file that kept its size, since any other size moves the files after
+      it in a fresh build, and the ROM has to match one.
+
+    Returns:
+      True if the changes were applied, or false if the ROM has to be laid out again.
+  */
+  bool Watcher::update_in_place(const std::set<std::string>& changed)
+  {
+    auto& regions = m_plan->regions();
+    std::vector<size_t> edits;
+
+    for (auto& path : changed)
+    {
+      boost::system::error_code error;
+      bool file = fs::is_regular_file(path, error);
+      auto it = m_sources.find(path);
+
+      //  Temporary files from an editor's save come and go without mattering
+      if (it == m_sources.end())
+      {
+        if (file)
+        {
+          return false;
+        }
+
+        continue;
+      }
+
+      uint64_t size = file ? fs::file_size(path, error) : 0;
+
+      if (!file || error || size != regions[it->second].size)
+      {
+        return false;
+      }
+
+      edits.push_back(it->second);
+    }
+
+    std::vector<ByteRange> written;
+
+    for (auto edit : edits)
+    {
+      Region& region = regions[edit];
+      util::File in;
+
+      if (!in.open(region.source) || !m_out.copy_from(in, 0, region.size, region.offset))
+      {
+        std::cout << "Could not read " << region.source << std::endl;
+        return false;
+      }
+
+      written.push_back(ByteRange(region.offset, region.size));
+    }
+
+    merkle_update(m_disc, written);
+    return true;
+  }
+
+  /*
+    Summary:
+      Lays the directory out again and writes every region that differs from
+      the last plan, either because it moved, its bytes changed or its
+      source file was written to.
+
+    Returns:
+      True if the ROM was brought up to date.
+  */
+  bool Watcher::rebuild(const std::set<std::string>& changed)
+  {
+    auto start = std::chrono::steady_clock::now();
+    DiskTree tree(m_dir);
+
+    if (!valid_tree(tree))
+    {
+      std::cout << "Waiting for " << m_dir << " to be complete again" << std::endl;
+      return false;
+    }
+
+    BuildOptions options = m_options;
+    options.verbose = false;
+
+    std::unique_ptr<BuildPlan> plan(new BuildPlan(tree, options));
+    auto& regions = plan->regions();
+    auto& old = m_plan->regions();
+
+    //  Regions of the last plan by where they sit
+    std::unordered_multimap<uint64_t, size_t> placed;
+
+    for (size_t i = 0; i < old.size(); i++)
+    {
+      if (old[i].size > 0)
+      {
+        placed.insert(std::make_pair((static_cast<uint64_t>(old[i].offset) << 32) | old[i].size, i));
+      }
+    }
+
+    std::vector<size_t> writes;
+
+    for (size_t i = 0; i < regions.size(); i++)
+    {
+      Region& region = regions[i];
+      bool same = false;
+
+      if (region.size == 0)
+      {
+        continue;
+      }
+
+      if (region.source.empty() || changed.count(region.source) == 0)
+      {
+        auto range = placed.equal_range((static_cast<uint64_t>(region.offset) << 32) | region.size);
+
+        for (auto it = range.first; it != range.second && !same; ++it)
+        {
+          Region& before = old[it->second];
+          same = before.source == region.source && before.source_offset == region.source_offset
+            && before.fill == region.fill && before.data == region.data;
+        }
+      }
+
+      if (!same)
+      {
+        writes.push_back(i);
+      }
+    }
+
+    if (plan->size() != m_plan->size() && !(plan->size() < m_plan->size() ? m_out.truncate(plan->size()) : m_out.allocate(plan->size())))
+    {
+      std::cout << "Could not resize " << m_disc << std::endl;
+      return false;
+    }
+
+    std::atomic<bool> ok(true);
+
+    util::parallel_for(writes.size(), [&](size_t i)
+    {
+      if (!write_region(m_out, regions[writes[i]], false))
+      {
+        ok = false;
+      }
+    });
+
+    //  Alignment between sections belongs to no region, so clear any that moved
+    std::set<std::pair<uint32_t, uint32_t>> before = gaps(*m_plan);
+    std::vector<ByteRange> written;
+
+    for (auto& gap : gaps(*plan))
+    {
+      if (before.count(gap) == 0 && !m_out.fill_at(0, gap.second - gap.first, gap.first))
+      {
+        ok = false;
+      }
+
+      if (before.count(gap) == 0)
+      {
+        written.push_back(ByteRange(gap.first, gap.second - gap.first));
+      }
+    }
+
+    for (auto i : writes)
+    {
+      written.push_back(ByteRange(regions[i].offset, regions[i].size));
+    }
+
+    merkle_update(m_disc, written);
+
+    m_plan = std::move(plan);
+    index();
+
+    std::cout << "Rebuilt " << m_disc << " writing " << writes.size() << " of " << regions.size()
+      << " regions in " << elapsed_ms(start) << " ms" << std::endl;
+
+    return ok;
+  }
+#endif
+
+  /*
+    Summary:
+      Builds a ROM from an extracted directory and keeps rebuilding it as
+      the directory changes, until the process is stopped.
+
+    Parameters:
+      dir: The directory containing sys/, overlay/ and files/
+      disc: Output file path
+      options: Where to place files
+
+    Returns:
+      False if the ROM could not be built or watching stopped.
+  */
+  bool watch(std::string dir, std::string disc, BuildOptions options)
+  {
+#ifdef __linux__
+    Watcher watcher(dir, disc, options);
+    return watcher.start() && watcher.run();
+#else
+    std::cout << "Watching a directory is only supported on Linux" << std::endl;
+    return false;
+#endif
+  }
+}
@@ -0,0 +1,58 @@
+#ifndef _MD_NDS_WATCH_H
+#define _MD_NDS_WATCH_H
+
+#include <cstdint>
+#include <memory>
+#include <set>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "nds_plan.h"
+#include "util_io.h"
+
+namespace nds
+{
+#ifdef __linux__
+  /*
+    Keeps a ROM up to date with the directory it was built from, the same
+    as a fresh build of it. The plan of the last build stays in memory, so
+    an edited file that kept its size is written in place. Any other
+    change lays the directory out again and writes only the regions that
+    moved or changed.
+  */
+  class Watcher
+  {
+  public:
+    Watcher(std::string dir, std::string disc, const BuildOptions& options);
+    Watcher(const Watcher&) = delete;
+    Watcher& operator=(const Watcher&) = delete;
+    ~Watcher();
+
+    bool start();
+    bool run();
+
+  private:
+    std::string m_dir;
+    std::string m_disc;
+    BuildOptions m_options;
+    std::unique_ptr<BuildPlan> m_plan;
+    util::File m_out;
+
+    std::unordered_map<std::string, size_t> m_sources;  //  Source path of every overlay and file region to its index
+
+    int m_fd;
+    std::unordered_map<int, std::string> m_watches;     //  Watch descriptor to its directory under m_dir
+
+    void index();
+    void add_watches(const std::string& path);
+    bool read_events(std::set<std::string>& changed, bool& structural);
+    bool update_in_place(const std::set<std::string>& changed);
+    bool rebuild(const std::set<std::string>& changed);
+  };
+#endif
+
+  bool watch(std::string dir, std::string disc, BuildOptions options = BuildOptions());
+}
+
+#endif
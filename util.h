@@ -42,7 +42,13 @@
 #include <sstream>
 #include <fstream>
 #include <cstdint>
+#include <cstring>
 #include <vector>
+#include <array>
+#include <thread>
+#include <atomic>
+
+#include "util_throttle.h"
 
 namespace util
 {
@@ -78,6 +84,7 @@ namespace util
     fseek(fp, offset, SEEK_SET);
 
     std::vector<uint8_t> ret(size);
+    throttle().read(size);
     fread(&ret[0], sizeof(uint8_t), size, fp);
     fclose(fp);
 
@@ -115,6 +122,7 @@ namespace util
       data.resize(vector_offset + size);
     }
 
+    throttle().read(size);
     fread(&data[vector_offset], sizeof(uint8_t), size, fp);
     fclose(fp);
 
@@ -127,6 +135,7 @@ namespace util
 
     if (fp && (data.size() > 0))
     {
+      throttle().write(count ? count : data.size());
       fwrite(&data[0], sizeof(data[0]), count ? count : data.size(), fp);
       fclose(fp);
     }
@@ -147,6 +156,7 @@ namespace util
         fseek(fp, 0, SEEK_END);
       }
 
+      throttle().write(count ? count : data.size());
       fwrite(&data[0], sizeof(data[0]), count ? count : data.size(), fp);
 
       if (count > data.size())
@@ -159,20 +169,46 @@ namespace util
     }
   }
 
-  template <typename T> inline T read(std::vector<uint8_t>& data, uint32_t offset = 0)
+  /*
+    Summary:
+      Loads a little endian integer from unaligned memory. The memcpy
+      compiles down to a single load on every target we care about.
+  */
+  template <typename T> inline T load(const uint8_t* data)
   {
     static_assert(std::is_integral<T>::value, "Value must be an integral type.");
-    T ret = 0;
+    T ret;
+    memcpy(&ret, data, sizeof(T));
 
-    for (uint32_t i = 0; i < sizeof(T); i++)
-    {
-      //  Cast it to T to allow proper shifting for 64 bit values
-      ret |= static_cast<T>(data[i + offset]) << (i * 8);
-    }
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    uint8_t* bytes = reinterpret_cast<uint8_t*>(&ret);
+    std::reverse(bytes, bytes + sizeof(T));
+#endif
 
     return ret;
   }
 
+  /*
+    Summary:
+      Stores a little endian integer to unaligned memory.
+  */
+  template <typename T> inline void store(uint8_t* data, T val)
+  {
+    static_assert(std::is_integral<T>::value, "Value must be an integral type.");
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    uint8_t* bytes = reinterpret_cast<uint8_t*>(&val);
+    std::reverse(bytes, bytes + sizeof(T));
+#endif
+
+    memcpy(data, &val, sizeof(T));
+  }
+
+  template <typename T> inline T read(const std::vector<uint8_t>& data, uint32_t offset = 0)
+  {
+    return load<T>(&data[offset]);
+  }
+
   template <typename T> inline T read_big(std::vector<uint8_t>& data, uint32_t offset = 0)
   {
     static_assert(std::is_integral<T>::value, "Value must be an integral type.");
@@ -340,10 +376,9 @@ namespace util
 
   template<typename T> inline void push_int(std::vector<uint8_t>& v, T val)
   {
-    for (int i = 0; i < sizeof(T); i++)
-    {
-      v.push_back((val & (static_cast<T>(0xFF) << (i * 8))) >> (i * 8));
-    }
+    size_t pos = v.size();
+    v.resize(pos + sizeof(T));
+    store<T>(&v[pos], val);
   }
 
   template<typename T> inline void push_int_big(std::vector<uint8_t>& v, T val)
@@ -353,10 +388,9 @@ namespace util
 
   template<typename T> inline void insert_int(std::vector<uint8_t>& v, T val, uint32_t offset = 0)
   {
-    for (int i = 0; i < sizeof(T); i++)
-    {
-      v.insert(v.begin() + offset, (val & (static_cast<T>(0xFF) << (i * 8))) >> (i * 8));
-    }
+    uint8_t bytes[sizeof(T)];
+    store<T>(bytes, val);
+    v.insert(v.begin() + offset, bytes, bytes + sizeof(T));
   }
 
   template<typename T> inline void insert_int_big(std::vector<uint8_t>& v, T val, uint32_t offset = 0)
@@ -366,10 +400,7 @@ namespace util
 
   template<typename T> inline void write_int(std::vector<uint8_t>& v, T val, uint32_t offset)
   {
-    for (int i = 0; i < sizeof(T); i++)
-    {
-      v[offset + i] = (val & (0xFF << (i * 8))) >> (i * 8);
-    }
+    store<T>(&v[offset], val);
   }
 
   template<typename T> inline void write_int_big(std::vector<uint8_t>& v, T val, uint32_t offset)
@@ -379,10 +410,7 @@ namespace util
 
   inline void push(std::vector<uint8_t>& v, std::string val)
   {
-    for (auto& c : val)
-    {
-      v.push_back(c);
-    }
+    v.insert(v.end(), val.begin(), val.end());
   }
 
   template<typename T> inline T pad(T val, uint32_t align)
@@ -393,9 +421,392 @@ namespace util
 
   inline void pad(std::vector<uint8_t>& v, uint32_t count, uint8_t val = 0)
   {
-    for (uint32_t i = 0; i < count; i++)
+    v.insert(v.end(), count, val);
+  }
+
+  /*
+    Builds a little endian byte buffer. Space can be reserved up front when
+    the final size is known, every write goes in as one block, and values
+    can be patched in later at offsets that were written earlier.
+  */
+  class ByteWriter
+  {
+  public:
+    ByteWriter(size_t reserve = 0)
+    {
+      m_data.reserve(reserve);
+    }
+
+    inline void reserve(size_t count)
+    {
+      m_data.reserve(count);
+    }
+
+    inline size_t size() const
+    {
+      return m_data.size();
+    }
+
+    //  Appends an integer
+    template<typename T> inline void write(T val)
+    {
+      size_t pos = m_data.size();
+      m_data.resize(pos + sizeof(T));
+      store<T>(&m_data[pos], val);
+    }
+
+    //  Appends a block of bytes
+    inline void write(const void* data, size_t count)
+    {
+      const uint8_t* bytes = static_cast<const uint8_t*>(data);
+      m_data.insert(m_data.end(), bytes, bytes + count);
+    }
+
+    inline void write(const std::string& str)
+    {
+      write(str.data(), str.size());
+    }
+
+    inline void write(const std::vector<uint8_t>& data)
+    {
+      write(data.data(), data.size());
+    }
+
+    //  Appends count copies of a byte
+    inline void fill(uint8_t val, size_t count)
+    {
+      m_data.resize(m_data.size() + count, val);
+    }
+
+    //  Pads the buffer out to a multiple of align
+    inline void align(uint32_t align, uint8_t val = 0)
+    {
+      fill(val, util::pad(m_data.size(), align));
+    }
+
+    //  Overwrites an integer that was already written
+    template<typename T> inline void patch(size_t offset, T val)
+    {
+      store<T>(&m_data[offset], val);
+    }
+
+    inline std::vector<uint8_t>& data()
+    {
+      return m_data;
+    }
+
+    //  Hands the buffer over, leaving the writer empty
+    inline std::vector<uint8_t> release()
+    {
+      return std::move(m_data);
+    }
+
+  private:
+    std::vector<uint8_t> m_data;
+  };
+
+  /*
+    Summary:
+      Computes the standard (zlib) CRC-32 of a block of data.
+
+    Parameters:
+      data: Data to checksum
+      size: Number of bytes
+      crc: CRC of everything before this block, to checksum data in pieces
+  */
+  inline uint32_t crc32(const uint8_t* data, size_t size, uint32_t crc = 0)
+  {
+    static const std::vector<uint32_t> table = []()
+    {
+      std::vector<uint32_t> table(256);
+
+      for (uint32_t i = 0; i < 256; i++)
+      {
+        uint32_t c = i;
+
+        for (int k = 0; k < 8; k++)
+        {
+          c = (c & 1) ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+        }
+
+        table[i] = c;
+      }
+
+      return table;
+    }();
+
+    crc = ~crc;
+
+    for (size_t i = 0; i < size; i++)
+    {
+      crc = table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+    }
+
+    return ~crc;
+  }
+
+  /*
+    Summary:
+      Computes the CRC-16 (MODBUS) used by the header and banner checksums.
+  */
+  inline uint16_t crc16(const uint8_t* data, size_t size, uint16_t crc = 0xFFFF)
+  {
+    static const std::vector<uint16_t> table = []()
+    {
+      std::vector<uint16_t> table(256);
+
+      for (uint32_t i = 0; i < 256; i++)
+      {
+        uint16_t c = static_cast<uint16_t>(i);
+
+        for (int k = 0; k < 8; k++)
+        {
+          c = (c & 1) ? 0xA001 ^ (c >> 1) : c >> 1;
+        }
+
+        table[i] = c;
+      }
+
+      return table;
+    }();
+
+    for (size_t i = 0; i < size; i++)
+    {
+      crc = table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+    }
+
+    return crc;
+  }
+
+  /*
+    Summary:
+      A fast 64 bit non-cryptographic hash in the style of XXH64. Used to
+      tell whether two ranges are likely to be equal before comparing them.
+  */
+  inline uint64_t hash64(const uint8_t* data, size_t size, uint64_t seed = 0)
+  {
+    const uint64_t p1 = 0x9E3779B185EBCA87ULL;
+    const uint64_t p2 = 0xC2B2AE3D27D4EB4FULL;
+    const uint64_t p3 = 0x165667B19E3779F9ULL;
+    const uint64_t p4 = 0x85EBCA77C2B2AE63ULL;
+    const uint64_t p5 = 0x27D4EB2F165667C5ULL;
+
+    auto round = [&](uint64_t acc, uint64_t input)
+    {
+      acc += input * p2;
+      acc = (acc << 31) | (acc >> 33);
+      return acc * p1;
+    };
+
+    auto rotl = [](uint64_t x, int r)
+    {
+      return (x << r) | (x >> (64 - r));
+    };
+
+    const uint8_t* end = data + size;
+    uint64_t h;
+
+    if (size >= 32)
+    {
+      uint64_t v1 = seed + p1 + p2;
+      uint64_t v2 = seed + p2;
+      uint64_t v3 = seed;
+      uint64_t v4 = seed - p1;
+
+      for (; data + 32 <= end; data += 32)
+      {
+        v1 = round(v1, load<uint64_t>(data));
+        v2 = round(v2, load<uint64_t>(data + 8));
+        v3 = round(v3, load<uint64_t>(data + 16));
+        v4 = round(v4, load<uint64_t>(data + 24));
+      }
+
+      h = rotl(v1, 1) + rotl(v2, 7) + rotl(v3, 12) + rotl(v4, 18);
+
+      for (uint64_t v : { v1, v2, v3, v4 })
+      {
+        h ^= round(0, v);
+        h = h * p1 + p4;
+      }
+    }
+    else
+    {
+      h = seed + p5;
+    }
+
+    h += size;
+
+    for (; data + 8 <= end; data += 8)
+    {
+      h ^= round(0, load<uint64_t>(data));
+      h = rotl(h, 27) * p1 + p4;
+    }
+
+    if (data + 4 <= end)
+    {
+      h ^= static_cast<uint64_t>(load<uint32_t>(data)) * p1;
+      h = rotl(h, 23) * p2 + p3;
+      data += 4;
+    }
+
+    for (; data < end; data++)
+    {
+      h ^= *data * p5;
+      h = rotl(h, 11) * p1;
+    }
+
+    h ^= h >> 33;
+    h *= p2;
+    h ^= h >> 29;
+    h *= p3;
+    h ^= h >> 32;
+
+    return h;
+  }
+
+  /*
+    Summary:
+      SHA-256 of a range. Much slower than hash64, for names that have to
+      stand for the contents on their own, such as store objects.
+  */
+  inline std::array<uint8_t, 32> sha256(const uint8_t* data, size_t size)
+  {
+    static const uint32_t k[64] =
+    {
+      0x428A2F98, 0x71374491, 0xB5C0FBCF, 0xE9B5DBA5, 0x3956C25B, 0x59F111F1, 0x923F82A4, 0xAB1C5ED5,
+      0xD807AA98, 0x12835B01, 0x243185BE, 0x550C7DC3, 0x72BE5D74, 0x80DEB1FE, 0x9BDC06A7, 0xC19BF174,
+      0xE49B69C1, 0xEFBE4786, 0x0FC19DC6, 0x240CA1CC, 0x2DE92C6F, 0x4A7484AA, 0x5CB0A9DC, 0x76F988DA,
+      0x983E5152, 0xA831C66D, 0xB00327C8, 0xBF597FC7, 0xC6E00BF3, 0xD5A79147, 0x06CA6351, 0x14292967,
+      0x27B70A85, 0x2E1B2138, 0x4D2C6DFC, 0x53380D13, 0x650A7354, 0x766A0ABB, 0x81C2C92E, 0x92722C85,
+      0xA2BFE8A1, 0xA81A664B, 0xC24B8B70, 0xC76C51A3, 0xD192E819, 0xD6990624, 0xF40E3585, 0x106AA070,
+      0x19A4C116, 0x1E376C08, 0x2748774C, 0x34B0BCB5, 0x391C0CB3, 0x4ED8AA4A, 0x5B9CCA4F, 0x682E6FF3,
+      0x748F82EE, 0x78A5636F, 0x84C87814, 0x8CC70208, 0x90BEFFFA, 0xA4506CEB, 0xBEF9A3F7, 0xC67178F2
+    };
+
+    uint32_t h[8] = { 0x6A09E667, 0xBB67AE85, 0x3C6EF372, 0xA54FF53A, 0x510E527F, 0x9B05688C, 0x1F83D9AB, 0x5BE0CD19 };
+
+    auto rotr = [](uint32_t x, int r)
+    {
+      return (x >> r) | (x << (32 - r));
+    };
+
+    auto block = [&](const uint8_t* p)
+    {
+      uint32_t w[64];
+
+      for (int i = 0; i < 16; i++)
+      {
+        w[i] = (uint32_t(p[i * 4]) << 24) | (uint32_t(p[i * 4 + 1]) << 16) | (uint32_t(p[i * 4 + 2]) << 8) | p[i * 4 + 3];
+      }
+
+      for (int i = 16; i < 64; i++)
+      {
+        uint32_t s0 = rotr(w[i - 15], 7) ^ rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        uint32_t s1 = rotr(w[i - 2], 17) ^ rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+      }
+
+      uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4], f = h[5], g = h[6], j = h[7];
+
+      for (int i = 0; i < 64; i++)
+      {
+        uint32_t t1 = j + (rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25)) + ((e & f) ^ (~e & g)) + k[i] + w[i];
+        uint32_t t2 = (rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+        j = g;
+        g = f;
+        f = e;
+        e = d + t1;
+        d = c;
+        c = b;
+        b = a;
+        a = t1 + t2;
+      }
+
+      h[0] += a; h[1] += b; h[2] += c; h[3] += d; h[4] += e; h[5] += f; h[6] += g; h[7] += j;
+    };
+
+    size_t full = size & ~size_t(63);
+
+    for (size_t i = 0; i < full; i += 64)
+    {
+      block(data + i);
+    }
+
+    //  The rest, a 1 bit, zeros and the length in bits, in one or two blocks
+    uint8_t last[128] = {};
+    size_t rest = size - full;
+    size_t tail = (rest < 56) ? 64 : 128;
+    uint64_t bits = static_cast<uint64_t>(size) * 8;
+
+    std::copy(data + full, data + size, last);
+    last[rest] = 0x80;
+
+    for (int i = 0; i < 8; i++)
+    {
+      last[tail - 1 - i] = static_cast<uint8_t>(bits >> (i * 8));
+    }
+
+    for (size_t i = 0; i < tail; i += 64)
     {
-      v.push_back(val);
+      block(last + i);
+    }
+
+    std::array<uint8_t, 32> digest;
+
+    for (int i = 0; i < 32; i++)
+    {
+      digest[i] = static_cast<uint8_t>(h[i / 4] >> (24 - (i % 4) * 8));
+    }
+
+    return digest;
+  }
+
+  /*
+    Summary:
+      Calls func(i) for every i in [0, count) spread across a pool of threads.
+      Indices are handed out one at a time so uneven work still balances.
+
+    Parameters:
+      count: Number of work items
+      func: Callable taking a size_t index
+      threads: Number of threads to use, or 0 for one per hardware thread
+  */
+  template<typename F> inline void parallel_for(size_t count, F func, uint32_t threads = 0)
+  {
+    if (threads == 0)
+    {
+      threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+
+    threads = static_cast<uint32_t>(std::min<size_t>(threads, count));
+
+    if (threads <= 1)
+    {
+      for (size_t i = 0; i < count; i++)
+      {
+        func(i);
+      }
+
+      return;
+    }
+
+    std::atomic<size_t> next(0);
+    std::vector<std::thread> pool;
+
+    for (uint32_t t = 0; t < threads; t++)
+    {
+      pool.emplace_back([&]()
+      {
+        for (size_t i = next++; i < count; i = next++)
+        {
+          func(i);
+        }
+      });
+    }
+
+    for (auto& thread : pool)
+    {
+      thread.join();
     }
   }
 
@@ -410,6 +821,106 @@ namespace util
 
     return ret;
   }
+
+  //  Lower case hex of every byte of a value, most significant first
+  template<typename T> inline std::string to_hex(T value)
+  {
+    static const char digits[] = "0123456789abcdef";
+    std::string ret(sizeof(T) * 2, '0');
+
+    for (size_t i = ret.size(); i > 0; i--)
+    {
+      ret[i - 1] = digits[value & 0xF];
+      value >>= 4;
+    }
+
+    return ret;
+  }
+
+  //  Quotes a UTF-8 string for JSON, escaping quotes and control characters
+  inline std::string json_string(const std::string& str)
+  {
+    std::string ret = "\"";
+
+    for (unsigned char c : str)
+    {
+      if (c == '"' || c == '\\')
+      {
+        ret += '\\';
+        ret += c;
+      }
+      else if (c < 0x20 || c == 0x7F)
+      {
+        ret += "\\u00" + to_hex<uint8_t>(c);
+      }
+      else
+      {
+        ret += c;
+      }
+    }
+
+    return ret + "\"";
+  }
+
+  /*
+    Summary:
+      Converts UTF-16 to UTF-8, stopping at the first zero.
+
+    Parameters:
+      data: Little endian UTF-16
+      units: Most 16 bit units to read
+  */
+  inline std::string utf16_to_utf8(const uint8_t* data, uint32_t units)
+  {
+    std::string ret;
+
+    for (uint32_t i = 0; i < units; i++)
+    {
+      uint32_t c = load<uint16_t>(data + i * 2);
+
+      if (c == 0)
+      {
+        break;
+      }
+
+      //  Join surrogate pairs
+      if (c >= 0xD800 && c < 0xDC00 && i + 1 < units)
+      {
+        uint32_t low = load<uint16_t>(data + i * 2 + 2);
+
+        if (low >= 0xDC00 && low < 0xE000)
+        {
+          c = 0x10000 + ((c - 0xD800) << 10) + (low - 0xDC00);
+          i++;
+        }
+      }
+
+      if (c < 0x80)
+      {
+        ret += static_cast<char>(c);
+      }
+      else if (c < 0x800)
+      {
+        ret += static_cast<char>(0xC0 | (c >> 6));
+        ret += static_cast<char>(0x80 | (c & 0x3F));
+      }
+      else if (c < 0x10000)
+      {
+        ret += static_cast<char>(0xE0 | (c >> 12));
+        ret += static_cast<char>(0x80 | ((c >> 6) & 0x3F));
+        ret += static_cast<char>(0x80 | (c & 0x3F));
+      }
+      else
+      {
+        ret += static_cast<char>(0xF0 | (c >> 18));
+        ret += static_cast<char>(0x80 | ((c >> 12) & 0x3F));
+        ret += static_cast<char>(0x80 | ((c >> 6) & 0x3F));
+        ret += static_cast<char>(0x80 | (c & 0x3F));
+      }
+    }
+
+    return ret;
+  }
 };
 
 #endif
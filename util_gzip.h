@@ -0,0 +1,940 @@
+/*
+    Random access to gzip files without inflating them up front.
+
+    The first time a file is opened it is inflated once from start to end,
+    noting a seek point at the first deflate block that starts after every
+    SeekSpan bytes of output, along with the 32 KiB of output before it that
+    the block may refer back to. The points are saved to an index file, so
+    later opens only inflate the spans that are actually read, each starting
+    from the point just before it.
+
+    Like util_png.h this carries its own deflate code instead of linking
+    zlib. Decoding is table driven with a 64 bit bit buffer, which is fast
+    enough that the spans, and not the decoder, set the cost of a read.
+*/
+
+#ifndef _UTIL_GZIP_H
+#define _UTIL_GZIP_H
+
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "util.h"
+#include "util_io.h"
+
+namespace util
+{
+  /*
+    Decodes deflate blocks from a buffer holding a whole gzip file. Blocks
+    are decoded one at a time into a caller's buffer, and decoding can be
+    picked up at the bit any block starts at.
+  */
+  class Inflater
+  {
+  public:
+    enum Status { Ok, Full, Bad };
+
+    Inflater(const uint8_t* in, size_t size) : m_in(in), m_size(size), m_lengths(1 << 15), m_distances(1 << 15), m_codes(1 << 7) {};
+
+    //  Bit position in the input of the next bit to decode
+    inline uint64_t position() const
+    {
+      return static_cast<uint64_t>(m_next) * 8 - m_count;
+    }
+
+    inline void seek(uint64_t bit)
+    {
+      m_next = static_cast<size_t>(bit >> 3);
+      m_bits = 0;
+      m_count = 0;
+      refill();
+      take(bit & 7);
+    }
+
+    //  Determines whether a gzip member starts at the next byte boundary
+    bool at_member()
+    {
+      size_t pos = static_cast<size_t>((position() + 7) >> 3);
+      return pos + 10 <= m_size && m_in[pos] == 0x1F && m_in[pos + 1] == 0x8B && m_in[pos + 2] == 8;
+    }
+
+    /*
+      Summary:
+        Skips the header of the gzip member at the next byte boundary.
+
+      Returns:
+        True if a valid header was skipped.
+    */
+    bool member()
+    {
+      if (!at_member())
+      {
+        return false;
+      }
+
+      size_t pos = static_cast<size_t>((position() + 7) >> 3);
+      uint8_t flags = m_in[pos + 3];
+
+      if (flags & 0xE0)
+      {
+        return false;
+      }
+
+      pos += 10;
+
+      //  FEXTRA
+      if (flags & 4)
+      {
+        if (pos + 2 > m_size)
+        {
+          return false;
+        }
+
+        pos += 2 + load<uint16_t>(m_in + pos);
+      }
+
+      //  FNAME and FCOMMENT are both zero terminated
+      for (uint8_t flag : { 8, 16 })
+      {
+        if (flags & flag)
+        {
+          while (pos < m_size && m_in[pos] != 0)
+          {
+            pos++;
+          }
+
+          pos++;
+        }
+      }
+
+      //  FHCRC
+      if (flags & 2)
+      {
+        pos += 2;
+      }
+
+      if (pos > m_size)
+      {
+        return false;
+      }
+
+      seek(static_cast<uint64_t>(pos) * 8);
+      return true;
+    }
+
+    /*
+      Summary:
+        Reads the CRC-32 and size that follow the last block of a member.
+
+      Returns:
+        True if the whole trailer was there.
+    */
+    bool trailer(uint32_t& crc, uint32_t& size)
+    {
+      size_t pos = static_cast<size_t>((position() + 7) >> 3);
+
+      if (pos + 8 > m_size)
+      {
+        return false;
+      }
+
+      crc = load<uint32_t>(m_in + pos);
+      size = load<uint32_t>(m_in + pos + 4);
+      seek(static_cast<uint64_t>(pos + 8) * 8);
+      return true;
+    }
+
+    /*
+      Summary:
+        Decodes one deflate block. Distances may reach back into whatever
+        the buffer holds before pos, which is how a seek point's window is
+        supplied.
+
+      Parameters:
+        out: Output buffer
+        pos: Where in out to write, moved past the output on success
+        limit: Size of out
+        last: Set if this was the last block of its member
+
+      Returns:
+        Ok, Full if out is too small for the block, in which case the block
+        has to be decoded again from its start, or Bad for invalid data.
+    */
+    Status block(uint8_t* out, size_t& pos, size_t limit, bool& last)
+    {
+      refill();
+      last = take(1) != 0;
+      uint32_t type = take(2);
+
+      if (type == 0)
+      {
+        return stored(out, pos, limit);
+      }
+
+      if (type == 1)
+      {
+        fixed();
+      }
+      else if (type != 2 || !dynamic())
+      {
+        return Bad;
+      }
+
+      return codes(out, pos, limit);
+    }
+
+  private:
+    //  A Huffman code as a table indexed by the next bits of input, each entry holding symbol << 4 | length
+    struct Table
+    {
+      Table(size_t size) : entries(size) {};
+
+      std::vector<uint16_t> entries;
+      uint32_t mask = 0;
+    };
+
+    const uint8_t* m_in;
+    size_t m_size;
+    size_t m_next = 0;    //  Next byte to load into the bit buffer
+    uint64_t m_bits = 0;
+    uint32_t m_count = 0; //  Bits in m_bits, always fewer than 64
+    Table m_lengths;
+    Table m_distances;
+    Table m_codes;
+
+    //  Loads the bit buffer to at least 56 bits. Reading past the end gives zeros, which block() catches.
+    inline void refill()
+    {
+      if (m_next + 8 <= m_size)
+      {
+        //  Bytes above the count are loaded again later at the same place, so they can be left in
+        m_bits |= load<uint64_t>(m_in + m_next) << m_count;
+        m_next += (63 - m_count) >> 3;
+        m_count |= 56;
+        return;
+      }
+
+      while (m_count < 56)
+      {
+        m_bits |= static_cast<uint64_t>(m_next < m_size ? m_in[m_next] : 0) << m_count;
+        m_next++;
+        m_count += 8;
+      }
+    }
+
+    //  Takes bits that refill() has already loaded
+    inline uint32_t take(uint32_t count)
+    {
+      uint32_t ret = static_cast<uint32_t>(m_bits & ((1ULL << count) - 1));
+      m_bits >>= count;
+      m_count -= count;
+      return ret;
+    }
+
+    inline uint32_t bits(uint32_t count)
+    {
+      if (m_count < count)
+      {
+        refill();
+      }
+
+      return take(count);
+    }
+
+    //  Decodes a symbol, or returns -1 for a code the table doesn't hold
+    inline int32_t decode(const Table& table)
+    {
+      if (m_count < 15)
+      {
+        refill();
+      }
+
+      uint16_t entry = table.entries[m_bits & table.mask];
+
+      if ((entry & 15) == 0)
+      {
+        return -1;
+      }
+
+      take(entry & 15);
+      return entry >> 4;
+    }
+
+    //  Builds the table of a canonical Huffman code from its code lengths, allowing incomplete codes
+    static bool build(Table& table, const uint8_t* lengths, uint32_t count)
+    {
+      uint32_t counts[16] = {};
+      uint32_t next[16] = {};
+      uint32_t max = 0;
+
+      for (uint32_t i = 0; i < count; i++)
+      {
+        counts[lengths[i]]++;
+        max = std::max<uint32_t>(max, lengths[i]);
+      }
+
+      counts[0] = 0;
+      int32_t left = 1;
+
+      for (uint32_t len = 1; len < 16; len++)
+      {
+        left = (left << 1) - static_cast<int32_t>(counts[len]);
+
+        if (left < 0)
+        {
+          return false;
+        }
+
+        next[len] = (next[len - 1] + counts[len - 1]) << 1;
+      }
+
+      //  A code with no symbols still needs one entry so every lookup misses
+      uint32_t size = 1 << std::max<uint32_t>(max, 1);
+      table.mask = size - 1;
+      std::fill(table.entries.begin(), table.entries.begin() + size, 0);
+
+      for (uint32_t sym = 0; sym < count; sym++)
+      {
+        uint32_t len = lengths[sym];
+
+        if (len == 0)
+        {
+          continue;
+        }
+
+        //  Codes are stored most significant bit first but read least significant bit first
+        uint32_t code = next[len]++;
+        uint32_t reversed = 0;
+
+        for (uint32_t i = 0; i < len; i++)
+        {
+          reversed |= ((code >> i) & 1) << (len - 1 - i);
+        }
+
+        for (uint32_t i = reversed; i < size; i += 1 << len)
+        {
+          table.entries[i] = static_cast<uint16_t>((sym << 4) | len);
+        }
+      }
+
+      return true;
+    }
+
+    void fixed()
+    {
+      uint8_t lengths[288 + 32];
+
+      std::fill(lengths, lengths + 144, 8);
+      std::fill(lengths + 144, lengths + 256, 9);
+      std::fill(lengths + 256, lengths + 280, 7);
+      std::fill(lengths + 280, lengths + 288, 8);
+      std::fill(lengths + 288, lengths + 320, 5);
+
+      build(m_lengths, lengths, 288);
+      build(m_distances, lengths + 288, 32);
+    }
+
+    bool dynamic()
+    {
+      static const uint8_t Order[19] = { 16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15 };
+
+      uint32_t literals = bits(5) + 257;
+      uint32_t distances = bits(5) + 1;
+      uint32_t codes = bits(4) + 4;
+      uint8_t lengths[288 + 32] = {};
+
+      for (uint32_t i = 0; i < codes; i++)
+      {
+        lengths[Order[i]] = static_cast<uint8_t>(bits(3));
+      }
+
+      if (literals > 286 || distances > 30 || !build(m_codes, lengths, 19))
+      {
+        return false;
+      }
+
+      std::fill(lengths, lengths + 19, 0);
+
+      for (uint32_t i = 0; i < literals + distances;)
+      {
+        int32_t sym = decode(m_codes);
+        uint32_t repeat = 0;
+        uint8_t value = 0;
+
+        if (sym < 0)
+        {
+          return false;
+        }
+
+        if (sym < 16)
+        {
+          lengths[i++] = static_cast<uint8_t>(sym);
+          continue;
+        }
+
+        if (sym == 16)
+        {
+          if (i == 0)
+          {
+            return false;
+          }
+
+          value = lengths[i - 1];
+          repeat = 3 + bits(2);
+        }
+        else
+        {
+          repeat = (sym == 17) ? 3 + bits(3) : 11 + bits(7);
+        }
+
+        if (i + repeat > literals + distances)
+        {
+          return false;
+        }
+
+        std::fill(lengths + i, lengths + i + repeat, value);
+        i += repeat;
+      }
+
+      //  Every block has to be able to end
+      return lengths[256] != 0 && build(m_lengths, lengths, literals) && build(m_distances, lengths + literals, distances);
+    }
+
+    Status stored(uint8_t* out, size_t& pos, size_t limit)
+    {
+      take(m_count & 7);
+      uint32_t len = bits(16);
+      uint32_t nlen = bits(16);
+      size_t in = static_cast<size_t>(position() >> 3);
+
+      if ((len ^ 0xFFFF) != nlen || in + len > m_size)
+      {
+        return Bad;
+      }
+
+      if (len > limit - pos)
+      {
+        return Full;
+      }
+
+      memcpy(out + pos, m_in + in, len);
+      pos += len;
+      seek(static_cast<uint64_t>(in + len) * 8);
+      return Ok;
+    }
+
+    Status codes(uint8_t* out, size_t& pos, size_t limit)
+    {
+      static const uint16_t LengthBase[29] = { 3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258 };
+      static const uint8_t LengthExtra[29] = { 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+      static const uint16_t DistanceBase[30] = { 1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577 };
+      static const uint8_t DistanceExtra[30] = { 0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13 };
+
+      const uint16_t* lengths = m_lengths.entries.data();
+      const uint16_t* distances = m_distances.entries.data();
+
+      while (true)
+      {
+        //  56 bits covers the longest length and distance with their extra bits
+        refill();
+
+        if (m_next > m_size + 8)
+        {
+          return Bad;
+        }
+
+        uint16_t entry = lengths[m_bits & m_lengths.mask];
+
+        if ((entry & 15) == 0)
+        {
+          return Bad;
+        }
+
+        take(entry & 15);
+        uint32_t sym = entry >> 4;
+
+        if (sym < 256)
+        {
+          if (pos >= limit)
+          {
+            return Full;
+          }
+
+          out[pos++] = static_cast<uint8_t>(sym);
+          continue;
+        }
+
+        if (sym == 256)
+        {
+          return (position() <= static_cast<uint64_t>(m_size) * 8) ? Ok : Bad;
+        }
+
+        sym -= 257;
+
+        if (sym >= 29)
+        {
+          return Bad;
+        }
+
+        uint32_t len = LengthBase[sym] + take(LengthExtra[sym]);
+        entry = distances[m_bits & m_distances.mask];
+
+        if ((entry & 15) == 0 || (entry >> 4) >= 30)
+        {
+          return Bad;
+        }
+
+        take(entry & 15);
+        uint32_t dist = DistanceBase[entry >> 4] + take(DistanceExtra[entry >> 4]);
+
+        if (dist > pos)
+        {
+          return Bad;
+        }
+
+        if (len > limit - pos)
+        {
+          return Full;
+        }
+
+        uint8_t* dst = out + pos;
+        const uint8_t* src = dst - dist;
+        pos += len;
+
+        if (dist >= len)
+        {
+          memcpy(dst, src, len);
+        }
+        else
+        {
+          //  Overlapping copies repeat the last dist bytes
+          for (uint32_t i = 0; i < len; i++)
+          {
+            dst[i] = src[i];
+          }
+        }
+      }
+    }
+  };
+
+  /*
+    A gzip file inflated on demand. The whole image has an address from the
+    start, but a span of it is only inflated the first time it is filled.
+    Filling is safe from several threads at once and spans are inflated in
+    parallel when different threads need different ones.
+  */
+  class GzipImage
+  {
+  public:
+    static constexpr uint64_t SeekSpan = 1 << 20;   //  Output between seek points
+    static constexpr uint32_t Window = 1 << 15;     //  History a deflate block can refer back to
+
+    GzipImage() {};
+    GzipImage(const GzipImage&) = delete;
+    GzipImage& operator=(const GzipImage&) = delete;
+
+    ~GzipImage()
+    {
+      release();
+    }
+
+    static inline bool is_gzip(const uint8_t* data, size_t size)
+    {
+      return size >= 18 && data[0] == 0x1F && data[1] == 0x8B && data[2] == 8;
+    }
+
+    /*
+      Summary:
+        Opens a gzip file, loading its seek points from an index file or
+        inflating the whole file to find them and saving them there.
+
+      Parameters:
+        filename: Path to the gzip file
+        index: Path to the index file
+
+      Returns:
+        True if the file could be opened and every member checked out
+        while indexing.
+    */
+    bool open(std::string filename, std::string index)
+    {
+      release();
+      m_points.clear();
+      m_windows.clear();
+      m_indexed = false;
+      m_saved = true;
+
+      if (!m_file.open(filename) || !is_gzip(m_file.data(), m_file.size()))
+      {
+        return false;
+      }
+
+      if (!load_index(index))
+      {
+        if (!scan())
+        {
+          return false;
+        }
+
+        m_indexed = true;
+        m_saved = save_index(index);
+      }
+
+      m_ready.reset(new std::atomic<bool>[m_points.size()]);
+      m_locks.reset(new std::mutex[m_points.size()]);
+
+      for (size_t i = 0; i < m_points.size(); i++)
+      {
+        m_ready[i] = m_indexed;
+      }
+
+      return true;
+    }
+
+    inline uint8_t* data() const
+    {
+      return m_data;
+    }
+
+    inline uint64_t size() const
+    {
+      return m_size;
+    }
+
+    //  Whether the index had to be built by this open, and whether it could then be saved
+    inline bool indexed() const
+    {
+      return m_indexed;
+    }
+
+    inline bool saved() const
+    {
+      return m_saved;
+    }
+
+    /*
+      Summary:
+        Makes sure a range of the image has been inflated. A span that can't
+        be inflated again is left as zeros, which can only happen if the file
+        changed in a way its index didn't notice.
+    */
+    void fill(uint64_t offset, uint64_t size) const
+    {
+      if (size == 0 || offset >= m_size)
+      {
+        return;
+      }
+
+      uint64_t end = std::min(offset + size, m_size);
+      size_t first = span_of(offset);
+
+      for (size_t i = first; i < m_points.size() && m_points[i].out < end; i++)
+      {
+        if (m_ready[i].load(std::memory_order_acquire))
+        {
+          continue;
+        }
+
+        std::lock_guard<std::mutex> lock(m_locks[i]);
+
+        if (!m_ready[i].load(std::memory_order_relaxed))
+        {
+          inflate_span(i);
+          m_ready[i].store(true, std::memory_order_release);
+        }
+      }
+    }
+
+  private:
+    struct Point
+    {
+      uint64_t out;   //  Offset in the image of the block
+      uint64_t bit;   //  Bit offset in the file of the block
+    };
+
+    static constexpr uint32_t IndexHeader = 48;
+
+    MappedFile m_file;
+    MappedFile m_index;
+    std::vector<Point> m_points;
+    std::vector<uint8_t> m_windows;           //  Windows of a freshly built index
+    const uint8_t* m_window_data = nullptr;   //  Window slots, each Window bytes ending at its point
+    uint8_t* m_data = nullptr;
+    uint64_t m_size = 0;
+    uint64_t m_capacity = 0;
+    bool m_indexed = false;
+    bool m_saved = true;
+    std::unique_ptr<std::atomic<bool>[]> m_ready;
+    std::unique_ptr<std::mutex[]> m_locks;
+#ifndef UTIL_IO_POSIX
+    std::vector<uint8_t> m_buffer;
+#endif
+
+    //  Identifies the file by its size and a hash of its tail, which ends with the CRC of the last member
+    uint64_t identity() const
+    {
+      size_t tail = std::min<size_t>(m_file.size(), 64 * 1024);
+      return hash64(m_file.data() + m_file.size() - tail, tail, m_file.size());
+    }
+
+    size_t span_of(uint64_t offset) const
+    {
+      size_t lo = 0;
+      size_t hi = m_points.size();
+
+      while (hi - lo > 1)
+      {
+        size_t mid = (lo + hi) / 2;
+
+        if (m_points[mid].out <= offset)
+        {
+          lo = mid;
+        }
+        else
+        {
+          hi = mid;
+        }
+      }
+
+      return lo;
+    }
+
+    //  Grows the image, keeping what is already in it. Pages that are never written cost nothing on POSIX.
+    bool reserve(uint64_t capacity)
+    {
+      if (capacity <= m_capacity)
+      {
+        return true;
+      }
+
+#ifdef UTIL_IO_POSIX
+      void* map = mmap(nullptr, capacity, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+
+      if (map == MAP_FAILED)
+      {
+        return false;
+      }
+
+      if (m_data)
+      {
+        memcpy(map, m_data, m_size);
+        munmap(m_data, m_capacity);
+      }
+
+      m_data = static_cast<uint8_t*>(map);
+#else
+      m_buffer.resize(capacity);
+      m_data = m_buffer.data();
+#endif
+      m_capacity = capacity;
+      return true;
+    }
+
+    void release()
+    {
+#ifdef UTIL_IO_POSIX
+      if (m_data)
+      {
+        munmap(m_data, m_capacity);
+      }
+#else
+      m_buffer.clear();
+#endif
+      m_data = nullptr;
+      m_size = 0;
+      m_capacity = 0;
+    }
+
+    /*
+      Summary:
+        Inflates the whole file into the image, checking each member against
+        its trailer and noting seek points along the way.
+    */
+    bool scan()
+    {
+      Inflater inflater(m_file.data(), m_file.size());
+
+      //  The size in the last trailer is exact for a single member under 4 GiB, otherwise it only sets where to start
+      uint32_t hint = load<uint32_t>(m_file.data() + m_file.size() - 4);
+
+      if (!reserve(std::max<uint64_t>(hint, SeekSpan)) || !inflater.member())
+      {
+        return false;
+      }
+
+      do
+      {
+        uint64_t start = m_size;
+        bool last = false;
+
+        while (!last)
+        {
+          uint64_t bit = inflater.position();
+
+          if (m_points.empty() || m_size - m_points.back().out >= SeekSpan)
+          {
+            size_t history = static_cast<size_t>(std::min<uint64_t>(m_size, Window));
+
+            m_points.push_back({ m_size, bit });
+            m_windows.resize(m_windows.size() + Window, 0);
+            memcpy(&m_windows[m_windows.size() - history], m_data + m_size - history, history);
+          }
+
+          while (true)
+          {
+            size_t pos = static_cast<size_t>(m_size);
+            Inflater::Status status = inflater.block(m_data, pos, static_cast<size_t>(m_capacity), last);
+
+            if (status == Inflater::Bad || (status == Inflater::Full && !reserve(m_capacity * 2)))
+            {
+              return false;
+            }
+
+            if (status == Inflater::Ok)
+            {
+              m_size = pos;
+              break;
+            }
+
+            inflater.seek(bit);
+          }
+        }
+
+        uint32_t crc;
+        uint32_t size;
+
+        if (!inflater.trailer(crc, size) || crc != crc32(m_data + start, m_size - start) || size != static_cast<uint32_t>(m_size - start))
+        {
+          return false;
+        }
+      }
+      while (inflater.at_member() && inflater.member());
+
+      m_window_data = m_windows.data();
+      return true;
+    }
+
+    bool load_index(const std::string& index)
+    {
+      if (!m_index.open(index) || m_index.size() < IndexHeader || memcmp(m_index.data(), "MDZIDX01", 8) != 0)
+      {
+        return false;
+      }
+
+      const uint8_t* header = m_index.data();
+      uint64_t count = load<uint32_t>(header + 40);
+
+      if (load<uint64_t>(header + 8) != m_file.size() || load<uint64_t>(header + 16) != identity()
+        || load<uint64_t>(header + 32) != SeekSpan || count == 0
+        || m_index.size() != IndexHeader + count * (sizeof(Point) + Window))
+      {
+        return false;
+      }
+
+      uint64_t size = load<uint64_t>(header + 24);
+
+      for (size_t i = 0; i < count; i++)
+      {
+        const uint8_t* entry = header + IndexHeader + i * sizeof(Point);
+        Point point = { load<uint64_t>(entry), load<uint64_t>(entry + 8) };
+
+        bool ordered = (i == 0) ? point.out == 0 : (point.out > m_points.back().out && point.out < size);
+
+        if (!ordered || point.bit >= m_file.size() * 8)
+        {
+          m_points.clear();
+          return false;
+        }
+
+        m_points.push_back(point);
+      }
+
+      if (!reserve(std::max<uint64_t>(size, 1)))
+      {
+        return false;
+      }
+
+      m_size = size;
+      m_window_data = header + IndexHeader + count * sizeof(Point);
+      return true;
+    }
+
+    //  Writes the index under a temporary name first so a reader never sees half of one
+    bool save_index(const std::string& index)
+    {
+      ByteWriter out(IndexHeader + m_points.size() * sizeof(Point));
+
+      out.write("MDZIDX01", 8);
+      out.write<uint64_t>(m_file.size());
+      out.write<uint64_t>(identity());
+      out.write<uint64_t>(m_size);
+      out.write<uint64_t>(SeekSpan);
+      out.write<uint32_t>(static_cast<uint32_t>(m_points.size()));
+      out.write<uint32_t>(0);
+
+      for (auto& point : m_points)
+      {
+        out.write<uint64_t>(point.out);
+        out.write<uint64_t>(point.bit);
+      }
+
+      std::string temp = index + ".tmp";
+      File file;
+      bool ok = file.create(temp) && file.write_at(out.data().data(), out.size(), 0)
+        && file.write_at(m_windows.data(), m_windows.size(), out.size());
+
+      file.close();
+
+      if (!ok || std::rename(temp.c_str(), index.c_str()) != 0)
+      {
+        std::remove(temp.c_str());
+        return false;
+      }
+
+      return true;
+    }
+
+    //  Inflates one span into a buffer that starts with the window of its point, then copies it into the image
+    void inflate_span(size_t span) const
+    {
+      const Point& point = m_points[span];
+      uint64_t end = (span + 1 < m_points.size()) ? m_points[span + 1].out : m_size;
+      size_t history = static_cast<size_t>(std::min<uint64_t>(point.out, Window));
+      std::vector<uint8_t> buffer(history + static_cast<size_t>(end - point.out));
+      Inflater inflater(m_file.data(), m_file.size());
+      size_t pos = history;
+
+      memcpy(buffer.data(), m_window_data + span * Window + Window - history, history);
+      inflater.seek(point.bit);
+
+      while (pos < buffer.size())
+      {
+        bool last = false;
+
+        if (inflater.block(buffer.data(), pos, buffer.size(), last) != Inflater::Ok)
+        {
+          return;
+        }
+
+        uint32_t crc;
+        uint32_t size;
+
+        //  Spans may run on into the next member
+        if (last && pos < buffer.size() && (!inflater.trailer(crc, size) || !inflater.member()))
+        {
+          return;
+        }
+      }
+
+      memcpy(m_data + point.out, buffer.data() + history, buffer.size() - history);
+    }
+  };
+}
+
+#endif
@@ -0,0 +1,847 @@
+/*
+    Positional file I/O used by the builders and extractors.
+
+    util::read_file and util::write_file reopen a file for every call and
+    can only write whole buffers. The File wrapper here keeps a descriptor
+    open so several threads can read and write at explicit offsets without
+    sharing a file position.
+*/
+
+#ifndef _UTIL_IO_H
+#define _UTIL_IO_H
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <mutex>
+
+#include "util_throttle.h"
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#define UTIL_IO_POSIX 1
+#elif defined(_WIN32)
+#include <io.h>
+#endif
+
+namespace util
+{
+  class File
+  {
+  public:
+    File() {};
+    File(const File&) = delete;
+    File& operator=(const File&) = delete;
+
+    ~File()
+    {
+      close();
+    }
+
+    /*
+      Summary:
+        Opens an existing file for reading.
+
+      Returns:
+        True if the file was opened.
+    */
+    bool open(std::string filename)
+    {
+      close();
+#ifdef UTIL_IO_POSIX
+      m_fd = ::open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+      return m_fd >= 0;
+#else
+      m_fp = fopen(filename.c_str(), "rb");
+      return m_fp != nullptr;
+#endif
+    }
+
+    /*
+      Summary:
+        Creates a file for writing, truncating it if it already exists.
+
+      Returns:
+        True if the file was created.
+    */
+    bool create(std::string filename)
+    {
+      close();
+#ifdef UTIL_IO_POSIX
+      m_fd = ::open(filename.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+      return m_fd >= 0;
+#else
+      m_fp = fopen(filename.c_str(), "wb+");
+      return m_fp != nullptr;
+#endif
+    }
+
+    /*
+      Summary:
+        Opens an existing file for reading and writing, keeping its contents.
+
+      Returns:
+        True if the file was opened.
+    */
+    bool modify(std::string filename)
+    {
+      close();
+#ifdef UTIL_IO_POSIX
+      m_fd = ::open(filename.c_str(), O_RDWR | O_CLOEXEC);
+      return m_fd >= 0;
+#else
+      m_fp = fopen(filename.c_str(), "rb+");
+      return m_fp != nullptr;
+#endif
+    }
+
+#ifdef UTIL_IO_POSIX
+    /*
+      Summary:
+        Creates a file relative to an open directory, which skips resolving
+        the directory's path again.
+
+      Returns:
+        True if the file was created.
+    */
+    bool create(int dir, std::string name)
+    {
+      close();
+      m_fd = ::openat(dir, name.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+      return m_fd >= 0;
+    }
+#endif
+
+    void close()
+    {
+#ifdef UTIL_IO_POSIX
+      if (m_fd >= 0)
+      {
+        ::close(m_fd);
+        m_fd = -1;
+      }
+#else
+      if (m_fp)
+      {
+        fclose(m_fp);
+        m_fp = nullptr;
+      }
+#endif
+    }
+
+    bool is_open() const
+    {
+#ifdef UTIL_IO_POSIX
+      return m_fd >= 0;
+#else
+      return m_fp != nullptr;
+#endif
+    }
+
+    uint64_t size()
+    {
+#ifdef UTIL_IO_POSIX
+      struct stat st;
+      return (fstat(m_fd, &st) == 0) ? st.st_size : 0;
+#else
+      std::lock_guard<std::mutex> lock(m_lock);
+      fseek(m_fp, 0, SEEK_END);
+      return ftell(m_fp);
+#endif
+    }
+
+    /*
+      Summary:
+        Reserves space for the whole file up front so later positional writes
+        never have to extend it. Unwritten space reads back as zero.
+
+      Returns:
+        True if the space was reserved.
+    */
+    bool allocate(uint64_t size)
+    {
+#if defined(UTIL_IO_POSIX) && defined(__linux__)
+      if (posix_fallocate(m_fd, 0, size) == 0)
+      {
+        return true;
+      }
+
+      return ftruncate(m_fd, size) == 0;
+#elif defined(UTIL_IO_POSIX)
+      return ftruncate(m_fd, size) == 0;
+#else
+      if (size == 0)
+      {
+        return true;
+      }
+
+      std::lock_guard<std::mutex> lock(m_lock);
+      uint8_t zero = 0;
+      fseek(m_fp, static_cast<long>(size - 1), SEEK_SET);
+      return fwrite(&zero, 1, 1, m_fp) == 1;
+#endif
+    }
+
+    /*
+      Summary:
+        Cuts the file off at the given size.
+
+      Returns:
+        True if the file was resized.
+    */
+    bool truncate(uint64_t size)
+    {
+#ifdef UTIL_IO_POSIX
+      return ftruncate(m_fd, size) == 0;
+#else
+      std::lock_guard<std::mutex> lock(m_lock);
+      fflush(m_fp);
+      return _chsize_s(_fileno(m_fp), size) == 0;
+#endif
+    }
+
+    /*
+      Summary:
+        Reads up to count bytes at the given offset without moving any shared
+        file position, so it is safe to call from several threads.
+
+      Returns:
+        The number of bytes read.
+    */
+    size_t read_at(void* data, size_t count, uint64_t offset)
+    {
+      uint8_t* out = static_cast<uint8_t*>(data);
+      size_t total = 0;
+      Throttle& limit = throttle();
+
+#ifdef UTIL_IO_POSIX
+      size_t step = limit.active() ? Throttle::Chunk : count;
+
+      while (total < count)
+      {
+        size_t len = std::min(step, count - total);
+        limit.read(len);
+
+        ssize_t ret = pread(m_fd, out + total, len, offset + total);
+
+        if (ret <= 0)
+        {
+          break;
+        }
+
+        total += ret;
+      }
+#else
+      limit.read(count);
+
+      std::lock_guard<std::mutex> lock(m_lock);
+      fseek(m_fp, static_cast<long>(offset), SEEK_SET);
+      total = fread(out, 1, count, m_fp);
+#endif
+
+      return total;
+    }
+
+    /*
+      Summary:
+        Writes count bytes at the given offset. Safe to call from several
+        threads as long as the ranges do not overlap.
+
+      Returns:
+        True if every byte was written.
+    */
+    bool write_at(const void* data, size_t count, uint64_t offset)
+    {
+      const uint8_t* in = static_cast<const uint8_t*>(data);
+      size_t total = 0;
+      Throttle& limit = throttle();
+
+#ifdef UTIL_IO_POSIX
+      size_t step = limit.active() ? Throttle::Chunk : count;
+
+      while (total < count)
+      {
+        size_t len = std::min(step, count - total);
+        limit.write(len);
+
+        ssize_t ret = pwrite(m_fd, in + total, len, offset + total);
+
+        if (ret <= 0)
+        {
+          break;
+        }
+
+        total += ret;
+      }
+#else
+      limit.write(count);
+
+      std::lock_guard<std::mutex> lock(m_lock);
+      fseek(m_fp, static_cast<long>(offset), SEEK_SET);
+      total = fwrite(in, 1, count, m_fp);
+#endif
+
+      return total == count;
+    }
+
+    /*
+      Summary:
+        Writes count copies of a byte starting at the given offset.
+    */
+    bool fill_at(uint8_t val, size_t count, uint64_t offset)
+    {
+      std::vector<uint8_t> block(std::min<size_t>(count, 0x10000), val);
+
+      while (count > 0)
+      {
+        size_t len = std::min(count, block.size());
+
+        if (!write_at(&block[0], len, offset))
+        {
+          return false;
+        }
+
+        count -= len;
+        offset += len;
+      }
+
+      return true;
+    }
+
+    /*
+      Summary:
+        Copies a range of another file into this one. On Linux the copy is
+        done inside the kernel with copy_file_range where possible.
+
+      Returns:
+        True if every byte was copied.
+    */
+    bool copy_from(File& source, uint64_t source_offset, size_t count, uint64_t offset)
+    {
+#if defined(UTIL_IO_POSIX) && defined(__linux__)
+      Throttle& limit = throttle();
+      size_t step = limit.active() ? Throttle::Chunk : count;
+
+      while (count > 0)
+      {
+        loff_t in = source_offset;
+        loff_t out = offset;
+        size_t len = std::min(step, count);
+
+        limit.read(len);
+        limit.write(len);
+
+        ssize_t ret = copy_file_range(source.m_fd, &in, m_fd, &out, len, 0);
+
+        if (ret <= 0)
+        {
+          break;
+        }
+
+        source_offset += ret;
+        offset += ret;
+        count -= ret;
+      }
+#endif
+
+      std::vector<uint8_t> block(std::min<size_t>(count, 0x100000));
+
+      while (count > 0)
+      {
+        size_t len = source.read_at(&block[0], std::min(count, block.size()), source_offset);
+
+        if (len == 0 || !write_at(&block[0], len, offset))
+        {
+          return false;
+        }
+
+        source_offset += len;
+        offset += len;
+        count -= len;
+      }
+
+      return true;
+    }
+
+#ifdef UTIL_IO_POSIX
+    int fd() const
+    {
+      return m_fd;
+    }
+#endif
+
+  private:
+#ifdef UTIL_IO_POSIX
+    int m_fd = -1;
+#else
+    FILE* m_fp = nullptr;
+    std::mutex m_lock;
+#endif
+  };
+
+  /*
+    A read-only view of a whole file. The file is memory mapped where
+    possible so reading from it never copies, otherwise it is read in once.
+  */
+  class MappedFile
+  {
+  public:
+    MappedFile() {};
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    ~MappedFile()
+    {
+      close();
+    }
+
+    /*
+      Summary:
+        Maps a file into memory.
+
+      Returns:
+        True if the file could be opened.
+    */
+    bool open(std::string filename)
+    {
+      close();
+
+#ifdef UTIL_IO_POSIX
+      int fd = ::open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+      struct stat st;
+
+      if (fd < 0)
+      {
+        return false;
+      }
+
+      if (fstat(fd, &st) != 0)
+      {
+        ::close(fd);
+        return false;
+      }
+
+      m_size = st.st_size;
+
+      //  Empty files can't be mapped but are still valid
+      if (m_size > 0)
+      {
+        void* map = mmap(nullptr, m_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+        if (map == MAP_FAILED)
+        {
+          ::close(fd);
+          m_size = 0;
+          return false;
+        }
+
+        m_data = static_cast<const uint8_t*>(map);
+      }
+
+      ::close(fd);
+      return true;
+#else
+      File file;
+
+      if (!file.open(filename))
+      {
+        return false;
+      }
+
+      m_buffer.resize(file.size());
+      m_size = file.read_at(m_buffer.data(), m_buffer.size(), 0);
+      m_data = m_buffer.data();
+      return true;
+#endif
+    }
+
+    void close()
+    {
+#ifdef UTIL_IO_POSIX
+      if (m_data)
+      {
+        munmap(const_cast<uint8_t*>(m_data), m_size);
+      }
+#else
+      m_buffer.clear();
+#endif
+      m_data = nullptr;
+      m_size = 0;
+    }
+
+    inline const uint8_t* data() const
+    {
+      return m_data;
+    }
+
+    inline size_t size() const
+    {
+      return m_size;
+    }
+
+    //  Tells the kernel the mapping will be read front to back, so it reads further ahead and drops pages behind
+    void sequential() const
+    {
+#ifdef UTIL_IO_POSIX
+      if (m_data)
+      {
+        madvise(const_cast<uint8_t*>(m_data), m_size, MADV_SEQUENTIAL);
+      }
+#endif
+    }
+
+    /*
+      Summary:
+        Starts reading a range of the file into memory in the background,
+        as one large read rather than a page fault at a time.
+    */
+    void read_ahead(uint64_t offset, uint64_t size) const
+    {
+#ifdef UTIL_IO_POSIX
+      if (!m_data || offset >= m_size || size == 0)
+      {
+        return;
+      }
+
+      //  The range has to start on a page
+      uint64_t page = static_cast<uint64_t>(sysconf(_SC_PAGESIZE));
+      uint64_t start = offset - offset % page;
+      uint64_t end = std::min<uint64_t>(offset + size, m_size);
+
+      madvise(const_cast<uint8_t*>(m_data) + start, end - start, MADV_WILLNEED);
+#endif
+    }
+
+  private:
+    const uint8_t* m_data = nullptr;
+    size_t m_size = 0;
+#ifndef UTIL_IO_POSIX
+    std::vector<uint8_t> m_buffer;
+#endif
+  };
+
+  /*
+    Sequential output through a fixed size buffer, to a file or to standard
+    output when the name is "-" so it can feed a pipe. Writes larger than
+    the buffer skip it and go straight out.
+  */
+  class OutputStream
+  {
+  public:
+    OutputStream(size_t buffer_size = 0x100000) : m_buffer(buffer_size) {};
+    OutputStream(const OutputStream&) = delete;
+    OutputStream& operator=(const OutputStream&) = delete;
+
+    ~OutputStream()
+    {
+      close();
+    }
+
+    bool open(std::string name)
+    {
+      close();
+      m_position = 0;
+      m_ok = true;
+#ifdef UTIL_IO_POSIX
+      m_fd = (name == "-") ? STDOUT_FILENO : ::open(name.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+      m_owned = (name != "-");
+      return m_fd >= 0;
+#else
+      m_fp = (name == "-") ? stdout : fopen(name.c_str(), "wb");
+      m_owned = (name != "-");
+      return m_fp != nullptr;
+#endif
+    }
+
+    bool write(const void* data, size_t size)
+    {
+      const uint8_t* bytes = static_cast<const uint8_t*>(data);
+      m_position += size;
+
+      if (size >= m_buffer.size())
+      {
+        return flush() && write_all(bytes, size);
+      }
+
+      if (m_fill + size > m_buffer.size() && !flush())
+      {
+        return false;
+      }
+
+      std::memcpy(&m_buffer[m_fill], bytes, size);
+      m_fill += size;
+
+      return m_ok;
+    }
+
+    bool fill(uint8_t val, size_t count)
+    {
+      while (count > 0)
+      {
+        if (m_fill == m_buffer.size() && !flush())
+        {
+          return false;
+        }
+
+        size_t len = std::min(count, m_buffer.size() - m_fill);
+        std::memset(&m_buffer[m_fill], val, len);
+
+        m_fill += len;
+        m_position += len;
+        count -= len;
+      }
+
+      return m_ok;
+    }
+
+    bool flush()
+    {
+      if (m_fill > 0)
+      {
+        write_all(&m_buffer[0], m_fill);
+        m_fill = 0;
+      }
+
+      return m_ok;
+    }
+
+    bool close()
+    {
+      bool ok = flush();
+#ifdef UTIL_IO_POSIX
+      if (m_fd >= 0 && m_owned)
+      {
+        ok = (::close(m_fd) == 0) && ok;
+      }
+
+      m_fd = -1;
+#else
+      if (m_fp != nullptr)
+      {
+        ok = (m_owned ? fclose(m_fp) : fflush(m_fp)) == 0 && ok;
+      }
+
+      m_fp = nullptr;
+#endif
+      return ok;
+    }
+
+    //  Bytes written so far, including any still buffered
+    inline uint64_t position() const
+    {
+      return m_position;
+    }
+
+  private:
+    std::vector<uint8_t> m_buffer;
+    size_t m_fill = 0;
+    uint64_t m_position = 0;
+    bool m_owned = false;
+    bool m_ok = true;
+#ifdef UTIL_IO_POSIX
+    int m_fd = -1;
+#else
+    FILE* m_fp = nullptr;
+#endif
+
+    bool write_all(const uint8_t* data, size_t size)
+    {
+      throttle().write(size);
+
+#ifdef UTIL_IO_POSIX
+      while (size > 0 && m_ok)
+      {
+        ssize_t ret = ::write(m_fd, data, size);
+
+        if (ret < 0 && errno == EINTR)
+        {
+          continue;
+        }
+
+        m_ok = ret > 0;
+        data += std::max<ssize_t>(ret, 0);
+        size -= std::max<ssize_t>(ret, 0);
+      }
+#else
+      m_ok = m_ok && fwrite(data, 1, size, m_fp) == size;
+#endif
+      return m_ok;
+    }
+  };
+
+  /*
+    Sequential input through a fixed size buffer, from a file or from
+    standard input when the name is "-". Skipping forward seeks when the
+    input is a regular file and reads past the bytes otherwise.
+  */
+  class InputStream
+  {
+  public:
+    InputStream(size_t buffer_size = 0x100000) : m_buffer(buffer_size) {};
+    InputStream(const InputStream&) = delete;
+    InputStream& operator=(const InputStream&) = delete;
+
+    ~InputStream()
+    {
+      close();
+    }
+
+    bool open(std::string name)
+    {
+      close();
+      m_pos = m_fill = 0;
+      m_position = 0;
+      m_owned = (name != "-");
+#ifdef UTIL_IO_POSIX
+      m_fd = (name == "-") ? STDIN_FILENO : ::open(name.c_str(), O_RDONLY | O_CLOEXEC);
+
+      struct stat st;
+      m_seekable = m_fd >= 0 && fstat(m_fd, &st) == 0 && S_ISREG(st.st_mode);
+      return m_fd >= 0;
+#else
+      m_fp = (name == "-") ? stdin : fopen(name.c_str(), "rb");
+      m_seekable = (name != "-");
+      return m_fp != nullptr;
+#endif
+    }
+
+    void close()
+    {
+#ifdef UTIL_IO_POSIX
+      if (m_fd >= 0 && m_owned)
+      {
+        ::close(m_fd);
+      }
+
+      m_fd = -1;
+#else
+      if (m_fp != nullptr && m_owned)
+      {
+        fclose(m_fp);
+      }
+
+      m_fp = nullptr;
+#endif
+    }
+
+    //  Reads up to size bytes, returning fewer only at the end of the input
+    size_t read(void* data, size_t size)
+    {
+      uint8_t* bytes = static_cast<uint8_t*>(data);
+      size_t done = 0;
+
+      while (done < size)
+      {
+        if (m_pos == m_fill && !refill())
+        {
+          break;
+        }
+
+        size_t len = std::min(size - done, m_fill - m_pos);
+        std::memcpy(bytes + done, &m_buffer[m_pos], len);
+
+        m_pos += len;
+        done += len;
+      }
+
+      m_position += done;
+      return done;
+    }
+
+    bool skip(uint64_t count)
+    {
+      size_t buffered = std::min<uint64_t>(count, m_fill - m_pos);
+      m_pos += buffered;
+      m_position += buffered;
+      count -= buffered;
+
+      if (count == 0)
+      {
+        return true;
+      }
+
+#ifdef UTIL_IO_POSIX
+      if (m_seekable)
+      {
+        m_position += count;
+        return lseek(m_fd, static_cast<off_t>(m_position), SEEK_SET) >= 0;
+      }
+#else
+      if (m_seekable)
+      {
+        m_position += count;
+        return _fseeki64(m_fp, m_position, SEEK_SET) == 0;
+      }
+#endif
+
+      while (count > 0)
+      {
+        if (!refill())
+        {
+          return false;
+        }
+
+        size_t len = std::min<uint64_t>(count, m_fill);
+        m_pos = len;
+        m_position += len;
+        count -= len;
+      }
+
+      return true;
+    }
+
+    //  True if the input is a regular file that can be read again at any offset
+    inline bool seekable() const
+    {
+      return m_seekable;
+    }
+
+    //  Bytes read or skipped so far
+    inline uint64_t position() const
+    {
+      return m_position;
+    }
+
+  private:
+    std::vector<uint8_t> m_buffer;
+    size_t m_pos = 0;
+    size_t m_fill = 0;
+    uint64_t m_position = 0;
+    bool m_owned = false;
+    bool m_seekable = false;
+#ifdef UTIL_IO_POSIX
+    int m_fd = -1;
+#else
+    FILE* m_fp = nullptr;
+#endif
+
+    bool refill()
+    {
+      m_pos = 0;
+      m_fill = 0;
+#ifdef UTIL_IO_POSIX
+      ssize_t ret;
+
+      do
+      {
+        ret = ::read(m_fd, &m_buffer[0], m_buffer.size());
+      } while (ret < 0 && errno == EINTR);
+
+      m_fill = std::max<ssize_t>(ret, 0);
+#else
+      m_fill = fread(&m_buffer[0], 1, m_buffer.size(), m_fp);
+#endif
+      throttle().read(m_fill);
+      return m_fill > 0;
+    }
+  };
+}
+
+#endif
@@ -0,0 +1,89 @@
+#ifndef _MD_UTIL_PNG_H
+#define _MD_UTIL_PNG_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "util.h"
+
+namespace util
+{
+  /*
+    Summary:
+      Encodes an RGBA image as a PNG. The image data is stored without
+      compression, which keeps this free of a zlib dependency and is fine
+      for the small images it is used for.
+
+    Parameters:
+      rgba: 4 bytes per pixel, rows top to bottom
+      width: Width in pixels
+      height: Height in pixels
+
+    Returns:
+      The PNG file.
+  */
+  inline std::vector<uint8_t> encode_png(const uint8_t* rgba, uint32_t width, uint32_t height)
+  {
+    std::vector<uint8_t> png = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n' };
+
+    auto chunk = [&](const char* type, const std::vector<uint8_t>& data)
+    {
+      push_int_big<uint32_t>(png, static_cast<uint32_t>(data.size()));
+      size_t start = png.size();
+      png.insert(png.end(), type, type + 4);
+      png.insert(png.end(), data.begin(), data.end());
+      push_int_big<uint32_t>(png, crc32(&png[start], png.size() - start));
+    };
+
+    std::vector<uint8_t> header;
+    push_int_big<uint32_t>(header, width);
+    push_int_big<uint32_t>(header, height);
+    header.insert(header.end(), { 8, 6, 0, 0, 0 });  //  8 bit RGBA, no interlacing
+    chunk("IHDR", header);
+
+    //  Every row starts with filter type 0
+    std::vector<uint8_t> raw;
+    raw.reserve((width * 4 + 1) * height);
+
+    for (uint32_t y = 0; y < height; y++)
+    {
+      raw.push_back(0);
+      raw.insert(raw.end(), rgba + y * width * 4, rgba + (y + 1) * width * 4);
+    }
+
+    //  zlib stream of stored deflate blocks
+    std::vector<uint8_t> zlib = { 0x78, 0x01 };
+    uint32_t a = 1;
+    uint32_t b = 0;
+
+    for (size_t pos = 0; pos < raw.size() || pos == 0; pos += 0xFFFF)
+    {
+      uint16_t len = static_cast<uint16_t>(std::min<size_t>(0xFFFF, raw.size() - pos));
+
+      zlib.push_back(pos + len >= raw.size() ? 1 : 0);
+      push_int<uint16_t>(zlib, len);
+      push_int<uint16_t>(zlib, static_cast<uint16_t>(~len));
+      zlib.insert(zlib.end(), raw.begin() + pos, raw.begin() + pos + len);
+
+      if (raw.empty())
+      {
+        break;
+      }
+    }
+
+    for (auto byte : raw)
+    {
+      a = (a + byte) % 65521;
+      b = (b + a) % 65521;
+    }
+
+    push_int_big<uint32_t>(zlib, (b << 16) | a);
+    chunk("IDAT", zlib);
+    chunk("IEND", std::vector<uint8_t>());
+
+    return png;
+  }
+}
+
+#endif
@@ -0,0 +1,358 @@
+/*
+    Token bucket limits on disk I/O, shared by every file access in the
+    process so batch jobs can run on hosts that also serve latency sensitive
+    work.
+
+    Reads and writes are charged against a bytes per second bucket each, and
+    both against an operations per second bucket. A caller that runs a bucket
+    into debt sleeps until it is paid back, so requests are spaced out in
+    the order they arrived rather than all waking at once. Large transfers
+    are charged a Chunk at a time by the callers in util_io.h, which keeps
+    the disk from seeing one long burst after each sleep.
+
+    Limits can be changed while running through a control file, which is
+    read again when it changes or when the process gets SIGUSR1.
+*/
+
+#ifndef _UTIL_THROTTLE_H
+#define _UTIL_THROTTLE_H
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <csignal>
+#include <cstdint>
+#include <fstream>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/stat.h>
+#endif
+
+namespace util
+{
+  /*
+    Summary:
+      Parses a rate such as 512K, 20M or 1G, in powers of 1024, or a plain
+      number. 0 means no limit.
+
+    Returns:
+      True if the whole string was a rate.
+  */
+  inline bool parse_rate(std::string text, uint64_t& rate)
+  {
+    uint64_t scale = 1;
+    uint64_t value = 0;
+
+    if (!text.empty())
+    {
+      switch (text.back())
+      {
+      case 'k': case 'K': scale = 1ULL << 10; break;
+      case 'm': case 'M': scale = 1ULL << 20; break;
+      case 'g': case 'G': scale = 1ULL << 30; break;
+      }
+
+      if (scale > 1)
+      {
+        text.pop_back();
+      }
+    }
+
+    if (text.empty() || text.size() > 12)
+    {
+      return false;
+    }
+
+    for (char c : text)
+    {
+      if (c < '0' || c > '9')
+      {
+        return false;
+      }
+
+      value = value * 10 + (c - '0');
+    }
+
+    rate = value * scale;
+    return true;
+  }
+
+  class TokenBucket
+  {
+  public:
+    //  Burst allowed after an idle spell, as time at the full rate
+    static constexpr double BurstSeconds = 0.05;
+
+    //  Changes the rate, with 0 for no limit
+    void set_rate(uint64_t rate)
+    {
+      std::lock_guard<std::mutex> lock(m_lock);
+      refill(std::chrono::steady_clock::now());
+      m_rate = static_cast<double>(rate);
+      m_tokens = std::min(m_tokens, m_rate * BurstSeconds);
+    }
+
+    inline uint64_t rate() const
+    {
+      std::lock_guard<std::mutex> lock(m_lock);
+      return static_cast<uint64_t>(m_rate);
+    }
+
+    /*
+      Summary:
+        Takes tokens from the bucket, sleeping as long as it takes to earn
+        them if the bucket runs dry.
+
+      Returns:
+        Nanoseconds slept.
+    */
+    uint64_t take(uint64_t count)
+    {
+      std::chrono::nanoseconds wait(0);
+
+      {
+        std::lock_guard<std::mutex> lock(m_lock);
+
+        if (m_rate <= 0)
+        {
+          return 0;
+        }
+
+        auto now = std::chrono::steady_clock::now();
+        refill(now);
+        m_tokens -= static_cast<double>(count);
+
+        if (m_tokens < 0)
+        {
+          wait = std::chrono::nanoseconds(static_cast<int64_t>(-m_tokens / m_rate * 1e9));
+        }
+      }
+
+      if (wait.count() > 0)
+      {
+        std::this_thread::sleep_for(wait);
+      }
+
+      m_throttled += wait.count();
+      return wait.count();
+    }
+
+    //  Total nanoseconds callers have slept in this bucket
+    inline uint64_t throttled() const
+    {
+      return m_throttled;
+    }
+
+  private:
+    mutable std::mutex m_lock;
+    double m_rate = 0;
+    double m_tokens = 0;
+    std::chrono::steady_clock::time_point m_last = std::chrono::steady_clock::now();
+    std::atomic<uint64_t> m_throttled{ 0 };
+
+    void refill(std::chrono::steady_clock::time_point now)
+    {
+      double elapsed = std::chrono::duration<double>(now - m_last).count();
+      m_last = now;
+      m_tokens = std::min(m_tokens + elapsed * m_rate, m_rate * BurstSeconds);
+    }
+  };
+
+  class Throttle
+  {
+  public:
+    //  Largest transfer charged at once, so throttled I/O is spread out instead of going in long bursts
+    static const size_t Chunk = 1 << 20;
+
+    static Throttle& global()
+    {
+      static Throttle throttle;
+      return throttle;
+    }
+
+    //  Whether any limit or a control file is set, checked before anything else so unthrottled I/O pays nothing
+    inline bool active() const
+    {
+      return m_active.load(std::memory_order_relaxed);
+    }
+
+    void set(uint64_t read, uint64_t write, uint64_t ops)
+    {
+      m_read.set_rate(read);
+      m_write.set_rate(write);
+      m_ops.set_rate(ops);
+      m_active = read > 0 || write > 0 || ops > 0 || m_watching;
+    }
+
+    /*
+      Summary:
+        Watches a control file holding lines such as read=20M, write=10M and
+        iops=500. A limit the file leaves out is lifted.
+
+      Returns:
+        True if the file could be read.
+    */
+    bool control(std::string path)
+    {
+      {
+        std::lock_guard<std::mutex> lock(m_control_lock);
+        m_control = path;
+        m_control_time = -1;
+      }
+
+#ifdef SIGUSR1
+      std::signal(SIGUSR1, [](int) { global().m_reload = true; });
+#endif
+      m_watching = true;
+      m_active = true;
+      return reload(true);
+    }
+
+    inline void read(uint64_t bytes)
+    {
+      if (active())
+      {
+        poll();
+        m_ops.take(1);
+        m_read.take(bytes);
+      }
+    }
+
+    inline void write(uint64_t bytes)
+    {
+      if (active())
+      {
+        poll();
+        m_ops.take(1);
+        m_write.take(bytes);
+      }
+    }
+
+    //  Describes the time spent waiting on each limit
+    std::string report() const
+    {
+      std::ostringstream out;
+      auto ms = [](uint64_t ns) { return ns / 1000000; };
+      auto limit = [](uint64_t rate, const char* unit) { return rate ? std::to_string(rate) + unit : std::string("no limit"); };
+
+      out << "Throttled I/O for " << ms(m_read.throttled() + m_write.throttled() + m_ops.throttled()) << " ms (read "
+          << ms(m_read.throttled()) << " ms at " << limit(m_read.rate(), " B/s") << ", write " << ms(m_write.throttled()) << " ms at "
+          << limit(m_write.rate(), " B/s") << ", operations " << ms(m_ops.throttled()) << " ms at " << limit(m_ops.rate(), "/s") << ")";
+
+      return out.str();
+    }
+
+  private:
+    TokenBucket m_read;
+    TokenBucket m_write;
+    TokenBucket m_ops;
+    std::atomic<bool> m_active{ false };
+    std::atomic<bool> m_watching{ false };
+    std::atomic<bool> m_reload{ false };       //  Set by SIGUSR1
+    std::atomic<int64_t> m_next_check{ 0 };    //  When to look at the control file again, see now()
+
+    std::mutex m_control_lock;
+    std::string m_control;
+    int64_t m_control_time = -1;
+
+    Throttle() {};
+
+    static inline int64_t now()
+    {
+      return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    //  Reads the control file again on a signal, or if it changed, looking at it at most once a second
+    void poll()
+    {
+      if (m_reload.exchange(false))
+      {
+        reload(true);
+      }
+      else if (m_watching && now() >= m_next_check)
+      {
+        reload(false);
+      }
+    }
+
+    bool reload(bool force)
+    {
+      std::lock_guard<std::mutex> lock(m_control_lock);
+      int64_t time = now();
+
+      if (m_control.empty() || (!force && time < m_next_check))
+      {
+        return false;
+      }
+
+      m_next_check = time + 1000000000;
+
+#if defined(__unix__) || defined(__APPLE__)
+      struct stat st;
+
+      if (stat(m_control.c_str(), &st) != 0 || (!force && st.st_mtime == m_control_time))
+      {
+        return false;
+      }
+
+      m_control_time = st.st_mtime;
+#endif
+
+      std::ifstream in(m_control);
+      std::string line;
+      uint64_t limits[3] = {};
+
+      if (!in)
+      {
+        return false;
+      }
+
+      while (std::getline(in, line))
+      {
+        size_t eq = line.find('=');
+        std::string name = line.substr(0, eq);
+        std::string value = (eq == std::string::npos) ? "" : line.substr(eq + 1);
+        uint64_t rate = 0;
+
+        while (!value.empty() && (value.back() == '\r' || value.back() == ' '))
+        {
+          value.pop_back();
+        }
+
+        if (eq == std::string::npos || !parse_rate(value, rate))
+        {
+          continue;
+        }
+
+        if (name == "read")
+        {
+          limits[0] = rate;
+        }
+        else if (name == "write")
+        {
+          limits[1] = rate;
+        }
+        else if (name == "iops")
+        {
+          limits[2] = rate;
+        }
+      }
+
+      m_read.set_rate(limits[0]);
+      m_write.set_rate(limits[1]);
+      m_ops.set_rate(limits[2]);
+      return true;
+    }
+  };
+
+  inline Throttle& throttle()
+  {
+    return Throttle::global();
+  }
+}
+
+#endif
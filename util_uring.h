@@ -0,0 +1,320 @@
+/*
+    A minimal io_uring wrapper built directly on the system calls so that no
+    external library is needed. Only what the batch writers use is exposed:
+    grabbing submission entries, submitting them and reaping completions.
+
+    On anything other than Linux, or on kernels without io_uring, setup()
+    returns false and callers are expected to use a different path.
+*/
+
+#ifndef _UTIL_URING_H
+#define _UTIL_URING_H
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#ifdef __linux__
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <fcntl.h>
+#endif
+
+namespace util
+{
+#ifdef __linux__
+  class Uring
+  {
+  public:
+    //  Most submission entries the kernel gives a ring
+    static constexpr uint32_t MaxEntries = 32768;
+
+    Uring() {};
+    Uring(const Uring&) = delete;
+    Uring& operator=(const Uring&) = delete;
+
+    ~Uring()
+    {
+      if (m_sqes)
+      {
+        munmap(m_sqes, m_sqes_size);
+      }
+
+      if (m_cq_ring && m_cq_ring != m_sq_ring)
+      {
+        munmap(m_cq_ring, m_cq_ring_size);
+      }
+
+      if (m_sq_ring)
+      {
+        munmap(m_sq_ring, m_sq_ring_size);
+      }
+
+      if (m_fd >= 0)
+      {
+        close(m_fd);
+      }
+    }
+
+    /*
+      Summary:
+        Creates the ring and maps its queues.
+
+      Parameters:
+        entries: Number of submission entries
+
+      Returns:
+        True if the kernel supports io_uring and the ring was created.
+    */
+    bool setup(uint32_t entries)
+    {
+      io_uring_params params;
+      memset(&params, 0, sizeof(params));
+
+      m_fd = static_cast<int>(syscall(__NR_io_uring_setup, entries, &params));
+
+      if (m_fd < 0)
+      {
+        return false;
+      }
+
+      m_sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+      m_cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+
+      if (params.features & IORING_FEAT_SINGLE_MMAP)
+      {
+        m_sq_ring_size = m_cq_ring_size = std::max(m_sq_ring_size, m_cq_ring_size);
+      }
+
+      m_sq_ring = map(m_sq_ring_size, IORING_OFF_SQ_RING);
+
+      if (!m_sq_ring)
+      {
+        return false;
+      }
+
+      if (params.features & IORING_FEAT_SINGLE_MMAP)
+      {
+        m_cq_ring = m_sq_ring;
+      }
+      else if (!(m_cq_ring = map(m_cq_ring_size, IORING_OFF_CQ_RING)))
+      {
+        return false;
+      }
+
+      m_sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+      m_sqes = static_cast<io_uring_sqe*>(map(m_sqes_size, IORING_OFF_SQES));
+
+      if (!m_sqes)
+      {
+        return false;
+      }
+
+      m_sq_head = ring<uint32_t>(m_sq_ring, params.sq_off.head);
+      m_sq_tail = ring<uint32_t>(m_sq_ring, params.sq_off.tail);
+      m_sq_mask = *ring<uint32_t>(m_sq_ring, params.sq_off.ring_mask);
+      m_sq_array = ring<uint32_t>(m_sq_ring, params.sq_off.array);
+      m_sq_entries = params.sq_entries;
+
+      m_cq_head = ring<uint32_t>(m_cq_ring, params.cq_off.head);
+      m_cq_tail = ring<uint32_t>(m_cq_ring, params.cq_off.tail);
+      m_cq_mask = *ring<uint32_t>(m_cq_ring, params.cq_off.ring_mask);
+      m_cqes = ring<io_uring_cqe>(m_cq_ring, params.cq_off.cqes);
+
+      m_sqe_tail = *m_sq_tail;
+
+      return true;
+    }
+
+    /*
+      Summary:
+        Asks the kernel which operations it implements.
+
+      Returns:
+        True if every given opcode is supported.
+    */
+    bool supports(std::vector<uint8_t> opcodes)
+    {
+      std::vector<uint8_t> buffer(sizeof(io_uring_probe) + 256 * sizeof(io_uring_probe_op), 0);
+      io_uring_probe* probe = reinterpret_cast<io_uring_probe*>(&buffer[0]);
+
+      if (syscall(__NR_io_uring_register, m_fd, IORING_REGISTER_PROBE, probe, 256) < 0)
+      {
+        return false;
+      }
+
+      for (auto op : opcodes)
+      {
+        if (op > probe->last_op || !(probe->ops[op].flags & IO_URING_OP_SUPPORTED))
+        {
+          return false;
+        }
+      }
+
+      return true;
+    }
+
+    inline uint32_t entries()
+    {
+      return m_sq_entries;
+    }
+
+    /*
+      Summary:
+        Gets a cleared submission entry to fill in.
+
+      Returns:
+        The entry, or nullptr if the submission queue is full.
+    */
+    io_uring_sqe* get_sqe()
+    {
+      uint32_t head = __atomic_load_n(m_sq_head, __ATOMIC_ACQUIRE);
+
+      if (m_sqe_tail - head >= m_sq_entries)
+      {
+        return nullptr;
+      }
+
+      io_uring_sqe* sqe = &m_sqes[m_sqe_tail & m_sq_mask];
+      memset(sqe, 0, sizeof(*sqe));
+
+      m_sq_array[m_sqe_tail & m_sq_mask] = m_sqe_tail & m_sq_mask;
+      m_sqe_tail++;
+
+      return sqe;
+    }
+
+    /*
+      Summary:
+        Submits every queued entry and optionally waits for completions.
+        The kernel may take fewer entries than were queued, so it is asked
+        again for the rest, and only waits once it has all of them, since
+        waiting for completions of entries it doesn't have never returns.
+
+      Parameters:
+        wait: Number of completions to wait for
+
+      Returns:
+        Number of entries submitted, or a negative errno if the kernel
+        failed or stopped taking entries.
+    */
+    int submit(uint32_t wait = 0)
+    {
+      uint32_t pending = m_sqe_tail - *m_sq_tail;
+      uint32_t submitted = 0;
+      __atomic_store_n(m_sq_tail, m_sqe_tail, __ATOMIC_RELEASE);
+
+      while (submitted < pending || wait > 0)
+      {
+        uint32_t left = pending - submitted;
+        uint32_t flags = (left == 0) ? IORING_ENTER_GETEVENTS : 0;
+        int ret = static_cast<int>(syscall(__NR_io_uring_enter, m_fd, left, (left == 0) ? wait : 0, flags, nullptr, 0));
+
+        if (ret < 0 && errno == EINTR)
+        {
+          continue;
+        }
+
+        if (ret < 0)
+        {
+          return -errno;
+        }
+
+        //  A call that takes nothing will take nothing the next time either
+        if (left > 0 && ret == 0)
+        {
+          return -EBUSY;
+        }
+
+        submitted += static_cast<uint32_t>(ret);
+        wait = (left == 0) ? 0 : wait;
+      }
+
+      return static_cast<int>(submitted);
+    }
+
+    /*
+      Summary:
+        Takes the next completion off the queue.
+
+      Returns:
+        True if there was a completion to take.
+    */
+    bool pop(io_uring_cqe& cqe)
+    {
+      uint32_t head = *m_cq_head;
+
+      if (head == __atomic_load_n(m_cq_tail, __ATOMIC_ACQUIRE))
+      {
+        return false;
+      }
+
+      cqe = m_cqes[head & m_cq_mask];
+      __atomic_store_n(m_cq_head, head + 1, __ATOMIC_RELEASE);
+
+      return true;
+    }
+
+    /*
+      Summary:
+        Waits for a completion and takes it off the queue.
+
+      Returns:
+        True if a completion was taken.
+    */
+    bool wait(io_uring_cqe& cqe)
+    {
+      while (!pop(cqe))
+      {
+        int ret = static_cast<int>(syscall(__NR_io_uring_enter, m_fd, 0, 1, IORING_ENTER_GETEVENTS, nullptr, 0));
+
+        if (ret < 0 && errno != EINTR)
+        {
+          return false;
+        }
+      }
+
+      return true;
+    }
+
+  private:
+    int m_fd = -1;
+
+    void* m_sq_ring = nullptr;
+    void* m_cq_ring = nullptr;
+    io_uring_sqe* m_sqes = nullptr;
+    size_t m_sq_ring_size = 0;
+    size_t m_cq_ring_size = 0;
+    size_t m_sqes_size = 0;
+
+    uint32_t* m_sq_head = nullptr;
+    uint32_t* m_sq_tail = nullptr;
+    uint32_t* m_sq_array = nullptr;
+    uint32_t m_sq_mask = 0;
+    uint32_t m_sq_entries = 0;
+    uint32_t m_sqe_tail = 0;
+
+    uint32_t* m_cq_head = nullptr;
+    uint32_t* m_cq_tail = nullptr;
+    uint32_t m_cq_mask = 0;
+    io_uring_cqe* m_cqes = nullptr;
+
+    void* map(size_t size, uint64_t offset)
+    {
+      void* ptr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd, offset);
+      return (ptr == MAP_FAILED) ? nullptr : ptr;
+    }
+
+    template<typename T> static T* ring(void* base, uint32_t offset)
+    {
+      return reinterpret_cast<T*>(static_cast<uint8_t*>(base) + offset);
+    }
+  };
+#endif
+}
+
+#endif